@@ -0,0 +1,379 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program, 
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// DoseMorphology includes
+#include "vtkImageScaleResample3D.h"
+
+// VTK includes
+#include <vtkDataArray.h>
+#include <vtkImageData.h>
+#include <vtkInformation.h>
+#include <vtkInformationVector.h>
+#include <vtkMultiThreader.h>
+#include <vtkNew.h>
+#include <vtkObjectFactory.h>
+#include <vtkPointData.h>
+#include <vtkStreamingDemandDrivenPipeline.h>
+#include <vtkTypeTraits.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Points this close (in voxels) outside the input are still interpolated, same as vtkImageReslice
+#define SCALERESAMPLE_BORDER_TOLERANCE 7.62939453125e-06
+
+//----------------------------------------------------------------------------
+vtkStandardNewMacro(vtkImageScaleResample3D);
+
+//----------------------------------------------------------------------------
+vtkImageScaleResample3D::vtkImageScaleResample3D()
+{
+  for (int axis = 0; axis < 3; axis++)
+  {
+    this->Scale[axis] = 1.0;
+    this->Offset[axis] = 0.0;
+    this->OutputExtent[2*axis] = 0;
+    this->OutputExtent[2*axis+1] = -1;
+  }
+  this->OutputScalarType = -1;
+  this->ScalarScale = 1.0;
+  this->NumberOfThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+}
+
+//----------------------------------------------------------------------------
+vtkImageScaleResample3D::~vtkImageScaleResample3D()
+{
+}
+
+//----------------------------------------------------------------------------
+void vtkImageScaleResample3D::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "Scale:   " << this->Scale[0] << ", " << this->Scale[1] << ", " << this->Scale[2] << "\n";
+  os << indent << "Offset:   " << this->Offset[0] << ", " << this->Offset[1] << ", " << this->Offset[2] << "\n";
+  os << indent << "OutputExtent:   " << this->OutputExtent[0] << ", " << this->OutputExtent[1] << ", " << this->OutputExtent[2]
+    << ", " << this->OutputExtent[3] << ", " << this->OutputExtent[4] << ", " << this->OutputExtent[5] << "\n";
+  os << indent << "OutputScalarType:   " << (this->OutputScalarType) << "\n";
+  os << indent << "ScalarScale:   " << (this->ScalarScale) << "\n";
+  os << indent << "NumberOfThreads:   " << (this->NumberOfThreads) << "\n";
+}
+
+//----------------------------------------------------------------------------
+// Input voxels and Catmull-Rom weights of one output voxel index along an axis.
+// The indices are relative to the start of the input extent.
+struct vtkImageScaleResample3DTaps
+{
+  int Index[4];
+  double Weight[4];
+  bool Inside;
+};
+
+//----------------------------------------------------------------------------
+static void vtkImageScaleResample3DComputeTaps(double scale, double offset, int outputMin, int outputMax,
+                                               int inputMin, int inputMax, std::vector<vtkImageScaleResample3DTaps> &taps)
+{
+  taps.resize(outputMax >= outputMin ? outputMax - outputMin + 1 : 0);
+  for (int outputIndex = outputMin; outputIndex <= outputMax; outputIndex++)
+  {
+    vtkImageScaleResample3DTaps &tap = taps[outputIndex - outputMin];
+    double position = scale * outputIndex + offset;
+    tap.Inside = ( position >= inputMin - SCALERESAMPLE_BORDER_TOLERANCE && position <= inputMax + SCALERESAMPLE_BORDER_TOLERANCE );
+
+    int base = (int)floor(position);
+    double f = position - base;
+    if (!tap.Inside || base < inputMin)
+    {
+      base = inputMin;
+      f = 0.0;
+    }
+    else if (base >= inputMax)
+    {
+      base = inputMax;
+      f = 0.0;
+    }
+
+    tap.Weight[0] = ((-0.5 * f + 1.0) * f - 0.5) * f;
+    tap.Weight[1] = (1.5 * f - 2.5) * f * f + 1.0;
+    tap.Weight[2] = ((-1.5 * f + 2.0) * f + 0.5) * f;
+    tap.Weight[3] = (0.5 * f - 0.5) * f * f;
+    for (int k = 0; k < 4; k++)
+    {
+      int index = base - 1 + k;
+      index = (index < inputMin ? inputMin : (index > inputMax ? inputMax : index));
+      tap.Index[k] = index - inputMin;
+      if (!tap.Inside)
+      {
+        tap.Weight[k] = 0.0;
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+// Convert interpolated values to the output type, rounding and clamping to integer types like vtkImageReslice
+template <class OT>
+void vtkImageScaleResample3DWriteRow(const double* values, vtkIdType numberOfValues, double scalarScale, OT* output)
+{
+  if (std::numeric_limits<OT>::is_integer)
+  {
+    double minimum = (double)vtkTypeTraits<OT>::Min();
+    double maximum = (double)vtkTypeTraits<OT>::Max();
+    for (vtkIdType i = 0; i < numberOfValues; i++)
+    {
+      double value = values[i] * scalarScale;
+      value = (value < minimum ? minimum : (value > maximum ? maximum : value));
+      output[i] = static_cast<OT>(floor(value + 0.5));
+    }
+  }
+  else
+  {
+    for (vtkIdType i = 0; i < numberOfValues; i++)
+    {
+      output[i] = static_cast<OT>(values[i] * scalarScale);
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+template <class IT>
+struct vtkImageScaleResample3DInfo
+{
+  const IT* Input;
+  int InputDimensions[3];
+  int NumberOfComponents;
+  void* Output;
+  int OutputScalarType;
+  int OutputDimensions[3];
+  double ScalarScale;
+  std::vector<vtkImageScaleResample3DTaps> Taps[3];
+};
+
+//----------------------------------------------------------------------------
+// Interpolate the output slices of a thread: first the four input slices along z into a plane,
+// then the four rows of the plane along y into a row, then the four values of the row along x
+template <class IT>
+void vtkImageScaleResample3DExecuteSlices(vtkImageScaleResample3DInfo<IT>* info, int threadId, int numberOfThreads)
+{
+  int numberOfSlices = info->OutputDimensions[2];
+  int firstSlice = (int)((vtkIdType)numberOfSlices * threadId / numberOfThreads);
+  int lastSlice = (int)((vtkIdType)numberOfSlices * (threadId + 1) / numberOfThreads);
+  if (firstSlice >= lastSlice)
+  {
+    return;
+  }
+
+  int numberOfComponents = info->NumberOfComponents;
+  vtkIdType inputRowSize = (vtkIdType)info->InputDimensions[0] * numberOfComponents;
+  vtkIdType inputSliceSize = inputRowSize * info->InputDimensions[1];
+  vtkIdType outputRowSize = (vtkIdType)info->OutputDimensions[0] * numberOfComponents;
+  int outputScalarSize = vtkDataArray::GetDataTypeSize(info->OutputScalarType);
+
+  std::vector<double> plane(inputSliceSize);
+  std::vector<double> row(inputRowSize);
+  std::vector<double> outputRow(outputRowSize);
+  const std::vector<vtkImageScaleResample3DTaps> &xTaps = info->Taps[0];
+  const std::vector<vtkImageScaleResample3DTaps> &yTaps = info->Taps[1];
+  const std::vector<vtkImageScaleResample3DTaps> &zTaps = info->Taps[2];
+
+  for (int z = firstSlice; z < lastSlice; z++)
+  {
+    const vtkImageScaleResample3DTaps &zTap = zTaps[z];
+    if (zTap.Inside)
+    {
+      std::fill(plane.begin(), plane.end(), 0.0);
+      for (int k = 0; k < 4; k++)
+      {
+        double weight = zTap.Weight[k];
+        if (weight == 0.0)
+        {
+          continue;
+        }
+        const IT* inputSlice = info->Input + zTap.Index[k] * inputSliceSize;
+        for (vtkIdType i = 0; i < inputSliceSize; i++)
+        {
+          plane[i] += weight * inputSlice[i];
+        }
+      }
+    }
+
+    for (int y = 0; y < info->OutputDimensions[1]; y++)
+    {
+      const vtkImageScaleResample3DTaps &yTap = yTaps[y];
+      if (!zTap.Inside || !yTap.Inside)
+      {
+        std::fill(outputRow.begin(), outputRow.end(), 0.0);
+      }
+      else
+      {
+        std::fill(row.begin(), row.end(), 0.0);
+        for (int k = 0; k < 4; k++)
+        {
+          double weight = yTap.Weight[k];
+          if (weight == 0.0)
+          {
+            continue;
+          }
+          const double* planeRow = &plane[0] + yTap.Index[k] * inputRowSize;
+          for (vtkIdType i = 0; i < inputRowSize; i++)
+          {
+            row[i] += weight * planeRow[i];
+          }
+        }
+
+        double* outputValue = &outputRow[0];
+        for (int x = 0; x < info->OutputDimensions[0]; x++)
+        {
+          const vtkImageScaleResample3DTaps &xTap = xTaps[x];
+          for (int c = 0; c < numberOfComponents; c++)
+          {
+            *(outputValue++) = xTap.Weight[0] * row[xTap.Index[0] * numberOfComponents + c]
+              + xTap.Weight[1] * row[xTap.Index[1] * numberOfComponents + c]
+              + xTap.Weight[2] * row[xTap.Index[2] * numberOfComponents + c]
+              + xTap.Weight[3] * row[xTap.Index[3] * numberOfComponents + c];
+          }
+        }
+      }
+
+      void* outputPointer = static_cast<char*>(info->Output)
+        + ((vtkIdType)z * info->OutputDimensions[1] + y) * outputRowSize * outputScalarSize;
+      switch (info->OutputScalarType)
+      {
+        vtkTemplateMacro(vtkImageScaleResample3DWriteRow(&outputRow[0], outputRowSize, info->ScalarScale, static_cast<VTK_TT*>(outputPointer)));
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+template <class IT>
+VTK_THREAD_RETURN_TYPE vtkImageScaleResample3DThreadedSlices(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* threadInfo = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  vtkImageScaleResample3DInfo<IT>* info = static_cast<vtkImageScaleResample3DInfo<IT>*>(threadInfo->UserData);
+
+  vtkImageScaleResample3DExecuteSlices(info, threadInfo->ThreadID, threadInfo->NumberOfThreads);
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+template <class IT>
+void vtkImageScaleResample3DExecute(vtkImageScaleResample3D* self, vtkImageData* input, vtkImageData* output, IT*)
+{
+  vtkImageScaleResample3DInfo<IT> info;
+  info.Input = static_cast<const IT*>(input->GetScalarPointer());
+  input->GetDimensions(info.InputDimensions);
+  info.NumberOfComponents = input->GetNumberOfScalarComponents();
+  info.Output = output->GetScalarPointer();
+  info.OutputScalarType = output->GetScalarType();
+  output->GetDimensions(info.OutputDimensions);
+  info.ScalarScale = self->GetScalarScale();
+
+  // The weights only depend on the output index along each axis
+  int* inputExtent = input->GetExtent();
+  int* outputExtent = output->GetExtent();
+  double* scale = self->GetScale();
+  double* offset = self->GetOffset();
+  for (int axis = 0; axis < 3; axis++)
+  {
+    vtkImageScaleResample3DComputeTaps(scale[axis], offset[axis], outputExtent[2*axis], outputExtent[2*axis+1],
+      inputExtent[2*axis], inputExtent[2*axis+1], info.Taps[axis]);
+  }
+
+  vtkNew<vtkMultiThreader> threader;
+  threader->SetNumberOfThreads(self->GetNumberOfThreads());
+  threader->SetSingleMethod(vtkImageScaleResample3DThreadedSlices<IT>, &info);
+  threader->SingleMethodExecute();
+}
+
+//----------------------------------------------------------------------------
+int vtkImageScaleResample3D::RequestInformation(vtkInformation* vtkNotUsed(request),
+                                                vtkInformationVector** vtkNotUsed(inputVector),
+                                                vtkInformationVector* outputVector)
+{
+  vtkInformation* outInfo = outputVector->GetInformationObject(0);
+  outInfo->Set(vtkStreamingDemandDrivenPipeline::WHOLE_EXTENT(), this->OutputExtent, 6);
+  if (this->OutputScalarType >= 0)
+  {
+    vtkDataObject::SetPointDataActiveScalarInfo(outInfo, this->OutputScalarType, -1);
+  }
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageScaleResample3D::RequestUpdateExtent(vtkInformation* vtkNotUsed(request),
+                                                 vtkInformationVector** inputVector,
+                                                 vtkInformationVector* vtkNotUsed(outputVector))
+{
+  // Any input voxel may be needed by a scaling
+  vtkInformation* inInfo = inputVector[0]->GetInformationObject(0);
+  int wholeExtent[6] = {0, -1, 0, -1, 0, -1};
+  inInfo->Get(vtkStreamingDemandDrivenPipeline::WHOLE_EXTENT(), wholeExtent);
+  inInfo->Set(vtkStreamingDemandDrivenPipeline::UPDATE_EXTENT(), wholeExtent, 6);
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageScaleResample3D::RequestData(vtkInformation* vtkNotUsed(request),
+                                         vtkInformationVector** inputVector,
+                                         vtkInformationVector* outputVector)
+{
+  vtkInformation* inInfo = inputVector[0]->GetInformationObject(0);
+  vtkInformation* outInfo = outputVector->GetInformationObject(0);
+  vtkImageData* input = vtkImageData::SafeDownCast(inInfo->Get(vtkDataObject::DATA_OBJECT()));
+  vtkImageData* output = vtkImageData::SafeDownCast(outInfo->Get(vtkDataObject::DATA_OBJECT()));
+  if (!input || !output || !input->GetPointData()->GetScalars())
+  {
+    vtkErrorMacro("RequestData: no input scalars!");
+    return 0;
+  }
+
+  int outputScalarType = (this->OutputScalarType >= 0 ? this->OutputScalarType : input->GetScalarType());
+  output->SetExtent(this->OutputExtent);
+  output->SetOrigin(input->GetOrigin());
+  output->SetSpacing(input->GetSpacing());
+#if (VTK_MAJOR_VERSION <= 5)
+  output->SetScalarType(outputScalarType);
+  output->SetNumberOfScalarComponents(input->GetNumberOfScalarComponents());
+  output->AllocateScalars();
+#else
+  output->AllocateScalars(outputScalarType, input->GetNumberOfScalarComponents());
+#endif
+  if (output->GetNumberOfPoints() == 0)
+  {
+    return 1;
+  }
+
+  switch (input->GetScalarType())
+  {
+    vtkTemplateMacro(vtkImageScaleResample3DExecute(this, input, output, static_cast<VTK_TT*>(NULL)));
+    default:
+      vtkErrorMacro("RequestData: unknown scalar type " << input->GetScalarType());
+      return 0;
+  }
+
+  return 1;
+}
@@ -0,0 +1,716 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program, 
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// DoseMorphology includes
+#include "vtkImageVanHerkDilate3D.h"
+
+// VTK includes
+#include <vtkImageData.h>
+#include <vtkInformation.h>
+#include <vtkInformationVector.h>
+#include <vtkMultiThreader.h>
+#include <vtkNew.h>
+#include <vtkObjectFactory.h>
+#include <vtkPointData.h>
+#include <vtkStreamingDemandDrivenPipeline.h>
+#include <vtkTypeTraits.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+
+// Number of adjacent lines processed together along y and z, keeps the memory access contiguous
+#define VANHERK_BUNDLE_SIZE 64
+
+// Relative tolerance for voxel centers that lie on the surface of a spacing ellipsoid
+#define VANHERK_RADIUS_TOLERANCE 1e-9
+
+//----------------------------------------------------------------------------
+vtkStandardNewMacro(vtkImageVanHerkDilate3D);
+
+//----------------------------------------------------------------------------
+vtkImageVanHerkDilate3D::vtkImageVanHerkDilate3D()
+{
+  this->KernelSize[0] = 1;
+  this->KernelSize[1] = 1;
+  this->KernelSize[2] = 1;
+  this->Radius[0] = 0.0;
+  this->Radius[1] = 0.0;
+  this->Radius[2] = 0.0;
+  this->Footprint = SLICERRT_FOOTPRINT_ELLIPSOID;
+  this->SubVoxelAccuracy = false;
+  this->Erosion = false;
+  this->NumberOfThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+}
+
+//----------------------------------------------------------------------------
+vtkImageVanHerkDilate3D::~vtkImageVanHerkDilate3D()
+{
+}
+
+//----------------------------------------------------------------------------
+void vtkImageVanHerkDilate3D::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "KernelSize:   " << this->KernelSize[0] << ", " << this->KernelSize[1] << ", " << this->KernelSize[2] << "\n";
+  os << indent << "Radius:   " << this->Radius[0] << ", " << this->Radius[1] << ", " << this->Radius[2] << "\n";
+  os << indent << "Footprint:   " << (this->Footprint) << "\n";
+  os << indent << "SubVoxelAccuracy:   " << (this->SubVoxelAccuracy) << "\n";
+  os << indent << "Erosion:   " << (this->Erosion) << "\n";
+  os << indent << "NumberOfThreads:   " << (this->NumberOfThreads) << "\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkImageVanHerkDilate3D::SetKernelSize(int size0, int size1, int size2)
+{
+  if (size0 < 1 || size1 < 1 || size2 < 1)
+  {
+    vtkErrorMacro("SetKernelSize: invalid kernel size " << size0 << ", " << size1 << ", " << size2);
+    return;
+  }
+  if (this->KernelSize[0] == size0 && this->KernelSize[1] == size1 && this->KernelSize[2] == size2)
+  {
+    return;
+  }
+
+  this->KernelSize[0] = size0;
+  this->KernelSize[1] = size1;
+  this->KernelSize[2] = size2;
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageVanHerkDilate3D::GetFootprintMask(const double spacing[3], int kernelSize[3], std::vector<bool> &mask)
+{
+  if (this->Footprint == SLICERRT_FOOTPRINT_SPACING_ELLIPSOID)
+  {
+    // Odd kernel centered on the output voxel, containing the voxel centers inside the ellipsoid
+    int halfSize[3] = {0, 0, 0};
+    for (int axis = 0; axis < 3; axis++)
+    {
+      if (this->Radius[axis] > 0.0 && spacing[axis] > 0.0)
+      {
+        halfSize[axis] = (int)floor(this->Radius[axis] / spacing[axis] + VANHERK_RADIUS_TOLERANCE);
+      }
+      kernelSize[axis] = 2*halfSize[axis] + 1;
+    }
+    mask.assign(kernelSize[0]*kernelSize[1]*kernelSize[2], false);
+    for (int idx2 = 0; idx2 < kernelSize[2]; idx2++)
+    {
+      double s2 = (halfSize[2] > 0 ? (idx2 - halfSize[2]) * spacing[2] / this->Radius[2] : 0.0);
+      for (int idx1 = 0; idx1 < kernelSize[1]; idx1++)
+      {
+        double s1 = (halfSize[1] > 0 ? (idx1 - halfSize[1]) * spacing[1] / this->Radius[1] : 0.0);
+        for (int idx0 = 0; idx0 < kernelSize[0]; idx0++)
+        {
+          double s0 = (halfSize[0] > 0 ? (idx0 - halfSize[0]) * spacing[0] / this->Radius[0] : 0.0);
+          mask[(idx2*kernelSize[1] + idx1)*kernelSize[0] + idx0] = (s0*s0 + s1*s1 + s2*s2 <= 1.0 + VANHERK_RADIUS_TOLERANCE);
+        }
+      }
+    }
+    return;
+  }
+
+  int size0 = this->KernelSize[0];
+  int size1 = this->KernelSize[1];
+  int size2 = this->KernelSize[2];
+  kernelSize[0] = size0;
+  kernelSize[1] = size1;
+  kernelSize[2] = size2;
+  mask.assign(size0*size1*size2, true);
+  if (this->Footprint == SLICERRT_FOOTPRINT_BOX)
+  {
+    return;
+  }
+
+  // Same ellipsoid as the mask that vtkImageContinuousDilate3D gets from vtkImageEllipsoidSource
+  double center[3] = { (size0-1)*0.5, (size1-1)*0.5, (size2-1)*0.5 };
+  double radius[3] = { size0*0.5, size1*0.5, size2*0.5 };
+  for (int idx2 = 0; idx2 < size2; idx2++)
+  {
+    double temp = (idx2 - center[2]) / radius[2];
+    double s2 = temp * temp;
+    for (int idx1 = 0; idx1 < size1; idx1++)
+    {
+      temp = (idx1 - center[1]) / radius[1];
+      double s1 = temp * temp;
+      for (int idx0 = 0; idx0 < size0; idx0++)
+      {
+        temp = (idx0 - center[0]) / radius[0];
+        double s0 = temp * temp;
+        mask[(idx2*size1 + idx1)*size0 + idx0] = !(s0 + s1 + s2 > 1.0);
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+// Append the contiguous runs of set flags as offsets from the middle of the kernel
+static void vtkImageVanHerkDilate3DGetRuns(const std::vector<bool> &flags, int middle, std::vector< std::pair<int,int> > &runs)
+{
+  int size = (int)flags.size();
+  int index = 0;
+  while (index < size)
+  {
+    if (!flags[index])
+    {
+      index++;
+      continue;
+    }
+    int start = index;
+    while (index < size && flags[index])
+    {
+      index++;
+    }
+    runs.push_back(std::make_pair(start - middle, index - 1 - middle));
+  }
+}
+
+//----------------------------------------------------------------------------
+static bool vtkImageVanHerkDilate3DRunContains(const std::vector< std::pair<int,int> > &runs, const std::pair<int,int> &run)
+{
+  for (std::vector< std::pair<int,int> >::const_iterator runIt = runs.begin(); runIt != runs.end(); ++runIt)
+  {
+    if (runIt->first <= run.first && runIt->second >= run.second)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------------
+static vtkImageVanHerkDilate3D::PassStep vtkImageVanHerkDilate3DMakeStep(int axis, const std::pair<int,int> &run, int source, int target, bool accumulate, double fraction = 0.0)
+{
+  vtkImageVanHerkDilate3D::PassStep step;
+  step.Axis = axis;
+  step.Lower = run.first;
+  step.Upper = run.second;
+  step.Source = source;
+  step.Target = target;
+  step.Accumulate = accumulate;
+  step.Fraction = fraction;
+  return step;
+}
+
+//----------------------------------------------------------------------------
+// Decompose the yz section of the rows that are dilated with the same x chord (flags of the
+// rows, y fastest) into y chords and z intervals
+static void vtkImageVanHerkDilate3DAppendSectionSteps(const std::vector<bool> &sectionFlags, int size1, int size2, int ySource,
+                                                      std::vector<vtkImageVanHerkDilate3D::PassStep> &steps)
+{
+  int middle1 = size1/2;
+  int middle2 = size2/2;
+
+  std::vector< std::vector< std::pair<int,int> > > sliceRuns(size2);
+  std::vector< std::pair<int,int> > yRuns;
+  for (int idx2 = 0; idx2 < size2; idx2++)
+  {
+    std::vector<bool> columnFlags(sectionFlags.begin() + idx2*size1, sectionFlags.begin() + (idx2+1)*size1);
+    vtkImageVanHerkDilate3DGetRuns(columnFlags, middle1, sliceRuns[idx2]);
+    yRuns.insert(yRuns.end(), sliceRuns[idx2].begin(), sliceRuns[idx2].end());
+  }
+  std::sort(yRuns.begin(), yRuns.end());
+  yRuns.erase(std::unique(yRuns.begin(), yRuns.end()), yRuns.end());
+
+  for (std::vector< std::pair<int,int> >::iterator yRunIt = yRuns.begin(); yRunIt != yRuns.end(); ++yRunIt)
+  {
+    int zSource = ySource;
+    if (yRunIt->first != 0 || yRunIt->second != 0)
+    {
+      steps.push_back(vtkImageVanHerkDilate3DMakeStep(1, *yRunIt, ySource, vtkImageVanHerkDilate3D::YBuffer, false));
+      zSource = vtkImageVanHerkDilate3D::YBuffer;
+    }
+
+    std::vector<bool> sliceFlags(size2, false);
+    for (int idx2 = 0; idx2 < size2; idx2++)
+    {
+      sliceFlags[idx2] = vtkImageVanHerkDilate3DRunContains(sliceRuns[idx2], *yRunIt);
+    }
+    std::vector< std::pair<int,int> > zRuns;
+    vtkImageVanHerkDilate3DGetRuns(sliceFlags, middle2, zRuns);
+    for (std::vector< std::pair<int,int> >::iterator zRunIt = zRuns.begin(); zRunIt != zRuns.end(); ++zRunIt)
+    {
+      steps.push_back(vtkImageVanHerkDilate3DMakeStep(2, *zRunIt, zSource, vtkImageVanHerkDilate3D::OutputBuffer, true));
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageVanHerkDilate3D::GetPassSteps(const double spacing[3], std::vector<PassStep> &steps)
+{
+  steps.clear();
+
+  std::vector<bool> mask;
+  int kernelSize[3] = {1, 1, 1};
+  this->GetFootprintMask(spacing, kernelSize, mask);
+
+  // The voxel of the kernel that is centered on the output voxel, as in vtkImageSpatialAlgorithm
+  int size0 = kernelSize[0];
+  int size1 = kernelSize[1];
+  int size2 = kernelSize[2];
+  int middle0 = size0/2;
+  int middle1 = size1/2;
+  int middle2 = size2/2;
+
+  // X chords of every row of the footprint
+  std::vector< std::vector< std::pair<int,int> > > rowRuns(size1*size2);
+  std::vector< std::pair<int,int> > xRuns;
+  for (int idx2 = 0; idx2 < size2; idx2++)
+  {
+    for (int idx1 = 0; idx1 < size1; idx1++)
+    {
+      std::vector<bool>::const_iterator rowBegin = mask.begin() + (idx2*size1 + idx1)*size0;
+      std::vector<bool> rowFlags(rowBegin, rowBegin + size0);
+      vtkImageVanHerkDilate3DGetRuns(rowFlags, middle0, rowRuns[idx2*size1 + idx1]);
+      xRuns.insert(xRuns.end(), rowRuns[idx2*size1 + idx1].begin(), rowRuns[idx2*size1 + idx1].end());
+    }
+  }
+  std::sort(xRuns.begin(), xRuns.end());
+  xRuns.erase(std::unique(xRuns.begin(), xRuns.end()), xRuns.end());
+
+  if (this->Footprint == SLICERRT_FOOTPRINT_SPACING_ELLIPSOID && this->SubVoxelAccuracy)
+  {
+    // Exact half length of the x chord of every row of the ellipsoid, -1 for rows outside
+    std::vector<double> halfChords(size1*size2, -1.0);
+    std::vector<double> distinctHalfChords;
+    for (int idx2 = 0; idx2 < size2; idx2++)
+    {
+      double s2 = (size2 > 1 ? (idx2 - middle2) * spacing[2] / this->Radius[2] : 0.0);
+      for (int idx1 = 0; idx1 < size1; idx1++)
+      {
+        if (rowRuns[idx2*size1 + idx1].empty())
+        {
+          continue;
+        }
+        double s1 = (size1 > 1 ? (idx1 - middle1) * spacing[1] / this->Radius[1] : 0.0);
+        double halfChord = 0.0;
+        if (this->Radius[0] > 0.0 && spacing[0] > 0.0)
+        {
+          halfChord = this->Radius[0] / spacing[0] * sqrt(std::max(0.0, 1.0 - s1*s1 - s2*s2));
+        }
+        halfChords[idx2*size1 + idx1] = halfChord;
+        distinctHalfChords.push_back(halfChord);
+      }
+    }
+    std::sort(distinctHalfChords.begin(), distinctHalfChords.end());
+    std::vector<double>::iterator lastHalfChord = distinctHalfChords.begin();
+    for (std::vector<double>::iterator halfChordIt = distinctHalfChords.begin(); halfChordIt != distinctHalfChords.end(); ++halfChordIt)
+    {
+      if (*halfChordIt > *lastHalfChord + VANHERK_RADIUS_TOLERANCE)
+      {
+        *(++lastHalfChord) = *halfChordIt;
+      }
+    }
+    if (!distinctHalfChords.empty())
+    {
+      distinctHalfChords.erase(lastHalfChord + 1, distinctHalfChords.end());
+    }
+
+    // Same nesting as for whole voxel chords, a longer chord never gives a smaller maximum
+    for (std::vector<double>::iterator halfChordIt = distinctHalfChords.begin(); halfChordIt != distinctHalfChords.end(); ++halfChordIt)
+    {
+      int wholeVoxels = (int)floor(*halfChordIt + VANHERK_RADIUS_TOLERANCE);
+      double fraction = std::max(0.0, *halfChordIt - wholeVoxels);
+      if (fraction < VANHERK_RADIUS_TOLERANCE)
+      {
+        fraction = 0.0;
+      }
+      int ySource = InputBuffer;
+      if (wholeVoxels > 0 || fraction > 0.0)
+      {
+        steps.push_back(vtkImageVanHerkDilate3DMakeStep(0, std::make_pair(-wholeVoxels, wholeVoxels), InputBuffer, XBuffer, false, fraction));
+        ySource = XBuffer;
+      }
+
+      std::vector<bool> sectionFlags(size1*size2, false);
+      for (int row = 0; row < size1*size2; row++)
+      {
+        sectionFlags[row] = (halfChords[row] >= 0.0 && halfChords[row] > *halfChordIt - VANHERK_RADIUS_TOLERANCE);
+      }
+      vtkImageVanHerkDilate3DAppendSectionSteps(sectionFlags, size1, size2, ySource, steps);
+    }
+    return;
+  }
+
+  // The rows whose chord contains a given x chord form the yz section that is dilated with it.
+  // Using all of them (not only the rows with exactly this chord) keeps the result exact,
+  // because the maximum over a shorter chord never exceeds the maximum over a longer one.
+  for (std::vector< std::pair<int,int> >::iterator xRunIt = xRuns.begin(); xRunIt != xRuns.end(); ++xRunIt)
+  {
+    int ySource = InputBuffer;
+    if (xRunIt->first != 0 || xRunIt->second != 0)
+    {
+      steps.push_back(vtkImageVanHerkDilate3DMakeStep(0, *xRunIt, InputBuffer, XBuffer, false));
+      ySource = XBuffer;
+    }
+
+    std::vector<bool> sectionFlags(size1*size2, false);
+    for (int row = 0; row < size1*size2; row++)
+    {
+      sectionFlags[row] = vtkImageVanHerkDilate3DRunContains(rowRuns[row], *xRunIt);
+    }
+    vtkImageVanHerkDilate3DAppendSectionSteps(sectionFlags, size1, size2, ySource, steps);
+  }
+}
+
+//----------------------------------------------------------------------------
+// Maximum of the window value and the linear interpolated dose at the fractional ends of an x chord.
+// An end is only used if both voxels it is interpolated from are in the image.
+template <class T>
+inline T vtkImageVanHerkDilate3DChordEnds(const T* source, vtkIdType stride, int length, int i, int lower, int upper, double fraction, T value)
+{
+  int position = i + upper;
+  if (position >= 0 && position + 1 < length)
+  {
+    T endValue = (T)((1.0 - fraction) * source[position * stride] + fraction * source[(position + 1) * stride]);
+    if (endValue > value)
+    {
+      value = endValue;
+    }
+  }
+  position = i + lower;
+  if (position - 1 >= 0 && position < length)
+  {
+    T endValue = (T)((1.0 - fraction) * source[position * stride] + fraction * source[(position - 1) * stride]);
+    if (endValue > value)
+    {
+      value = endValue;
+    }
+  }
+  return value;
+}
+
+//----------------------------------------------------------------------------
+// Order reversing bijection of the values of a type, erosion is the dilation of the reversed values
+template <class T>
+inline T vtkImageVanHerkDilate3DReverse(T value)
+{
+  return static_cast<T>(~value);
+}
+
+inline float vtkImageVanHerkDilate3DReverse(float value)
+{
+  return -value;
+}
+
+inline double vtkImageVanHerkDilate3DReverse(double value)
+{
+  return -value;
+}
+
+//----------------------------------------------------------------------------
+template <class T>
+struct vtkImageVanHerkDilate3DPassInfo
+{
+  const T* Source;
+  T* Target;
+  int Dimensions[3];
+  int NumberOfComponents;
+  vtkImageVanHerkDilate3D::PassStep Step;
+};
+
+//----------------------------------------------------------------------------
+// Running maximum over the window [Lower, Upper] along one axis for the lines of one thread.
+// Voxels outside the image are ignored, like in vtkImageContinuousDilate3D.
+template <class T>
+void vtkImageVanHerkDilate3DExecutePass(vtkImageVanHerkDilate3DPassInfo<T>* info, int threadId, int numberOfThreads)
+{
+  const int* dimensions = info->Dimensions;
+  vtkIdType strides[3];
+  strides[0] = info->NumberOfComponents;
+  strides[1] = strides[0] * dimensions[0];
+  strides[2] = strides[1] * dimensions[1];
+
+  int axis = info->Step.Axis;
+  int length = dimensions[axis];
+  vtkIdType stride = strides[axis];
+  int lower = info->Step.Lower;
+  int upper = info->Step.Upper;
+  int width = upper - lower + 1;
+  bool accumulate = info->Step.Accumulate;
+  // Fractional chord ends only occur along x, where every unit is a single line
+  double fraction = (axis == 0 ? info->Step.Fraction : 0.0);
+
+  // Work units are single lines along x, and bundles of adjacent lines along y and z
+  vtkIdType contiguousSize = strides[1];
+  vtkIdType numberOfBundles = (contiguousSize + VANHERK_BUNDLE_SIZE - 1) / VANHERK_BUNDLE_SIZE;
+  vtkIdType numberOfUnits = 0;
+  if (axis == 0)
+  {
+    numberOfUnits = (vtkIdType)info->NumberOfComponents * dimensions[1] * dimensions[2];
+  }
+  else
+  {
+    numberOfUnits = numberOfBundles * dimensions[axis == 1 ? 2 : 1];
+  }
+  vtkIdType firstUnit = numberOfUnits * threadId / numberOfThreads;
+  vtkIdType lastUnit = numberOfUnits * (threadId + 1) / numberOfThreads;
+
+  const T padValue = vtkTypeTraits<T>::Min();
+  int paddedLength = length + width - 1;
+  std::vector<T> forwardMax((width > 1 ? paddedLength : 0) * VANHERK_BUNDLE_SIZE);
+  std::vector<T> backwardMax((width > 1 ? paddedLength : 0) * VANHERK_BUNDLE_SIZE);
+
+  for (vtkIdType unit = firstUnit; unit < lastUnit; unit++)
+  {
+    vtkIdType base = 0;
+    int bundleSize = 1;
+    if (axis == 0)
+    {
+      vtkIdType component = unit % info->NumberOfComponents;
+      vtkIdType row = unit / info->NumberOfComponents;
+      base = component + (row % dimensions[1]) * strides[1] + (row / dimensions[1]) * strides[2];
+    }
+    else
+    {
+      vtkIdType bundle = unit % numberOfBundles;
+      vtkIdType line = unit / numberOfBundles;
+      base = bundle * VANHERK_BUNDLE_SIZE + line * strides[axis == 1 ? 2 : 1];
+      bundleSize = (int)std::min<vtkIdType>(VANHERK_BUNDLE_SIZE, contiguousSize - bundle * VANHERK_BUNDLE_SIZE);
+    }
+    const T* source = info->Source + base;
+    T* target = info->Target + base;
+
+    if (width == 1)
+    {
+      // Plain shift, no running maximum needed
+      for (int i = 0; i < length; i++)
+      {
+        int position = i + lower;
+        T* targetValues = target + i * stride;
+        for (int b = 0; b < bundleSize; b++)
+        {
+          T value = (position >= 0 && position < length) ? source[position * stride + b] : padValue;
+          if (fraction > 0.0)
+          {
+            value = vtkImageVanHerkDilate3DChordEnds(source, stride, length, i, lower, upper, fraction, value);
+          }
+          if (!accumulate || value > targetValues[b])
+          {
+            targetValues[b] = value;
+          }
+        }
+      }
+      continue;
+    }
+
+    // Maximum from the start of each block of width voxels to the current voxel
+    for (int j = 0; j < paddedLength; j++)
+    {
+      int position = j + lower;
+      bool inside = (position >= 0 && position < length);
+      const T* sourceValues = source + (inside ? position * stride : 0);
+      T* forward = &forwardMax[j * bundleSize];
+      if (j % width == 0)
+      {
+        for (int b = 0; b < bundleSize; b++)
+        {
+          forward[b] = inside ? sourceValues[b] : padValue;
+        }
+      }
+      else
+      {
+        const T* previous = forward - bundleSize;
+        for (int b = 0; b < bundleSize; b++)
+        {
+          T value = inside ? sourceValues[b] : padValue;
+          forward[b] = (value > previous[b] ? value : previous[b]);
+        }
+      }
+    }
+
+    // Maximum from the current voxel to the end of its block
+    for (int j = paddedLength - 1; j >= 0; j--)
+    {
+      int position = j + lower;
+      bool inside = (position >= 0 && position < length);
+      const T* sourceValues = source + (inside ? position * stride : 0);
+      T* backward = &backwardMax[j * bundleSize];
+      if (j % width == width - 1 || j == paddedLength - 1)
+      {
+        for (int b = 0; b < bundleSize; b++)
+        {
+          backward[b] = inside ? sourceValues[b] : padValue;
+        }
+      }
+      else
+      {
+        const T* next = backward + bundleSize;
+        for (int b = 0; b < bundleSize; b++)
+        {
+          T value = inside ? sourceValues[b] : padValue;
+          backward[b] = (value > next[b] ? value : next[b]);
+        }
+      }
+    }
+
+    // Every window spans at most two blocks: the end of one and the start of the next
+    for (int i = 0; i < length; i++)
+    {
+      const T* backward = &backwardMax[i * bundleSize];
+      const T* forward = &forwardMax[(i + width - 1) * bundleSize];
+      T* targetValues = target + i * stride;
+      for (int b = 0; b < bundleSize; b++)
+      {
+        T value = (backward[b] > forward[b] ? backward[b] : forward[b]);
+        if (fraction > 0.0)
+        {
+          value = vtkImageVanHerkDilate3DChordEnds(source, stride, length, i, lower, upper, fraction, value);
+        }
+        if (!accumulate || value > targetValues[b])
+        {
+          targetValues[b] = value;
+        }
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+template <class T>
+VTK_THREAD_RETURN_TYPE vtkImageVanHerkDilate3DThreadedPass(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* threadInfo = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  vtkImageVanHerkDilate3DPassInfo<T>* info = static_cast<vtkImageVanHerkDilate3DPassInfo<T>*>(threadInfo->UserData);
+
+  vtkImageVanHerkDilate3DExecutePass(info, threadInfo->ThreadID, threadInfo->NumberOfThreads);
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+template <class T>
+void vtkImageVanHerkDilate3DExecute(vtkImageVanHerkDilate3D* self, vtkImageData* input, vtkImageData* output, T*)
+{
+  std::vector<vtkImageVanHerkDilate3D::PassStep> steps;
+  self->GetPassSteps(input->GetSpacing(), steps);
+
+  vtkImageVanHerkDilate3DPassInfo<T> info;
+  input->GetDimensions(info.Dimensions);
+  info.NumberOfComponents = input->GetNumberOfScalarComponents();
+  vtkIdType numberOfValues = (vtkIdType)info.NumberOfComponents * info.Dimensions[0] * info.Dimensions[1] * info.Dimensions[2];
+
+  // Intermediate results of the x and y passes
+  std::vector<T> xBuffer;
+  std::vector<T> yBuffer;
+  for (std::vector<vtkImageVanHerkDilate3D::PassStep>::iterator stepIt = steps.begin(); stepIt != steps.end(); ++stepIt)
+  {
+    if (stepIt->Target == vtkImageVanHerkDilate3D::XBuffer && xBuffer.empty())
+    {
+      xBuffer.resize(numberOfValues);
+    }
+    if (stepIt->Target == vtkImageVanHerkDilate3D::YBuffer && yBuffer.empty())
+    {
+      yBuffer.resize(numberOfValues);
+    }
+  }
+
+  T* outputPointer = static_cast<T*>(output->GetScalarPointer());
+  std::fill(outputPointer, outputPointer + numberOfValues, vtkTypeTraits<T>::Min());
+
+  T* buffers[4];
+  buffers[vtkImageVanHerkDilate3D::InputBuffer] = static_cast<T*>(input->GetScalarPointer());
+  std::vector<T> reversedInput;
+  if (self->GetErosion() && numberOfValues > 0)
+  {
+    reversedInput.assign(buffers[vtkImageVanHerkDilate3D::InputBuffer], buffers[vtkImageVanHerkDilate3D::InputBuffer] + numberOfValues);
+    for (vtkIdType i = 0; i < numberOfValues; i++)
+    {
+      reversedInput[i] = vtkImageVanHerkDilate3DReverse(reversedInput[i]);
+    }
+    buffers[vtkImageVanHerkDilate3D::InputBuffer] = &reversedInput[0];
+  }
+  buffers[vtkImageVanHerkDilate3D::XBuffer] = (xBuffer.empty() ? NULL : &xBuffer[0]);
+  buffers[vtkImageVanHerkDilate3D::YBuffer] = (yBuffer.empty() ? NULL : &yBuffer[0]);
+  buffers[vtkImageVanHerkDilate3D::OutputBuffer] = outputPointer;
+
+  vtkNew<vtkMultiThreader> threader;
+  threader->SetNumberOfThreads(self->GetNumberOfThreads());
+  for (std::vector<vtkImageVanHerkDilate3D::PassStep>::iterator stepIt = steps.begin(); stepIt != steps.end(); ++stepIt)
+  {
+    info.Step = *stepIt;
+    info.Source = buffers[stepIt->Source];
+    info.Target = buffers[stepIt->Target];
+    threader->SetSingleMethod(vtkImageVanHerkDilate3DThreadedPass<T>, &info);
+    threader->SingleMethodExecute();
+  }
+
+  if (self->GetErosion())
+  {
+    for (vtkIdType i = 0; i < numberOfValues; i++)
+    {
+      outputPointer[i] = vtkImageVanHerkDilate3DReverse(outputPointer[i]);
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+int vtkImageVanHerkDilate3D::RequestUpdateExtent(vtkInformation* vtkNotUsed(request),
+                                                 vtkInformationVector** inputVector,
+                                                 vtkInformationVector* vtkNotUsed(outputVector))
+{
+  // Every pass needs the whole lines of the image
+  vtkInformation* inInfo = inputVector[0]->GetInformationObject(0);
+  int wholeExtent[6] = {0, -1, 0, -1, 0, -1};
+  inInfo->Get(vtkStreamingDemandDrivenPipeline::WHOLE_EXTENT(), wholeExtent);
+  inInfo->Set(vtkStreamingDemandDrivenPipeline::UPDATE_EXTENT(), wholeExtent, 6);
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageVanHerkDilate3D::RequestData(vtkInformation* vtkNotUsed(request),
+                                         vtkInformationVector** inputVector,
+                                         vtkInformationVector* outputVector)
+{
+  vtkInformation* inInfo = inputVector[0]->GetInformationObject(0);
+  vtkInformation* outInfo = outputVector->GetInformationObject(0);
+  vtkImageData* input = vtkImageData::SafeDownCast(inInfo->Get(vtkDataObject::DATA_OBJECT()));
+  vtkImageData* output = vtkImageData::SafeDownCast(outInfo->Get(vtkDataObject::DATA_OBJECT()));
+  if (!input || !output || !input->GetPointData()->GetScalars())
+  {
+    vtkErrorMacro("RequestData: no input scalars!");
+    return 0;
+  }
+
+  output->SetExtent(input->GetExtent());
+  output->SetOrigin(input->GetOrigin());
+  output->SetSpacing(input->GetSpacing());
+#if (VTK_MAJOR_VERSION <= 5)
+  output->SetScalarType(input->GetScalarType());
+  output->SetNumberOfScalarComponents(input->GetNumberOfScalarComponents());
+  output->AllocateScalars();
+#else
+  output->AllocateScalars(input->GetScalarType(), input->GetNumberOfScalarComponents());
+#endif
+
+  switch (input->GetScalarType())
+  {
+    vtkTemplateMacro(vtkImageVanHerkDilate3DExecute(this, input, output, static_cast<VTK_TT*>(NULL)));
+    default:
+      vtkErrorMacro("RequestData: unknown scalar type " << input->GetScalarType());
+      return 0;
+  }
+
+  return 1;
+}
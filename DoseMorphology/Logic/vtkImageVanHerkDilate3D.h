@@ -0,0 +1,148 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program, 
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// .NAME vtkImageVanHerkDilate3D - grey scale dilation with a box or ellipsoid footprint
+// .SECTION Description
+// Computes the same result as vtkImageContinuousDilate3D (maximum over an ellipsoid
+// footprint of the given kernel size, voxels outside the image are ignored), but with the
+// van Herk/Gil-Werman running maximum that needs a constant number of comparisons per
+// voxel along an axis, regardless of the kernel size.
+// A box footprint is separable into one pass per axis. An ellipsoid footprint is decomposed
+// into nested boxes: for every distinct x chord the yz cross section of the chords that
+// contain it is again split into y chords and z intervals, which gives the exact footprint.
+// Each pass costs a constant number of comparisons per voxel, but the number of passes grows
+// with the kernel size: roughly quadratically for the ellipsoid (about 8 passes for a kernel
+// of 5, 116 for 21 and 908 for 61 voxels) and up to cubically for the spacing ellipsoid and
+// sub-voxel accuracy, whose chords differ more often. Large kernels are still much cheaper
+// than the kernel volume of comparisons per voxel of vtkImageContinuousDilate3D.
+// The passes are multithreaded across image lines.
+// With the spacing ellipsoid footprint the kernel is instead the exact voxelization of an
+// ellipsoid of the given physical radius on the (anisotropic) spacing of the input image,
+// so margins can be applied directly on the native dose grid.
+// With sub-voxel accuracy the x chords of the spacing ellipsoid are not rounded to whole
+// voxels: the ends of each chord are linearly interpolated between the two nearest voxels,
+// so the result changes continuously with the radius instead of in steps of one voxel.
+// With erosion the minimum instead of the maximum over the footprint is computed, by
+// dilating the values in reversed order (negated, or bitwise complemented for integers).
+
+#ifndef __vtkImageVanHerkDilate3D_h
+#define __vtkImageVanHerkDilate3D_h
+
+// VTK includes
+#include <vtkImageAlgorithm.h>
+
+// STD includes
+#include <vector>
+
+#include "vtkSlicerDoseMorphologyModuleLogicExport.h"
+
+// Footprint options
+#define SLICERRT_FOOTPRINT_BOX                0
+#define SLICERRT_FOOTPRINT_ELLIPSOID          1
+#define SLICERRT_FOOTPRINT_SPACING_ELLIPSOID  2
+
+class VTK_SLICER_DOSEMORPHOLOGY_MODULE_LOGIC_EXPORT vtkImageVanHerkDilate3D : public vtkImageAlgorithm
+{
+public:
+  static vtkImageVanHerkDilate3D *New();
+  vtkTypeMacro(vtkImageVanHerkDilate3D, vtkImageAlgorithm);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  /// Set the size of the footprint in voxels, same convention as vtkImageContinuousDilate3D
+  void SetKernelSize(int size0, int size1, int size2);
+  vtkGetVector3Macro(KernelSize, int);
+
+  /// Get/Set the radius of the spacing ellipsoid footprint, in the units of the input spacing
+  vtkSetVector3Macro(Radius, double);
+  vtkGetVector3Macro(Radius, double);
+
+  /// Get/Set the shape of the footprint.
+  /// Box and ellipsoid use the kernel size, spacing ellipsoid uses the radius and the input spacing
+  vtkSetClampMacro(Footprint, int, SLICERRT_FOOTPRINT_BOX, SLICERRT_FOOTPRINT_SPACING_ELLIPSOID);
+  vtkGetMacro(Footprint, int);
+  void SetFootprintToBox() {this->SetFootprint(SLICERRT_FOOTPRINT_BOX);};
+  void SetFootprintToEllipsoid() {this->SetFootprint(SLICERRT_FOOTPRINT_ELLIPSOID);};
+  void SetFootprintToSpacingEllipsoid() {this->SetFootprint(SLICERRT_FOOTPRINT_SPACING_ELLIPSOID);};
+
+  /// Get/Set whether the chords of the spacing ellipsoid end between voxels (see description)
+  vtkSetMacro(SubVoxelAccuracy, bool);
+  vtkGetMacro(SubVoxelAccuracy, bool);
+  vtkBooleanMacro(SubVoxelAccuracy, bool);
+
+  /// Get/Set whether the minimum (grey scale erosion) is computed instead of the maximum
+  vtkSetMacro(Erosion, bool);
+  vtkGetMacro(Erosion, bool);
+  vtkBooleanMacro(Erosion, bool);
+
+  /// Get/Set the maximum number of threads used by the passes
+  vtkSetClampMacro(NumberOfThreads, int, 1, VTK_MAX_THREADS);
+  vtkGetMacro(NumberOfThreads, int);
+
+  /// One running maximum pass along an axis, the offsets of the window are in voxels
+  struct PassStep
+  {
+    int Axis;
+    int Lower;
+    int Upper;
+    int Source;
+    int Target;
+    bool Accumulate;
+    /// Linear interpolated extension of both ends of an x window, in voxels (less than one)
+    double Fraction;
+  };
+
+  /// Buffers used by the passes
+  enum
+  {
+    InputBuffer = 0,
+    XBuffer,
+    YBuffer,
+    OutputBuffer
+  };
+
+  /// Get the passes that compute the dilation with the current footprint on an image of the given spacing
+  void GetPassSteps(const double spacing[3], std::vector<PassStep> &steps);
+
+  /// Get the footprint on an image of the given spacing as a mask (x fastest), true for voxels inside
+  void GetFootprintMask(const double spacing[3], int kernelSize[3], std::vector<bool> &mask);
+
+protected:
+  vtkImageVanHerkDilate3D();
+  ~vtkImageVanHerkDilate3D();
+
+  virtual int RequestUpdateExtent(vtkInformation*, vtkInformationVector**, vtkInformationVector*);
+  virtual int RequestData(vtkInformation*, vtkInformationVector**, vtkInformationVector*);
+
+protected:
+  int KernelSize[3];
+  double Radius[3];
+  int Footprint;
+  bool SubVoxelAccuracy;
+  bool Erosion;
+  int NumberOfThreads;
+
+private:
+  vtkImageVanHerkDilate3D(const vtkImageVanHerkDilate3D&); // Not implemented
+  void operator=(const vtkImageVanHerkDilate3D&);          // Not implemented
+};
+
+#endif
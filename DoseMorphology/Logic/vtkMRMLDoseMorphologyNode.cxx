@@ -52,6 +52,8 @@ vtkMRMLDoseMorphologyNode::vtkMRMLDoseMorphologyNode()
   this->XSize = 1;
   this->YSize = 1;
   this->ZSize = 1;
+  this->DilationMethod = SLICERRT_DILATION_RESAMPLED;
+  this->DosePrecision = MARGINCALCULATOR_DOSE_PRECISION_DOUBLE;
 
   this->HideFromEditors = false;
 }
@@ -76,6 +78,10 @@ void vtkMRMLDoseMorphologyNode::WriteXML(ostream& of, int nIndent)
   of << indent << " YSize=\"" << (this->YSize) << "\"";
 
   of << indent << " ZSize=\"" << (this->ZSize) << "\"";
+
+  of << indent << " DilationMethod=\"" << (this->DilationMethod) << "\"";
+
+  of << indent << " DosePrecision=\"" << (this->DosePrecision) << "\"";
 }
 
 //----------------------------------------------------------------------------
@@ -112,6 +118,22 @@ void vtkMRMLDoseMorphologyNode::ReadXMLAttributes(const char** atts)
       this->ZSize = 
         (strcmp(attValue,"true") ? false : true);
       }
+    else if (!strcmp(attName, "DilationMethod")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      int intAttValue;
+      ss >> intAttValue;
+      this->DilationMethod = intAttValue;
+      }
+    else if (!strcmp(attName, "DosePrecision")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      int intAttValue;
+      ss >> intAttValue;
+      this->DosePrecision = intAttValue;
+      }
     }
 }
 
@@ -129,6 +151,8 @@ void vtkMRMLDoseMorphologyNode::Copy(vtkMRMLNode *anode)
   this->XSize = node->XSize;
   this->YSize = node->YSize;
   this->ZSize = node->ZSize;
+  this->DilationMethod = node->DilationMethod;
+  this->DosePrecision = node->DosePrecision;
 
   this->DisableModifiedEventOff();
   this->InvokePendingModifiedEvent();
@@ -143,6 +167,8 @@ void vtkMRMLDoseMorphologyNode::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "XSize:   " << (this->XSize) << "\n";
   os << indent << "YSize:   " << (this->YSize) << "\n";
   os << indent << "ZSize:   " << (this->ZSize) << "\n";
+  os << indent << "DilationMethod:   " << (this->DilationMethod) << "\n";
+  os << indent << "DosePrecision:   " << (this->DosePrecision) << "\n";
 }
 
 //----------------------------------------------------------------------------
@@ -35,6 +35,12 @@
 // Operation options.
 #define SLICERRT_EXPAND_BY_SCALING            0
 #define SLICERRT_EXPAND_BY_DILATION           1
+#define SLICERRT_SHRINK_BY_SCALING            2
+#define SLICERRT_SHRINK_BY_EROSION            3
+
+// Dilation methods.
+#define SLICERRT_DILATION_RESAMPLED           0
+#define SLICERRT_DILATION_NATIVE_ELLIPSOID    1
 
 class vtkMRMLScalarVolumeNode;
 
@@ -85,23 +91,39 @@ public:
 
   // Description:
   // Set/Get the Operation to perform.
+  // Shrink by scaling divides the dose coordinates by the sizes (the inverse of expand by scaling),
+  // shrink by erosion takes the minimum dose within the ellipsoid of the sizes.
   vtkSetMacro(Operation,int);
   vtkGetMacro(Operation,int);
   void SetOperationToExpandByScaling() {this->SetOperation(SLICERRT_EXPAND_BY_SCALING);};
   void SetOperationToExpandByDilation() {this->SetOperation(SLICERRT_EXPAND_BY_DILATION);};
+  void SetOperationToShrinkByScaling() {this->SetOperation(SLICERRT_SHRINK_BY_SCALING);};
+  void SetOperationToShrinkByErosion() {this->SetOperation(SLICERRT_SHRINK_BY_EROSION);};
 
-  /// Get/Set Save labelmaps checkbox state
+  /// Get/Set the size along the X axis: margin (radius) in mm for dilation and erosion,
+  /// factor for scaling. Y and Z sizes are interpreted the same way.
   vtkGetMacro(XSize, double);
   vtkSetMacro(XSize, double);
 
-  /// Get/Set Save labelmaps checkbox state
+  /// Get/Set the size along the Y axis, see XSize
   vtkGetMacro(YSize, double);
   vtkSetMacro(YSize, double);
 
-  /// Get/Set Save labelmaps checkbox state
+  /// Get/Set the size along the Z axis, see XSize
   vtkGetMacro(ZSize, double);
   vtkSetMacro(ZSize, double);
 
+  /// Get/Set how ExpandByDilation and ShrinkByErosion are computed (SLICERRT_DILATION_*): kernel on the resampled
+  /// 0.5 mm grid (default), or exact ellipsoid of the X/Y/Z sizes on the native dose grid
+  vtkGetMacro(DilationMethod, int);
+  vtkSetMacro(DilationMethod, int);
+  void SetDilationMethodToResampled() {this->SetDilationMethod(SLICERRT_DILATION_RESAMPLED);};
+  void SetDilationMethodToNativeEllipsoid() {this->SetDilationMethod(SLICERRT_DILATION_NATIVE_ELLIPSOID);};
+
+  /// Get/Set internal dose representation of the morphology kernels (MARGINCALCULATOR_DOSE_PRECISION_* in MarginCalculatorCommon.h)
+  vtkGetMacro(DosePrecision, int);
+  vtkSetMacro(DosePrecision, int);
+
 protected:
   vtkMRMLDoseMorphologyNode();
   ~vtkMRMLDoseMorphologyNode();
@@ -120,6 +142,12 @@ protected:
 
   /// State of Show scalarbar checkbox
   double ZSize;
+
+  /// Method used by ExpandByDilation
+  int DilationMethod;
+
+  /// Internal dose representation used while resampling and dilating
+  int DosePrecision;
 };
 
 #endif
@@ -23,6 +23,8 @@
 // DoseMorpholgyModule Logic includes
 #include "vtkSlicerDoseMorphologyModuleLogic.h"
 #include "vtkMRMLDoseMorphologyNode.h"
+#include "vtkImageVanHerkDilate3D.h"
+#include "vtkImageScaleResample3D.h"
 
 // SlicerRT includes
 #include "MarginCalculatorCommon.h"
@@ -41,6 +43,8 @@
 
 // VTK includes
 #include <vtkNew.h>
+#include <vtkCollection.h>
+#include <vtkDoubleArray.h>
 #include <vtkImageData.h>
 #include <vtkImageMarchingCubes.h>
 #include <vtkImageChangeInformation.h>
@@ -57,16 +61,34 @@
 #include <vtkImageLogic.h>
 #include <vtkImageAccumulate.h>
 #include <vtkImageReslice.h>
+#include <vtkMatrix4x4.h>
+#include <vtkMultiThreader.h>
+#include <vtkImageShiftScale.h>
 #include <vtkGeneralTransform.h>
 #include <vtkTransform.h>
 #include <vtkObjectFactory.h>
 
 // STD includes
 #include <cassert>
+#include <cmath>
+#include <list>
+#include <vector>
 
 #define THRESHOLD 0.001
 #define RESAMPLE_SIZE_DILATION 0.5
 
+// Kernels up to this many voxels are dilated directly, larger ones with the van Herk filter
+#define MAX_DIRECT_DILATION_KERNEL_VOLUME 27
+
+// Centers of mass closer than this to a whole voxel index are truncated to that index
+#define CENTER_OF_MASS_INDEX_TOLERANCE 1e-6
+
+// Off-diagonal elements of a scaling reslice matrix smaller than this are considered zero
+#define AXIS_ALIGNED_SCALING_TOLERANCE 1e-9
+
+// Default memory limit of the morphed dose cache in kilobytes
+#define DEFAULT_MORPHOLOGY_CACHE_SIZE_LIMIT 262144
+
 //----------------------------------------------------------------------------
 vtkStandardNewMacro(vtkSlicerDoseMorphologyModuleLogic);
 
@@ -74,11 +96,40 @@ vtkStandardNewMacro(vtkSlicerDoseMorphologyModuleLogic);
 vtkSlicerDoseMorphologyModuleLogic::vtkSlicerDoseMorphologyModuleLogic()
 {
   this->DoseMorphologyNode = NULL;
+  this->CenterOfMass[0] = 0.0;
+  this->CenterOfMass[1] = 0.0;
+  this->CenterOfMass[2] = 0.0;
+  this->CenterOfMassImageData = NULL;
+  this->CenterOfMassImageDataMTime = 0;
+  this->MorphologyInputDoseImageData = NULL;
+  this->MorphologyInputIJKToRASMatrix = NULL;
+  for (int axis = 0; axis < 3; axis++)
+  {
+    this->MorphologyInputSpacing[axis] = 1.0;
+    this->MorphologyNativeGridSpacing[axis] = 1.0;
+    this->MorphologyReferenceDimensions[axis] = 0;
+    this->MorphologyReferenceSpacing[axis] = 1.0;
+    this->MorphologyCenterOfMass[axis] = 0;
+    this->DilationSessionSize[axis] = 0.0;
+  }
+  this->MorphologyDosePrecision = MARGINCALCULATOR_DOSE_PRECISION_DOUBLE;
+  this->MorphologyDoseScale = 1.0;
+  this->MorphologyNativeGridDoseImageData = NULL;
+  this->MorphologyFineGridDoseImageData = NULL;
+  this->DilationSessionActive = false;
+  this->DilationSessionMethod = SLICERRT_DILATION_RESAMPLED;
+  this->DilationSessionDoseImageData = NULL;
+  this->MorphologyCacheSizeLimit = DEFAULT_MORPHOLOGY_CACHE_SIZE_LIMIT;
+  this->MorphologyCacheSize = 0;
+  this->MorphologyCacheHits = 0;
+  this->MorphologyCacheMisses = 0;
 }
 
 //----------------------------------------------------------------------------
 vtkSlicerDoseMorphologyModuleLogic::~vtkSlicerDoseMorphologyModuleLogic()
 {
+  this->ReleaseMorphology();
+  this->ClearMorphologyCache();
   vtkSetAndObserveMRMLNodeMacro(this->DoseMorphologyNode, NULL);
 }
 
@@ -203,57 +254,168 @@ bool vtkSlicerDoseMorphologyModuleLogic::VolumeContainsDose()
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerDoseMorphologyModuleLogic::GetVolumeNodeCenterOfMass(vtkMRMLScalarVolumeNode *volumeNode, int* centerOfMass)
+struct vtkDoseMorphologyCenterOfMassInfo
 {
-  double sumValue = 0.0;
-  double sumX = 0, sumY = 0, sumZ = 0;
+  vtkImageData* ImageData;
+  /// Sum of the dose and the dose weighted x, y, z indices (relative to the extent) for every thread
+  std::vector<double> Sums;
+};
 
-  vtkSmartPointer<vtkImageData> imageData = volumeNode->GetImageData();
-  int extent[6];
-  int dim[3] = {0,0,0};
-#if (VTK_MAJOR_VERSION <= 5)
-  imageData->GetWholeExtent(extent);
-#else
-  imageData->GetExtent(extent);
-#endif
-  imageData->GetDimensions(dim);
-  for (int zz = extent[4]; zz <= extent[5]; zz ++)
+//---------------------------------------------------------------------------
+// Add the sums of the slices [firstSlice, lastSlice) of the first component, negative doses are ignored.
+// The row loop has no branches so that the compiler can vectorize it.
+template <class T>
+void vtkDoseMorphologyCenterOfMassSums(const T* scalars, const int dimensions[3], int numberOfComponents, int firstSlice, int lastSlice, double* sums)
+{
+  for (int zz = firstSlice; zz < lastSlice; zz++)
   {
-    for (int yy = extent[2]; yy <= extent[3]; yy ++)
+    double sliceSum = 0.0;
+    double sliceSumX = 0.0;
+    double sliceSumY = 0.0;
+    for (int yy = 0; yy < dimensions[1]; yy++)
     {
-      for (int xx = extent[0]; xx <= extent[1]; xx ++)
+      const T* row = scalars + ((vtkIdType)zz * dimensions[1] + yy) * dimensions[0] * numberOfComponents;
+      double rowSum = 0.0;
+      double rowSumX = 0.0;
+      for (int xx = 0; xx < dimensions[0]; xx++)
       {
-        double voxelVal = imageData->GetScalarComponentAsDouble(xx, yy, zz, 0);
-        if (voxelVal > 0)
-        {
-          sumValue = sumValue + voxelVal;
-          sumX = sumX + xx * voxelVal;
-          sumY = sumY + yy * voxelVal;
-          sumZ = sumZ + zz * voxelVal;
-        }
-      } // for xx
-    } // for yy
-  } // for zz
+        double voxelVal = (double)row[xx * numberOfComponents];
+        voxelVal = (voxelVal > 0.0 ? voxelVal : 0.0);
+        rowSum += voxelVal;
+        rowSumX += xx * voxelVal;
+      }
+      sliceSum += rowSum;
+      sliceSumX += rowSumX;
+      sliceSumY += yy * rowSum;
+    }
+    sums[0] += sliceSum;
+    sums[1] += sliceSumX;
+    sums[2] += sliceSumY;
+    sums[3] += zz * sliceSum;
+  }
+}
+
+//---------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE vtkDoseMorphologyCenterOfMassThread(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* threadInfo = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  vtkDoseMorphologyCenterOfMassInfo* info = static_cast<vtkDoseMorphologyCenterOfMassInfo*>(threadInfo->UserData);
+
+  int dimensions[3] = {0, 0, 0};
+  info->ImageData->GetDimensions(dimensions);
+  int firstSlice = (int)((vtkIdType)dimensions[2] * threadInfo->ThreadID / threadInfo->NumberOfThreads);
+  int lastSlice = (int)((vtkIdType)dimensions[2] * (threadInfo->ThreadID + 1) / threadInfo->NumberOfThreads);
+  double* sums = &(info->Sums[4 * threadInfo->ThreadID]);
 
-  if (sumValue > 0)
+  void* scalars = info->ImageData->GetScalarPointer();
+  switch (info->ImageData->GetScalarType())
   {
-    centerOfMass[0] = sumX / sumValue;
-    centerOfMass[1] = sumY / sumValue;
-    centerOfMass[2] = sumZ / sumValue;
+    vtkTemplateMacro(vtkDoseMorphologyCenterOfMassSums(static_cast<VTK_TT*>(scalars), dimensions,
+      info->ImageData->GetNumberOfScalarComponents(), firstSlice, lastSlice, sums));
   }
-  return;
+
+  return VTK_THREAD_RETURN_VALUE;
 }
 
 //---------------------------------------------------------------------------
-int vtkSlicerDoseMorphologyModuleLogic::MorphDose()
+// The pivot of the scaling has always been the truncated index, keep it for reproducibility.
+// The tolerance keeps centers that are whole indices from dropping to the previous one
+// because of the different summation order. A zero center (no dose) leaves the output unchanged.
+static void vtkSlicerDoseMorphologyTruncateCenterOfMass(const double preciseCenterOfMass[3], int centerOfMass[3])
 {
-  double originX, originY, originZ;
-  double spacingX, spacingY, spacingZ;
-  int dimensions[3] = {0, 0, 0};
-  double originX2, originY2, originZ2;
-  double spacingX2, spacingY2, spacingZ2;
-  int dimensions2[3] = {0, 0, 0};
+  if (preciseCenterOfMass[0] != 0.0 || preciseCenterOfMass[1] != 0.0 || preciseCenterOfMass[2] != 0.0)
+  {
+    centerOfMass[0] = (int)floor(preciseCenterOfMass[0] + CENTER_OF_MASS_INDEX_TOLERANCE);
+    centerOfMass[1] = (int)floor(preciseCenterOfMass[1] + CENTER_OF_MASS_INDEX_TOLERANCE);
+    centerOfMass[2] = (int)floor(preciseCenterOfMass[2] + CENTER_OF_MASS_INDEX_TOLERANCE);
+  }
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::GetVolumeNodeCenterOfMass(vtkMRMLScalarVolumeNode *volumeNode, double centerOfMass[3])
+{
+  centerOfMass[0] = centerOfMass[1] = centerOfMass[2] = 0.0;
+  if (!volumeNode)
+  {
+    vtkErrorMacro("GetVolumeNodeCenterOfMass: Volume is missing!");
+    return;
+  }
+  this->GetImageDataCenterOfMass(volumeNode->GetImageData(), centerOfMass);
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::GetImageDataCenterOfMass(vtkImageData* imageData, double centerOfMass[3])
+{
+  centerOfMass[0] = centerOfMass[1] = centerOfMass[2] = 0.0;
+  if (!imageData || !imageData->GetScalarPointer())
+  {
+    vtkErrorMacro("GetImageDataCenterOfMass: Image has no scalars!");
+    return;
+  }
+
+  // A sweep morphs the same dose many times, only sum the voxels again if the image changed
+  if (imageData == this->CenterOfMassImageData && imageData->GetMTime() == this->CenterOfMassImageDataMTime)
+  {
+    centerOfMass[0] = this->CenterOfMass[0];
+    centerOfMass[1] = this->CenterOfMass[1];
+    centerOfMass[2] = this->CenterOfMass[2];
+    return;
+  }
+
+  int extent[6] = {0, -1, 0, -1, 0, -1};
+  imageData->GetExtent(extent);
+  int numberOfThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  if (numberOfThreads > extent[5] - extent[4] + 1)
+  {
+    numberOfThreads = extent[5] - extent[4] + 1;
+  }
+
+  if (numberOfThreads > 0)
+  {
+    vtkDoseMorphologyCenterOfMassInfo info;
+    info.ImageData = imageData;
+    info.Sums.assign(4 * numberOfThreads, 0.0);
+
+    vtkNew<vtkMultiThreader> threader;
+    threader->SetNumberOfThreads(numberOfThreads);
+    threader->SetSingleMethod(vtkDoseMorphologyCenterOfMassThread, &info);
+    threader->SingleMethodExecute();
+
+    // Add the partial sums in thread order so that the result does not depend on the scheduling
+    double sums[4] = {0.0, 0.0, 0.0, 0.0};
+    for (int threadIndex = 0; threadIndex < numberOfThreads; threadIndex++)
+    {
+      for (int sumIndex = 0; sumIndex < 4; sumIndex++)
+      {
+        sums[sumIndex] += info.Sums[4 * threadIndex + sumIndex];
+      }
+    }
+    if (sums[0] > 0)
+    {
+      centerOfMass[0] = extent[0] + sums[1] / sums[0];
+      centerOfMass[1] = extent[2] + sums[2] / sums[0];
+      centerOfMass[2] = extent[4] + sums[3] / sums[0];
+    }
+  }
+
+  this->CenterOfMass[0] = centerOfMass[0];
+  this->CenterOfMass[1] = centerOfMass[1];
+  this->CenterOfMass[2] = centerOfMass[2];
+  this->CenterOfMassImageData = imageData;
+  this->CenterOfMassImageDataMTime = imageData->GetMTime();
+}
 
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::GetVolumeNodeCenterOfMass(vtkMRMLScalarVolumeNode *volumeNode, int* centerOfMass)
+{
+  double preciseCenterOfMass[3] = {0.0, 0.0, 0.0};
+  this->GetVolumeNodeCenterOfMass(volumeNode, preciseCenterOfMass);
+  vtkSlicerDoseMorphologyTruncateCenterOfMass(preciseCenterOfMass, centerOfMass);
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::MorphDose()
+{
   vtkSmartPointer<vtkMRMLScalarVolumeNode> referenceDoseVolumeNode = this->DoseMorphologyNode->GetReferenceDoseVolumeNode();
   vtkSmartPointer<vtkMRMLScalarVolumeNode> inputDoseVolumeNode = this->DoseMorphologyNode->GetInputDoseVolumeNode();
   vtkSmartPointer<vtkMRMLScalarVolumeNode> outputDoseVolumeNode = this->DoseMorphologyNode->GetOutputDoseVolumeNode();
@@ -265,198 +427,967 @@ int vtkSlicerDoseMorphologyModuleLogic::MorphDose()
     return -1;
   }
 
+  if (!referenceDoseVolumeNode->GetImageData() || !inputDoseVolumeNode->GetImageData())
+  {
+    vtkErrorMacro("DoseMorphology: Input or reference dose volume contains no image data!")
+    return -1;
+  }
+
+  vtkSmartPointer<vtkMatrix4x4> inputIJKToRASMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  inputDoseVolumeNode->GetIJKToRASMatrix(inputIJKToRASMatrix);
+  int referenceDimensions[3] = {0, 0, 0};
+  referenceDoseVolumeNode->GetImageData()->GetDimensions(referenceDimensions);
+  double referenceSpacing[3] = {1.0, 1.0, 1.0};
+  referenceDoseVolumeNode->GetSpacing(referenceSpacing);
+
+  vtkSmartPointer<vtkImageData> tempImageData = vtkSmartPointer<vtkImageData>::New();
+  if (this->MorphDoseImage(inputDoseVolumeNode->GetImageData(), inputIJKToRASMatrix, referenceDimensions, referenceSpacing,
+    this->DoseMorphologyNode->GetOperation(), this->DoseMorphologyNode->GetDilationMethod(),
+    this->DoseMorphologyNode->GetXSize(), this->DoseMorphologyNode->GetYSize(), this->DoseMorphologyNode->GetZSize(),
+    this->DoseMorphologyNode->GetDosePrecision(), MarginCalculatorCommon::GetDoseUnitValue(inputDoseVolumeNode), tempImageData) != 0)
+  {
+    return -1;
+  }
+
+  // to do .... 
+  outputDoseVolumeNode->CopyOrientation( referenceDoseVolumeNode );
+  outputDoseVolumeNode->SetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_NAME_ATTRIBUTE_NAME.c_str(), inputDoseVolumeNode->GetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_NAME_ATTRIBUTE_NAME.c_str()));
+  outputDoseVolumeNode->SetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_VALUE_ATTRIBUTE_NAME.c_str(), inputDoseVolumeNode->GetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_VALUE_ATTRIBUTE_NAME.c_str()));
+
+  outputDoseVolumeNode->SetAndObserveImageData( tempImageData );
+  outputDoseVolumeNode->SetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_VOLUME_IDENTIFIER_ATTRIBUTE_NAME.c_str(), "1");
+  outputDoseVolumeNode->HideFromEditorsOff();
+
+  // An output that is already displayed keeps its display settings and the current selection
+  if (outputDoseVolumeNode->GetDisplayNode())
+  {
+    return 0;
+  }
+
   this->GetMRMLScene()->StartState(vtkMRMLScene::BatchProcessState); 
 
-  int op = this->DoseMorphologyNode->GetOperation();
+  // Create display node
+  vtkSmartPointer<vtkMRMLScalarVolumeDisplayNode> outputDoseVolumeDisplayNode = vtkSmartPointer<vtkMRMLScalarVolumeDisplayNode>::New();
+  outputDoseVolumeDisplayNode = vtkMRMLScalarVolumeDisplayNode::SafeDownCast(this->GetMRMLScene()->AddNode(outputDoseVolumeDisplayNode));
+  //outputDoseVolumeNodeName.append("Display");
+  //doseVolumeDisplayNode->SetName(outputDoseVolumeNodeName.c_str());
+  outputDoseVolumeNode->SetAndObserveDisplayNodeID( outputDoseVolumeDisplayNode->GetID() );
 
-  referenceDoseVolumeNode->GetOrigin(originX, originY, originZ); 
-  referenceDoseVolumeNode->GetSpacing(spacingX, spacingY, spacingZ);
-  referenceDoseVolumeNode->GetImageData()->GetDimensions(dimensions);
-  inputDoseVolumeNode->GetOrigin(originX2, originY2, originZ2); 
-  inputDoseVolumeNode->GetSpacing(spacingX2, spacingY2, spacingZ2);
-  inputDoseVolumeNode->GetImageData()->GetDimensions(dimensions2);
+  // Set default colormap to rainbow
+  outputDoseVolumeDisplayNode->SetAndObserveColorNodeID("vtkMRMLColorTableNodeRainbow");
 
-  vtkSmartPointer<vtkImageData> tempImage = NULL;
-  tempImage = inputDoseVolumeNode->GetImageData();
+  // Select as active volume
+  if (this->GetApplicationLogic()!=NULL)
+  {
+    if (this->GetApplicationLogic()->GetSelectionNode()!=NULL)
+    {
+      this->GetApplicationLogic()->GetSelectionNode()->SetReferenceActiveVolumeID(outputDoseVolumeNode->GetID());
+      this->GetApplicationLogic()->PropagateVolumeSelection();
+    }
+  }
+  outputDoseVolumeDisplayNode->SetVisibility(1);
 
-  double dimsH[4];
-  double rasCorner[4];
-  double origin[3] = {0.,0.,0.};
-  
-  // Use image center to scale dose
+  this->GetMRMLScene()->EndState(vtkMRMLScene::BatchProcessState); 
+
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerDoseMorphologyModuleLogic::MorphologyCacheKeysEqual(const MorphologyCacheEntry &entry1, const MorphologyCacheEntry &entry2)
+{
+  if ( entry1.InputDoseImageData != entry2.InputDoseImageData || entry1.InputDoseImageDataMTime != entry2.InputDoseImageDataMTime
+    || entry1.Operation != entry2.Operation || entry1.DilationMethod != entry2.DilationMethod
+    || entry1.DosePrecision != entry2.DosePrecision || entry1.DoseUnitValue != entry2.DoseUnitValue )
   {
-  int *dims = tempImage->GetDimensions();
-  dimsH[0] = dims[0] - 1;
-  dimsH[1] = dims[1] - 1;
-  dimsH[2] = dims[2] - 1;
-  dimsH[3] = 0.;
+    return false;
+  }
+  for (int element = 0; element < 16; element++)
+  {
+    if (entry1.InputIJKToRASMatrix[element] != entry2.InputIJKToRASMatrix[element])
+    {
+      return false;
+    }
   }
-  
-  // Use center of mass to scale dose
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if ( entry1.ReferenceDimensions[axis] != entry2.ReferenceDimensions[axis] || entry1.ReferenceSpacing[axis] != entry2.ReferenceSpacing[axis]
+      || entry1.Size[axis] != entry2.Size[axis] )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::MorphDoseImage(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+                                                       const int referenceDimensions[3], const double referenceSpacing[3],
+                                                       int operation, int dilationMethod, double xSize, double ySize, double zSize,
+                                                       int dosePrecision, double doseUnitValue, vtkImageData* outputDoseImageData)
+{
+  if (!inputDoseImageData || !inputIJKToRASMatrix || !outputDoseImageData)
+  {
+    vtkErrorMacro("MorphDoseImage: Input dose, its geometry or the output image data is missing!");
+    return -1;
+  }
+  this->EndDilationSession();
+
+  MorphologyCacheEntry key;
+  InitializeMorphologyCacheKey(inputDoseImageData, inputIJKToRASMatrix, referenceDimensions, referenceSpacing,
+    operation, dilationMethod, xSize, ySize, zSize, dosePrecision, doseUnitValue, key);
+  if (this->GetCachedMorphology(key, outputDoseImageData))
+  {
+    return 0;
+  }
+
+  if (this->PrepareMorphology(inputDoseImageData, inputIJKToRASMatrix, referenceDimensions, referenceSpacing, dosePrecision, doseUnitValue) != 0)
+  {
+    return -1;
+  }
+  int result = this->ComputeMorphology(this->GetPreparedMorphologyDose(operation, dilationMethod), operation, dilationMethod,
+    xSize, ySize, zSize, 0, outputDoseImageData);
+  this->ReleaseMorphology();
+  if (result != 0)
+  {
+    return result;
+  }
+
+  this->CacheMorphology(key, outputDoseImageData);
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+struct vtkDoseMorphologyBatchInfo
+{
+  vtkSlicerDoseMorphologyModuleLogic* Logic;
+  vtkDoubleArray* Parameters;
+  int DilationMethod;
+  /// Threads of the filters of one morphology
+  int NumberOfFilterThreads;
+  /// Indices of the morphologies to compute, with their own prepared dose objects (shallow copies) and outputs
+  std::vector<vtkIdType> MorphologyIndices;
+  std::vector<vtkImageData*> PreparedDoseImageDatas;
+  std::vector<vtkImageData*> OutputDoseImageDatas;
+  std::vector<int> Results;
+};
+
+//---------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE vtkSlicerDoseMorphologyModuleLogic::MorphDoseBatchThread(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* threadInfo = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  vtkDoseMorphologyBatchInfo* info = static_cast<vtkDoseMorphologyBatchInfo*>(threadInfo->UserData);
+
+  for (unsigned int itemIndex = threadInfo->ThreadID; itemIndex < info->MorphologyIndices.size(); itemIndex += threadInfo->NumberOfThreads)
   {
-  int centerOfMass[3] = {0,0,0};
-  this->GetVolumeNodeCenterOfMass(inputDoseVolumeNode, centerOfMass);
-  dimsH[0] = centerOfMass[0];
-  dimsH[1] = centerOfMass[1];
-  dimsH[2] = centerOfMass[2];
-  dimsH[3] = 0.;
+    double* morphologyParameters = info->Parameters->GetTuple4(info->MorphologyIndices[itemIndex]);
+    info->Results[itemIndex] = info->Logic->ComputeMorphology(info->PreparedDoseImageDatas[itemIndex], (int)morphologyParameters[0],
+      info->DilationMethod, morphologyParameters[1], morphologyParameters[2], morphologyParameters[3],
+      info->NumberOfFilterThreads, info->OutputDoseImageDatas[itemIndex]);
   }
 
-  vtkSmartPointer<vtkMatrix4x4> ijkToRAS = vtkSmartPointer<vtkMatrix4x4>::New();
-  inputDoseVolumeNode->GetIJKToRASMatrix(ijkToRAS);
-  ijkToRAS->MultiplyPoint(dimsH, rasCorner);
+  return VTK_THREAD_RETURN_VALUE;
+}
 
-  // Use image center to scale dose
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::MorphDoseBatch(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+                                                       const int referenceDimensions[3], const double referenceSpacing[3],
+                                                       vtkDoubleArray* parameters, int dilationMethod, int dosePrecision, double doseUnitValue,
+                                                       vtkCollection* outputDoseImageDatas)
+{
+  if (!inputDoseImageData || !inputIJKToRASMatrix || !parameters || parameters->GetNumberOfComponents() != 4 || !outputDoseImageDatas)
   {
-  origin[0] = -0.5 * rasCorner[0];
-  origin[1] = -0.5 * rasCorner[1];
-  origin[2] = -0.5 * rasCorner[2];
+    vtkErrorMacro("MorphDoseBatch: Input dose, its geometry or the output collection is missing, or the parameters do not have four components (operation, X, Y, Z size)!");
+    return -1;
   }
+  this->EndDilationSession();
 
-  // Use center of mass to scale dose
+  // Answer what the cache can, the other morphologies are computed together
+  vtkIdType numberOfMorphologies = parameters->GetNumberOfTuples();
+  std::vector<MorphologyCacheEntry> keys(numberOfMorphologies);
+  std::vector< vtkSmartPointer<vtkImageData> > outputs(numberOfMorphologies);
+  vtkDoseMorphologyBatchInfo info;
+  info.Logic = this;
+  info.Parameters = parameters;
+  info.DilationMethod = dilationMethod;
+  for (vtkIdType morphologyIndex = 0; morphologyIndex < numberOfMorphologies; morphologyIndex++)
   {
-  origin[0] = - rasCorner[0];
-  origin[1] = - rasCorner[1];
-  origin[2] = - rasCorner[2];
+    double* morphologyParameters = parameters->GetTuple4(morphologyIndex);
+    InitializeMorphologyCacheKey(inputDoseImageData, inputIJKToRASMatrix, referenceDimensions, referenceSpacing,
+      (int)morphologyParameters[0], dilationMethod, morphologyParameters[1], morphologyParameters[2], morphologyParameters[3],
+      dosePrecision, doseUnitValue, keys[morphologyIndex]);
+    outputs[morphologyIndex] = vtkSmartPointer<vtkImageData>::New();
+    if (!this->GetCachedMorphology(keys[morphologyIndex], outputs[morphologyIndex]))
+    {
+      info.MorphologyIndices.push_back(morphologyIndex);
+    }
   }
 
-  vtkSmartPointer<vtkMRMLScalarVolumeNode> tempDoseVolumeNode = vtkSmartPointer<vtkMRMLScalarVolumeNode>::New();
-  tempDoseVolumeNode->Copy(inputDoseVolumeNode);
-  tempDoseVolumeNode->SetOrigin(origin);
+  int result = 0;
+  if (!info.MorphologyIndices.empty())
+  {
+    if (this->PrepareMorphology(inputDoseImageData, inputIJKToRASMatrix, referenceDimensions, referenceSpacing, dosePrecision, doseUnitValue) != 0)
+    {
+      return -1;
+    }
+
+    // The dilation grids are computed here once, every morphology gets its own dose object
+    // so that the pipelines of the threads do not share an input
+    std::vector< vtkSmartPointer<vtkImageData> > preparedDoseImageDatas;
+    for (unsigned int itemIndex = 0; itemIndex < info.MorphologyIndices.size(); itemIndex++)
+    {
+      vtkIdType morphologyIndex = info.MorphologyIndices[itemIndex];
+      vtkImageData* preparedDoseImageData = this->GetPreparedMorphologyDose(keys[morphologyIndex].Operation, dilationMethod);
+      if (!preparedDoseImageData)
+      {
+        this->ReleaseMorphology();
+        return -1;
+      }
+      vtkSmartPointer<vtkImageData> preparedDoseImageDataCopy = vtkSmartPointer<vtkImageData>::New();
+      preparedDoseImageDataCopy->ShallowCopy(preparedDoseImageData);
+      preparedDoseImageDatas.push_back(preparedDoseImageDataCopy);
+      info.PreparedDoseImageDatas.push_back(preparedDoseImageDataCopy);
+      info.OutputDoseImageDatas.push_back(outputs[morphologyIndex]);
+    }
+    info.Results.assign(info.MorphologyIndices.size(), 0);
+
+    // Morphologies run side by side and share the threads of their filters
+    int numberOfThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+    if (numberOfThreads > (int)info.MorphologyIndices.size())
+    {
+      numberOfThreads = (int)info.MorphologyIndices.size();
+    }
+    info.NumberOfFilterThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads() / numberOfThreads;
+    if (info.NumberOfFilterThreads < 1)
+    {
+      info.NumberOfFilterThreads = 1;
+    }
+    vtkNew<vtkMultiThreader> threader;
+    threader->SetNumberOfThreads(numberOfThreads);
+    threader->SetSingleMethod(MorphDoseBatchThread, &info);
+    threader->SingleMethodExecute();
+    this->ReleaseMorphology();
+
+    for (unsigned int itemIndex = 0; itemIndex < info.MorphologyIndices.size(); itemIndex++)
+    {
+      vtkIdType morphologyIndex = info.MorphologyIndices[itemIndex];
+      if (info.Results[itemIndex] != 0)
+      {
+        vtkErrorMacro("MorphDoseBatch: Morphology " << morphologyIndex << " failed!");
+        result = -1;
+        continue;
+      }
+      this->CacheMorphology(keys[morphologyIndex], outputs[morphologyIndex]);
+    }
+  }
+  if (result != 0)
+  {
+    return result;
+  }
+
+  for (vtkIdType morphologyIndex = 0; morphologyIndex < numberOfMorphologies; morphologyIndex++)
+  {
+    outputDoseImageDatas->AddItem(outputs[morphologyIndex]);
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::InitializeMorphologyCacheKey(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+                                                                      const int referenceDimensions[3], const double referenceSpacing[3],
+                                                                      int operation, int dilationMethod, double xSize, double ySize, double zSize,
+                                                                      int dosePrecision, double doseUnitValue, MorphologyCacheEntry &key)
+{
+  key.InputDoseImageData = inputDoseImageData;
+  key.InputDoseImageDataMTime = inputDoseImageData->GetMTime();
+  for (int element = 0; element < 16; element++)
+  {
+    key.InputIJKToRASMatrix[element] = inputIJKToRASMatrix->GetElement(element / 4, element % 4);
+  }
+  for (int axis = 0; axis < 3; axis++)
+  {
+    key.ReferenceDimensions[axis] = referenceDimensions[axis];
+    key.ReferenceSpacing[axis] = referenceSpacing[axis];
+  }
+  key.Operation = operation;
+  key.DilationMethod = dilationMethod;
+  key.Size[0] = xSize;
+  key.Size[1] = ySize;
+  key.Size[2] = zSize;
+  key.DosePrecision = dosePrecision;
+  key.DoseUnitValue = doseUnitValue;
+  key.OutputDoseImageData = NULL;
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerDoseMorphologyModuleLogic::GetCachedMorphology(const MorphologyCacheEntry &key, vtkImageData* outputDoseImageData)
+{
+  for (std::list<MorphologyCacheEntry>::iterator entryIt = this->MorphologyCache.begin(); entryIt != this->MorphologyCache.end(); ++entryIt)
+  {
+    if (MorphologyCacheKeysEqual(key, *entryIt))
+    {
+      // Copied so that changing the output does not change the cache
+      outputDoseImageData->DeepCopy(entryIt->OutputDoseImageData);
+      this->MorphologyCache.splice(this->MorphologyCache.begin(), this->MorphologyCache, entryIt);
+      this->MorphologyCacheHits++;
+      return true;
+    }
+  }
+  this->MorphologyCacheMisses++;
+  return false;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::CacheMorphology(MorphologyCacheEntry key, vtkImageData* outputDoseImageData)
+{
+  // Doses larger than the whole cache are not kept
+  if (outputDoseImageData->GetActualMemorySize() > this->MorphologyCacheSizeLimit)
+  {
+    return;
+  }
+  key.OutputDoseImageData = vtkImageData::New();
+  key.OutputDoseImageData->DeepCopy(outputDoseImageData);
+  this->MorphologyCache.push_front(key);
+  this->MorphologyCacheSize += key.OutputDoseImageData->GetActualMemorySize();
+  this->TrimMorphologyCache();
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::SetMorphologyCacheSizeLimit(unsigned long kilobytes)
+{
+  if (this->MorphologyCacheSizeLimit == kilobytes)
+  {
+    return;
+  }
+  this->MorphologyCacheSizeLimit = kilobytes;
+  this->TrimMorphologyCache();
+  this->Modified();
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::TrimMorphologyCache()
+{
+  while (this->MorphologyCacheSize > this->MorphologyCacheSizeLimit && !this->MorphologyCache.empty())
+  {
+    vtkImageData* leastRecentlyUsed = this->MorphologyCache.back().OutputDoseImageData;
+    this->MorphologyCacheSize -= leastRecentlyUsed->GetActualMemorySize();
+    leastRecentlyUsed->Delete();
+    this->MorphologyCache.pop_back();
+  }
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::ClearMorphologyCache()
+{
+  for (std::list<MorphologyCacheEntry>::iterator entryIt = this->MorphologyCache.begin(); entryIt != this->MorphologyCache.end(); ++entryIt)
+  {
+    entryIt->OutputDoseImageData->Delete();
+  }
+  this->MorphologyCache.clear();
+  this->MorphologyCacheSize = 0;
+  this->MorphologyCacheHits = 0;
+  this->MorphologyCacheMisses = 0;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::PrepareMorphology(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+                                                          const int referenceDimensions[3], const double referenceSpacing[3],
+                                                          int dosePrecision, double doseUnitValue)
+{
+  this->ReleaseMorphology();
+  if (!inputDoseImageData || !inputIJKToRASMatrix)
+  {
+    vtkErrorMacro("PrepareMorphology: Input dose or its geometry is missing!");
+    return -1;
+  }
+
+  // Morph the dose in the requested internal representation
+  double doseScale = 1.0;
+  vtkSmartPointer<vtkImageData> convertedDoseImageData = vtkSmartPointer<vtkImageData>::New();
+  if (MarginCalculatorCommon::ConvertDoseImageData(inputDoseImageData, dosePrecision, doseUnitValue, convertedDoseImageData, doseScale) != 0)
+  {
+    vtkErrorMacro("PrepareMorphology: Input dose cannot be represented with dose precision " << dosePrecision << " (dose unit value: " << doseUnitValue << ")!");
+    return -1;
+  }
+  this->MorphologyInputDoseImageData = vtkImageData::New();
+  this->MorphologyInputDoseImageData->ShallowCopy(convertedDoseImageData);
+  this->MorphologyDosePrecision = dosePrecision;
+  this->MorphologyDoseScale = doseScale;
+
+  this->MorphologyInputIJKToRASMatrix = vtkMatrix4x4::New();
+  this->MorphologyInputIJKToRASMatrix->DeepCopy(inputIJKToRASMatrix);
+  for (int axis = 0; axis < 3; axis++)
+  {
+    this->MorphologyInputSpacing[axis] = sqrt(inputIJKToRASMatrix->GetElement(0, axis) * inputIJKToRASMatrix->GetElement(0, axis)
+      + inputIJKToRASMatrix->GetElement(1, axis) * inputIJKToRASMatrix->GetElement(1, axis)
+      + inputIJKToRASMatrix->GetElement(2, axis) * inputIJKToRASMatrix->GetElement(2, axis));
+    this->MorphologyReferenceDimensions[axis] = referenceDimensions[axis];
+    this->MorphologyReferenceSpacing[axis] = referenceSpacing[axis];
+  }
+
+  // The native grid dilation runs on the input itself if it has the dimensions of the reference, else on the reference grid
+  int inputDimensions[3] = {0, 0, 0};
+  inputDoseImageData->GetDimensions(inputDimensions);
+  bool inputGrid = (inputDimensions[0] == referenceDimensions[0] && inputDimensions[1] == referenceDimensions[1]
+    && inputDimensions[2] == referenceDimensions[2]);
+  for (int axis = 0; axis < 3; axis++)
+  {
+    this->MorphologyNativeGridSpacing[axis] = (inputGrid ? this->MorphologyInputSpacing[axis] : referenceSpacing[axis]);
+  }
+
+  // Scaling pivot, from the original dose so that it does not depend on the dose precision
+  double centerOfMass[3] = {0.0, 0.0, 0.0};
+  this->GetImageDataCenterOfMass(inputDoseImageData, centerOfMass);
+  vtkSlicerDoseMorphologyTruncateCenterOfMass(centerOfMass, this->MorphologyCenterOfMass);
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::ReleaseMorphology()
+{
+  vtkImageData** imageDatas[4] = { &this->MorphologyInputDoseImageData, &this->MorphologyNativeGridDoseImageData,
+    &this->MorphologyFineGridDoseImageData, &this->DilationSessionDoseImageData };
+  for (int imageIndex = 0; imageIndex < 4; imageIndex++)
+  {
+    if (*imageDatas[imageIndex])
+    {
+      (*imageDatas[imageIndex])->Delete();
+      *imageDatas[imageIndex] = NULL;
+    }
+  }
+  if (this->MorphologyInputIJKToRASMatrix)
+  {
+    this->MorphologyInputIJKToRASMatrix->Delete();
+    this->MorphologyInputIJKToRASMatrix = NULL;
+  }
+  this->DilationSessionActive = false;
+}
+
+//---------------------------------------------------------------------------
+// Transform from the output voxels to the voxels of an input with the given geometry and center of mass
+static void vtkSlicerDoseMorphologyResliceTransform(vtkMatrix4x4* inputIJKToRASMatrix, const int inputCenterOfMass[3],
+                                                    bool scaling, double xSize, double ySize, double zSize,
+                                                    vtkTransform* outputResliceTransform)
+{
+  // Voxel coordinates of the input with the center of mass in the RAS origin, so that scaling keeps the center of mass
+  double centerOfMass[4] = {(double)inputCenterOfMass[0], (double)inputCenterOfMass[1], (double)inputCenterOfMass[2], 0.0};
+  double rasCenterOfMass[4] = {0.0, 0.0, 0.0, 0.0};
+  inputIJKToRASMatrix->MultiplyPoint(centerOfMass, rasCenterOfMass);
 
   vtkSmartPointer<vtkMatrix4x4> inputIJK2RASMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
-  tempDoseVolumeNode->GetIJKToRASMatrix(inputIJK2RASMatrix);
+  inputIJK2RASMatrix->DeepCopy(inputIJKToRASMatrix);
+  inputIJK2RASMatrix->SetElement(0, 3, -rasCenterOfMass[0]);
+  inputIJK2RASMatrix->SetElement(1, 3, -rasCenterOfMass[1]);
+  inputIJK2RASMatrix->SetElement(2, 3, -rasCenterOfMass[2]);
   vtkSmartPointer<vtkMatrix4x4> inputRAS2IJKMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
-  tempDoseVolumeNode->GetRASToIJKMatrix(inputRAS2IJKMatrix);
+  vtkMatrix4x4::Invert(inputIJK2RASMatrix, inputRAS2IJKMatrix);
 
-  vtkSmartPointer<vtkTransform> outputResliceTransform = vtkSmartPointer<vtkTransform>::New();
   outputResliceTransform->Identity();
   outputResliceTransform->PostMultiply();
   outputResliceTransform->SetMatrix(inputIJK2RASMatrix);
-
-  vtkSmartPointer<vtkMRMLTransformNode> inputVolumeNodeTransformNode = tempDoseVolumeNode->GetParentTransformNode();
-  vtkSmartPointer<vtkMatrix4x4> inputRAS2RASMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
-  if (inputVolumeNodeTransformNode!=NULL)
-  {
-    inputVolumeNodeTransformNode->GetMatrixTransformToWorld(inputRAS2RASMatrix);  
-    outputResliceTransform->Concatenate(inputRAS2RASMatrix);
-  }
-  
-  if (op == SLICERRT_EXPAND_BY_SCALING) 
+  if (scaling)
   {
     vtkSmartPointer<vtkMatrix4x4> ScalingMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
     vtkSmartPointer<vtkTransform> transform = vtkSmartPointer<vtkTransform>::New();
-    transform->Scale(this->GetDoseMorphologyNode()->GetXSize(),
-                     this->GetDoseMorphologyNode()->GetYSize(),
-                     this->GetDoseMorphologyNode()->GetZSize());
+    transform->Scale(xSize, ySize, zSize);
     transform->GetMatrix(ScalingMatrix);
     outputResliceTransform->Concatenate(ScalingMatrix);
   }
   outputResliceTransform->Concatenate(inputRAS2IJKMatrix);
   outputResliceTransform->Inverse();
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::GetMorphologyResliceTransform(bool scaling, double xSize, double ySize, double zSize, vtkTransform* outputResliceTransform)
+{
+  vtkSlicerDoseMorphologyResliceTransform(this->MorphologyInputIJKToRASMatrix, this->MorphologyCenterOfMass,
+    scaling, xSize, ySize, zSize, outputResliceTransform);
+}
 
-  vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::GetScalingResliceMatrix(double xSize, double ySize, double zSize, vtkMatrix4x4* outputResliceMatrix)
+{
+  vtkMRMLScalarVolumeNode* inputDoseVolumeNode = (this->DoseMorphologyNode ? this->DoseMorphologyNode->GetInputDoseVolumeNode() : NULL);
+  if (!inputDoseVolumeNode || !inputDoseVolumeNode->GetImageData() || !outputResliceMatrix)
+  {
+    vtkErrorMacro("GetScalingResliceMatrix: Input dose or the output matrix is missing!");
+    return -1;
+  }
+
+  vtkSmartPointer<vtkMatrix4x4> inputIJKToRASMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  inputDoseVolumeNode->GetIJKToRASMatrix(inputIJKToRASMatrix);
+  return this->GetScalingResliceMatrixOfImage(inputDoseVolumeNode->GetImageData(), inputIJKToRASMatrix, xSize, ySize, zSize, outputResliceMatrix);
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::GetScalingResliceMatrixOfImage(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+                                                                       double xSize, double ySize, double zSize, vtkMatrix4x4* outputResliceMatrix)
+{
+  if (!inputDoseImageData || !inputIJKToRASMatrix || !outputResliceMatrix)
+  {
+    vtkErrorMacro("GetScalingResliceMatrixOfImage: Input dose, its geometry or the output matrix is missing!");
+    return -1;
+  }
+
+  // Same pivot and geometry as the scaling of MorphDoseImage, without converting or resampling the dose
+  double preciseCenterOfMass[3] = {0.0, 0.0, 0.0};
+  this->GetImageDataCenterOfMass(inputDoseImageData, preciseCenterOfMass);
+  int centerOfMass[3] = {0, 0, 0};
+  vtkSlicerDoseMorphologyTruncateCenterOfMass(preciseCenterOfMass, centerOfMass);
+
+  vtkSmartPointer<vtkTransform> resliceTransform = vtkSmartPointer<vtkTransform>::New();
+  vtkSlicerDoseMorphologyResliceTransform(inputIJKToRASMatrix, centerOfMass, true, xSize, ySize, zSize, resliceTransform);
+  outputResliceMatrix->DeepCopy(resliceTransform->GetMatrix());
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+vtkImageData* vtkSlicerDoseMorphologyModuleLogic::GetPreparedMorphologyDose(int operation, int dilationMethod)
+{
+  if (!this->MorphologyInputDoseImageData)
+  {
+    vtkErrorMacro("GetPreparedMorphologyDose: Morphology inputs are not prepared!");
+    return NULL;
+  }
+  if (operation == SLICERRT_EXPAND_BY_SCALING || operation == SLICERRT_SHRINK_BY_SCALING)
+  {
+    return this->MorphologyInputDoseImageData;
+  }
+  if (operation != SLICERRT_EXPAND_BY_DILATION && operation != SLICERRT_SHRINK_BY_EROSION)
+  {
+    vtkErrorMacro("GetPreparedMorphologyDose: Unknown operation " << operation << "!");
+    return NULL;
+  }
+  const int* dimensions = this->MorphologyReferenceDimensions;
+  const double* spacing = this->MorphologyReferenceSpacing;
+
+  if (dilationMethod == SLICERRT_DILATION_NATIVE_ELLIPSOID)
+  {
+    if (!this->MorphologyNativeGridDoseImageData)
+    {
+      // Dilate on the dose grid itself, the kernel is defined in mm so no oversampling is needed
+      this->MorphologyNativeGridDoseImageData = vtkImageData::New();
+      int inputDimensions[3] = {0, 0, 0};
+      this->MorphologyInputDoseImageData->GetDimensions(inputDimensions);
+      if (dimensions[0] == inputDimensions[0] && dimensions[1] == inputDimensions[1] && dimensions[2] == inputDimensions[2])
+      {
+        // The reslice would only copy the input, dilate the input itself
+        this->MorphologyNativeGridDoseImageData->ShallowCopy(this->MorphologyInputDoseImageData);
+      }
+      else
+      {
+        vtkSmartPointer<vtkTransform> outputResliceTransform = vtkSmartPointer<vtkTransform>::New();
+        this->GetMorphologyResliceTransform(false, 1.0, 1.0, 1.0, outputResliceTransform);
+        vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
 #if (VTK_MAJOR_VERSION <= 5)
-  reslice->SetInput(inputDoseVolumeNode->GetImageData());
+        reslice->SetInput(this->MorphologyInputDoseImageData);
 #else
-  reslice->SetInputData(inputDoseVolumeNode->GetImageData());
+        reslice->SetInputData(this->MorphologyInputDoseImageData);
 #endif
-  reslice->SetOutputOrigin(0, 0, 0);
-  if (op == SLICERRT_EXPAND_BY_SCALING) 
+        reslice->SetOutputOrigin(0, 0, 0);
+        reslice->SetOutputSpacing(1, 1, 1);
+        reslice->SetOutputExtent(0, dimensions[0]-1, 0, dimensions[1]-1, 0, dimensions[2]-1);
+        reslice->SetResliceTransform(outputResliceTransform);
+        reslice->SetInterpolationModeToCubic();
+        reslice->Update();
+        this->MorphologyNativeGridDoseImageData->ShallowCopy(reslice->GetOutput());
+      }
+    }
+    return this->MorphologyNativeGridDoseImageData;
+  }
+
+  if (!this->MorphologyFineGridDoseImageData)
   {
+    vtkSmartPointer<vtkTransform> outputResliceTransform = vtkSmartPointer<vtkTransform>::New();
+    this->GetMorphologyResliceTransform(false, 1.0, 1.0, 1.0, outputResliceTransform);
+    vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+    reslice->SetInput(this->MorphologyInputDoseImageData);
+#else
+    reslice->SetInputData(this->MorphologyInputDoseImageData);
+#endif
+    reslice->SetOutputOrigin(0, 0, 0);
+    reslice->SetOutputSpacing(RESAMPLE_SIZE_DILATION/spacing[0], RESAMPLE_SIZE_DILATION/spacing[1], RESAMPLE_SIZE_DILATION/spacing[2]);
+    reslice->SetOutputExtent(0, dimensions[0]*spacing[0]/RESAMPLE_SIZE_DILATION-1, 0, dimensions[1]*spacing[1]/RESAMPLE_SIZE_DILATION-1, 0, dimensions[2]*spacing[2]/RESAMPLE_SIZE_DILATION-1);
+    reslice->SetResliceTransform(outputResliceTransform);
+    reslice->SetInterpolationModeToCubic();
+    reslice->Update();
+    this->MorphologyFineGridDoseImageData = vtkImageData::New();
+    this->MorphologyFineGridDoseImageData->ShallowCopy(reslice->GetOutput());
+  }
+  return this->MorphologyFineGridDoseImageData;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::ComputeMorphology(vtkImageData* preparedDoseImageData, int operation, int dilationMethod,
+                                                          double xSize, double ySize, double zSize, int numberOfThreads, vtkImageData* outputDoseImageData)
+{
+  if (!preparedDoseImageData || !outputDoseImageData)
+  {
+    vtkErrorMacro("ComputeMorphology: Morphology inputs are not prepared or the output is missing!");
+    return -1;
+  }
+  const int* dimensions = this->MorphologyReferenceDimensions;
+  int dosePrecision = this->MorphologyDosePrecision;
+  double doseScale = this->MorphologyDoseScale;
+
+  if (operation == SLICERRT_EXPAND_BY_SCALING || operation == SLICERRT_SHRINK_BY_SCALING)
+  {
+    if (operation == SLICERRT_SHRINK_BY_SCALING)
+    {
+      if (xSize <= 0.0 || ySize <= 0.0 || zSize <= 0.0)
+      {
+        vtkErrorMacro("ComputeMorphology: Invalid shrink factors " << xSize << ", " << ySize << ", " << zSize << "!");
+        return -1;
+      }
+      xSize = 1.0 / xSize;
+      ySize = 1.0 / ySize;
+      zSize = 1.0 / zSize;
+    }
+    vtkSmartPointer<vtkTransform> outputResliceTransform = vtkSmartPointer<vtkTransform>::New();
+    this->GetMorphologyResliceTransform(true, xSize, ySize, zSize, outputResliceTransform);
+
+    // Dose grids aligned with the RAS axes give a separable scaling that is resampled axis by axis
+    vtkMatrix4x4* resliceMatrix = outputResliceTransform->GetMatrix();
+    bool axisAligned = true;
+    for (int row = 0; row < 3; row++)
+    {
+      for (int column = 0; column < 3; column++)
+      {
+        if (row != column && fabs(resliceMatrix->GetElement(row, column)) > AXIS_ALIGNED_SCALING_TOLERANCE)
+        {
+          axisAligned = false;
+        }
+      }
+    }
+    if (axisAligned)
+    {
+      vtkSmartPointer<vtkImageScaleResample3D> scaleResample = vtkSmartPointer<vtkImageScaleResample3D>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+      scaleResample->SetInput(preparedDoseImageData);
+#else
+      scaleResample->SetInputData(preparedDoseImageData);
+#endif
+      scaleResample->SetScale(resliceMatrix->GetElement(0, 0), resliceMatrix->GetElement(1, 1), resliceMatrix->GetElement(2, 2));
+      scaleResample->SetOffset(resliceMatrix->GetElement(0, 3), resliceMatrix->GetElement(1, 3), resliceMatrix->GetElement(2, 3));
+      scaleResample->SetOutputExtent(0, dimensions[0]-1, 0, dimensions[1]-1, 0, dimensions[2]-1);
+      if (numberOfThreads > 0)
+      {
+        scaleResample->SetNumberOfThreads(numberOfThreads);
+      }
+      if (dosePrecision == MARGINCALCULATOR_DOSE_PRECISION_UINT16)
+      {
+        scaleResample->SetOutputScalarType(VTK_FLOAT);
+        scaleResample->SetScalarScale(doseScale);
+      }
+      scaleResample->Update();
+      outputDoseImageData->ShallowCopy(scaleResample->GetOutput());
+      outputDoseImageData->SetOrigin(0, 0, 0);
+      outputDoseImageData->SetSpacing(1, 1, 1);
+      return 0;
+    }
+
+    vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+    reslice->SetInput(preparedDoseImageData);
+#else
+    reslice->SetInputData(preparedDoseImageData);
+#endif
+    reslice->SetOutputOrigin(0, 0, 0);
     reslice->SetOutputSpacing(1, 1, 1);
     reslice->SetOutputExtent(0, dimensions[0]-1, 0, dimensions[1]-1, 0, dimensions[2]-1);
+    if (dosePrecision == MARGINCALCULATOR_DOSE_PRECISION_UINT16)
+    {
+      reslice->SetOutputScalarType(VTK_FLOAT);
+      reslice->SetScalarScale(doseScale);
+    }
+    reslice->SetResliceTransform(outputResliceTransform);
+    reslice->SetInterpolationModeToCubic();
+    if (numberOfThreads > 0)
+    {
+      reslice->SetNumberOfThreads(numberOfThreads);
+    }
+    reslice->Update();
+    outputDoseImageData->ShallowCopy(reslice->GetOutput());
+    return 0;
   }
-  if (op == SLICERRT_EXPAND_BY_DILATION) 
+
+  vtkSmartPointer<vtkImageData> dilatedDoseImageData = vtkSmartPointer<vtkImageData>::New();
+  if (this->DilatePreparedDose(preparedDoseImageData, dilationMethod, operation == SLICERRT_SHRINK_BY_EROSION,
+    xSize, ySize, zSize, numberOfThreads, dilatedDoseImageData) != 0)
   {
-    reslice->SetOutputSpacing(RESAMPLE_SIZE_DILATION/spacingX, RESAMPLE_SIZE_DILATION/spacingY, RESAMPLE_SIZE_DILATION/spacingZ);
-    reslice->SetOutputExtent(0, dimensions[0]*spacingX/RESAMPLE_SIZE_DILATION-1, 0, dimensions[1]*spacingY/RESAMPLE_SIZE_DILATION-1, 0, dimensions[2]*spacingZ/RESAMPLE_SIZE_DILATION-1);
+    return -1;
   }
-  reslice->SetResliceTransform(outputResliceTransform);
-  reslice->SetInterpolationModeToCubic();
-  reslice->Update();
-  tempImage = reslice->GetOutput();
+  return this->ConvertDilatedDose(dilatedDoseImageData, dilationMethod, numberOfThreads, outputDoseImageData);
+}
 
-  vtkSmartPointer<vtkImageData> tempImageData = NULL;
-  vtkSmartPointer<vtkImageContinuousDilate3D> dilateFilter = vtkSmartPointer<vtkImageContinuousDilate3D>::New();
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::DilatePreparedDose(vtkImageData* preparedDoseImageData, int dilationMethod, bool erosion,
+                                                           double xSize, double ySize, double zSize, int numberOfThreads,
+                                                           vtkImageData* dilatedDoseImageData)
+{
+  if (!preparedDoseImageData || !dilatedDoseImageData)
+  {
+    vtkErrorMacro("DilatePreparedDose: Prepared dose or the output is missing!");
+    return -1;
+  }
 
-  //int op = this->DoseMorphologyNode->GetOperation();
-  switch (op) 
+  if (dilationMethod == SLICERRT_DILATION_NATIVE_ELLIPSOID)
   {
-    case SLICERRT_EXPAND_BY_SCALING:
-      //transform->Scale(this->GetDoseMorphologyNode()->GetXSize(),
-      //                 this->GetDoseMorphologyNode()->GetYSize(),
-      //                 this->GetDoseMorphologyNode()->GetZSize());
-      //resliceFilter->SetInput(tempImage2);
-      //resliceFilter->SetInformationInput(tempImage);
-      //resliceFilter->SetResliceTransform(transform);
-      //resliceFilter->GetOutput();
-      tempImageData = tempImage;
-      break;
-    case SLICERRT_EXPAND_BY_DILATION:
-      // temp work around for calculating the kernel size
-      //double spacing[3] = {0,0,0};
-      //volumeNode->GetSpacing(spacing);
-      int kernelSize[3] = {1,1,1};
-      kernelSize[0] = (int)(this->GetDoseMorphologyNode()->GetXSize()*2*spacingX/RESAMPLE_SIZE_DILATION+1);
-      kernelSize[1] = (int)(this->GetDoseMorphologyNode()->GetYSize()*2*spacingY/RESAMPLE_SIZE_DILATION+1);
-      kernelSize[2] = (int)(this->GetDoseMorphologyNode()->GetZSize()*2*spacingZ/RESAMPLE_SIZE_DILATION+1);
+    // Image data carries unit spacing, give the filter the voxel size so that it can build the ellipsoid in mm
+    vtkSmartPointer<vtkImageChangeInformation> physicalSpacing = vtkSmartPointer<vtkImageChangeInformation>::New();
 #if (VTK_MAJOR_VERSION <= 5)
-      dilateFilter->SetInput(tempImage);
+    physicalSpacing->SetInput(preparedDoseImageData);
 #else
-      dilateFilter->SetInputData(tempImage);
+    physicalSpacing->SetInputData(preparedDoseImageData);
 #endif
-      dilateFilter->SetKernelSize(kernelSize[0], kernelSize[1], kernelSize[2]);
-      dilateFilter->Update();
-      //tempImageData = dilateFilter->GetOutput();
+    physicalSpacing->SetOutputSpacing(this->MorphologyNativeGridSpacing);
+
+    // Sizes are radii in mm
+    vtkSmartPointer<vtkImageVanHerkDilate3D> ellipsoidDilateFilter = vtkSmartPointer<vtkImageVanHerkDilate3D>::New();
+    ellipsoidDilateFilter->SetInputConnection(physicalSpacing->GetOutputPort());
+    ellipsoidDilateFilter->SetFootprintToSpacingEllipsoid();
+    ellipsoidDilateFilter->SubVoxelAccuracyOn();
+    ellipsoidDilateFilter->SetRadius(xSize, ySize, zSize);
+    ellipsoidDilateFilter->SetErosion(erosion);
+    if (numberOfThreads > 0)
+    {
+      ellipsoidDilateFilter->SetNumberOfThreads(numberOfThreads);
+    }
+
+    vtkSmartPointer<vtkImageChangeInformation> unitSpacing = vtkSmartPointer<vtkImageChangeInformation>::New();
+    unitSpacing->SetInputConnection(ellipsoidDilateFilter->GetOutputPort());
+    unitSpacing->SetOutputSpacing(1, 1, 1);
+    unitSpacing->Update();
+    dilatedDoseImageData->ShallowCopy(unitSpacing->GetOutput());
+    return 0;
+  }
 
-      vtkSmartPointer<vtkImageReslice> reslice2 = vtkSmartPointer<vtkImageReslice>::New();
+  // Sizes are radii in mm as on the native grid, the voxels of the fine grid are RESAMPLE_SIZE_DILATION mm large
+  int kernelSize[3] = {1,1,1};
+  kernelSize[0] = (int)(xSize*2/RESAMPLE_SIZE_DILATION+1);
+  kernelSize[1] = (int)(ySize*2/RESAMPLE_SIZE_DILATION+1);
+  kernelSize[2] = (int)(zSize*2/RESAMPLE_SIZE_DILATION+1);
+  // Both filters give the same result, the cost of the van Herk filter grows with its number of passes
+  // instead of the kernel volume, which only pays off for large kernels
+  vtkSmartPointer<vtkImageAlgorithm> dilateFilter = NULL;
+  if (kernelSize[0]*kernelSize[1]*kernelSize[2] > MAX_DIRECT_DILATION_KERNEL_VOLUME)
+  {
+    vtkSmartPointer<vtkImageVanHerkDilate3D> vanHerkDilateFilter = vtkSmartPointer<vtkImageVanHerkDilate3D>::New();
+    vanHerkDilateFilter->SetKernelSize(kernelSize[0], kernelSize[1], kernelSize[2]);
+    vanHerkDilateFilter->SetFootprintToEllipsoid();
+    vanHerkDilateFilter->SetErosion(erosion);
+    if (numberOfThreads > 0)
+    {
+      vanHerkDilateFilter->SetNumberOfThreads(numberOfThreads);
+    }
+    dilateFilter = vanHerkDilateFilter;
+  }
+  else if (erosion)
+  {
+    vtkSmartPointer<vtkImageContinuousErode3D> continuousErodeFilter = vtkSmartPointer<vtkImageContinuousErode3D>::New();
+    continuousErodeFilter->SetKernelSize(kernelSize[0], kernelSize[1], kernelSize[2]);
+    if (numberOfThreads > 0)
+    {
+      continuousErodeFilter->SetNumberOfThreads(numberOfThreads);
+    }
+    dilateFilter = continuousErodeFilter;
+  }
+  else
+  {
+    vtkSmartPointer<vtkImageContinuousDilate3D> continuousDilateFilter = vtkSmartPointer<vtkImageContinuousDilate3D>::New();
+    continuousDilateFilter->SetKernelSize(kernelSize[0], kernelSize[1], kernelSize[2]);
+    if (numberOfThreads > 0)
+    {
+      continuousDilateFilter->SetNumberOfThreads(numberOfThreads);
+    }
+    dilateFilter = continuousDilateFilter;
+  }
 #if (VTK_MAJOR_VERSION <= 5)
-      reslice2->SetInput(dilateFilter->GetOutput());
+  dilateFilter->SetInput(preparedDoseImageData);
 #else
-      reslice2->SetInputData(dilateFilter->GetOutput());
+  dilateFilter->SetInputData(preparedDoseImageData);
 #endif
-      reslice2->SetOutputOrigin(0, 0, 0);
-      reslice2->SetOutputSpacing(1, 1, 1);
-      reslice2->SetOutputExtent(0, dimensions[0]-1, 0, dimensions[1]-1, 0, dimensions[2]-1);
-      reslice2->SetInterpolationModeToCubic();
-      reslice2->Update();
-      tempImageData = reslice2->GetOutput();
-      break;
+  dilateFilter->Update();
+  dilatedDoseImageData->ShallowCopy(dilateFilter->GetOutput());
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::ConvertDilatedDose(vtkImageData* dilatedDoseImageData, int dilationMethod, int numberOfThreads,
+                                                           vtkImageData* outputDoseImageData)
+{
+  if (!dilatedDoseImageData || !outputDoseImageData)
+  {
+    vtkErrorMacro("ConvertDilatedDose: Dilated dose or the output is missing!");
+    return -1;
   }
+  const int* dimensions = this->MorphologyReferenceDimensions;
+  int dosePrecision = this->MorphologyDosePrecision;
+  double doseScale = this->MorphologyDoseScale;
 
-  // to do .... 
-  outputDoseVolumeNode->CopyOrientation( referenceDoseVolumeNode );
-  outputDoseVolumeNode->SetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_NAME_ATTRIBUTE_NAME.c_str(), inputDoseVolumeNode->GetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_NAME_ATTRIBUTE_NAME.c_str()));
-  outputDoseVolumeNode->SetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_VALUE_ATTRIBUTE_NAME.c_str(), inputDoseVolumeNode->GetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_VALUE_ATTRIBUTE_NAME.c_str()));
+  if (dilationMethod == SLICERRT_DILATION_NATIVE_ELLIPSOID)
+  {
+    if (dosePrecision != MARGINCALCULATOR_DOSE_PRECISION_UINT16)
+    {
+      outputDoseImageData->ShallowCopy(dilatedDoseImageData);
+      return 0;
+    }
 
-  outputDoseVolumeNode->SetAndObserveImageData( tempImageData );
-  outputDoseVolumeNode->SetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_VOLUME_IDENTIFIER_ATTRIBUTE_NAME.c_str(), "1");
-  outputDoseVolumeNode->HideFromEditorsOff();
+    // Dilation is the last operation, convert fixed point dose back to dose
+    vtkSmartPointer<vtkImageShiftScale> toDose = vtkSmartPointer<vtkImageShiftScale>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+    toDose->SetInput(dilatedDoseImageData);
+#else
+    toDose->SetInputData(dilatedDoseImageData);
+#endif
+    toDose->SetOutputScalarTypeToFloat();
+    toDose->SetScale(doseScale);
+    if (numberOfThreads > 0)
+    {
+      toDose->SetNumberOfThreads(numberOfThreads);
+    }
+    toDose->Update();
+    outputDoseImageData->ShallowCopy(toDose->GetOutput());
+    return 0;
+  }
 
-  // Create display node
-  vtkSmartPointer<vtkMRMLScalarVolumeDisplayNode> outputDoseVolumeDisplayNode = vtkSmartPointer<vtkMRMLScalarVolumeDisplayNode>::New();
-  outputDoseVolumeDisplayNode = vtkMRMLScalarVolumeDisplayNode::SafeDownCast(this->GetMRMLScene()->AddNode(outputDoseVolumeDisplayNode));
-  //outputDoseVolumeNodeName.append("Display");
-  //doseVolumeDisplayNode->SetName(outputDoseVolumeNodeName.c_str());
-  outputDoseVolumeNode->SetAndObserveDisplayNodeID( outputDoseVolumeDisplayNode->GetID() );
+  // Back from the fine grid to the reference grid
+  vtkSmartPointer<vtkImageReslice> reslice2 = vtkSmartPointer<vtkImageReslice>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+  reslice2->SetInput(dilatedDoseImageData);
+#else
+  reslice2->SetInputData(dilatedDoseImageData);
+#endif
+  reslice2->SetOutputOrigin(0, 0, 0);
+  reslice2->SetOutputSpacing(1, 1, 1);
+  reslice2->SetOutputExtent(0, dimensions[0]-1, 0, dimensions[1]-1, 0, dimensions[2]-1);
+  reslice2->SetInterpolationModeToCubic();
+  if (dosePrecision == MARGINCALCULATOR_DOSE_PRECISION_UINT16)
+  {
+    reslice2->SetOutputScalarType(VTK_FLOAT);
+    reslice2->SetScalarScale(doseScale);
+  }
+  if (numberOfThreads > 0)
+  {
+    reslice2->SetNumberOfThreads(numberOfThreads);
+  }
+  reslice2->Update();
+  outputDoseImageData->ShallowCopy(reslice2->GetOutput());
+  return 0;
+}
 
-  // Set default colormap to rainbow
-  outputDoseVolumeDisplayNode->SetAndObserveColorNodeID("vtkMRMLColorTableNodeRainbow");
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::StartDilationSession(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+                                                             const int referenceDimensions[3], const double referenceSpacing[3],
+                                                             int dilationMethod, int dosePrecision, double doseUnitValue)
+{
+  if (this->PrepareMorphology(inputDoseImageData, inputIJKToRASMatrix, referenceDimensions, referenceSpacing, dosePrecision, doseUnitValue) != 0)
+  {
+    return -1;
+  }
+  if (!this->GetPreparedMorphologyDose(SLICERRT_EXPAND_BY_DILATION, dilationMethod))
+  {
+    this->ReleaseMorphology();
+    return -1;
+  }
+  this->DilationSessionActive = true;
+  this->DilationSessionMethod = dilationMethod;
+  return 0;
+}
 
-  // Select as active volume
-  if (this->GetApplicationLogic()!=NULL)
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::DilateSessionDose(double xSize, double ySize, double zSize, vtkImageData* outputDoseImageData)
+{
+  if (!this->DilationSessionActive)
   {
-    if (this->GetApplicationLogic()->GetSelectionNode()!=NULL)
+    vtkErrorMacro("DilateSessionDose: No dilation session is started!");
+    return -1;
+  }
+
+  // Grow the previous dose of the session by the increment, or the prepared dose by the whole margin
+  // for the first margin and margins smaller than the previous one along any axis
+  double size[3] = {xSize, ySize, zSize};
+  double radius[3] = {xSize, ySize, zSize};
+  bool increment = (this->DilationSessionDoseImageData != NULL);
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (increment && size[axis] < this->DilationSessionSize[axis])
     {
-      this->GetApplicationLogic()->GetSelectionNode()->SetReferenceActiveVolumeID(outputDoseVolumeNode->GetID());
-      this->GetApplicationLogic()->PropagateVolumeSelection();
+      increment = false;
+    }
+  }
+  vtkImageData* sourceDoseImageData = this->GetPreparedMorphologyDose(SLICERRT_EXPAND_BY_DILATION, this->DilationSessionMethod);
+  if (increment)
+  {
+    sourceDoseImageData = this->DilationSessionDoseImageData;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      radius[axis] = size[axis] - this->DilationSessionSize[axis];
     }
   }
-  outputDoseVolumeDisplayNode->SetVisibility(1);
 
-  this->GetMRMLScene()->EndState(vtkMRMLScene::BatchProcessState); 
+  vtkSmartPointer<vtkImageData> dilatedDoseImageData = vtkSmartPointer<vtkImageData>::New();
+  if (increment && radius[0] == 0.0 && radius[1] == 0.0 && radius[2] == 0.0)
+  {
+    dilatedDoseImageData->ShallowCopy(sourceDoseImageData);
+  }
+  else if (this->DilatePreparedDose(sourceDoseImageData, this->DilationSessionMethod, false,
+    radius[0], radius[1], radius[2], 0, dilatedDoseImageData) != 0)
+  {
+    return -1;
+  }
 
-  return 0;
+  if (!this->DilationSessionDoseImageData)
+  {
+    this->DilationSessionDoseImageData = vtkImageData::New();
+  }
+  this->DilationSessionDoseImageData->ShallowCopy(dilatedDoseImageData);
+  for (int axis = 0; axis < 3; axis++)
+  {
+    this->DilationSessionSize[axis] = size[axis];
+  }
+  return this->ConvertDilatedDose(dilatedDoseImageData, this->DilationSessionMethod, 0, outputDoseImageData);
 }
 
+//---------------------------------------------------------------------------
+void vtkSlicerDoseMorphologyModuleLogic::EndDilationSession()
+{
+  this->ReleaseMorphology();
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDoseMorphologyModuleLogic::DilateDoseSequence(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+                                                           const int referenceDimensions[3], const double referenceSpacing[3],
+                                                           int dilationMethod, vtkDoubleArray* sizes, int dosePrecision, double doseUnitValue,
+                                                           vtkCollection* outputDoseImageDatas)
+{
+  if (!sizes || sizes->GetNumberOfComponents() != 3 || !outputDoseImageDatas)
+  {
+    vtkErrorMacro("DilateDoseSequence: Sizes must have three components (X, Y, Z size) and the output collection must exist!");
+    return -1;
+  }
+
+  if (this->StartDilationSession(inputDoseImageData, inputIJKToRASMatrix, referenceDimensions, referenceSpacing,
+    dilationMethod, dosePrecision, doseUnitValue) != 0)
+  {
+    return -1;
+  }
+
+  int result = 0;
+  for (vtkIdType marginIndex = 0; marginIndex < sizes->GetNumberOfTuples(); marginIndex++)
+  {
+    double size[3] = {0.0, 0.0, 0.0};
+    sizes->GetTuple(marginIndex, size);
+    vtkSmartPointer<vtkImageData> outputDoseImageData = vtkSmartPointer<vtkImageData>::New();
+    if (this->DilateSessionDose(size[0], size[1], size[2], outputDoseImageData) != 0)
+    {
+      vtkErrorMacro("DilateDoseSequence: Failed to dilate the dose by " << size[0] << ", " << size[1] << ", " << size[2] << " mm!");
+      result = -1;
+      break;
+    }
+    outputDoseImageDatas->AddItem(outputDoseImageData);
+  }
+
+  this->EndDilationSession();
+  return result;
+}
@@ -34,13 +34,22 @@
 
 // MRML includes
 
+// VTK includes
+#include <vtkMultiThreader.h>
+
 // STD includes
 #include <cstdlib>
+#include <list>
 
 #include "vtkSlicerDoseMorphologyModuleLogicExport.h"
 
+class vtkCollection;
+class vtkDoubleArray;
+class vtkImageData;
+class vtkMatrix4x4;
 class vtkMRMLScalarVolumeNode;
 class vtkMRMLDoseMorphologyNode;
+class vtkTransform;
 
 /// \ingroup Slicer_QtModules_ExtensionTemplate
 class VTK_SLICER_DOSEMORPHOLOGY_MODULE_LOGIC_EXPORT vtkSlicerDoseMorphologyModuleLogic :
@@ -61,12 +70,89 @@ public:
   ///
   bool VolumeContainsDose();
 
-  ///
+  /// Dose weighted center of the voxels with positive dose, truncated to whole voxel indices
   void GetVolumeNodeCenterOfMass(vtkMRMLScalarVolumeNode* volumeNode, int* centerOfMass);
 
-  ///
+  /// Dose weighted center of the voxels with positive dose in voxel index coordinates.
+  /// The result is kept until the image data of the volume changes.
+  void GetVolumeNodeCenterOfMass(vtkMRMLScalarVolumeNode* volumeNode, double centerOfMass[3]);
+
+  /// Dose weighted center of the voxels with positive dose of an image, see GetVolumeNodeCenterOfMass
+  void GetImageDataCenterOfMass(vtkImageData* imageData, double centerOfMass[3]);
+
+  /// Morph the input dose of the parameter node into its output dose volume node.
+  /// The display node of the output is only created (and the output selected) the first time.
   int MorphDose();
 
+  /// Morph a dose image without a scene or a parameter node. The input image has the geometry
+  /// of the IJK to RAS matrix, the output has unit spacing and the reference dimensions, in the
+  /// geometry of the reference volume (as the image data of the MorphDose output).
+  /// Operation is SLICERRT_EXPAND_BY_* or SLICERRT_SHRINK_BY_*, dilation method SLICERRT_DILATION_*, dose precision
+  /// MARGINCALCULATOR_DOSE_PRECISION_*, the dose unit value is used for the fixed point precision.
+  int MorphDoseImage(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+    const int referenceDimensions[3], const double referenceSpacing[3],
+    int operation, int dilationMethod, double xSize, double ySize, double zSize,
+    int dosePrecision, double doseUnitValue, vtkImageData* outputDoseImageData);
+
+  /// Start dilating an input dose (with the geometry and settings of MorphDoseImage) by a series of margins.
+  /// The input is converted and brought onto the dilation grid once for the whole session.
+  /// MorphDoseImage ends the session.
+  int StartDilationSession(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+    const int referenceDimensions[3], const double referenceSpacing[3],
+    int dilationMethod, int dosePrecision, double doseUnitValue);
+
+  /// Dilate the session dose by the given margins (mm), output as in MorphDoseImage. The dose of the previous
+  /// margin of the session is only dilated by the increment, unless the margin is smaller along an axis:
+  /// growing margins are dilated step by step. The increments add up exactly for continuous ellipsoids,
+  /// on the dilation grid the result can differ from a single dilation by the rounding of the steps.
+  int DilateSessionDose(double xSize, double ySize, double zSize, vtkImageData* outputDoseImageData);
+
+  /// Release the doses of the dilation session
+  void EndDilationSession();
+
+  /// Dilate an input dose by every margin in one dilation session, each margin from the dose of the previous one.
+  /// Sizes has three components (X, Y, Z margin in mm) per margin, one new image data per margin is added
+  /// to the collection. The morphology cache is not used.
+  int DilateDoseSequence(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+    const int referenceDimensions[3], const double referenceSpacing[3],
+    int dilationMethod, vtkDoubleArray* sizes, int dosePrecision, double doseUnitValue,
+    vtkCollection* outputDoseImageDatas);
+
+  /// Morph an input dose (with the geometry and settings of MorphDoseImage) by many parameter sets at once.
+  /// Parameters has four components (operation, X, Y, Z size) per morphology, one new image data per morphology
+  /// is added to the collection. The morphologies share the converted input, its center of mass and its dilation
+  /// grids, and run in parallel on one set of threads. The morphology cache is used as by MorphDoseImage.
+  int MorphDoseBatch(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+    const int referenceDimensions[3], const double referenceSpacing[3],
+    vtkDoubleArray* parameters, int dilationMethod, int dosePrecision, double doseUnitValue,
+    vtkCollection* outputDoseImageDatas);
+
+  /// Maximum memory (in kilobytes) of the morphed doses kept by MorphDoseImage (and MorphDose) for
+  /// repeated requests. The least recently used doses are dropped first, 0 disables the cache.
+  void SetMorphologyCacheSizeLimit(unsigned long kilobytes);
+  vtkGetMacro(MorphologyCacheSizeLimit, unsigned long);
+
+  /// Memory (in kilobytes) of the morphed doses currently in the cache
+  vtkGetMacro(MorphologyCacheSize, unsigned long);
+
+  /// Number of morphologies answered from the cache and computed since the last ClearMorphologyCache
+  vtkGetMacro(MorphologyCacheHits, int);
+  vtkGetMacro(MorphologyCacheMisses, int);
+
+  /// Drop the cached morphed doses and reset the counters
+  void ClearMorphologyCache();
+
+  /// Get the voxel transform of the scaling of MorphDose with the given factors for the input dose
+  /// of the parameter node: it maps the voxels of the scaled dose to the voxels of the input dose.
+  /// Resampling the input with it (composed with any further transform) gives the scaled dose
+  /// without computing it, see vtkSlicerMotionSimulatorModuleLogic::SetDoseResliceMatrix
+  int GetScalingResliceMatrix(double xSize, double ySize, double zSize, vtkMatrix4x4* outputResliceMatrix);
+
+  /// Get the voxel transform of the scaling of MorphDoseImage for an input dose image with the geometry of
+  /// the IJK to RAS matrix, as GetScalingResliceMatrix does for the input dose of the parameter node
+  int GetScalingResliceMatrixOfImage(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+    double xSize, double ySize, double zSize, vtkMatrix4x4* outputResliceMatrix);
+
 protected:
   vtkSlicerDoseMorphologyModuleLogic();
   virtual ~vtkSlicerDoseMorphologyModuleLogic();
@@ -81,9 +167,110 @@ protected:
   virtual void OnMRMLSceneEndImport();
   virtual void OnMRMLSceneEndClose();
 
+  /// Convert the input dose and compute what the morphologies of an input share.
+  /// The morphology keeps the geometry of the input voxels, within the extent of the reference.
+  int PrepareMorphology(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+    const int referenceDimensions[3], const double referenceSpacing[3], int dosePrecision, double doseUnitValue);
+
+  /// Morph the prepared dose of the operation (see GetPreparedMorphologyDose). Only reads the prepared state, so that
+  /// morphologies of separate prepared dose objects can run in parallel. The filters use the given number of threads,
+  /// their default if 0.
+  int ComputeMorphology(vtkImageData* preparedDoseImageData, int operation, int dilationMethod, double xSize, double ySize, double zSize,
+    int numberOfThreads, vtkImageData* outputDoseImageData);
+
+  /// Run the morphologies of a batch assigned to one thread of MorphDoseBatch
+  static VTK_THREAD_RETURN_TYPE MorphDoseBatchThread(void* arg);
+
+  /// Get the prepared dose an operation starts from: the converted input for scaling, the input on the native grid
+  /// or on the fine grid for dilation and erosion. The grids are computed when first needed. NULL on error.
+  vtkImageData* GetPreparedMorphologyDose(int operation, int dilationMethod);
+
+  /// Dilate (or erode) a dose on the native or fine grid by the ellipsoid with the given semi-axes (mm).
+  /// The output stays on the grid of the input and in the internal dose representation.
+  int DilatePreparedDose(vtkImageData* preparedDoseImageData, int dilationMethod, bool erosion,
+    double xSize, double ySize, double zSize, int numberOfThreads, vtkImageData* dilatedDoseImageData);
+
+  /// Bring a dilated dose from its dilation grid to the output: reference grid, unit spacing and dose values
+  int ConvertDilatedDose(vtkImageData* dilatedDoseImageData, int dilationMethod, int numberOfThreads, vtkImageData* outputDoseImageData);
+
+  /// Release the prepared input dose
+  void ReleaseMorphology();
+
+  /// Drop the least recently used morphed doses until the cache fits in its size limit
+  void TrimMorphologyCache();
+
+  /// Transform from the output voxels to the input voxels, optionally scaling about the center of mass
+  void GetMorphologyResliceTransform(bool scaling, double xSize, double ySize, double zSize, vtkTransform* outputResliceTransform);
+
   /// Parameter set MRML node
   vtkMRMLDoseMorphologyNode* DoseMorphologyNode;
 
+  /// Last computed center of mass and the image data (with its modification time) it belongs to
+  double CenterOfMass[3];
+  vtkImageData* CenterOfMassImageData;
+  unsigned long CenterOfMassImageDataMTime;
+
+  /// Prepared input of the morphologies in the internal dose representation, NULL if nothing is prepared
+  vtkImageData* MorphologyInputDoseImageData;
+  vtkMatrix4x4* MorphologyInputIJKToRASMatrix;
+  double MorphologyInputSpacing[3];
+  /// Voxel size of the native dilation grid: the input grid, or the reference grid the input is resampled onto
+  double MorphologyNativeGridSpacing[3];
+  int MorphologyReferenceDimensions[3];
+  double MorphologyReferenceSpacing[3];
+  int MorphologyCenterOfMass[3];
+  int MorphologyDosePrecision;
+  double MorphologyDoseScale;
+  /// Prepared input resampled for the native and the resampled dilation, computed when first needed
+  vtkImageData* MorphologyNativeGridDoseImageData;
+  vtkImageData* MorphologyFineGridDoseImageData;
+
+  /// Dilation session on the prepared input: method, last margin and its dose on the dilation grid (NULL before the first)
+  bool DilationSessionActive;
+  int DilationSessionMethod;
+  double DilationSessionSize[3];
+  vtkImageData* DilationSessionDoseImageData;
+
+  /// Morphed dose of MorphDoseImage with everything it depends on. The input image is only used
+  /// to identify the input together with its modification time (that also covers the center of mass
+  /// used as scaling pivot), it is not referenced.
+  struct MorphologyCacheEntry
+  {
+    vtkImageData* InputDoseImageData;
+    unsigned long InputDoseImageDataMTime;
+    double InputIJKToRASMatrix[16];
+    int ReferenceDimensions[3];
+    double ReferenceSpacing[3];
+    int Operation;
+    int DilationMethod;
+    double Size[3];
+    int DosePrecision;
+    double DoseUnitValue;
+    vtkImageData* OutputDoseImageData;
+  };
+
+  /// Cached morphed doses, the most recently used first
+  std::list<MorphologyCacheEntry> MorphologyCache;
+  unsigned long MorphologyCacheSizeLimit;
+  unsigned long MorphologyCacheSize;
+  int MorphologyCacheHits;
+  int MorphologyCacheMisses;
+
+  /// Return true if the entries belong to the same morphology (the outputs are not compared)
+  static bool MorphologyCacheKeysEqual(const MorphologyCacheEntry &entry1, const MorphologyCacheEntry &entry2);
+
+  /// Fill the key of a morphology of MorphDoseImage, without an output
+  static void InitializeMorphologyCacheKey(vtkImageData* inputDoseImageData, vtkMatrix4x4* inputIJKToRASMatrix,
+    const int referenceDimensions[3], const double referenceSpacing[3],
+    int operation, int dilationMethod, double xSize, double ySize, double zSize,
+    int dosePrecision, double doseUnitValue, MorphologyCacheEntry &key);
+
+  /// Copy the cached dose of the key into the output. Returns false if the morphology is not cached
+  bool GetCachedMorphology(const MorphologyCacheEntry &key, vtkImageData* outputDoseImageData);
+
+  /// Keep a copy of a morphed dose in the cache, if it fits
+  void CacheMorphology(MorphologyCacheEntry key, vtkImageData* outputDoseImageData);
+
 private:
 
   vtkSlicerDoseMorphologyModuleLogic(const vtkSlicerDoseMorphologyModuleLogic&); // Not implemented
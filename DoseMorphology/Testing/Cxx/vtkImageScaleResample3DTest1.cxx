@@ -0,0 +1,167 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Copyright (c) Kitware Inc.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Techna Institute, UHN 
+  and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// DoseMorphology includes
+#include "vtkImageScaleResample3D.h"
+
+// VTK includes
+#include <vtkImageData.h>
+#include <vtkImageReslice.h>
+#include <vtkMinimalStandardRandomSequence.h>
+#include <vtkNew.h>
+#include <vtkSmartPointer.h>
+#include <vtkTransform.h>
+
+// STD includes
+#include <cmath>
+
+// Largest accepted difference from vtkImageReslice, relative to the maximum of the image
+#define MAX_RELATIVE_DIFFERENCE 1e-4
+
+//-----------------------------------------------------------------------------
+// Compare the scaled resample with the cubic vtkImageReslice of the same scaling on the whole output extent,
+// including the voxels outside the input and those whose taps are clamped at the border.
+// The cubic reslice of VTK 5 lowers the interpolation order within a voxel of the border instead of
+// clamping the taps, there only the voxels whose taps are all inside the input are compared.
+int CompareWithReslice(vtkImageData* image, const double scale[3], const double offset[3], double maximumValue)
+{
+  int dimensions[3] = {0, 0, 0};
+  image->GetDimensions(dimensions);
+
+  vtkNew<vtkTransform> transform;
+  transform->Translate(offset[0], offset[1], offset[2]);
+  transform->Scale(scale[0], scale[1], scale[2]);
+
+  vtkNew<vtkImageReslice> reslice;
+#if (VTK_MAJOR_VERSION <= 5)
+  reslice->SetInput(image);
+#else
+  reslice->SetInputData(image);
+#endif
+  reslice->SetOutputOrigin(0, 0, 0);
+  reslice->SetOutputSpacing(1, 1, 1);
+  reslice->SetOutputExtent(0, dimensions[0]-1, 0, dimensions[1]-1, 0, dimensions[2]-1);
+  reslice->SetResliceTransform(transform.GetPointer());
+  reslice->SetInterpolationModeToCubic();
+
+  vtkNew<vtkImageScaleResample3D> scaleResample;
+#if (VTK_MAJOR_VERSION <= 5)
+  scaleResample->SetInput(image);
+#else
+  scaleResample->SetInputData(image);
+#endif
+  scaleResample->SetScale(scale[0], scale[1], scale[2]);
+  scaleResample->SetOffset(offset[0], offset[1], offset[2]);
+  scaleResample->SetOutputExtent(0, dimensions[0]-1, 0, dimensions[1]-1, 0, dimensions[2]-1);
+
+  reslice->Update();
+  scaleResample->Update();
+
+  vtkImageData* expected = reslice->GetOutput();
+  vtkImageData* actual = scaleResample->GetOutput();
+  int numberOfDifferences = 0;
+  for (int z = 0; z < dimensions[2]; z++)
+  {
+    for (int y = 0; y < dimensions[1]; y++)
+    {
+      for (int x = 0; x < dimensions[0]; x++)
+      {
+        bool compared = true;
+#if (VTK_MAJOR_VERSION <= 5)
+        int index[3] = {x, y, z};
+        for (int axis = 0; axis < 3; axis++)
+        {
+          double position = scale[axis] * index[axis] + offset[axis];
+          if (position < 1.0 || position > dimensions[axis] - 2.0)
+          {
+            compared = false;
+          }
+        }
+#endif
+        if (compared && fabs(expected->GetScalarComponentAsDouble(x, y, z, 0) - actual->GetScalarComponentAsDouble(x, y, z, 0))
+          > MAX_RELATIVE_DIFFERENCE * maximumValue)
+        {
+          numberOfDifferences++;
+        }
+      }
+    }
+  }
+
+  if (numberOfDifferences > 0)
+  {
+    std::cerr << "Scale " << scale[0] << ", " << scale[1] << ", " << scale[2] << ": " << numberOfDifferences
+      << " voxels differ from vtkImageReslice" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+int vtkImageScaleResample3DTest1( int vtkNotUsed(argc), char * vtkNotUsed(argv)[] )
+{
+  // Smooth dose like peak with some noise
+  vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+  image->SetExtent(0, 127, 0, 111, 0, 79);
+#if (VTK_MAJOR_VERSION <= 5)
+  image->SetScalarTypeToFloat();
+  image->SetNumberOfScalarComponents(1);
+  image->AllocateScalars();
+#else
+  image->AllocateScalars(VTK_FLOAT, 1);
+#endif
+  vtkNew<vtkMinimalStandardRandomSequence> random;
+  random->SetSeed(1);
+  float* imagePointer = static_cast<float*>(image->GetScalarPointer());
+  double maximumValue = 0.0;
+  for (int z = 0; z < 80; z++)
+  {
+    for (int y = 0; y < 112; y++)
+    {
+      for (int x = 0; x < 128; x++)
+      {
+        double distance2 = (x-64)*(x-64)/900.0 + (y-56)*(y-56)/600.0 + (z-40)*(z-40)/400.0;
+        double value = 70.0 * exp(-distance2) + random->GetValue();
+        random->Next();
+        *(imagePointer++) = (float)value;
+        maximumValue = (value > maximumValue ? value : maximumValue);
+      }
+    }
+  }
+
+  // Expansion and shrinking about the center, and an anisotropic scaling about another point
+  double scales[][3] = { {1.0/1.1, 1.0/1.1, 1.0/1.1}, {1.25, 1.25, 1.25}, {0.8, 0.95, 0.7} };
+  double centers[][3] = { {64.0, 56.0, 40.0}, {64.0, 56.0, 40.0}, {30.5, 70.0, 12.0} };
+  for (unsigned int scaleIndex = 0; scaleIndex < sizeof(scales)/sizeof(scales[0]); scaleIndex++)
+  {
+    double offset[3] = {0.0, 0.0, 0.0};
+    for (int axis = 0; axis < 3; axis++)
+    {
+      offset[axis] = centers[scaleIndex][axis] * (1.0 - scales[scaleIndex][axis]);
+    }
+    if (CompareWithReslice(image, scales[scaleIndex], offset, maximumValue) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
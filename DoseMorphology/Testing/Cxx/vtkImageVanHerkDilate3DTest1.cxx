@@ -0,0 +1,415 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Copyright (c) Kitware Inc.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Techna Institute, UHN 
+  and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// DoseMorphology includes
+#include "vtkImageVanHerkDilate3D.h"
+
+// VTK includes
+#include <vtkImageContinuousDilate3D.h>
+#include <vtkImageContinuousErode3D.h>
+#include <vtkImageData.h>
+#include <vtkMinimalStandardRandomSequence.h>
+#include <vtkNew.h>
+#include <vtkSmartPointer.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+// Compare the van Herk dilation (or erosion) with vtkImageContinuousDilate3D (or vtkImageContinuousErode3D),
+// the results must be identical
+int CompareWithContinuousDilate(vtkImageData* image, int size0, int size1, int size2, bool erosion=false)
+{
+  vtkSmartPointer<vtkImageSpatialAlgorithm> continuousDilate;
+  if (erosion)
+  {
+    vtkSmartPointer<vtkImageContinuousErode3D> continuousErode = vtkSmartPointer<vtkImageContinuousErode3D>::New();
+    continuousErode->SetKernelSize(size0, size1, size2);
+    continuousDilate = continuousErode;
+  }
+  else
+  {
+    vtkSmartPointer<vtkImageContinuousDilate3D> continuousMaximum = vtkSmartPointer<vtkImageContinuousDilate3D>::New();
+    continuousMaximum->SetKernelSize(size0, size1, size2);
+    continuousDilate = continuousMaximum;
+  }
+#if (VTK_MAJOR_VERSION <= 5)
+  continuousDilate->SetInput(image);
+#else
+  continuousDilate->SetInputData(image);
+#endif
+  continuousDilate->Update();
+
+  vtkNew<vtkImageVanHerkDilate3D> vanHerkDilate;
+#if (VTK_MAJOR_VERSION <= 5)
+  vanHerkDilate->SetInput(image);
+#else
+  vanHerkDilate->SetInputData(image);
+#endif
+  vanHerkDilate->SetKernelSize(size0, size1, size2);
+  vanHerkDilate->SetFootprintToEllipsoid();
+  vanHerkDilate->SetErosion(erosion);
+  vanHerkDilate->Update();
+
+  vtkImageData* expected = continuousDilate->GetOutput();
+  vtkImageData* actual = vanHerkDilate->GetOutput();
+  int dimensions[3] = {0, 0, 0};
+  expected->GetDimensions(dimensions);
+  int extent[6] = {0, -1, 0, -1, 0, -1};
+  expected->GetExtent(extent);
+
+  int numberOfDifferences = 0;
+  for (int z = extent[4]; z <= extent[5]; z++)
+  {
+    for (int y = extent[2]; y <= extent[3]; y++)
+    {
+      for (int x = extent[0]; x <= extent[1]; x++)
+      {
+        if (expected->GetScalarComponentAsDouble(x, y, z, 0) != actual->GetScalarComponentAsDouble(x, y, z, 0))
+        {
+          numberOfDifferences++;
+        }
+      }
+    }
+  }
+
+  if (numberOfDifferences > 0)
+  {
+    std::cerr << (erosion ? "Erosion kernel " : "Kernel ") << size0 << "x" << size1 << "x" << size2 << ": " << numberOfDifferences
+      << " voxels differ from " << (erosion ? "vtkImageContinuousErode3D" : "vtkImageContinuousDilate3D") << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Maximum (or minimum with erosion) over the footprint mask of the filter, computed voxel by voxel.
+// The kernel is centered as in vtkImageSpatialAlgorithm and voxels outside the image are ignored.
+void BruteForceDilate(vtkImageData* image, const int kernelSize[3], const std::vector<bool> &mask, bool erosion, vtkImageData* output)
+{
+  output->DeepCopy(image);
+  int dimensions[3] = {0, 0, 0};
+  image->GetDimensions(dimensions);
+  int middle[3] = { kernelSize[0]/2, kernelSize[1]/2, kernelSize[2]/2 };
+  const float* input = static_cast<float*>(image->GetScalarPointer());
+  float* result = static_cast<float*>(output->GetScalarPointer());
+  for (int z = 0; z < dimensions[2]; z++)
+  {
+    for (int y = 0; y < dimensions[1]; y++)
+    {
+      for (int x = 0; x < dimensions[0]; x++)
+      {
+        bool found = false;
+        float value = 0.0f;
+        for (int k2 = 0; k2 < kernelSize[2]; k2++)
+        {
+          int z2 = z + k2 - middle[2];
+          for (int k1 = 0; k1 < kernelSize[1]; k1++)
+          {
+            int y2 = y + k1 - middle[1];
+            for (int k0 = 0; k0 < kernelSize[0]; k0++)
+            {
+              int x2 = x + k0 - middle[0];
+              if ( !mask[(k2*kernelSize[1] + k1)*kernelSize[0] + k0] || x2 < 0 || x2 >= dimensions[0]
+                || y2 < 0 || y2 >= dimensions[1] || z2 < 0 || z2 >= dimensions[2] )
+              {
+                continue;
+              }
+              float inputValue = input[(z2*dimensions[1] + y2)*dimensions[0] + x2];
+              if (!found || (erosion ? inputValue < value : inputValue > value))
+              {
+                value = inputValue;
+                found = true;
+              }
+            }
+          }
+        }
+        result[(z*dimensions[1] + y)*dimensions[0] + x] = value;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Count the voxels that differ by more than the tolerance
+int CompareImages(vtkImageData* expected, vtkImageData* actual, double tolerance, const char* caseName)
+{
+  int extent[6] = {0, -1, 0, -1, 0, -1};
+  expected->GetExtent(extent);
+  int numberOfDifferences = 0;
+  for (int z = extent[4]; z <= extent[5]; z++)
+  {
+    for (int y = extent[2]; y <= extent[3]; y++)
+    {
+      for (int x = extent[0]; x <= extent[1]; x++)
+      {
+        if (fabs(expected->GetScalarComponentAsDouble(x, y, z, 0) - actual->GetScalarComponentAsDouble(x, y, z, 0)) > tolerance)
+        {
+          numberOfDifferences++;
+        }
+      }
+    }
+  }
+
+  if (numberOfDifferences > 0)
+  {
+    std::cerr << caseName << ": " << numberOfDifferences << " voxels differ from the reference" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Compare the van Herk filter with the brute force maximum (or minimum) over its own footprint mask
+int CompareWithBruteForceDilate(vtkImageData* image, vtkImageVanHerkDilate3D* vanHerkDilate, const char* caseName)
+{
+#if (VTK_MAJOR_VERSION <= 5)
+  vanHerkDilate->SetInput(image);
+#else
+  vanHerkDilate->SetInputData(image);
+#endif
+  vanHerkDilate->Update();
+
+  std::vector<bool> mask;
+  int kernelSize[3] = {1, 1, 1};
+  vanHerkDilate->GetFootprintMask(image->GetSpacing(), kernelSize, mask);
+  vtkSmartPointer<vtkImageData> expected = vtkSmartPointer<vtkImageData>::New();
+  BruteForceDilate(image, kernelSize, mask, vanHerkDilate->GetErosion(), expected);
+
+  return CompareImages(expected, vanHerkDilate->GetOutput(), 0.0, caseName);
+}
+
+//-----------------------------------------------------------------------------
+// Sub-voxel spacing ellipsoid dilation computed voxel by voxel: for every row of the footprint the maximum
+// over the whole voxels of its x chord and over the chord ends, linearly interpolated at the exact half
+// chord length. An end is only used if both voxels it is interpolated from are in the image.
+// With erosion the minimum is taken instead.
+void BruteForceSubVoxelDilate(vtkImageData* image, const double radius[3], bool erosion, vtkImageData* output)
+{
+  output->DeepCopy(image);
+  int dimensions[3] = {0, 0, 0};
+  image->GetDimensions(dimensions);
+  double* spacing = image->GetSpacing();
+
+  // Rows of the footprint are the ones whose center voxel is in the whole voxel mask
+  vtkNew<vtkImageVanHerkDilate3D> footprint;
+  footprint->SetFootprintToSpacingEllipsoid();
+  footprint->SetRadius(radius[0], radius[1], radius[2]);
+  std::vector<bool> mask;
+  int kernelSize[3] = {1, 1, 1};
+  footprint->GetFootprintMask(spacing, kernelSize, mask);
+  int middle[3] = { kernelSize[0]/2, kernelSize[1]/2, kernelSize[2]/2 };
+
+  const float* input = static_cast<float*>(image->GetScalarPointer());
+  float* result = static_cast<float*>(output->GetScalarPointer());
+  for (int z = 0; z < dimensions[2]; z++)
+  {
+    for (int y = 0; y < dimensions[1]; y++)
+    {
+      for (int x = 0; x < dimensions[0]; x++)
+      {
+        bool found = false;
+        float value = 0.0f;
+        for (int k2 = 0; k2 < kernelSize[2]; k2++)
+        {
+          int z2 = z + k2 - middle[2];
+          double s2 = (kernelSize[2] > 1 ? (k2 - middle[2]) * spacing[2] / radius[2] : 0.0);
+          for (int k1 = 0; k1 < kernelSize[1]; k1++)
+          {
+            int y2 = y + k1 - middle[1];
+            double s1 = (kernelSize[1] > 1 ? (k1 - middle[1]) * spacing[1] / radius[1] : 0.0);
+            if ( !mask[(k2*kernelSize[1] + k1)*kernelSize[0] + middle[0]]
+              || y2 < 0 || y2 >= dimensions[1] || z2 < 0 || z2 >= dimensions[2] )
+            {
+              continue;
+            }
+            double halfChord = (radius[0] > 0.0 ? radius[0] / spacing[0] * sqrt(std::max(0.0, 1.0 - s1*s1 - s2*s2)) : 0.0);
+            int wholeVoxels = (int)floor(halfChord + 1e-9);
+            double fraction = std::max(0.0, halfChord - wholeVoxels);
+
+            const float* row = input + (z2*dimensions[1] + y2)*dimensions[0];
+            std::vector<float> candidates;
+            for (int x2 = std::max(0, x - wholeVoxels); x2 <= std::min(dimensions[0] - 1, x + wholeVoxels); x2++)
+            {
+              candidates.push_back(row[x2]);
+            }
+            if (fraction > 1e-9 && x + wholeVoxels >= 0 && x + wholeVoxels + 1 < dimensions[0])
+            {
+              candidates.push_back((float)((1.0 - fraction) * row[x + wholeVoxels] + fraction * row[x + wholeVoxels + 1]));
+            }
+            if (fraction > 1e-9 && x - wholeVoxels - 1 >= 0 && x - wholeVoxels < dimensions[0])
+            {
+              candidates.push_back((float)((1.0 - fraction) * row[x - wholeVoxels] + fraction * row[x - wholeVoxels - 1]));
+            }
+            for (unsigned int candidateIndex = 0; candidateIndex < candidates.size(); candidateIndex++)
+            {
+              if (!found || (erosion ? candidates[candidateIndex] < value : candidates[candidateIndex] > value))
+              {
+                value = candidates[candidateIndex];
+                found = true;
+              }
+            }
+          }
+        }
+        result[(z*dimensions[1] + y)*dimensions[0] + x] = value;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+int vtkImageVanHerkDilate3DTest1( int vtkNotUsed(argc), char * vtkNotUsed(argv)[] )
+{
+  // Random dose like image with a float scalar type
+  vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+  image->SetExtent(0, 40, 0, 31, 0, 17);
+#if (VTK_MAJOR_VERSION <= 5)
+  image->SetScalarTypeToFloat();
+  image->SetNumberOfScalarComponents(1);
+  image->AllocateScalars();
+#else
+  image->AllocateScalars(VTK_FLOAT, 1);
+#endif
+  vtkNew<vtkMinimalStandardRandomSequence> random;
+  random->SetSeed(1);
+  float* imagePointer = static_cast<float*>(image->GetScalarPointer());
+  for (vtkIdType i = 0; i < image->GetNumberOfPoints(); i++)
+  {
+    imagePointer[i] = (float)(random->GetValue() * 70.0);
+    random->Next();
+  }
+
+  // Odd, even and anisotropic kernels, including ones larger than the image
+  int kernelSizes[][3] = { {3,3,3}, {5,5,5}, {4,6,3}, {11,7,5}, {1,9,2}, {21,21,21} };
+  for (unsigned int kernelIndex = 0; kernelIndex < sizeof(kernelSizes)/sizeof(kernelSizes[0]); kernelIndex++)
+  {
+    if (CompareWithContinuousDilate(image, kernelSizes[kernelIndex][0], kernelSizes[kernelIndex][1], kernelSizes[kernelIndex][2]) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Box footprint
+  int boxKernelSizes[][3] = { {3,3,3}, {4,6,3}, {1,9,2}, {21,5,7} };
+  for (unsigned int kernelIndex = 0; kernelIndex < sizeof(boxKernelSizes)/sizeof(boxKernelSizes[0]); kernelIndex++)
+  {
+    vtkNew<vtkImageVanHerkDilate3D> boxDilate;
+    boxDilate->SetFootprintToBox();
+    boxDilate->SetKernelSize(boxKernelSizes[kernelIndex][0], boxKernelSizes[kernelIndex][1], boxKernelSizes[kernelIndex][2]);
+    if (CompareWithBruteForceDilate(image, boxDilate.GetPointer(), "Box footprint") != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Spacing ellipsoid on an anisotropic grid, including radii that are whole multiples of the spacing
+  vtkSmartPointer<vtkImageData> anisotropicImage = vtkSmartPointer<vtkImageData>::New();
+  anisotropicImage->DeepCopy(image);
+  anisotropicImage->SetSpacing(0.8, 1.5, 2.5);
+  double radii[][3] = { {3.0,3.0,3.0}, {4.0,4.5,5.0}, {2.2,6.1,7.3}, {0.5,3.0,0.0} };
+  for (unsigned int radiusIndex = 0; radiusIndex < sizeof(radii)/sizeof(radii[0]); radiusIndex++)
+  {
+    vtkNew<vtkImageVanHerkDilate3D> spacingDilate;
+    spacingDilate->SetFootprintToSpacingEllipsoid();
+    spacingDilate->SetRadius(radii[radiusIndex]);
+    if (CompareWithBruteForceDilate(anisotropicImage, spacingDilate.GetPointer(), "Spacing ellipsoid footprint") != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Sub-voxel accuracy, the chord ends are interpolated. The chords of rows that are within a rounding
+  // error of each other share their interpolation, so the comparison allows a small tolerance.
+  for (unsigned int radiusIndex = 0; radiusIndex < sizeof(radii)/sizeof(radii[0]); radiusIndex++)
+  {
+    vtkNew<vtkImageVanHerkDilate3D> subVoxelDilate;
+#if (VTK_MAJOR_VERSION <= 5)
+    subVoxelDilate->SetInput(anisotropicImage);
+#else
+    subVoxelDilate->SetInputData(anisotropicImage);
+#endif
+    subVoxelDilate->SetFootprintToSpacingEllipsoid();
+    subVoxelDilate->SubVoxelAccuracyOn();
+    subVoxelDilate->SetRadius(radii[radiusIndex]);
+    subVoxelDilate->Update();
+
+    vtkSmartPointer<vtkImageData> expected = vtkSmartPointer<vtkImageData>::New();
+    BruteForceSubVoxelDilate(anisotropicImage, radii[radiusIndex], false, expected);
+    if (CompareImages(expected, subVoxelDilate->GetOutput(), 1e-4, "Sub-voxel spacing ellipsoid footprint") != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Erosion with every footprint
+  for (unsigned int kernelIndex = 0; kernelIndex < sizeof(kernelSizes)/sizeof(kernelSizes[0]); kernelIndex++)
+  {
+    if (CompareWithContinuousDilate(image, kernelSizes[kernelIndex][0], kernelSizes[kernelIndex][1], kernelSizes[kernelIndex][2], true) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  for (unsigned int kernelIndex = 0; kernelIndex < sizeof(boxKernelSizes)/sizeof(boxKernelSizes[0]); kernelIndex++)
+  {
+    vtkNew<vtkImageVanHerkDilate3D> boxErode;
+    boxErode->SetFootprintToBox();
+    boxErode->ErosionOn();
+    boxErode->SetKernelSize(boxKernelSizes[kernelIndex][0], boxKernelSizes[kernelIndex][1], boxKernelSizes[kernelIndex][2]);
+    if (CompareWithBruteForceDilate(image, boxErode.GetPointer(), "Box footprint erosion") != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  for (unsigned int radiusIndex = 0; radiusIndex < sizeof(radii)/sizeof(radii[0]); radiusIndex++)
+  {
+    vtkNew<vtkImageVanHerkDilate3D> spacingErode;
+    spacingErode->SetFootprintToSpacingEllipsoid();
+    spacingErode->ErosionOn();
+    spacingErode->SetRadius(radii[radiusIndex]);
+    if (CompareWithBruteForceDilate(anisotropicImage, spacingErode.GetPointer(), "Spacing ellipsoid footprint erosion") != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+
+    vtkNew<vtkImageVanHerkDilate3D> subVoxelErode;
+#if (VTK_MAJOR_VERSION <= 5)
+    subVoxelErode->SetInput(anisotropicImage);
+#else
+    subVoxelErode->SetInputData(anisotropicImage);
+#endif
+    subVoxelErode->SetFootprintToSpacingEllipsoid();
+    subVoxelErode->SubVoxelAccuracyOn();
+    subVoxelErode->ErosionOn();
+    subVoxelErode->SetRadius(radii[radiusIndex]);
+    subVoxelErode->Update();
+    vtkSmartPointer<vtkImageData> expected = vtkSmartPointer<vtkImageData>::New();
+    BruteForceSubVoxelDilate(anisotropicImage, radii[radiusIndex], true, expected);
+    if (CompareImages(expected, subVoxelErode->GetOutput(), 1e-4, "Sub-voxel spacing ellipsoid footprint erosion") != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
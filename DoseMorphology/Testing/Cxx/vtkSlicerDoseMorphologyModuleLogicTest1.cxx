@@ -45,6 +45,7 @@
 #include <vtkImageData.h>
 #include <vtkImageAccumulate.h>
 #include <vtkImageMathematics.h>
+#include <vtkMatrix4x4.h>
 
 // ITK includes
 #if ITK_VERSION_MAJOR > 3
@@ -320,6 +321,38 @@ int volumeDifferenceToleranceVoxel = 0.0;
     std::cerr << "Invalid output dose volume node!" << std::endl;
     return EXIT_FAILURE;
   }
+
+  // The scene-free morphology must give the same dose as the parameter node
+  vtkSmartPointer<vtkSlicerDoseMorphologyModuleLogic> headlessLogic = vtkSmartPointer<vtkSlicerDoseMorphologyModuleLogic>::New();
+  vtkSmartPointer<vtkMatrix4x4> inputIJKToRASMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  inputDoseVolumeNode->GetIJKToRASMatrix(inputIJKToRASMatrix);
+  int referenceDimensions[3] = {0, 0, 0};
+  referenceDoseVolumeNode->GetImageData()->GetDimensions(referenceDimensions);
+  double referenceSpacing[3] = {1.0, 1.0, 1.0};
+  referenceDoseVolumeNode->GetSpacing(referenceSpacing);
+  vtkSmartPointer<vtkImageData> headlessDoseImageData = vtkSmartPointer<vtkImageData>::New();
+  if (headlessLogic->MorphDoseImage(inputDoseVolumeNode->GetImageData(), inputIJKToRASMatrix, referenceDimensions, referenceSpacing,
+    operation, paramNode->GetDilationMethod(), morphologicalParameter, morphologicalParameter, morphologicalParameter,
+    paramNode->GetDosePrecision(), MarginCalculatorCommon::GetDoseUnitValue(inputDoseVolumeNode), headlessDoseImageData) != 0)
+  {
+    mrmlScene->Commit();
+    std::cerr << "Scene-free dose morphology failed!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  vtkSmartPointer<vtkImageMathematics> headlessDifference = vtkSmartPointer<vtkImageMathematics>::New();
+  headlessDifference->SetInput1Data(outputDoseVolumeNode->GetImageData());
+  headlessDifference->SetInput2Data(headlessDoseImageData);
+  headlessDifference->SetOperationToSubtract();
+  vtkSmartPointer<vtkImageAccumulate> headlessHistogram = vtkSmartPointer<vtkImageAccumulate>::New();
+  headlessHistogram->SetInputConnection(headlessDifference->GetOutputPort());
+  headlessHistogram->IgnoreZeroOn();
+  headlessHistogram->Update();
+  if (headlessHistogram->GetVoxelCount() > 0)
+  {
+    mrmlScene->Commit();
+    std::cerr << "Scene-free dose morphology differs from MorphDose in " << headlessHistogram->GetVoxelCount() << " voxels!" << std::endl;
+    return EXIT_FAILURE;
+  }
   
   // Create baseline labelmap node
   vtkSmartPointer<vtkMRMLScalarVolumeNode> baselineDoseVolumeNode = vtkSmartPointer<vtkMRMLScalarVolumeNode>::New();
@@ -0,0 +1,123 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Copyright (c) Kitware Inc.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Techna Institute, UHN
+  and was supported by Cancer Care Ontario (CCO)'s ACRU program
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// DoseMorphology includes
+#include "vtkSlicerDoseMorphologyModuleLogic.h"
+#include "vtkMRMLDoseMorphologyNode.h"
+
+// MarginCal includes
+#include "MarginCalculatorCommon.h"
+
+// VTK includes
+#include <vtkImageData.h>
+#include <vtkMatrix4x4.h>
+#include <vtkNew.h>
+#include <vtkSmartPointer.h>
+
+// STD includes
+#include <cmath>
+#include <cstdlib>
+
+//-----------------------------------------------------------------------------
+// Number of voxels along the line through the center of the image, in the direction of the axis,
+// with at least half of the maximum dose
+int GetDoseWidth(vtkImageData* doseImageData, int axis)
+{
+  int dimensions[3] = {0, 0, 0};
+  doseImageData->GetDimensions(dimensions);
+  int index[3] = { dimensions[0]/2, dimensions[1]/2, dimensions[2]/2 };
+  int width = 0;
+  for (index[axis] = 0; index[axis] < dimensions[axis]; index[axis]++)
+  {
+    if (doseImageData->GetScalarComponentAsDouble(index[0], index[1], index[2], 0) >= 5.0)
+    {
+      width++;
+    }
+  }
+  return width;
+}
+
+//-----------------------------------------------------------------------------
+// The sizes of both dilation methods are margins in mm: on a grid with a different voxel size
+// along each axis, they must grow a dose plateau by the same number of voxels
+int vtkSlicerDoseMorphologyModuleLogicTest2(int vtkNotUsed(argc), char* vtkNotUsed(argv)[])
+{
+  const int dimensions[3] = {30, 24, 20};
+  const double spacing[3] = {2.0, 3.0, 4.0};
+  const double margin = 12.0;
+
+  // Dose plateau of 5 voxels in the middle of the grid
+  vtkSmartPointer<vtkImageData> doseImageData = vtkSmartPointer<vtkImageData>::New();
+  doseImageData->SetDimensions(dimensions[0], dimensions[1], dimensions[2]);
+#if (VTK_MAJOR_VERSION <= 5)
+  doseImageData->SetScalarTypeToFloat();
+  doseImageData->SetNumberOfScalarComponents(1);
+  doseImageData->AllocateScalars();
+#else
+  doseImageData->AllocateScalars(VTK_FLOAT, 1);
+#endif
+  float* dose = static_cast<float*>(doseImageData->GetScalarPointer());
+  for (int z = 0; z < dimensions[2]; z++)
+  {
+    for (int y = 0; y < dimensions[1]; y++)
+    {
+      for (int x = 0; x < dimensions[0]; x++)
+      {
+        bool inside = ( abs(2*x - dimensions[0]) < 6 && abs(2*y - dimensions[1]) < 6 && abs(2*z - dimensions[2]) < 6 );
+        dose[(z*dimensions[1] + y)*dimensions[0] + x] = (inside ? 10.0f : 0.0f);
+      }
+    }
+  }
+
+  vtkSmartPointer<vtkMatrix4x4> inputIJKToRASMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  for (int axis = 0; axis < 3; axis++)
+  {
+    inputIJKToRASMatrix->SetElement(axis, axis, spacing[axis]);
+  }
+
+  vtkNew<vtkSlicerDoseMorphologyModuleLogic> logic;
+  vtkSmartPointer<vtkImageData> resampledDoseImageData = vtkSmartPointer<vtkImageData>::New();
+  vtkSmartPointer<vtkImageData> nativeDoseImageData = vtkSmartPointer<vtkImageData>::New();
+  if ( logic->MorphDoseImage(doseImageData, inputIJKToRASMatrix, dimensions, spacing, SLICERRT_EXPAND_BY_DILATION,
+      SLICERRT_DILATION_RESAMPLED, margin, margin, margin, MARGINCALCULATOR_DOSE_PRECISION_FLOAT, 1.0, resampledDoseImageData) != 0
+    || logic->MorphDoseImage(doseImageData, inputIJKToRASMatrix, dimensions, spacing, SLICERRT_EXPAND_BY_DILATION,
+      SLICERRT_DILATION_NATIVE_ELLIPSOID, margin, margin, margin, MARGINCALCULATOR_DOSE_PRECISION_FLOAT, 1.0, nativeDoseImageData) != 0 )
+  {
+    std::cerr << "Dilation of the dose failed!" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  for (int axis = 0; axis < 3; axis++)
+  {
+    int expectedWidth = 5 + 2 * (int)floor(margin / spacing[axis] + 0.5);
+    int resampledWidth = GetDoseWidth(resampledDoseImageData, axis);
+    int nativeWidth = GetDoseWidth(nativeDoseImageData, axis);
+    if (abs(resampledWidth - expectedWidth) > 2 || abs(nativeWidth - expectedWidth) > 2 || abs(resampledWidth - nativeWidth) > 2)
+    {
+      std::cerr << "Dilation by " << margin << " mm along axis " << axis << " (spacing " << spacing[axis] << " mm): resampled dose is "
+        << resampledWidth << " voxels wide, native dose " << nativeWidth << " voxels, expected " << expectedWidth << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
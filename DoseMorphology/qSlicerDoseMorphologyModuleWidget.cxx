@@ -197,13 +197,18 @@ void qSlicerDoseMorphologyModuleWidget::updateWidgetFromMRML()
     {
       case SLICERRT_EXPAND_BY_SCALING:
         d->radioButton_ExpandByScaling->setChecked(true);
-        d->radioButton_ExpandByDilation->setChecked(false);
         break;
       case SLICERRT_EXPAND_BY_DILATION:
-        d->radioButton_ExpandByScaling->setChecked(false);
         d->radioButton_ExpandByDilation->setChecked(true);
         break;
+      case SLICERRT_SHRINK_BY_SCALING:
+        d->radioButton_ShrinkByScaling->setChecked(true);
+        break;
+      case SLICERRT_SHRINK_BY_EROSION:
+        d->radioButton_ShrinkByErosion->setChecked(true);
+        break;
     }
+    d->checkBox_DilateOnDoseGrid->setChecked(paramNode->GetDilationMethod() == SLICERRT_DILATION_NATIVE_ELLIPSOID);
 
     std::ostringstream sstream_xsize;
     sstream_xsize << paramNode->GetXSize();
@@ -243,6 +248,9 @@ void qSlicerDoseMorphologyModuleWidget::setup()
 
   this->connect( d->radioButton_ExpandByScaling, SIGNAL(clicked()), this, SLOT(radioButtonExpandByScalingClicked()));
   this->connect( d->radioButton_ExpandByDilation, SIGNAL(clicked()), this, SLOT(radioButtonExpandByDilationClicked()));
+  this->connect( d->radioButton_ShrinkByScaling, SIGNAL(clicked()), this, SLOT(radioButtonShrinkByScalingClicked()));
+  this->connect( d->radioButton_ShrinkByErosion, SIGNAL(clicked()), this, SLOT(radioButtonShrinkByErosionClicked()));
+  this->connect( d->checkBox_DilateOnDoseGrid, SIGNAL(toggled(bool)), this, SLOT(checkBoxDilateOnDoseGridToggled(bool)));
 
   this->connect( d->lineEdit_XSize, SIGNAL(textChanged(const QString &)), this, SLOT(lineEditXSizeChanged(const QString &)));
   this->connect( d->lineEdit_YSize, SIGNAL(textChanged(const QString &)), this, SLOT(lineEditYSizeChanged(const QString &)));
@@ -360,6 +368,58 @@ void qSlicerDoseMorphologyModuleWidget::radioButtonExpandByDilationClicked()
   paramNode->DisableModifiedEventOff();
 }
 
+//-----------------------------------------------------------------------------
+void qSlicerDoseMorphologyModuleWidget::radioButtonShrinkByScalingClicked()
+{
+  Q_D(qSlicerDoseMorphologyModuleWidget);
+
+  vtkMRMLDoseMorphologyNode* paramNode = d->logic()->GetDoseMorphologyNode();
+  if (!paramNode || !this->mrmlScene())
+  {
+    return;
+  }
+  paramNode->DisableModifiedEventOn();
+  paramNode->SetOperationToShrinkByScaling();
+  paramNode->DisableModifiedEventOff();
+}
+
+//-----------------------------------------------------------------------------
+void qSlicerDoseMorphologyModuleWidget::radioButtonShrinkByErosionClicked()
+{
+  Q_D(qSlicerDoseMorphologyModuleWidget);
+
+  vtkMRMLDoseMorphologyNode* paramNode = d->logic()->GetDoseMorphologyNode();
+  if (!paramNode || !this->mrmlScene())
+  {
+    return;
+  }
+  paramNode->DisableModifiedEventOn();
+  paramNode->SetOperationToShrinkByErosion();
+  paramNode->DisableModifiedEventOff();
+}
+
+//-----------------------------------------------------------------------------
+void qSlicerDoseMorphologyModuleWidget::checkBoxDilateOnDoseGridToggled(bool checked)
+{
+  Q_D(qSlicerDoseMorphologyModuleWidget);
+
+  vtkMRMLDoseMorphologyNode* paramNode = d->logic()->GetDoseMorphologyNode();
+  if (!paramNode || !this->mrmlScene())
+  {
+    return;
+  }
+  paramNode->DisableModifiedEventOn();
+  if (checked)
+  {
+    paramNode->SetDilationMethodToNativeEllipsoid();
+  }
+  else
+  {
+    paramNode->SetDilationMethodToResampled();
+  }
+  paramNode->DisableModifiedEventOff();
+}
+
 //-----------------------------------------------------------------------------
 void qSlicerDoseMorphologyModuleWidget::lineEditXSizeChanged(const QString & text)
 {
@@ -75,6 +75,15 @@ protected slots:
   ///
   void radioButtonExpandByDilationClicked();
 
+  ///
+  void radioButtonShrinkByScalingClicked();
+
+  ///
+  void radioButtonShrinkByErosionClicked();
+
+  ///
+  void checkBoxDilateOnDoseGridToggled(bool checked);
+
   ///
   void lineEditXSizeChanged(const QString & text);
 
@@ -38,6 +38,7 @@
 #include <vtkSmartPointer.h>
 
 // STD includes
+#include <cstdlib>
 #include <sstream>
 
 //------------------------------------------------------------------------------
@@ -54,7 +55,14 @@ vtkMRMLNodeNewMacro(vtkMRMLDosePopulationHistogramNode);
 vtkMRMLDosePopulationHistogramNode::vtkMRMLDosePopulationHistogramNode()
 {
   this->UseDoseOption = ART_DPH_USEDMIN;
-  this->DPHDoubleArrayNodeIDs.clear();
+  this->NumberOfBootstrapResamples = 0;
+  this->BootstrapConfidenceLevel = 95.0;
+  this->HistogramType = ART_DPH_HISTOGRAM_BINNED;
+  this->ChartMaximumNumberOfPoints = 500;
+  this->ChartDoseRange[0] = 0.0;
+  this->ChartDoseRange[1] = 0.0;
+  this->DoseAxisValues.clear();
+  this->RemoveAllDPHDoubleArrayNodeIDs();
   this->ShowHideAll = 0;
   this->ShowInChartCheckStates.clear();
 
@@ -64,10 +72,61 @@ vtkMRMLDosePopulationHistogramNode::vtkMRMLDosePopulationHistogramNode()
 //----------------------------------------------------------------------------
 vtkMRMLDosePopulationHistogramNode::~vtkMRMLDosePopulationHistogramNode()
 {
-  this->DPHDoubleArrayNodeIDs.clear();
+  this->RemoveAllDPHDoubleArrayNodeIDs();
   this->ShowInChartCheckStates.clear();
 }
 
+//----------------------------------------------------------------------------
+bool vtkMRMLDosePopulationHistogramNode::AddDPHDoubleArrayNodeID(const char* nodeId)
+{
+  if (!nodeId || this->HasDPHDoubleArrayNodeID(nodeId))
+  {
+    return false;
+  }
+
+  this->DPHDoubleArrayNodeIDIndices[nodeId] = this->DPHDoubleArrayNodeIDs.size();
+  this->DPHDoubleArrayNodeIDs.push_back(nodeId);
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool vtkMRMLDosePopulationHistogramNode::RemoveDPHDoubleArrayNodeID(const char* nodeId)
+{
+  if (!nodeId)
+  {
+    return false;
+  }
+  vtksys::hash_map<std::string, size_t>::iterator indexIt = this->DPHDoubleArrayNodeIDIndices.find(nodeId);
+  if (indexIt == this->DPHDoubleArrayNodeIDIndices.end())
+  {
+    return false;
+  }
+
+  // Move the last ID into the freed position instead of shifting the rest of the list
+  size_t index = indexIt->second;
+  this->DPHDoubleArrayNodeIDIndices.erase(indexIt);
+  if (index + 1 < this->DPHDoubleArrayNodeIDs.size())
+  {
+    this->DPHDoubleArrayNodeIDs[index] = this->DPHDoubleArrayNodeIDs.back();
+    this->DPHDoubleArrayNodeIDIndices[this->DPHDoubleArrayNodeIDs[index]] = index;
+  }
+  this->DPHDoubleArrayNodeIDs.pop_back();
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool vtkMRMLDosePopulationHistogramNode::HasDPHDoubleArrayNodeID(const char* nodeId)
+{
+  return nodeId && this->DPHDoubleArrayNodeIDIndices.find(nodeId) != this->DPHDoubleArrayNodeIDIndices.end();
+}
+
+//----------------------------------------------------------------------------
+void vtkMRMLDosePopulationHistogramNode::RemoveAllDPHDoubleArrayNodeIDs()
+{
+  this->DPHDoubleArrayNodeIDs.clear();
+  this->DPHDoubleArrayNodeIDIndices.clear();
+}
+
 //----------------------------------------------------------------------------
 void vtkMRMLDosePopulationHistogramNode::WriteXML(ostream& of, int nIndent)
 {
@@ -77,6 +136,18 @@ void vtkMRMLDosePopulationHistogramNode::WriteXML(ostream& of, int nIndent)
   vtkIndent indent(nIndent);
 
   of << indent << " UseDoseOption=\"" << this->UseDoseOption << "\"";
+  of << indent << " NumberOfBootstrapResamples=\"" << this->NumberOfBootstrapResamples << "\"";
+  of << indent << " BootstrapConfidenceLevel=\"" << this->BootstrapConfidenceLevel << "\"";
+  of << indent << " HistogramType=\"" << this->HistogramType << "\"";
+  of << indent << " ChartMaximumNumberOfPoints=\"" << this->ChartMaximumNumberOfPoints << "\"";
+  of << indent << " ChartDoseRange=\"" << this->ChartDoseRange[0] << " " << this->ChartDoseRange[1] << "\"";
+
+  of << indent << " DoseAxisValues=\"";
+  for (std::vector<double>::iterator it = this->DoseAxisValues.begin(); it != this->DoseAxisValues.end(); ++it)
+    {
+    of << (*it) << "|";
+    }
+  of << "\"";
 
   of << indent << " DPHDoubleArrayNodeIDs=\"";
   for (std::vector<std::string>::iterator it = this->DPHDoubleArrayNodeIDs.begin(); it != this->DPHDoubleArrayNodeIDs.end(); ++it)
@@ -118,6 +189,64 @@ void vtkMRMLDosePopulationHistogramNode::ReadXMLAttributes(const char** atts)
       this->UseDoseOption = 
         (strcmp(attValue,"true") ? false : true);
       }
+    else if (!strcmp(attName, "NumberOfBootstrapResamples")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      int intAttValue;
+      ss >> intAttValue;
+      this->NumberOfBootstrapResamples = intAttValue;
+      }
+    else if (!strcmp(attName, "BootstrapConfidenceLevel")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      double doubleAttValue;
+      ss >> doubleAttValue;
+      this->BootstrapConfidenceLevel = doubleAttValue;
+      }
+    else if (!strcmp(attName, "HistogramType")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      int intAttValue;
+      ss >> intAttValue;
+      this->HistogramType = intAttValue;
+      }
+    else if (!strcmp(attName, "ChartMaximumNumberOfPoints")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      int intAttValue;
+      ss >> intAttValue;
+      this->ChartMaximumNumberOfPoints = intAttValue;
+      }
+    else if (!strcmp(attName, "ChartDoseRange")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      ss >> this->ChartDoseRange[0] >> this->ChartDoseRange[1];
+      }
+    else if (!strcmp(attName, "DoseAxisValues")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      std::string valueStr = ss.str();
+      std::string separatorCharacter("|");
+
+      this->DoseAxisValues.clear();
+      size_t separatorPosition = valueStr.find( separatorCharacter );
+      while (separatorPosition != std::string::npos)
+        {
+        this->DoseAxisValues.push_back( atof(valueStr.substr(0, separatorPosition).c_str()) );
+        valueStr = valueStr.substr( separatorPosition+1 );
+        separatorPosition = valueStr.find( separatorCharacter );
+        }
+      if (! valueStr.empty() )
+        {
+        this->DoseAxisValues.push_back( atof(valueStr.c_str()) );
+        }
+      }
     else if (!strcmp(attName, "DPHDoubleArrayNodeIDs")) 
       {
       std::stringstream ss;
@@ -125,17 +254,17 @@ void vtkMRMLDosePopulationHistogramNode::ReadXMLAttributes(const char** atts)
       std::string valueStr = ss.str();
       std::string separatorCharacter("|");
 
-      this->DPHDoubleArrayNodeIDs.clear();
+      this->RemoveAllDPHDoubleArrayNodeIDs();
       size_t separatorPosition = valueStr.find( separatorCharacter );
       while (separatorPosition != std::string::npos)
         {
-        this->DPHDoubleArrayNodeIDs.push_back( valueStr.substr(0, separatorPosition) );
+        this->AddDPHDoubleArrayNodeID( valueStr.substr(0, separatorPosition).c_str() );
         valueStr = valueStr.substr( separatorPosition+1 );
         separatorPosition = valueStr.find( separatorCharacter );
         }
       if (! valueStr.empty() )
         {
-        this->DPHDoubleArrayNodeIDs.push_back( valueStr );
+        this->AddDPHDoubleArrayNodeID( valueStr.c_str() );
         }
       }
     else if (!strcmp(attName, "ShowHIDeAll")) 
@@ -182,8 +311,16 @@ void vtkMRMLDosePopulationHistogramNode::Copy(vtkMRMLNode *anode)
   vtkMRMLDosePopulationHistogramNode *node = (vtkMRMLDosePopulationHistogramNode *) anode;
 
   this->UseDoseOption = node->UseDoseOption;
+  this->NumberOfBootstrapResamples = node->NumberOfBootstrapResamples;
+  this->BootstrapConfidenceLevel = node->BootstrapConfidenceLevel;
+  this->HistogramType = node->HistogramType;
+  this->ChartMaximumNumberOfPoints = node->ChartMaximumNumberOfPoints;
+  this->ChartDoseRange[0] = node->ChartDoseRange[0];
+  this->ChartDoseRange[1] = node->ChartDoseRange[1];
+  this->DoseAxisValues = node->DoseAxisValues;
 
   this->DPHDoubleArrayNodeIDs = node->DPHDoubleArrayNodeIDs;
+  this->DPHDoubleArrayNodeIDIndices = node->DPHDoubleArrayNodeIDIndices;
   this->ShowHideAll = node->ShowHideAll;
   this->ShowInChartCheckStates = node->ShowInChartCheckStates;
 
@@ -206,6 +343,20 @@ void vtkMRMLDosePopulationHistogramNode::PrintSelf(ostream& os, vtkIndent indent
   }
 
   os << indent << "ShowHideAll:   " << this->ShowHideAll << "\n";
+  os << indent << "NumberOfBootstrapResamples:   " << this->NumberOfBootstrapResamples << "\n";
+  os << indent << "BootstrapConfidenceLevel:   " << this->BootstrapConfidenceLevel << "\n";
+  os << indent << "HistogramType:   " << this->HistogramType << "\n";
+  os << indent << "ChartMaximumNumberOfPoints:   " << this->ChartMaximumNumberOfPoints << "\n";
+  os << indent << "ChartDoseRange:   " << this->ChartDoseRange[0] << " " << this->ChartDoseRange[1] << "\n";
+
+  {
+    os << indent << "DoseAxisValues:   ";
+    for (std::vector<double>::iterator it = this->DoseAxisValues.begin(); it != this->DoseAxisValues.end(); ++it)
+      {
+      os << (*it) << "|";
+      }
+    os << "\n";
+  }
 
   {
     os << indent << "ShowInChartCheckStates:   ";
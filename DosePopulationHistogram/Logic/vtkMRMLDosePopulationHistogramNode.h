@@ -27,6 +27,9 @@
 #include <vtkMRML.h>
 #include <vtkMRMLNode.h>
 
+// VTKSYS includes
+#include <vtksys/hash_map.hxx>
+
 // STD includes
 #include <vector>
 #include <set>
@@ -37,6 +40,11 @@
 #define ART_DPH_USEDMIN            0
 #define ART_DPH_USED98             1
 
+// Histogram types.
+#define ART_DPH_HISTOGRAM_BINNED     0
+#define ART_DPH_HISTOGRAM_EXACT      1
+#define ART_DPH_HISTOGRAM_DOSE_AXIS  2
+
 class vtkMRMLDoubleArrayNode;
 class vtkMRMLChartNode;
 class vtkMRMLScalarVolumeNode;
@@ -109,12 +117,61 @@ public:
   void SetUseDoseOptionToDmin() {this->SetUseDoseOption(ART_DPH_USEDMIN);};
   void SetUseDoseOptionToD98() {this->SetUseDoseOption(ART_DPH_USED98);};
 
+  /// Get/Set the number of bootstrap resamples of the trials used for the confidence band
+  /// of the population histogram (0 computes no band)
+  vtkSetMacro(NumberOfBootstrapResamples, int);
+  vtkGetMacro(NumberOfBootstrapResamples, int);
+
+  /// Get/Set the confidence level of the bootstrap band in percent
+  vtkSetMacro(BootstrapConfidenceLevel, double);
+  vtkGetMacro(BootstrapConfidenceLevel, double);
+
+  /// Get/Set the kind of population curve (ART_DPH_HISTOGRAM_*): fixed bins, the exact step curve
+  /// of the trials, or the exact curve evaluated at the doses of GetDoseAxisValues()
+  vtkSetMacro(HistogramType, int);
+  vtkGetMacro(HistogramType, int);
+  void SetHistogramTypeToBinned() {this->SetHistogramType(ART_DPH_HISTOGRAM_BINNED);};
+  void SetHistogramTypeToExact() {this->SetHistogramType(ART_DPH_HISTOGRAM_EXACT);};
+  void SetHistogramTypeToDoseAxis() {this->SetHistogramType(ART_DPH_HISTOGRAM_DOSE_AXIS);};
+
+  /// Get/Set the largest number of points of a curve shown in the chart. Longer curves are decimated
+  /// for display, the DPH arrays themselves keep full resolution (0 shows all points).
+  vtkSetMacro(ChartMaximumNumberOfPoints, int);
+  vtkGetMacro(ChartMaximumNumberOfPoints, int);
+
+  /// Get/Set the dose range the chart is zoomed to. The curves are cropped to the range and decimated
+  /// only if the visible part is still too long, so zooming in reveals full resolution.
+  /// The full curve is shown if the maximum is not larger than the minimum.
+  vtkSetVector2Macro(ChartDoseRange, double);
+  vtkGetVector2Macro(ChartDoseRange, double);
+
+  /// Get the doses (in the units of the dose axis of the histogram) the curve is evaluated at
+  /// for ART_DPH_HISTOGRAM_DOSE_AXIS
+  std::vector<double>* GetDoseAxisValues()
+  {
+    return &this->DoseAxisValues;
+  }
+
   /// Get list of all the DPH double array node IDs in the scene
-  std::vector<std::string>* GetDPHDoubleArrayNodeIDs()
+  const std::vector<std::string>* GetDPHDoubleArrayNodeIDs()
   {
     return &this->DPHDoubleArrayNodeIDs;
   }
 
+  /// Add a DPH double array node ID to the list if not already there
+  /// \return True if the ID was added
+  bool AddDPHDoubleArrayNodeID(const char* nodeId);
+
+  /// Remove a DPH double array node ID from the list. The last ID takes its place.
+  /// \return True if the ID was in the list
+  bool RemoveDPHDoubleArrayNodeID(const char* nodeId);
+
+  /// Return true if the ID is in the list of DPH double array node IDs
+  bool HasDPHDoubleArrayNodeID(const char* nodeId);
+
+  /// Clear the list of DPH double array node IDs
+  void RemoveAllDPHDoubleArrayNodeIDs();
+
   /// Get/Set Show/Hide all checkbox state
   vtkGetMacro(ShowHideAll, int);
   vtkSetMacro(ShowHideAll, int);
@@ -135,9 +192,31 @@ protected:
   /// State of Show isodose lines checkbox
   int UseDoseOption;
 
+  /// Number of bootstrap resamples, 0 if no confidence band is computed
+  int NumberOfBootstrapResamples;
+
+  /// Confidence level of the bootstrap band in percent
+  double BootstrapConfidenceLevel;
+
+  /// Kind of population curve
+  int HistogramType;
+
+  /// Largest number of points of a curve in the chart, 0 for no limit
+  int ChartMaximumNumberOfPoints;
+
+  /// Dose range the chart is zoomed to, full range if empty
+  double ChartDoseRange[2];
+
+  /// Doses the curve is evaluated at for the dose axis histogram type
+  std::vector<double> DoseAxisValues;
+
   /// List of all the DPH double array MRML node IDs that are present in the scene
   std::vector<std::string> DPHDoubleArrayNodeIDs;
 
+  /// Position of each ID in DPHDoubleArrayNodeIDs, so that adding, removing and lookup
+  /// do not scan the list
+  vtksys::hash_map<std::string, size_t> DPHDoubleArrayNodeIDIndices;
+
   /// State of Show/Hide all checkbox
   int ShowHideAll;
 
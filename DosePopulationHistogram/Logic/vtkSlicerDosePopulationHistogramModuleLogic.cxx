@@ -28,6 +28,8 @@
 #include "MarginCalculatorCommon.h"
 
 #include "vtkMRMLMotionSimulatorDoubleArrayNode.h"
+#include "vtkMotionSimulatorTrialStore.h"
+#include "vtkDosePopulationHistogramAccumulator.h"
 
 // MRML includes
 #include <vtkMRMLScalarVolumeNode.h>
@@ -43,6 +45,7 @@
 
 // VTK includes
 #include <vtkNew.h>
+#include <vtkCommand.h>
 #include <vtkTransform.h>
 #include <vtkImageAccumulate.h>
 #include <vtkImageThreshold.h>
@@ -53,14 +56,22 @@
 #include <vtkPiecewiseFunction.h>
 #include <vtkImageResample.h>
 #include <vtkImageData.h>
+#include <vtkCollection.h>
+#include <vtkMultiThreader.h>
 #include <vtkObjectFactory.h>
 
 // VTKSYS includes
 #include <vtksys/SystemTools.hxx>
 
 // STD includes
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <set>
+#include <sstream>
+
+// Dose and contour pairs whose nominal plan statistics are kept
+#define MAX_NOMINAL_STATISTICS_CACHE_ENTRIES 64
 
 //----------------------------------------------------------------------------
 vtkStandardNewMacro(vtkSlicerDosePopulationHistogramModuleLogic);
@@ -71,6 +82,12 @@ vtkSlicerDosePopulationHistogramModuleLogic::vtkSlicerDosePopulationHistogramMod
   this->DosePopulationHistogramNode = NULL;
   this->StartValue = 0.1;
   this->StepSize = 0.2;
+  this->NominalStatisticsCacheHits = 0;
+  this->NominalStatisticsCacheMisses = 0;
+  this->DPHAccumulator = vtkDosePopulationHistogramAccumulator::New();
+  this->DPHAccumulatorTrialArrayNode = NULL;
+  this->DPHAccumulatorTrialArrayMTime = 0;
+  this->DPHAccumulatorStreaming = false;
 }
 
 //----------------------------------------------------------------------------
@@ -78,7 +95,7 @@ vtkSlicerDosePopulationHistogramModuleLogic::~vtkSlicerDosePopulationHistogramMo
 {
   if (this->GetMRMLScene() && this->DosePopulationHistogramNode)
   {
-    for (std::vector<std::string>::iterator it = this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->begin();
+    for (std::vector<std::string>::const_iterator it = this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->begin();
       it != this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->end(); ++it)
     {
       vtkMRMLDoubleArrayNode* dvhNode = vtkMRMLDoubleArrayNode::SafeDownCast(
@@ -91,12 +108,16 @@ vtkSlicerDosePopulationHistogramModuleLogic::~vtkSlicerDosePopulationHistogramMo
   }
 
   vtkSetAndObserveMRMLNodeMacro(this->DosePopulationHistogramNode, NULL);
+  this->DPHAccumulator->Delete();
 }
 
 //----------------------------------------------------------------------------
 void vtkSlicerDosePopulationHistogramModuleLogic::PrintSelf(ostream& os, vtkIndent indent)
 {
   this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "NominalStatisticsCache: " << this->NominalStatisticsCache.size() << " entries, "
+    << this->NominalStatisticsCacheHits << " hits, " << this->NominalStatisticsCacheMisses << " misses\n";
 }
 
 //----------------------------------------------------------------------------
@@ -115,6 +136,20 @@ void vtkSlicerDosePopulationHistogramModuleLogic::SetMRMLSceneInternal(vtkMRMLSc
   events->InsertNextValue(vtkMRMLScene::EndCloseEvent);
   events->InsertNextValue(vtkMRMLScene::EndBatchProcessEvent);
   this->SetAndObserveMRMLSceneEvents(newScene, events.GetPointer());
+
+  // The DPH arrays already in the scene are registered once, the later ones from the scene events
+  this->DPHDoubleArrayNodeRegistry.clear();
+  if (newScene)
+  {
+    std::vector<vtkMRMLNode*> doubleArrayNodes;
+    newScene->GetNodesByClass("vtkMRMLDoubleArrayNode", doubleArrayNodes);
+    for (std::vector<vtkMRMLNode*>::iterator nodeIt = doubleArrayNodes.begin(); nodeIt != doubleArrayNodes.end(); ++nodeIt)
+    {
+      vtkMRMLDoubleArrayNode* doubleArrayNode = vtkMRMLDoubleArrayNode::SafeDownCast(*nodeIt);
+      vtkObserveMRMLNodeMacro(doubleArrayNode);
+      this->UpdateDPHDoubleArrayNodeRegistry(doubleArrayNode, true);
+    }
+  }
 }
 
 //-----------------------------------------------------------------------------
@@ -136,28 +171,58 @@ void vtkSlicerDosePopulationHistogramModuleLogic::RefreshDPHDoubleArrayNodesFrom
     vtkErrorMacro("RefreshDPHDoubleArrayNodesFromScene: Invalid MRML scene or parameter set node!");
     return;
   }
-  this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->clear();
+  this->DosePopulationHistogramNode->RemoveAllDPHDoubleArrayNodeIDs();
+
+  for (vtksys::hash_map<std::string, std::string>::iterator registryIt = this->DPHDoubleArrayNodeRegistry.begin();
+    registryIt != this->DPHDoubleArrayNodeRegistry.end(); ++registryIt)
+  {
+    this->DosePopulationHistogramNode->AddDPHDoubleArrayNodeID(registryIt->first.c_str());
+  }
+}
 
-  if (this->GetMRMLScene() == NULL || this->GetMRMLScene()->GetNumberOfNodesByClass("vtkMRMLDoubleArrayNode") < 1)
+//---------------------------------------------------------------------------
+void vtkSlicerDosePopulationHistogramModuleLogic::UpdateDPHDoubleArrayNodeRegistry(vtkMRMLDoubleArrayNode* node, bool inScene)
+{
+  if (!node || !node->GetID())
   {
     return;
   }
 
-  this->GetMRMLScene()->InitTraversal();
-  vtkMRMLNode *node = this->GetMRMLScene()->GetNextNodeByClass("vtkMRMLDoubleArrayNode");
-  while (node != NULL)
+  const char* identifier = (inScene ? node->GetAttribute(MarginCalculatorCommon::DVH_DVH_IDENTIFIER_ATTRIBUTE_NAME.c_str()) : NULL);
+  vtksys::hash_map<std::string, std::string>::iterator registryIt = this->DPHDoubleArrayNodeRegistry.find(node->GetID());
+  if (identifier)
   {
-    vtkMRMLDoubleArrayNode* doubleArrayNode = vtkMRMLDoubleArrayNode::SafeDownCast(node);
-    if (doubleArrayNode)
+    if (registryIt != this->DPHDoubleArrayNodeRegistry.end())
     {
-      const char* type = doubleArrayNode->GetAttribute(MarginCalculatorCommon::DVH_DVH_IDENTIFIER_ATTRIBUTE_NAME.c_str());
-      if (type)
-      {
-        this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->push_back(doubleArrayNode->GetID());
-      }
+      registryIt->second = identifier;
+      return;
+    }
+    this->DPHDoubleArrayNodeRegistry[node->GetID()] = identifier;
+    if (this->DosePopulationHistogramNode)
+    {
+      this->DosePopulationHistogramNode->AddDPHDoubleArrayNodeID(node->GetID());
     }
+  }
+  else if (registryIt != this->DPHDoubleArrayNodeRegistry.end())
+  {
+    this->DPHDoubleArrayNodeRegistry.erase(registryIt);
+    if (this->DosePopulationHistogramNode)
+    {
+      this->DosePopulationHistogramNode->RemoveDPHDoubleArrayNodeID(node->GetID());
+    }
+  }
+}
 
-    node = this->GetMRMLScene()->GetNextNodeByClass("vtkMRMLDoubleArrayNode");
+//---------------------------------------------------------------------------
+void vtkSlicerDosePopulationHistogramModuleLogic::ProcessMRMLNodesEvents(vtkObject* caller, unsigned long event, void* callData)
+{
+  this->Superclass::ProcessMRMLNodesEvents(caller, event, callData);
+
+  // Setting or removing an attribute modifies the node
+  vtkMRMLDoubleArrayNode* doubleArrayNode = vtkMRMLDoubleArrayNode::SafeDownCast(caller);
+  if (doubleArrayNode && event == vtkCommand::ModifiedEvent && this->GetMRMLScene() && doubleArrayNode->GetScene() == this->GetMRMLScene())
+  {
+    this->UpdateDPHDoubleArrayNodeRegistry(doubleArrayNode, true);
   }
 }
 
@@ -174,28 +239,23 @@ void vtkSlicerDosePopulationHistogramModuleLogic::UpdateFromMRMLScene()
 //---------------------------------------------------------------------------
 void vtkSlicerDosePopulationHistogramModuleLogic::OnMRMLSceneNodeAdded(vtkMRMLNode* node)
 {
-  if (!node || !this->GetMRMLScene() || !this->DosePopulationHistogramNode)
+  if (!node || !this->GetMRMLScene())
   {
     return;
   }
 
-  // if the scene is still updating, jump out
-  if (this->GetMRMLScene()->IsBatchProcessing())
+  // The registry is also kept during batch processing, so the scene does not have to be searched afterwards
+  vtkMRMLDoubleArrayNode* doubleArrayNode = vtkMRMLDoubleArrayNode::SafeDownCast(node);
+  if (doubleArrayNode)
   {
-    return;
+    vtkObserveMRMLNodeMacro(doubleArrayNode);
+    this->UpdateDPHDoubleArrayNodeRegistry(doubleArrayNode, true);
   }
 
-  if (node->IsA("vtkMRMLDoubleArrayNode"))
+  // if the scene is still updating, jump out
+  if (!this->DosePopulationHistogramNode || this->GetMRMLScene()->IsBatchProcessing())
   {
-    vtkMRMLDoubleArrayNode* doubleArrayNode = vtkMRMLDoubleArrayNode::SafeDownCast(node);
-    if (doubleArrayNode)
-    {
-      const char* type = doubleArrayNode->GetAttribute(MarginCalculatorCommon::DVH_DVH_IDENTIFIER_ATTRIBUTE_NAME.c_str());
-      if (type)
-      {
-        this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->push_back(doubleArrayNode->GetID());
-      }
-    }
+    return;
   }
 
   if (node->IsA("vtkMRMLMotionSimulatorDoubleArrayNode") || node->IsA("vtkMRMLChartNode") 
@@ -208,7 +268,36 @@ void vtkSlicerDosePopulationHistogramModuleLogic::OnMRMLSceneNodeAdded(vtkMRMLNo
 //---------------------------------------------------------------------------
 void vtkSlicerDosePopulationHistogramModuleLogic::OnMRMLSceneNodeRemoved(vtkMRMLNode* node)
 {
-  if (!node || !this->GetMRMLScene() || !this->DosePopulationHistogramNode)
+  if (!node)
+  {
+    return;
+  }
+
+  // The statistics of a removed dose or contour are not needed any more
+  if (node->IsA("vtkMRMLScalarVolumeNode") && node->GetID())
+  {
+    std::list<NominalStatisticsCacheEntry>::iterator entryIt = this->NominalStatisticsCache.begin();
+    while (entryIt != this->NominalStatisticsCache.end())
+    {
+      if (entryIt->DoseVolumeNodeID == node->GetID() || entryIt->ContourNodeID == node->GetID())
+      {
+        entryIt = this->NominalStatisticsCache.erase(entryIt);
+      }
+      else
+      {
+        ++entryIt;
+      }
+    }
+  }
+
+  vtkMRMLDoubleArrayNode* doubleArrayNode = vtkMRMLDoubleArrayNode::SafeDownCast(node);
+  if (doubleArrayNode)
+  {
+    vtkUnObserveMRMLNodeMacro(doubleArrayNode);
+    this->UpdateDPHDoubleArrayNodeRegistry(doubleArrayNode, false);
+  }
+
+  if (!this->GetMRMLScene() || !this->DosePopulationHistogramNode)
   {
     return;
   }
@@ -219,17 +308,14 @@ void vtkSlicerDosePopulationHistogramModuleLogic::OnMRMLSceneNodeRemoved(vtkMRML
     return;
   }
 
-  if (node->IsA("vtkMRMLDoubleArrayNode"))
+  if (doubleArrayNode)
   {
-    const char* removedNodeId = vtkMRMLDoubleArrayNode::SafeDownCast(node)->GetID();
-    for (std::vector<std::string>::iterator it = this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->begin();
-      it != this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->end(); ++it)
+    // The chart curve of a removed DPH is not needed any more
+    const char* chartCurveNodeID = node->GetAttribute(MarginCalculatorCommon::DPH_CHART_CURVE_NODE_ID_ATTRIBUTE_NAME.c_str());
+    vtkMRMLNode* chartCurveNode = (chartCurveNodeID ? this->GetMRMLScene()->GetNodeByID(chartCurveNodeID) : NULL);
+    if (chartCurveNode)
     {
-      if (!it->compare(removedNodeId))
-      {
-        this->DosePopulationHistogramNode->GetDPHDoubleArrayNodeIDs()->erase(it);
-        break;
-      }
+      this->GetMRMLScene()->RemoveNode(chartCurveNode);
     }
   }
 
@@ -255,6 +341,9 @@ void vtkSlicerDosePopulationHistogramModuleLogic::OnMRMLSceneEndImport()
 //---------------------------------------------------------------------------
 void vtkSlicerDosePopulationHistogramModuleLogic::OnMRMLSceneEndClose()
 {
+  this->ClearNominalStatisticsCache();
+  this->DPHDoubleArrayNodeRegistry.clear();
+
   this->Modified();
 }
 
@@ -325,28 +414,54 @@ void vtkSlicerDosePopulationHistogramModuleLogic::GetStencilForContour(vtkMRMLSc
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerDosePopulationHistogramModuleLogic::ComputeDPH()
+void vtkSlicerDosePopulationHistogramModuleLogic::ClearNominalStatisticsCache()
 {
-  if ( !this->GetMRMLScene() || !this->DosePopulationHistogramNode )
+  this->NominalStatisticsCache.clear();
+  this->NominalStatisticsCacheHits = 0;
+  this->NominalStatisticsCacheMisses = 0;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDosePopulationHistogramModuleLogic::GetNominalPlanStatistics(vtkMRMLScalarVolumeNode* doseVolumeNode,
+                                                                          vtkMRMLScalarVolumeNode* contourNode,
+                                                                          double &minDose, double &d98Dose)
+{
+  if (!doseVolumeNode || !doseVolumeNode->GetImageData() || !contourNode || !contourNode->GetImageData())
   {
-    return;
+    vtkErrorMacro("GetNominalPlanStatistics: Invalid dose volume or contour!");
+    return -1;
   }
 
-  vtkMRMLMotionSimulatorDoubleArrayNode* doubleArrayNode = this->DosePopulationHistogramNode->GetDoubleArrayNode();
-  vtkMRMLScalarVolumeNode* doseVolumeNode = this->DosePopulationHistogramNode->GetDoseVolumeNode();
-  //vtkMRMLContourNode* contourNode = this->DosePopulationHistogramNode->GetContourNode();
-  vtkMRMLScalarVolumeNode* contourNode = this->DosePopulationHistogramNode->GetContourNode();
-  // Make sure inputs are initialized
-  if (!doseVolumeNode || !contourNode || !doubleArrayNode)
+  vtkImageData* doseImageData = doseVolumeNode->GetImageData();
+  vtkImageData* contourImageData = contourNode->GetImageData();
+  std::string doseVolumeNodeID = (doseVolumeNode->GetID() ? doseVolumeNode->GetID() : "");
+  std::string contourNodeID = (contourNode->GetID() ? contourNode->GetID() : "");
+
+  // Look up the pair, the entry of a replaced or modified image is recomputed below
+  std::list<NominalStatisticsCacheEntry>::iterator entryIt;
+  for (entryIt = this->NominalStatisticsCache.begin(); entryIt != this->NominalStatisticsCache.end(); ++entryIt)
   {
-    vtkErrorMacro("DosePopulationHistogram: inputs are not initialized!")
-    return ;
+    if (entryIt->DoseVolumeNodeID == doseVolumeNodeID && entryIt->ContourNodeID == contourNodeID)
+    {
+      break;
+    }
   }
+  if (entryIt != this->NominalStatisticsCache.end())
+  {
+    bool valid = ( entryIt->DoseImageData == doseImageData && entryIt->DoseImageDataMTime == doseImageData->GetMTime()
+      && entryIt->ContourImageData == contourImageData && entryIt->ContourImageDataMTime == contourImageData->GetMTime() );
+    if (valid)
+    {
+      minDose = entryIt->MinDose;
+      d98Dose = entryIt->D98Dose;
+      this->NominalStatisticsCache.splice(this->NominalStatisticsCache.begin(), this->NominalStatisticsCache, entryIt);
+      this->NominalStatisticsCacheHits++;
+      return 0;
+    }
+    this->NominalStatisticsCache.erase(entryIt);
+  }
+  this->NominalStatisticsCacheMisses++;
 
-  vtkSmartPointer<vtkMRMLScalarVolumeNode> structureStenciledDoseVolumeNode
-    = vtkSmartPointer<vtkMRMLScalarVolumeNode>::New();
-
-  // Compute statistics
   vtkSmartPointer<vtkImageData> resampledDoseVolume = vtkSmartPointer<vtkImageData>::New();
   vtkSmartPointer<vtkImageStencilData> structureStencil = vtkSmartPointer<vtkImageStencilData>::New();
   this->GetStencilForContour(doseVolumeNode, contourNode, resampledDoseVolume, structureStencil);
@@ -354,9 +469,9 @@ void vtkSlicerDosePopulationHistogramModuleLogic::ComputeDPH()
   // Get maximum dose from dose volume
   vtkNew<vtkImageAccumulate> doseStat;
 #if (VTK_MAJOR_VERSION <= 5)
-  doseStat->SetInput(doseVolumeNode->GetImageData());
+  doseStat->SetInput(doseImageData);
 #else
-  doseStat->SetInputData(doseVolumeNode->GetImageData());
+  doseStat->SetInputData(doseImageData);
 #endif
   doseStat->Update();
   double maxDose = doseStat->GetMax()[0];
@@ -376,10 +491,10 @@ void vtkSlicerDosePopulationHistogramModuleLogic::ComputeDPH()
   structureStat->SetComponentOrigin(startValue,0,0);
   structureStat->SetComponentSpacing(stepSize,1,1);
   structureStat->Update();
-  double minDose = structureStat->GetMin()[0];
+  minDose = structureStat->GetMin()[0];
 
   // Get D98 dose from dose volume
-  double D98Dose = 0.0;
+  d98Dose = 0.0;
   vtkImageData* statArray = structureStat->GetOutput();
   unsigned long totalVoxels = structureStat->GetVoxelCount();
   double vlast = 0.0;
@@ -390,78 +505,320 @@ void vtkSlicerDosePopulationHistogramModuleLogic::ComputeDPH()
     unsigned long voxelsInBin = statArray->GetScalarComponentAsDouble(sampleIndex,0,0,0);
     if ( (1.0-(double)voxelBelowDose/(double)totalVoxels)*100.0 < 98 && vlast >= 98)
     {
-      D98Dose = (startValue + sampleIndex * stepSize + dlast)/2;
+      d98Dose = (startValue + sampleIndex * stepSize + dlast)/2;
     }
     vlast = (1.0-(double)voxelBelowDose/(double)totalVoxels)*100.0;
     voxelBelowDose += voxelsInBin;
     dlast = startValue + sampleIndex * stepSize;
   }
 
-  //// Get maximum dose 
-  vtkDoubleArray* planArray = doubleArrayNode->GetArray();
-  int numberTotal = planArray->GetNumberOfTuples();
-  maxDose = 0.0;
+  NominalStatisticsCacheEntry entry;
+  entry.DoseVolumeNodeID = doseVolumeNodeID;
+  entry.ContourNodeID = contourNodeID;
+  entry.DoseImageData = doseImageData;
+  entry.DoseImageDataMTime = doseImageData->GetMTime();
+  entry.ContourImageData = contourImageData;
+  entry.ContourImageDataMTime = contourImageData->GetMTime();
+  entry.MinDose = minDose;
+  entry.D98Dose = d98Dose;
+  this->NominalStatisticsCache.push_front(entry);
+  if (this->NominalStatisticsCache.size() > MAX_NOMINAL_STATISTICS_CACHE_ENTRIES)
+  {
+    this->NominalStatisticsCache.pop_back();
+  }
+
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDosePopulationHistogramModuleLogic::InitializeDPHAccumulator(vtkDosePopulationHistogramAccumulator* accumulator)
+{
+  if (!this->DosePopulationHistogramNode)
+  {
+    vtkErrorMacro("InitializeDPHAccumulator: Invalid parameter set node!");
+    return -1;
+  }
+  return this->InitializeDPHAccumulator(this->DosePopulationHistogramNode->GetDoseVolumeNode(),
+    this->DosePopulationHistogramNode->GetContourNode(), accumulator);
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDosePopulationHistogramModuleLogic::InitializeDPHAccumulator(vtkMRMLScalarVolumeNode* doseVolumeNode, vtkMRMLScalarVolumeNode* contourNode,
+                                                                          vtkDosePopulationHistogramAccumulator* accumulator)
+{
+  if (!accumulator || !this->DosePopulationHistogramNode)
+  {
+    vtkErrorMacro("InitializeDPHAccumulator: Invalid accumulator or parameter set node!");
+    return -1;
+  }
+
+  // Nominal statistics, recomputed only when the dose or the contour changed
+  double minDose = 0.0;
+  double D98Dose = 0.0;
+  if (this->GetNominalPlanStatistics(doseVolumeNode, contourNode, minDose, D98Dose) != 0)
+  {
+    vtkErrorMacro("InitializeDPHAccumulator: Failed to get nominal plan statistics!");
+    return -1;
+  }
+
+  // Trial doses are binned in percent of the nominal dose when it is not negligible
   int UseDoseNormalization = this->DosePopulationHistogramNode->GetUseDoseOption();
   double doseNormalizationFactor = 1.0;
-  for (int i=0; i<numberTotal; i++)
+  double nominalDose = (UseDoseNormalization == ART_DPH_USEDMIN ? minDose : D98Dose);
+  if ((UseDoseNormalization == ART_DPH_USEDMIN || UseDoseNormalization == ART_DPH_USED98) && nominalDose > 0.01)
+  {
+    this->StepSize = 1.0;
+    doseNormalizationFactor = 100.0/nominalDose;
+  }
+
+  accumulator->SetUseDoseOption(UseDoseNormalization);
+  accumulator->SetDoseNormalizationFactor(doseNormalizationFactor);
+  accumulator->SetStartValue(this->StartValue);
+  accumulator->SetStepSize(this->StepSize);
+  accumulator->RemoveAllTrials();
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+vtkDosePopulationHistogramAccumulator* vtkSlicerDosePopulationHistogramModuleLogic::StartDPHAccumulation(vtkMRMLMotionSimulatorDoubleArrayNode* trialArrayNode)
+{
+  this->DPHAccumulatorStreaming = false;
+  if ( !trialArrayNode || !this->DosePopulationHistogramNode
+    || this->DosePopulationHistogramNode->GetDoubleArrayNode() != trialArrayNode )
+  {
+    return NULL;
+  }
+  this->DPHAccumulatorTrialArrayNode = NULL;
+  if (this->InitializeDPHAccumulator(this->DPHAccumulator) != 0)
+  {
+    return NULL;
+  }
+
+  // The modification time is only known once the simulation stored its results, see ComputeDPH
+  this->DPHAccumulatorTrialArrayNode = trialArrayNode;
+  this->DPHAccumulatorTrialArrayMTime = 0;
+  this->DPHAccumulatorStreaming = true;
+  return this->DPHAccumulator;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDosePopulationHistogramModuleLogic::GetDPHCurve(vtkDosePopulationHistogramAccumulator* accumulator, int histogramType,
+                                                             const std::vector<double> &doseAxisValues, int numberOfResamples,
+                                                             double confidenceLevel, vtkDoubleArray* histogram)
+{
+  switch (histogramType)
   {
-    // check Dmin
-    if (UseDoseNormalization == ART_DPH_USEDMIN)
+    case ART_DPH_HISTOGRAM_EXACT:
+      return accumulator->GetExactHistogram(histogram, numberOfResamples, confidenceLevel);
+    case ART_DPH_HISTOGRAM_DOSE_AXIS:
     {
-      if (maxDose < planArray->GetComponent(i, 3))
+      if (doseAxisValues.empty())
       {
-        maxDose = planArray->GetComponent(i, 3);
+        vtkGenericWarningMacro("GetDPHCurve: No doses are given for the dose axis!");
+        return -1;
       }
-    }
-    else if (UseDoseNormalization == ART_DPH_USED98)
-    {
-      if (maxDose < planArray->GetComponent(i, 4))
+      vtkSmartPointer<vtkDoubleArray> doseAxis = vtkSmartPointer<vtkDoubleArray>::New();
+      doseAxis->SetNumberOfTuples(doseAxisValues.size());
+      for (unsigned int doseIndex = 0; doseIndex < doseAxisValues.size(); doseIndex++)
       {
-        maxDose = planArray->GetComponent(i, 4);
+        doseAxis->SetValue(doseIndex, doseAxisValues[doseIndex]);
       }
+      return accumulator->GetHistogramAtDoses(doseAxis, histogram, numberOfResamples, confidenceLevel);
     }
+    default:
+      return accumulator->GetHistogramWithBootstrapBands(histogram, numberOfResamples, confidenceLevel);
   }
+}
 
-  // Compute statistics
-  std::vector<int> DPHBins;
-  int numberBins = 100;
-  DPHBins.resize(numberBins);
-  if (UseDoseNormalization == ART_DPH_USEDMIN)
+//---------------------------------------------------------------------------
+/// Plans of a DPH batch, shared by the batch threads
+struct vtkSlicerDosePopulationHistogramBatchData
+{
+  std::vector<vtkDosePopulationHistogramAccumulator*> Accumulators;
+  std::vector<vtkDoubleArray*> TrialArrays;
+  std::vector<vtkDoubleArray*> Histograms;
+  std::vector<int> Results;
+  int HistogramType;
+  std::vector<double> DoseAxisValues;
+  int NumberOfResamples;
+  double ConfidenceLevel;
+};
+
+//---------------------------------------------------------------------------
+static VTK_THREAD_RETURN_TYPE vtkSlicerDosePopulationHistogramBatchThread(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* threadInfo = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  vtkSlicerDosePopulationHistogramBatchData* data = static_cast<vtkSlicerDosePopulationHistogramBatchData*>(threadInfo->UserData);
+
+  // Plans are interleaved over the threads, so plans with many trials next to each other are spread
+  for (size_t planIndex = threadInfo->ThreadID; planIndex < data->Accumulators.size(); planIndex += threadInfo->NumberOfThreads)
   {
-    if (minDose > 0.01)
+    vtkDosePopulationHistogramAccumulator* accumulator = data->Accumulators[planIndex];
+    vtkDoubleArray* trialArray = data->TrialArrays[planIndex];
+    for (vtkIdType trialIndex = 0; trialIndex < trialArray->GetNumberOfTuples(); trialIndex++)
     {
-      this->StepSize = 1.0;
-      doseNormalizationFactor = 100.0/minDose;
+      accumulator->AddTrial(trialArray->GetComponent(trialIndex, 3), trialArray->GetComponent(trialIndex, 4));
     }
-    for (int i=0; i<numberTotal; i++)
+    data->Results[planIndex] = vtkSlicerDosePopulationHistogramModuleLogic::GetDPHCurve(accumulator, data->HistogramType, data->DoseAxisValues,
+      data->NumberOfResamples, data->ConfidenceLevel, data->Histograms[planIndex]);
+  }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDosePopulationHistogramModuleLogic::ComputeDPHBatch(vtkCollection* trialArrayNodes, vtkCollection* doseVolumeNodes,
+                                                                 vtkCollection* contourNodes, vtkCollection* outputHistograms)
+{
+  if ( !trialArrayNodes || !doseVolumeNodes || !contourNodes || !outputHistograms || !this->DosePopulationHistogramNode
+    || doseVolumeNodes->GetNumberOfItems() != trialArrayNodes->GetNumberOfItems()
+    || contourNodes->GetNumberOfItems() != trialArrayNodes->GetNumberOfItems() )
+  {
+    vtkErrorMacro("ComputeDPHBatch: Invalid inputs, the collections must have the same number of items and the parameter set node must exist!");
+    return -1;
+  }
+
+  // Binning and trials of every plan. The nominal statistics are cached, so a dose and contour pair repeated
+  // over the plans is only computed once. This runs in the calling thread as it uses the VTK pipeline and
+  // reads the trial stores.
+  vtkSlicerDosePopulationHistogramBatchData data;
+  int numberOfPlans = trialArrayNodes->GetNumberOfItems();
+  std::vector< vtkSmartPointer<vtkDosePopulationHistogramAccumulator> > accumulators(numberOfPlans);
+  std::vector< vtkSmartPointer<vtkDoubleArray> > trialArrays(numberOfPlans);
+  std::vector< vtkSmartPointer<vtkDoubleArray> > histograms(numberOfPlans);
+  for (int planIndex = 0; planIndex < numberOfPlans; planIndex++)
+  {
+    vtkMRMLMotionSimulatorDoubleArrayNode* trialArrayNode = vtkMRMLMotionSimulatorDoubleArrayNode::SafeDownCast(trialArrayNodes->GetItemAsObject(planIndex));
+    vtkMRMLScalarVolumeNode* doseVolumeNode = vtkMRMLScalarVolumeNode::SafeDownCast(doseVolumeNodes->GetItemAsObject(planIndex));
+    vtkMRMLScalarVolumeNode* contourNode = vtkMRMLScalarVolumeNode::SafeDownCast(contourNodes->GetItemAsObject(planIndex));
+    trialArrays[planIndex] = vtkSmartPointer<vtkDoubleArray>::New();
+    if (!trialArrayNode || trialArrayNode->GetTuples(0, trialArrayNode->GetSize(), trialArrays[planIndex]) != 0)
     {
-      // fill bins
-      int binIndex = (int)(planArray->GetComponent(i, 3)*doseNormalizationFactor/this->StepSize);
-      if (binIndex+1>numberBins)
-      {
-        numberBins = binIndex+1;
-        DPHBins.resize(numberBins);
-      }
-      DPHBins[binIndex]++;
+      vtkErrorMacro("ComputeDPHBatch: Invalid trial array node for plan " << planIndex << "!");
+      return -1;
     }
+
+    accumulators[planIndex] = vtkSmartPointer<vtkDosePopulationHistogramAccumulator>::New();
+    if (this->InitializeDPHAccumulator(doseVolumeNode, contourNode, accumulators[planIndex]) != 0)
+    {
+      vtkErrorMacro("ComputeDPHBatch: Failed to set up the histogram of plan " << planIndex << "!");
+      return -1;
+    }
+    // The plans are already computed in parallel
+    accumulators[planIndex]->SetNumberOfThreads(1);
+    histograms[planIndex] = vtkSmartPointer<vtkDoubleArray>::New();
+
+    data.Accumulators.push_back(accumulators[planIndex]);
+    data.TrialArrays.push_back(trialArrays[planIndex]);
+    data.Histograms.push_back(histograms[planIndex]);
+  }
+  data.Results.resize(numberOfPlans, 0);
+  data.HistogramType = this->DosePopulationHistogramNode->GetHistogramType();
+  data.DoseAxisValues = *this->DosePopulationHistogramNode->GetDoseAxisValues();
+  data.NumberOfResamples = this->DosePopulationHistogramNode->GetNumberOfBootstrapResamples();
+  data.ConfidenceLevel = this->DosePopulationHistogramNode->GetBootstrapConfidenceLevel();
+
+  if (numberOfPlans > 0)
+  {
+    vtkSmartPointer<vtkMultiThreader> threader = vtkSmartPointer<vtkMultiThreader>::New();
+    if (threader->GetNumberOfThreads() > numberOfPlans)
+    {
+      threader->SetNumberOfThreads(numberOfPlans);
+    }
+    threader->SetSingleMethod(vtkSlicerDosePopulationHistogramBatchThread, &data);
+    threader->SingleMethodExecute();
+  }
+
+  for (int planIndex = 0; planIndex < numberOfPlans; planIndex++)
+  {
+    if (data.Results[planIndex] != 0)
+    {
+      vtkErrorMacro("ComputeDPHBatch: Failed to compute the population histogram of plan " << planIndex << "!");
+      return -1;
+    }
+    outputHistograms->AddItem(histograms[planIndex]);
+  }
+
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerDosePopulationHistogramModuleLogic::ComputeDPH()
+{
+  if ( !this->GetMRMLScene() || !this->DosePopulationHistogramNode )
+  {
+    return;
+  }
+
+  vtkMRMLMotionSimulatorDoubleArrayNode* doubleArrayNode = this->DosePopulationHistogramNode->GetDoubleArrayNode();
+  vtkMRMLScalarVolumeNode* doseVolumeNode = this->DosePopulationHistogramNode->GetDoseVolumeNode();
+  //vtkMRMLContourNode* contourNode = this->DosePopulationHistogramNode->GetContourNode();
+  vtkMRMLScalarVolumeNode* contourNode = this->DosePopulationHistogramNode->GetContourNode();
+  // Make sure inputs are initialized
+  if (!doseVolumeNode || !contourNode || !doubleArrayNode)
+  {
+    vtkErrorMacro("DosePopulationHistogram: inputs are not initialized!")
+    return ;
   }
-  if (UseDoseNormalization == ART_DPH_USED98)
+
+  // Compute statistics. The trials are only added again if they or their binning changed,
+  // otherwise the sorted trials of the previous call answer the query.
+  vtkSmartPointer<vtkDosePopulationHistogramAccumulator> binning = vtkSmartPointer<vtkDosePopulationHistogramAccumulator>::New();
+  if (this->InitializeDPHAccumulator(binning) != 0)
   {
-    if (D98Dose > 0.01)
+    return;
+  }
+  // Trials of a file backed node are read chunk by chunk, without loading the whole array
+  vtkMotionSimulatorTrialStore* trialStore = doubleArrayNode->GetTrialStore();
+  unsigned long planMTime = std::max(doubleArrayNode->GetMTime(),
+    (trialStore ? trialStore->GetMTime() : doubleArrayNode->GetArray()->GetMTime()));
+  // Trials added by a simulation (see StartDPHAccumulation) are used once they are all the trials of the node.
+  // Until then the simulation may still add trials, so the node is read into another accumulator.
+  vtkDosePopulationHistogramAccumulator* accumulator = this->DPHAccumulator;
+  vtkSmartPointer<vtkDosePopulationHistogramAccumulator> trialArrayAccumulator;
+  if (this->DPHAccumulatorStreaming)
+  {
+    if ( this->DPHAccumulatorTrialArrayNode == doubleArrayNode && this->DPHAccumulator->IsBinningEqual(binning)
+      && this->DPHAccumulator->GetNumberOfTrials() == (vtkIdType)doubleArrayNode->GetSize() )
     {
-      this->StepSize = 1.0;
-      doseNormalizationFactor = 100.0/D98Dose;
+      this->DPHAccumulatorTrialArrayMTime = planMTime;
+      this->DPHAccumulatorStreaming = false;
     }
-    for (int i=0; i<numberTotal; i++)
+    else
     {
-      // fill bins
-      int binIndex = (int)(planArray->GetComponent(i, 4)*doseNormalizationFactor/this->StepSize);
-      if (binIndex+1>numberBins)
+      trialArrayAccumulator = vtkSmartPointer<vtkDosePopulationHistogramAccumulator>::New();
+      accumulator = trialArrayAccumulator;
+    }
+  }
+  if ( accumulator != this->DPHAccumulator || !this->DPHAccumulator->IsBinningEqual(binning)
+    || this->DPHAccumulatorTrialArrayNode != doubleArrayNode || this->DPHAccumulatorTrialArrayMTime != planMTime )
+  {
+    accumulator->CopyBinningParameters(binning);
+    accumulator->RemoveAllTrials();
+    vtkIdType numberTotal = doubleArrayNode->GetSize();
+    vtkIdType chunkSize = (trialStore ? trialStore->GetChunkSize() : numberTotal);
+    vtkSmartPointer<vtkDoubleArray> trialChunk = vtkSmartPointer<vtkDoubleArray>::New();
+    for (vtkIdType start = 0; start < numberTotal; start += chunkSize)
+    {
+      vtkIdType count = std::min(chunkSize, numberTotal - start);
+      if (doubleArrayNode->GetTuples(start, count, trialChunk) != 0)
+      {
+        vtkErrorMacro("ComputeDPH: Failed to read the trials!");
+        if (accumulator == this->DPHAccumulator)
+        {
+          this->DPHAccumulatorTrialArrayNode = NULL;
+        }
+        return;
+      }
+      for (vtkIdType i = 0; i < count; i++)
       {
-        numberBins = binIndex+1;
-        DPHBins.resize(numberBins);
+        accumulator->AddTrial(trialChunk->GetComponent(i, 3), trialChunk->GetComponent(i, 4));
       }
-      DPHBins[binIndex]++;
+    }
+    if (accumulator == this->DPHAccumulator)
+    {
+      this->DPHAccumulatorTrialArrayNode = doubleArrayNode;
+      this->DPHAccumulatorTrialArrayMTime = planMTime;
     }
   }
   
@@ -479,30 +836,28 @@ void vtkSlicerDosePopulationHistogramModuleLogic::ComputeDPH()
 
   outputDoubleArrayNode->SetAttribute(MarginCalculatorCommon::DVH_DVH_IDENTIFIER_ATTRIBUTE_NAME.c_str(), "1");
 
-  vtkDoubleArray* doubleArray = outputDoubleArrayNode->GetArray();
-  bool insertPointAtOrigin=true;
-  doubleArray->SetNumberOfTuples(numberBins + (insertPointAtOrigin?1:0));
-
-  int outputArrayIndex=0;
-
-  if (insertPointAtOrigin)
+  // Components 3 and 4 hold the lower and upper bootstrap band if requested
+  int numberOfBootstrapResamples = this->DosePopulationHistogramNode->GetNumberOfBootstrapResamples();
+  double bootstrapConfidenceLevel = this->DosePopulationHistogramNode->GetBootstrapConfidenceLevel();
+  if (GetDPHCurve(accumulator, this->DosePopulationHistogramNode->GetHistogramType(), *this->DosePopulationHistogramNode->GetDoseAxisValues(),
+    numberOfBootstrapResamples, bootstrapConfidenceLevel, outputDoubleArrayNode->GetArray()) != 0)
   {
-    // Add first fixed point at (0.0, 100%)
-    doubleArray->SetComponent(outputArrayIndex, 0, 0.0);
-    doubleArray->SetComponent(outputArrayIndex, 1, 100.0);
-    doubleArray->SetComponent(outputArrayIndex, 2, 0);
-    ++outputArrayIndex;
+    vtkErrorMacro("ComputeDPH: Failed to compute the population histogram!");
+    return;
   }
-
-  unsigned long numberBelowDose = 0;
-  for (int sampleIndex=0; sampleIndex<numberBins; ++sampleIndex)
+  if (numberOfBootstrapResamples > 0)
+  {
+    std::ostringstream resamplesStream;
+    resamplesStream << numberOfBootstrapResamples;
+    outputDoubleArrayNode->SetAttribute(MarginCalculatorCommon::DPH_BOOTSTRAP_RESAMPLES_ATTRIBUTE_NAME.c_str(), resamplesStream.str().c_str());
+    std::ostringstream confidenceLevelStream;
+    confidenceLevelStream << bootstrapConfidenceLevel;
+    outputDoubleArrayNode->SetAttribute(MarginCalculatorCommon::DPH_BOOTSTRAP_CONFIDENCE_LEVEL_ATTRIBUTE_NAME.c_str(), confidenceLevelStream.str().c_str());
+  }
+  else
   {
-    unsigned long numberInBin = DPHBins[sampleIndex];
-    doubleArray->SetComponent( outputArrayIndex, 0, this->StartValue + sampleIndex * this->StepSize );
-    doubleArray->SetComponent( outputArrayIndex, 1, (1.0-(double)numberBelowDose/(double)numberTotal)*100.0 );
-    doubleArray->SetComponent( outputArrayIndex, 2, 0 );
-    ++outputArrayIndex;
-    numberBelowDose += numberInBin;
+    outputDoubleArrayNode->RemoveAttribute(MarginCalculatorCommon::DPH_BOOTSTRAP_RESAMPLES_ATTRIBUTE_NAME.c_str());
+    outputDoubleArrayNode->RemoveAttribute(MarginCalculatorCommon::DPH_BOOTSTRAP_CONFIDENCE_LEVEL_ATTRIBUTE_NAME.c_str());
   }
 
   this->GetMRMLScene()->AddNode(outputDoubleArrayNode);
@@ -547,8 +902,14 @@ void vtkSlicerDosePopulationHistogramModuleLogic::AddDPHToSelectedChart(const ch
     return;
   }
 
-  // Add array to chart
-  chartNode->AddArray( planName, DPHArrayNodeID );
+  // Add array to chart, decimated if it is too long to plot
+  const char* chartCurveNodeID = this->UpdateChartCurveNode(DPHArrayNode);
+  if (chartCurveNodeID == NULL)
+  {
+    vtkErrorMacro("Error: unable to create chart curve of double array node!");
+    return;
+  }
+  chartNode->AddArray( planName, chartCurveNodeID );
 
   // Set plot color and line style
   const char* color = DPHArrayNode->GetAttribute(MarginCalculatorCommon::DVH_STRUCTURE_COLOR_ATTRIBUTE_NAME.c_str());
@@ -586,6 +947,204 @@ void vtkSlicerDosePopulationHistogramModuleLogic::RemoveDPHFromSelectedChart(con
   chartNode->RemoveArray(planName);
 }
 
+//---------------------------------------------------------------------------
+void vtkSlicerDosePopulationHistogramModuleLogic::UpdateChartLevelOfDetail()
+{
+  if (!this->GetMRMLScene() || !this->DosePopulationHistogramNode)
+  {
+    return;
+  }
+
+  vtkMRMLChartNode* chartNode = this->DosePopulationHistogramNode->GetChartNode();
+  if (!chartNode)
+  {
+    return;
+  }
+
+  // Copy the plot names and array IDs, as the arrays of the chart are replaced below
+  std::vector<std::string> planNames;
+  std::vector<std::string> arrayNodeIDs;
+  vtkStringArray* chartArrayNames = chartNode->GetArrayNames();
+  vtkStringArray* chartArrayNodeIDs = chartNode->GetArrays();
+  for (vtkIdType arrayIndex = 0; arrayIndex < chartArrayNames->GetNumberOfValues(); arrayIndex++)
+  {
+    planNames.push_back(chartArrayNames->GetValue(arrayIndex));
+    arrayNodeIDs.push_back(chartArrayNodeIDs->GetValue(arrayIndex));
+  }
+
+  for (unsigned int arrayIndex = 0; arrayIndex < planNames.size(); arrayIndex++)
+  {
+    vtkMRMLDoubleArrayNode* arrayNode = vtkMRMLDoubleArrayNode::SafeDownCast(
+      this->GetMRMLScene()->GetNodeByID(arrayNodeIDs[arrayIndex].c_str()));
+    if (!arrayNode)
+    {
+      continue;
+    }
+
+    // The chart may show either the DPH node or its chart curve node
+    const char* fullResolutionNodeID = arrayNode->GetAttribute(MarginCalculatorCommon::DPH_FULL_RESOLUTION_NODE_ID_ATTRIBUTE_NAME.c_str());
+    if (fullResolutionNodeID)
+    {
+      arrayNode = vtkMRMLDoubleArrayNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(fullResolutionNodeID));
+    }
+    if (!arrayNode || !arrayNode->GetAttribute(MarginCalculatorCommon::DVH_DVH_IDENTIFIER_ATTRIBUTE_NAME.c_str()))
+    {
+      continue;
+    }
+
+    const char* chartCurveNodeID = this->UpdateChartCurveNode(arrayNode);
+    if (chartCurveNodeID)
+    {
+      chartNode->AddArray(planNames[arrayIndex].c_str(), chartCurveNodeID);
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+const char* vtkSlicerDosePopulationHistogramModuleLogic::UpdateChartCurveNode(vtkMRMLDoubleArrayNode* DPHArrayNode)
+{
+  if (!this->GetMRMLScene() || !this->DosePopulationHistogramNode || !DPHArrayNode || !DPHArrayNode->GetArray())
+  {
+    return NULL;
+  }
+
+  int maximumNumberOfPoints = this->DosePopulationHistogramNode->GetChartMaximumNumberOfPoints();
+  double* doseRange = this->DosePopulationHistogramNode->GetChartDoseRange();
+  bool zoomed = (doseRange[1] > doseRange[0]);
+  if ( !zoomed && (maximumNumberOfPoints <= 0 || DPHArrayNode->GetArray()->GetNumberOfTuples() <= maximumNumberOfPoints) )
+  {
+    return DPHArrayNode->GetID();
+  }
+
+  // Find or create the hidden node holding the displayed curve
+  vtkMRMLDoubleArrayNode* chartCurveNode = NULL;
+  const char* chartCurveNodeID = DPHArrayNode->GetAttribute(MarginCalculatorCommon::DPH_CHART_CURVE_NODE_ID_ATTRIBUTE_NAME.c_str());
+  if (chartCurveNodeID)
+  {
+    chartCurveNode = vtkMRMLDoubleArrayNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(chartCurveNodeID));
+  }
+  if (!chartCurveNode)
+  {
+    vtkSmartPointer<vtkMRMLDoubleArrayNode> newChartCurveNode = vtkSmartPointer<vtkMRMLDoubleArrayNode>::New();
+    std::string chartCurveNodeName = std::string(DPHArrayNode->GetName() ? DPHArrayNode->GetName() : "") + MarginCalculatorCommon::DPH_CHART_CURVE_NODE_NAME_POSTFIX;
+    newChartCurveNode->SetName(this->GetMRMLScene()->GenerateUniqueName(chartCurveNodeName).c_str());
+    newChartCurveNode->HideFromEditorsOn();
+    newChartCurveNode->SetAttribute(MarginCalculatorCommon::DPH_FULL_RESOLUTION_NODE_ID_ATTRIBUTE_NAME.c_str(), DPHArrayNode->GetID());
+    this->GetMRMLScene()->AddNode(newChartCurveNode);
+    DPHArrayNode->SetAttribute(MarginCalculatorCommon::DPH_CHART_CURVE_NODE_ID_ATTRIBUTE_NAME.c_str(), newChartCurveNode->GetID());
+    chartCurveNode = newChartCurveNode;
+  }
+
+  if (DecimateCurve(DPHArrayNode->GetArray(), maximumNumberOfPoints, doseRange[0], doseRange[1], chartCurveNode->GetArray()) != 0)
+  {
+    return NULL;
+  }
+  chartCurveNode->Modified();
+
+  return chartCurveNode->GetID();
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerDosePopulationHistogramModuleLogic::DecimateCurve(vtkDoubleArray* curve, int maximumNumberOfPoints, double doseRangeMin, double doseRangeMax,
+                                                               vtkDoubleArray* decimatedCurve)
+{
+  if (!curve || !decimatedCurve || curve == decimatedCurve || curve->GetNumberOfComponents() < 2)
+  {
+    return -1;
+  }
+
+  // Points within the dose range, extended by one point on each side so the curve reaches the edges.
+  // The dose is not assumed to be sorted, so a single pass collects the visible indices.
+  std::vector<vtkIdType> visible;
+  vtkIdType numberOfTuples = curve->GetNumberOfTuples();
+  bool cropped = (doseRangeMax > doseRangeMin);
+  for (vtkIdType tupleIndex = 0; tupleIndex < numberOfTuples; tupleIndex++)
+  {
+    if (!cropped)
+    {
+      visible.push_back(tupleIndex);
+      continue;
+    }
+    bool inside = ( curve->GetComponent(tupleIndex, 0) >= doseRangeMin && curve->GetComponent(tupleIndex, 0) <= doseRangeMax );
+    bool nextInside = ( tupleIndex + 1 < numberOfTuples
+      && curve->GetComponent(tupleIndex + 1, 0) >= doseRangeMin && curve->GetComponent(tupleIndex + 1, 0) <= doseRangeMax );
+    bool previousInside = ( tupleIndex > 0
+      && curve->GetComponent(tupleIndex - 1, 0) >= doseRangeMin && curve->GetComponent(tupleIndex - 1, 0) <= doseRangeMax );
+    if (inside || nextInside || previousInside)
+    {
+      visible.push_back(tupleIndex);
+    }
+  }
+
+  // Largest-triangle-three-buckets: keep the first and last point, and from each bucket in between the
+  // point forming the largest triangle with the previously kept point and the average of the next bucket
+  std::vector<vtkIdType> selected;
+  int numberOfVisible = (int)visible.size();
+  if (maximumNumberOfPoints <= 0 || numberOfVisible <= maximumNumberOfPoints || maximumNumberOfPoints < 3)
+  {
+    selected = visible;
+  }
+  else
+  {
+    double bucketSize = (double)(numberOfVisible - 2) / (maximumNumberOfPoints - 2);
+    int previous = 0;
+    selected.push_back(visible[0]);
+    for (int bucketIndex = 0; bucketIndex < maximumNumberOfPoints - 2; bucketIndex++)
+    {
+      int bucketStart = (int)(bucketIndex * bucketSize) + 1;
+      int bucketEnd = (int)((bucketIndex + 1) * bucketSize) + 1;
+      int nextBucketEnd = std::min((int)((bucketIndex + 2) * bucketSize) + 1, numberOfVisible);
+
+      double averageDose = 0.0;
+      double averagePopulation = 0.0;
+      for (int nextIndex = bucketEnd; nextIndex < nextBucketEnd; nextIndex++)
+      {
+        averageDose += curve->GetComponent(visible[nextIndex], 0);
+        averagePopulation += curve->GetComponent(visible[nextIndex], 1);
+      }
+      int numberInNextBucket = nextBucketEnd - bucketEnd;
+      if (numberInNextBucket > 0)
+      {
+        averageDose /= numberInNextBucket;
+        averagePopulation /= numberInNextBucket;
+      }
+      else
+      {
+        averageDose = curve->GetComponent(visible[numberOfVisible - 1], 0);
+        averagePopulation = curve->GetComponent(visible[numberOfVisible - 1], 1);
+      }
+
+      double previousDose = curve->GetComponent(visible[previous], 0);
+      double previousPopulation = curve->GetComponent(visible[previous], 1);
+      double largestArea = -1.0;
+      int largestAreaIndex = bucketStart;
+      for (int index = bucketStart; index < bucketEnd; index++)
+      {
+        double area = fabs( (previousDose - averageDose) * (curve->GetComponent(visible[index], 1) - previousPopulation)
+          - (previousDose - curve->GetComponent(visible[index], 0)) * (averagePopulation - previousPopulation) );
+        if (area > largestArea)
+        {
+          largestArea = area;
+          largestAreaIndex = index;
+        }
+      }
+      selected.push_back(visible[largestAreaIndex]);
+      previous = largestAreaIndex;
+    }
+    selected.push_back(visible[numberOfVisible - 1]);
+  }
+
+  decimatedCurve->Initialize();
+  decimatedCurve->SetNumberOfComponents(curve->GetNumberOfComponents());
+  decimatedCurve->SetNumberOfTuples(selected.size());
+  for (unsigned int selectedIndex = 0; selectedIndex < selected.size(); selectedIndex++)
+  {
+    decimatedCurve->SetTuple(selectedIndex, selected[selectedIndex], curve);
+  }
+
+  return 0;
+}
+
 //---------------------------------------------------------------------------
 vtkMRMLChartViewNode* vtkSlicerDosePopulationHistogramModuleLogic::GetChartViewNode()
 {
@@ -35,13 +35,21 @@
 // VTK includes
 #include "vtkImageAccumulate.h"
 
+// VTKSYS includes
+#include <vtksys/hash_map.hxx>
+
 // STD includes
 #include <cstdlib>
+#include <list>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "vtkSlicerDosePopulationHistogramModuleLogicExport.h"
 
 class vtkImageData;
+class vtkDoubleArray;
+class vtkCollection;
 class vtkImageStencilData;
 class vtkMRMLDoubleArrayNode;
 class vtkMRMLScalarVolumeNode;
@@ -49,6 +57,8 @@ class vtkMRMLScalarVolumeNode;
 class vtkMRMLModelNode;
 class vtkMRMLChartViewNode;
 class vtkMRMLDosePopulationHistogramNode;
+class vtkDosePopulationHistogramAccumulator;
+class vtkMRMLMotionSimulatorDoubleArrayNode;
 
 /// \ingroup Slicer_QtModules_ExtensionTemplate
 ///
@@ -71,15 +81,74 @@ public:
   /// Compute DVH for the selected structure set based on the selected dose volume
   void ComputeDPH();
 
+  /// Set up the binning of the accumulator for the dose, contour and dose option of the parameter node
+  /// and remove its trials. Adding the trials of the selected double array node to the accumulator then
+  /// gives the same histogram as ComputeDPH.
+  /// \return 0 on success, -1 on error
+  int InitializeDPHAccumulator(vtkDosePopulationHistogramAccumulator* accumulator);
+
+  /// Set up the binning of the accumulator as InitializeDPHAccumulator, for the given dose and contour
+  /// instead of those of the parameter node
+  int InitializeDPHAccumulator(vtkMRMLScalarVolumeNode* doseVolumeNode, vtkMRMLScalarVolumeNode* contourNode,
+                               vtkDosePopulationHistogramAccumulator* accumulator);
+
+  /// Compute the population histograms of many plans in one call, without creating nodes. The i-th
+  /// plan is given by the i-th item of each collection: its trials (vtkMRMLMotionSimulatorDoubleArrayNode),
+  /// nominal dose and contour (vtkMRMLScalarVolumeNode). The histogram options of the parameter node are
+  /// used. The nominal statistics are computed once per distinct dose and contour pair, the histograms
+  /// in parallel. One new array (with the components of the ComputeDPH output) is added to the output
+  /// collection per plan.
+  /// \return 0 on success, -1 on error
+  int ComputeDPHBatch(vtkCollection* trialArrayNodes, vtkCollection* doseVolumeNodes, vtkCollection* contourNodes,
+                      vtkCollection* outputHistograms);
+
+  /// Get the accumulator of the logic, set up for the parameter node and empty, to add the trials of the given
+  /// double array node to while they are simulated (see vtkSlicerMotionSimulatorModuleLogic::SetDPHAccumulator).
+  /// ComputeDPH then uses these trials instead of reading the node, once all the trials of the node were added.
+  /// \return NULL if the node is not the double array node of the parameter node or on error
+  vtkDosePopulationHistogramAccumulator* StartDPHAccumulation(vtkMRMLMotionSimulatorDoubleArrayNode* trialArrayNode);
+
+  /// Write the population curve of the accumulated trials of the given type (ART_DPH_HISTOGRAM_*),
+  /// with bootstrap bands if numberOfResamples is positive. Safe to call from several threads on different accumulators.
+  static int GetDPHCurve(vtkDosePopulationHistogramAccumulator* accumulator, int histogramType, const std::vector<double> &doseAxisValues,
+                         int numberOfResamples, double confidenceLevel, vtkDoubleArray* histogram);
+
   /// Add dose volume histogram of a structure (ROI) to the selected chart given its plot name (including table row number) and the corresponding DVH double array node ID
   void AddDPHToSelectedChart(const char* structurePlotName, const char* dvhArrayNodeId);
 
   /// Remove dose volume histogram of a structure from the selected chart
   void RemoveDPHFromSelectedChart(const char* dvhArrayNodeId);
 
-  /// Refreshes DVH double array MRML node vector from the scene
+  /// Regenerate the displayed curves of the selected chart for the current chart point limit and
+  /// dose range of the parameter node. Call after changing either of them.
+  void UpdateChartLevelOfDetail();
+
+  /// Select at most maximumNumberOfPoints tuples of the curve (dose in component 0, population in
+  /// component 1) with the largest-triangle-three-buckets method, which keeps the visual shape
+  /// including steps and extremes. Only the points within the dose range (and their neighbors at the
+  /// edges) are kept if doseRangeMax is larger than doseRangeMin. All components of the selected tuples
+  /// are copied to the output.
+  /// \return 0 on success, -1 on error
+  static int DecimateCurve(vtkDoubleArray* curve, int maximumNumberOfPoints, double doseRangeMin, double doseRangeMax,
+                           vtkDoubleArray* decimatedCurve);
+
+  /// Refreshes DVH double array MRML node vector of the parameter node from the DPH arrays of the scene.
+  /// The arrays are registered from the scene and node events, the scene is not searched.
   void RefreshDPHDoubleArrayNodesFromScene();
 
+  /// Get the minimum and D98 dose of the nominal plan within the structure. The statistics are cached
+  /// per dose and contour node and only recomputed when the image of either of them is replaced or modified.
+  /// The cache keeps the most recently used pairs, the pairs of a node are dropped when it leaves the scene.
+  /// \return 0 on success, -1 on error
+  int GetNominalPlanStatistics(vtkMRMLScalarVolumeNode* doseVolumeNode, vtkMRMLScalarVolumeNode* contourNode, double &minDose, double &d98Dose);
+
+  /// Remove all cached nominal plan statistics
+  void ClearNominalStatisticsCache();
+
+  /// Number of nominal plan statistics answered from the cache and computed since the last ClearNominalStatisticsCache
+  vtkGetMacro(NominalStatisticsCacheHits, int);
+  vtkGetMacro(NominalStatisticsCacheMisses, int);
+
 public:
   void SetAndObserveDosePopulationHistogramNode(vtkMRMLDosePopulationHistogramNode* node);
   vtkGetObjectMacro(DosePopulationHistogramNode, vtkMRMLDosePopulationHistogramNode);
@@ -104,6 +173,11 @@ protected:
   virtual void OnMRMLSceneNodeRemoved(vtkMRMLNode* node);
   virtual void OnMRMLSceneEndImport();
   virtual void OnMRMLSceneEndClose();
+  virtual void ProcessMRMLNodesEvents(vtkObject* caller, unsigned long event, void* callData);
+
+  /// Register the double array node as a DPH array if it is in the scene and has the DPH identifier
+  /// attribute, unregister it otherwise. The parameter node is updated accordingly.
+  void UpdateDPHDoubleArrayNodeRegistry(vtkMRMLDoubleArrayNode* node, bool inScene);
 
   ///
   void GetStencilForContour( vtkMRMLScalarVolumeNode* volumeNode,
@@ -115,6 +189,11 @@ protected:
   /// Return the chart view node object from the layout
   vtkMRMLChartViewNode* GetChartViewNode();
 
+  /// Return the ID of the array node to show in the chart for a DPH array node: the DPH node itself if
+  /// it is short enough and the chart is not zoomed, otherwise its hidden chart curve node, which is
+  /// created if needed and filled with the decimated curve
+  const char* UpdateChartCurveNode(vtkMRMLDoubleArrayNode* DPHArrayNode);
+
 protected:
   /// Parameter set MRML node
   vtkMRMLDosePopulationHistogramNode* DosePopulationHistogramNode;
@@ -125,6 +204,40 @@ protected:
   /// Step size for the dose axis of the DVH table
   double StepSize;
 
+  /// Nominal plan statistics of a dose and contour node pair. The images are only used to check that
+  /// the statistics still belong to the images of the nodes (together with their modification times),
+  /// they are not referenced.
+  struct NominalStatisticsCacheEntry
+  {
+    std::string DoseVolumeNodeID;
+    std::string ContourNodeID;
+    vtkImageData* DoseImageData;
+    unsigned long DoseImageDataMTime;
+    vtkImageData* ContourImageData;
+    unsigned long ContourImageDataMTime;
+    double MinDose;
+    double D98Dose;
+  };
+
+  /// Trials of the last ComputeDPH (or of a simulation, see StartDPHAccumulation), sorted, so another curve of the same trials is a query only
+  vtkDosePopulationHistogramAccumulator* DPHAccumulator;
+
+  /// Trial array node added to DPHAccumulator and the modification time of its values
+  vtkMRMLMotionSimulatorDoubleArrayNode* DPHAccumulatorTrialArrayNode;
+  unsigned long DPHAccumulatorTrialArrayMTime;
+
+  /// Set by StartDPHAccumulation while the trials of DPHAccumulatorTrialArrayNode are added by a simulation
+  bool DPHAccumulatorStreaming;
+
+  /// DPH identifier attribute of the DPH double array nodes of the scene, by node ID.
+  /// Double array nodes are observed, so setting or removing the attribute updates the registry.
+  vtksys::hash_map<std::string, std::string> DPHDoubleArrayNodeRegistry;
+
+  /// Cached nominal plan statistics, one entry per dose and contour node pair, the most recently used first
+  std::list<NominalStatisticsCacheEntry> NominalStatisticsCache;
+  int NominalStatisticsCacheHits;
+  int NominalStatisticsCacheMisses;
+
 private:
   vtkSlicerDosePopulationHistogramModuleLogic(const vtkSlicerDosePopulationHistogramModuleLogic&); // Not implemented
   void operator=(const vtkSlicerDosePopulationHistogramModuleLogic&);               // Not implemented
@@ -0,0 +1,251 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program,
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// MotionSimulatorDoubleArray includes
+#include "vtkDosePopulationHistogramAccumulator.h"
+
+// VTK includes
+#include <vtkDoubleArray.h>
+#include <vtkMinimalStandardRandomSequence.h>
+#include <vtkNew.h>
+
+// STD includes
+#include <cmath>
+#include <vector>
+
+// Largest accepted difference of two populations in percent
+#define POPULATION_TOLERANCE 1e-9
+
+//-----------------------------------------------------------------------------
+// Percentage of the doses that are at least (or more than) the given dose
+double CountPopulation(const std::vector<double> &doses, double dose, bool strictlyAbove)
+{
+  int numberOfTrials = 0;
+  for (unsigned int trialIndex = 0; trialIndex < doses.size(); trialIndex++)
+  {
+    if (strictlyAbove ? doses[trialIndex] > dose : doses[trialIndex] >= dose)
+    {
+      numberOfTrials++;
+    }
+  }
+  return (doses.empty() ? 0.0 : 100.0 * numberOfTrials / doses.size());
+}
+
+//-----------------------------------------------------------------------------
+// Compare a population with the expected one and report the difference
+bool CheckPopulation(const char* caseName, double dose, double expected, double actual)
+{
+  if (fabs(expected - actual) > POPULATION_TOLERANCE)
+  {
+    std::cerr << caseName << ": population at dose " << dose << " is " << actual << " instead of " << expected << std::endl;
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+int vtkDosePopulationHistogramAccumulatorTest1( int vtkNotUsed(argc), char * vtkNotUsed(argv)[] )
+{
+  // Trials with D98 on a half Gy grid so that many trials share a dose, the minimum dose a bit lower
+  const int numberOfTrials = 500;
+  const double nominalDose = 60.0;
+  vtkNew<vtkMinimalStandardRandomSequence> random;
+  random->SetSeed(1);
+  std::vector<double> minDoses;
+  std::vector<double> d98Doses;
+  for (int trialIndex = 0; trialIndex < numberOfTrials; trialIndex++)
+  {
+    double d98 = floor(random->GetValue() * 2.0 * nominalDose) / 2.0;
+    random->Next();
+    d98Doses.push_back(d98);
+    minDoses.push_back(d98 * (0.8 + 0.2 * random->GetValue()));
+    random->Next();
+  }
+
+  vtkNew<vtkDosePopulationHistogramAccumulator> accumulator;
+  accumulator->SetUseDoseOption(1);
+  accumulator->SetDoseNormalizationFactor(100.0 / nominalDose);
+  accumulator->SetStartValue(0.1);
+  accumulator->SetStepSize(1.0);
+  std::vector<double> normalizedDoses;
+  for (int trialIndex = 0; trialIndex < numberOfTrials; trialIndex++)
+  {
+    accumulator->AddTrial(minDoses[trialIndex], d98Doses[trialIndex]);
+    normalizedDoses.push_back(d98Doses[trialIndex] * accumulator->GetDoseNormalizationFactor());
+  }
+  if (accumulator->GetNumberOfTrials() != numberOfTrials)
+  {
+    std::cerr << "Number of trials is " << accumulator->GetNumberOfTrials() << " instead of " << numberOfTrials << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Binned histogram: the row of a bin gives the population of the trials in that bin or above
+  vtkNew<vtkDoubleArray> histogram;
+  accumulator->GetHistogram(histogram.GetPointer());
+  if (histogram->GetNumberOfComponents() != 3 || histogram->GetNumberOfTuples() < 2
+    || histogram->GetComponent(0, 0) != 0.0 || histogram->GetComponent(0, 1) != 100.0)
+  {
+    std::cerr << "Histogram does not start with the point (0, 100%)" << std::endl;
+    return EXIT_FAILURE;
+  }
+  for (vtkIdType binIndex = 0; binIndex < histogram->GetNumberOfTuples() - 1; binIndex++)
+  {
+    int numberOfTrialsInOrAboveBin = 0;
+    for (int trialIndex = 0; trialIndex < numberOfTrials; trialIndex++)
+    {
+      if ((int)(normalizedDoses[trialIndex] / accumulator->GetStepSize()) >= binIndex)
+      {
+        numberOfTrialsInOrAboveBin++;
+      }
+    }
+    double binDose = histogram->GetComponent(binIndex + 1, 0);
+    if ( fabs(binDose - (accumulator->GetStartValue() + binIndex * accumulator->GetStepSize())) > POPULATION_TOLERANCE
+      || !CheckPopulation("Binned histogram", binDose, 100.0 * numberOfTrialsInOrAboveBin / numberOfTrials, histogram->GetComponent(binIndex + 1, 1)) )
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Exact population at trial doses, between them and outside of their range
+  std::vector<double> queryDoses(normalizedDoses.begin(), normalizedDoses.begin() + 20);
+  queryDoses.push_back(-1.0);
+  queryDoses.push_back(0.0);
+  queryDoses.push_back(33.3);
+  queryDoses.push_back(150.0);
+  for (unsigned int queryIndex = 0; queryIndex < queryDoses.size(); queryIndex++)
+  {
+    double dose = queryDoses[queryIndex];
+    if (!CheckPopulation("GetPopulationAtDose", dose, CountPopulation(normalizedDoses, dose, false), accumulator->GetPopulationAtDose(dose)))
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Population at unsorted doses keeps the order of the doses
+  vtkNew<vtkDoubleArray> doses;
+  for (unsigned int queryIndex = 0; queryIndex < queryDoses.size(); queryIndex++)
+  {
+    doses->InsertNextValue(queryDoses[queryIndex]);
+  }
+  vtkNew<vtkDoubleArray> histogramAtDoses;
+  if (accumulator->GetHistogramAtDoses(doses.GetPointer(), histogramAtDoses.GetPointer(), 0, 0.0) != 0
+    || histogramAtDoses->GetNumberOfTuples() != doses->GetNumberOfTuples())
+  {
+    std::cerr << "GetHistogramAtDoses failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  for (unsigned int queryIndex = 0; queryIndex < queryDoses.size(); queryIndex++)
+  {
+    double dose = queryDoses[queryIndex];
+    if ( histogramAtDoses->GetComponent(queryIndex, 0) != dose
+      || !CheckPopulation("GetHistogramAtDoses", dose, CountPopulation(normalizedDoses, dose, false), histogramAtDoses->GetComponent(queryIndex, 1)) )
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Exact curve: two rows per distinct dose, at least and more than the dose
+  vtkNew<vtkDoubleArray> exactHistogram;
+  if (accumulator->GetExactHistogram(exactHistogram.GetPointer(), 0, 0.0) != 0 || exactHistogram->GetNumberOfTuples() % 2 != 1)
+  {
+    std::cerr << "GetExactHistogram failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  for (vtkIdType stepIndex = 0; stepIndex < exactHistogram->GetNumberOfTuples() / 2; stepIndex++)
+  {
+    double dose = exactHistogram->GetComponent(2*stepIndex+1, 0);
+    if ( (stepIndex > 0 && dose <= exactHistogram->GetComponent(2*stepIndex-1, 0))
+      || !CheckPopulation("Exact histogram", dose, CountPopulation(normalizedDoses, dose, false), exactHistogram->GetComponent(2*stepIndex+1, 1))
+      || !CheckPopulation("Exact histogram above", dose, CountPopulation(normalizedDoses, dose, true), exactHistogram->GetComponent(2*stepIndex+2, 1)) )
+    {
+      std::cerr << "Exact histogram step " << stepIndex << " is wrong" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Bootstrap bands do not depend on the number of threads and stay within [0, 100%]
+  vtkNew<vtkDoubleArray> singleThreadBands;
+  accumulator->SetNumberOfThreads(1);
+  int singleThreadResult = accumulator->GetHistogramWithBootstrapBands(singleThreadBands.GetPointer(), 200, 95.0);
+  vtkNew<vtkDoubleArray> multiThreadBands;
+  accumulator->SetNumberOfThreads(3);
+  int multiThreadResult = accumulator->GetHistogramWithBootstrapBands(multiThreadBands.GetPointer(), 200, 95.0);
+  if ( singleThreadResult != 0 || multiThreadResult != 0 || singleThreadBands->GetNumberOfComponents() != 5
+    || singleThreadBands->GetNumberOfTuples() != multiThreadBands->GetNumberOfTuples() )
+  {
+    std::cerr << "GetHistogramWithBootstrapBands failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  for (vtkIdType rowIndex = 0; rowIndex < singleThreadBands->GetNumberOfTuples(); rowIndex++)
+  {
+    for (int component = 0; component < 5; component++)
+    {
+      if (singleThreadBands->GetComponent(rowIndex, component) != multiThreadBands->GetComponent(rowIndex, component))
+      {
+        std::cerr << "Bootstrap bands of row " << rowIndex << " depend on the number of threads" << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    double lower = singleThreadBands->GetComponent(rowIndex, 3);
+    double upper = singleThreadBands->GetComponent(rowIndex, 4);
+    if (lower < 0.0 || lower > upper || upper > 100.0)
+    {
+      std::cerr << "Bootstrap band of row " << rowIndex << " is [" << lower << ", " << upper << "]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Minimum dose metric with the same binning
+  vtkNew<vtkDosePopulationHistogramAccumulator> minDoseAccumulator;
+  minDoseAccumulator->CopyBinningParameters(accumulator.GetPointer());
+  minDoseAccumulator->SetUseDoseOption(0);
+  if (minDoseAccumulator->IsBinningEqual(accumulator.GetPointer()))
+  {
+    std::cerr << "Accumulators of different metrics have the same binning" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::vector<double> normalizedMinDoses;
+  for (int trialIndex = 0; trialIndex < numberOfTrials; trialIndex++)
+  {
+    minDoseAccumulator->AddTrial(minDoses[trialIndex], d98Doses[trialIndex]);
+    normalizedMinDoses.push_back(minDoses[trialIndex] * minDoseAccumulator->GetDoseNormalizationFactor());
+  }
+  for (unsigned int queryIndex = 0; queryIndex < queryDoses.size(); queryIndex++)
+  {
+    double dose = queryDoses[queryIndex];
+    if (!CheckPopulation("Minimum dose", dose, CountPopulation(normalizedMinDoses, dose, false), minDoseAccumulator->GetPopulationAtDose(dose)))
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Removing the trials keeps the binning
+  accumulator->RemoveAllTrials();
+  if ( accumulator->GetNumberOfTrials() != 0 || accumulator->GetPopulationAtDose(10.0) != 0.0
+    || accumulator->GetDoseNormalizationFactor() != 100.0 / nominalDose )
+  {
+    std::cerr << "RemoveAllTrials did not remove the trials or changed the binning" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,237 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program,
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// DosePopulationHistogram includes
+#include "vtkSlicerDosePopulationHistogramModuleLogic.h"
+#include "vtkMRMLDosePopulationHistogramNode.h"
+
+// MarginCalculator includes
+#include "MarginCalculatorCommon.h"
+
+// MotionSimulatorDoubleArray includes
+#include "vtkDosePopulationHistogramAccumulator.h"
+#include "vtkMRMLMotionSimulatorDoubleArrayNode.h"
+
+// MRML includes
+#include <vtkMRMLDoubleArrayNode.h>
+#include <vtkMRMLScalarVolumeNode.h>
+#include <vtkMRMLScene.h>
+
+// VTK includes
+#include <vtkCollection.h>
+#include <vtkDoubleArray.h>
+#include <vtkImageData.h>
+#include <vtkNew.h>
+
+// STD includes
+#include <cmath>
+
+#define TEST_NUMBER_OF_PLANS 3
+#define TEST_NUMBER_OF_TRIALS 50
+
+//-----------------------------------------------------------------------------
+// Add a volume of a dose ramp along the x axis, and the labelmap of a box in the middle of it
+void CreateSyntheticPlan(vtkMRMLScene* scene, vtkMRMLScalarVolumeNode* doseVolumeNode, vtkMRMLScalarVolumeNode* contourNode)
+{
+  const int dimension = 10;
+  vtkNew<vtkImageData> doseImageData;
+  doseImageData->SetDimensions(dimension, dimension, dimension);
+  vtkNew<vtkImageData> contourImageData;
+  contourImageData->SetDimensions(dimension, dimension, dimension);
+#if (VTK_MAJOR_VERSION <= 5)
+  doseImageData->SetScalarTypeToDouble();
+  doseImageData->AllocateScalars();
+  contourImageData->SetScalarTypeToUnsignedChar();
+  contourImageData->AllocateScalars();
+#else
+  doseImageData->AllocateScalars(VTK_DOUBLE, 1);
+  contourImageData->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+#endif
+  for (int k = 0; k < dimension; k++)
+  {
+    for (int j = 0; j < dimension; j++)
+    {
+      for (int i = 0; i < dimension; i++)
+      {
+        bool inside = (i >= 3 && i < 7 && j >= 3 && j < 7 && k >= 3 && k < 7);
+        doseImageData->SetScalarComponentFromDouble(i, j, k, 0, 40.0 + 2.0 * i);
+        contourImageData->SetScalarComponentFromDouble(i, j, k, 0, inside ? 1.0 : 0.0);
+      }
+    }
+  }
+
+  doseVolumeNode->SetName("Dose");
+  doseVolumeNode->SetAndObserveImageData(doseImageData.GetPointer());
+  scene->AddNode(doseVolumeNode);
+  contourNode->SetName("Structure");
+  contourNode->SetAndObserveImageData(contourImageData.GetPointer());
+  scene->AddNode(contourNode);
+}
+
+//-----------------------------------------------------------------------------
+// Compare the histogram of a plan with the one of an accumulator set up as ComputeDPH does
+bool CheckPlanHistogram(vtkSlicerDosePopulationHistogramModuleLogic* logic, vtkMRMLScalarVolumeNode* doseVolumeNode,
+                        vtkMRMLScalarVolumeNode* contourNode, vtkMRMLMotionSimulatorDoubleArrayNode* trialArrayNode,
+                        int planIndex, vtkDoubleArray* histogram)
+{
+  vtkNew<vtkDosePopulationHistogramAccumulator> accumulator;
+  if (logic->InitializeDPHAccumulator(doseVolumeNode, contourNode, accumulator.GetPointer()) != 0)
+  {
+    std::cerr << "Plan " << planIndex << ": failed to set up the expected histogram" << std::endl;
+    return false;
+  }
+  vtkDoubleArray* trials = trialArrayNode->GetArray();
+  for (vtkIdType trialIndex = 0; trialIndex < trials->GetNumberOfTuples(); trialIndex++)
+  {
+    accumulator->AddTrial(trials->GetComponent(trialIndex, 3), trials->GetComponent(trialIndex, 4));
+  }
+  vtkMRMLDosePopulationHistogramNode* paramNode = logic->GetDosePopulationHistogramNode();
+  vtkNew<vtkDoubleArray> expectedHistogram;
+  if (vtkSlicerDosePopulationHistogramModuleLogic::GetDPHCurve(accumulator.GetPointer(), paramNode->GetHistogramType(),
+    *paramNode->GetDoseAxisValues(), paramNode->GetNumberOfBootstrapResamples(), paramNode->GetBootstrapConfidenceLevel(),
+    expectedHistogram.GetPointer()) != 0)
+  {
+    std::cerr << "Plan " << planIndex << ": failed to compute the expected histogram" << std::endl;
+    return false;
+  }
+
+  if ( histogram->GetNumberOfTuples() != expectedHistogram->GetNumberOfTuples()
+    || histogram->GetNumberOfComponents() != expectedHistogram->GetNumberOfComponents() )
+  {
+    std::cerr << "Plan " << planIndex << ": histogram has " << histogram->GetNumberOfTuples() << " points instead of "
+      << expectedHistogram->GetNumberOfTuples() << std::endl;
+    return false;
+  }
+  for (vtkIdType pointIndex = 0; pointIndex < histogram->GetNumberOfTuples(); pointIndex++)
+  {
+    for (int component = 0; component < histogram->GetNumberOfComponents(); component++)
+    {
+      if (histogram->GetComponent(pointIndex, component) != expectedHistogram->GetComponent(pointIndex, component))
+      {
+        std::cerr << "Plan " << planIndex << ": component " << component << " of point " << pointIndex << " is "
+          << histogram->GetComponent(pointIndex, component) << " instead of " << expectedHistogram->GetComponent(pointIndex, component) << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// DPH arrays are registered in the parameter node when they are added to the scene with the DPH
+// identifier attribute or get it later, and unregistered when they leave the scene
+bool CheckDPHRegistry(vtkMRMLScene* scene, vtkMRMLDosePopulationHistogramNode* paramNode)
+{
+  const char* identifierAttributeName = MarginCalculatorCommon::DVH_DVH_IDENTIFIER_ATTRIBUTE_NAME.c_str();
+  vtkNew<vtkMRMLDoubleArrayNode> dphArrayNode;
+  dphArrayNode->SetAttribute(identifierAttributeName, "1");
+  scene->AddNode(dphArrayNode.GetPointer());
+  vtkNew<vtkMRMLDoubleArrayNode> otherArrayNode;
+  scene->AddNode(otherArrayNode.GetPointer());
+  if (!paramNode->HasDPHDoubleArrayNodeID(dphArrayNode->GetID()) || paramNode->HasDPHDoubleArrayNodeID(otherArrayNode->GetID()))
+  {
+    std::cerr << "Added arrays are not registered by their DPH identifier attribute" << std::endl;
+    return false;
+  }
+
+  otherArrayNode->SetAttribute(identifierAttributeName, "1");
+  if (!paramNode->HasDPHDoubleArrayNodeID(otherArrayNode->GetID()))
+  {
+    std::cerr << "Arrays are not registered when they get the DPH identifier attribute" << std::endl;
+    return false;
+  }
+
+  scene->RemoveNode(otherArrayNode.GetPointer());
+  scene->RemoveNode(dphArrayNode.GetPointer());
+  if (paramNode->GetDPHDoubleArrayNodeIDs()->size() != 0)
+  {
+    std::cerr << "Removed arrays are still registered" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// The histograms of a batch of plans sharing a dose and contour must be those of the plans computed one by one,
+// with the nominal statistics computed once
+int vtkSlicerDosePopulationHistogramModuleLogicTest1( int vtkNotUsed(argc), char * vtkNotUsed(argv)[] )
+{
+  vtkNew<vtkMRMLScene> scene;
+  vtkNew<vtkMRMLScalarVolumeNode> doseVolumeNode;
+  vtkNew<vtkMRMLScalarVolumeNode> contourNode;
+  CreateSyntheticPlan(scene.GetPointer(), doseVolumeNode.GetPointer(), contourNode.GetPointer());
+
+  vtkNew<vtkSlicerDosePopulationHistogramModuleLogic> logic;
+  logic->SetMRMLScene(scene.GetPointer());
+  vtkNew<vtkMRMLDosePopulationHistogramNode> paramNode;
+  paramNode->SetUseDoseOptionToD98();
+  scene->AddNode(paramNode.GetPointer());
+  logic->SetAndObserveDosePopulationHistogramNode(paramNode.GetPointer());
+
+  if (!CheckDPHRegistry(scene.GetPointer(), paramNode.GetPointer()))
+  {
+    return EXIT_FAILURE;
+  }
+
+  vtkNew<vtkCollection> trialArrayNodes;
+  vtkNew<vtkCollection> doseVolumeNodes;
+  vtkNew<vtkCollection> contourNodes;
+  for (int planIndex = 0; planIndex < TEST_NUMBER_OF_PLANS; planIndex++)
+  {
+    vtkNew<vtkMRMLMotionSimulatorDoubleArrayNode> trialArrayNode;
+    for (int trialIndex = 0; trialIndex < TEST_NUMBER_OF_TRIALS; trialIndex++)
+    {
+      double d98Dose = 40.0 + fmod(7.3 * trialIndex + 3.1 * planIndex, 16.0);
+      trialArrayNode->AddXYZValue(0.0, 0.0, 0.0, d98Dose - 2.0, d98Dose);
+    }
+    scene->AddNode(trialArrayNode.GetPointer());
+    trialArrayNodes->AddItem(trialArrayNode.GetPointer());
+    doseVolumeNodes->AddItem(doseVolumeNode.GetPointer());
+    contourNodes->AddItem(contourNode.GetPointer());
+  }
+
+  logic->ClearNominalStatisticsCache();
+  vtkNew<vtkCollection> histograms;
+  if (logic->ComputeDPHBatch(trialArrayNodes.GetPointer(), doseVolumeNodes.GetPointer(), contourNodes.GetPointer(), histograms.GetPointer()) != 0
+    || histograms->GetNumberOfItems() != TEST_NUMBER_OF_PLANS)
+  {
+    std::cerr << "Batch computation of the population histograms failed!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (logic->GetNominalStatisticsCacheMisses() != 1)
+  {
+    std::cerr << "Nominal statistics of the shared dose and contour computed " << logic->GetNominalStatisticsCacheMisses() << " times" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  for (int planIndex = 0; planIndex < TEST_NUMBER_OF_PLANS; planIndex++)
+  {
+    if (!CheckPlanHistogram(logic.GetPointer(), doseVolumeNode.GetPointer(), contourNode.GetPointer(),
+      vtkMRMLMotionSimulatorDoubleArrayNode::SafeDownCast(trialArrayNodes->GetItemAsObject(planIndex)), planIndex,
+      vtkDoubleArray::SafeDownCast(histograms->GetItemAsObject(planIndex))))
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
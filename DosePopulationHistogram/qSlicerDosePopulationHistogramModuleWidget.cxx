@@ -241,6 +241,27 @@ void qSlicerDosePopulationHistogramModuleWidget::updateWidgetFromMRML()
     {
       this->chartNodeChanged(d->MRMLNodeComboBox_Chart->currentNode());
     }
+
+    d->spinBox_BootstrapResamples->setValue(paramNode->GetNumberOfBootstrapResamples());
+    d->comboBox_HistogramType->setCurrentIndex(paramNode->GetHistogramType());
+    QStringList doseAxisValues;
+    std::vector<double>* doseAxisValueVector = paramNode->GetDoseAxisValues();
+    for (std::vector<double>::iterator it = doseAxisValueVector->begin(); it != doseAxisValueVector->end(); ++it)
+    {
+      doseAxisValues << QString::number(*it);
+    }
+    d->lineEdit_DoseAxisValues->setText(doseAxisValues.join(", "));
+    d->lineEdit_DoseAxisValues->setEnabled(paramNode->GetHistogramType() == ART_DPH_HISTOGRAM_DOSE_AXIS);
+    d->spinBox_ChartMaximumNumberOfPoints->setValue(paramNode->GetChartMaximumNumberOfPoints());
+    double* chartDoseRange = paramNode->GetChartDoseRange();
+    if (chartDoseRange[1] > chartDoseRange[0])
+    {
+      d->rangeWidget_ChartDoseRange->setValues(chartDoseRange[0], chartDoseRange[1]);
+    }
+    else
+    {
+      d->rangeWidget_ChartDoseRange->setValues(d->rangeWidget_ChartDoseRange->minimum(), d->rangeWidget_ChartDoseRange->maximum());
+    }
   }
 
   this->refreshDPHTable();
@@ -265,6 +286,11 @@ void qSlicerDosePopulationHistogramModuleWidget::setup()
 
   this->connect( d->radioButton_UseDmin, SIGNAL(clicked()), this, SLOT(radioButtonUseDminClicked()));
   this->connect( d->radioButton_UseD98, SIGNAL(clicked()), this, SLOT(radioButtonUseD98Clicked()));
+  this->connect( d->spinBox_BootstrapResamples, SIGNAL(valueChanged(int)), this, SLOT(bootstrapResamplesChanged(int)));
+  this->connect( d->comboBox_HistogramType, SIGNAL(currentIndexChanged(int)), this, SLOT(histogramTypeChanged(int)));
+  this->connect( d->lineEdit_DoseAxisValues, SIGNAL(editingFinished()), this, SLOT(doseAxisValuesEdited()));
+  this->connect( d->spinBox_ChartMaximumNumberOfPoints, SIGNAL(valueChanged(int)), this, SLOT(chartMaximumNumberOfPointsChanged(int)));
+  this->connect( d->rangeWidget_ChartDoseRange, SIGNAL(valuesChanged(double,double)), this, SLOT(chartDoseRangeChanged(double,double)));
 
   this->connect( d->pushButton_ComputeDPH, SIGNAL( clicked() ), this, SLOT( computeDPH() ) );
 
@@ -330,9 +356,19 @@ void qSlicerDosePopulationHistogramModuleWidget::updateChartCheckboxesState()
     it.key()->blockSignals(true); // block signals for the checkboxes so that changing it do not toggle the visibility of the plot
     it.key()->setChecked(false);
 
+    // The chart may show the decimated curve of the DPH instead of the DPH itself
+    std::string DPHArrayNodeID(it.value().second.toLatin1());
+    std::string chartCurveNodeID;
+    vtkMRMLNode* DPHArrayNode = this->mrmlScene()->GetNodeByID(DPHArrayNodeID.c_str());
+    if (DPHArrayNode && DPHArrayNode->GetAttribute(MarginCalculatorCommon::DPH_CHART_CURVE_NODE_ID_ATTRIBUTE_NAME.c_str()))
+    {
+      chartCurveNodeID = DPHArrayNode->GetAttribute(MarginCalculatorCommon::DPH_CHART_CURVE_NODE_ID_ATTRIBUTE_NAME.c_str());
+    }
+
     for (int i=0; i<arraysInSelectedChart->GetNumberOfValues(); ++i)
     {
-      if (arraysInSelectedChart->GetValue(i).compare(it.value().second.toLatin1()) == 0)
+      if ( arraysInSelectedChart->GetValue(i).compare(DPHArrayNodeID) == 0
+        || (!chartCurveNodeID.empty() && arraysInSelectedChart->GetValue(i).compare(chartCurveNodeID) == 0) )
       {
         it.key()->setChecked(true);
         break;
@@ -464,6 +500,110 @@ void qSlicerDosePopulationHistogramModuleWidget::radioButtonUseD98Clicked()
   paramNode->DisableModifiedEventOff();
 }
 
+//-----------------------------------------------------------------------------
+void qSlicerDosePopulationHistogramModuleWidget::bootstrapResamplesChanged(int value)
+{
+  Q_D(qSlicerDosePopulationHistogramModuleWidget);
+
+  vtkMRMLDosePopulationHistogramNode* paramNode = d->logic()->GetDosePopulationHistogramNode();
+  if (!paramNode || !this->mrmlScene())
+  {
+    return;
+  }
+  paramNode->DisableModifiedEventOn();
+  paramNode->SetNumberOfBootstrapResamples(value);
+  paramNode->DisableModifiedEventOff();
+}
+
+//-----------------------------------------------------------------------------
+void qSlicerDosePopulationHistogramModuleWidget::histogramTypeChanged(int index)
+{
+  Q_D(qSlicerDosePopulationHistogramModuleWidget);
+
+  vtkMRMLDosePopulationHistogramNode* paramNode = d->logic()->GetDosePopulationHistogramNode();
+  if (!paramNode || !this->mrmlScene())
+  {
+    return;
+  }
+  paramNode->DisableModifiedEventOn();
+  paramNode->SetHistogramType(index);
+  paramNode->DisableModifiedEventOff();
+
+  d->lineEdit_DoseAxisValues->setEnabled(index == ART_DPH_HISTOGRAM_DOSE_AXIS);
+}
+
+//-----------------------------------------------------------------------------
+void qSlicerDosePopulationHistogramModuleWidget::doseAxisValuesEdited()
+{
+  Q_D(qSlicerDosePopulationHistogramModuleWidget);
+
+  vtkMRMLDosePopulationHistogramNode* paramNode = d->logic()->GetDosePopulationHistogramNode();
+  if (!paramNode || !this->mrmlScene())
+  {
+    return;
+  }
+
+  // Entries that are not numbers are dropped, the line edit shows the values that were kept
+  std::vector<double>* doseAxisValueVector = paramNode->GetDoseAxisValues();
+  doseAxisValueVector->clear();
+  QStringList doseAxisValues;
+  QStringList entries = d->lineEdit_DoseAxisValues->text().split(",", QString::SkipEmptyParts);
+  for (int entryIndex = 0; entryIndex < entries.size(); entryIndex++)
+  {
+    bool valid = false;
+    double value = entries[entryIndex].trimmed().toDouble(&valid);
+    if (valid)
+    {
+      doseAxisValueVector->push_back(value);
+      doseAxisValues << QString::number(value);
+    }
+  }
+  d->lineEdit_DoseAxisValues->setText(doseAxisValues.join(", "));
+}
+
+//-----------------------------------------------------------------------------
+void qSlicerDosePopulationHistogramModuleWidget::chartMaximumNumberOfPointsChanged(int value)
+{
+  Q_D(qSlicerDosePopulationHistogramModuleWidget);
+
+  vtkMRMLDosePopulationHistogramNode* paramNode = d->logic()->GetDosePopulationHistogramNode();
+  if (!paramNode || !this->mrmlScene())
+  {
+    return;
+  }
+  paramNode->DisableModifiedEventOn();
+  paramNode->SetChartMaximumNumberOfPoints(value);
+  paramNode->DisableModifiedEventOff();
+
+  d->logic()->UpdateChartLevelOfDetail();
+}
+
+//-----------------------------------------------------------------------------
+void qSlicerDosePopulationHistogramModuleWidget::chartDoseRangeChanged(double minValue, double maxValue)
+{
+  Q_D(qSlicerDosePopulationHistogramModuleWidget);
+
+  vtkMRMLDosePopulationHistogramNode* paramNode = d->logic()->GetDosePopulationHistogramNode();
+  if (!paramNode || !this->mrmlScene())
+  {
+    return;
+  }
+
+  // The whole slider range means not zoomed, so curves beyond it are not cut off
+  paramNode->DisableModifiedEventOn();
+  if (minValue <= d->rangeWidget_ChartDoseRange->minimum() && maxValue >= d->rangeWidget_ChartDoseRange->maximum())
+  {
+    paramNode->SetChartDoseRange(0.0, 0.0);
+  }
+  else
+  {
+    paramNode->SetChartDoseRange(minValue, maxValue);
+  }
+  paramNode->DisableModifiedEventOff();
+
+  d->logic()->UpdateChartLevelOfDetail();
+}
+
 //-----------------------------------------------------------------------------
 void qSlicerDosePopulationHistogramModuleWidget::chartNodeChanged(vtkMRMLNode* node)
 {
@@ -517,7 +657,7 @@ void qSlicerDosePopulationHistogramModuleWidget::refreshDPHTable()
     return;
   }
 
-  std::vector<std::string>* DPHNodes = paramNode->GetDPHDoubleArrayNodeIDs();
+  const std::vector<std::string>* DPHNodes = paramNode->GetDPHDoubleArrayNodeIDs();
 
   if (DPHNodes->size() < 1)
   {
@@ -534,7 +674,7 @@ void qSlicerDosePopulationHistogramModuleWidget::refreshDPHTable()
   d->tableWidget_ChartStatistics->setRowCount(DPHNodes->size());
 
   // Fill the table
-  std::vector<std::string>::iterator DPHIt;
+  std::vector<std::string>::const_iterator DPHIt;
   int i;
   QList<QString> structureNames;
   for (i=0, DPHIt = DPHNodes->begin(); DPHIt != DPHNodes->end(); ++DPHIt, ++i)
@@ -65,6 +65,11 @@ protected slots:
   void chartNodeChanged(vtkMRMLNode*);
   void radioButtonUseDminClicked();
   void radioButtonUseD98Clicked();
+  void bootstrapResamplesChanged(int value);
+  void histogramTypeChanged(int index);
+  void doseAxisValuesEdited();
+  void chartMaximumNumberOfPointsChanged(int value);
+  void chartDoseRangeChanged(double minValue, double maxValue);
 
   void computeDPH();
   void showInChartCheckStateChanged(int aState);
@@ -0,0 +1,732 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program,
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// MarginCalculator includes
+#include "vtkSlicerMarginCalculatorModuleLogic.h"
+
+// SlicerRT includes
+#include "MarginCalculatorCommon.h"
+#include "vtkSlicerDoseMorphologyModuleLogic.h"
+#include "vtkMRMLDoseMorphologyNode.h"
+#include "vtkSlicerMotionSimulatorModuleLogic.h"
+#include "vtkMRMLMotionSimulatorNode.h"
+#include "vtkSlicerDosePopulationHistogramModuleLogic.h"
+#include "vtkMRMLDosePopulationHistogramNode.h"
+#include "vtkDosePopulationHistogramAccumulator.h"
+
+// MRML includes
+#include <vtkMRMLScalarVolumeNode.h>
+#include <vtkMRMLScene.h>
+
+// VTK includes
+#include <vtkCollection.h>
+#include <vtkCommand.h>
+#include <vtkDoubleArray.h>
+#include <vtkImageData.h>
+#include <vtkMath.h>
+#include <vtkMatrix4x4.h>
+#include <vtkMultiThreader.h>
+#include <vtkObjectFactory.h>
+#include <vtkSmartPointer.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+// Errors below this are simulated with this standard deviation, as the MarginCalculator module does
+#define MARGIN_MIN_ERROR_SD 0.0001
+
+// Histogram element read as the coverage of a sweep point, as the MarginCalculator module does
+#define MARGIN_COVERAGE_HISTOGRAM_INDEX 97
+
+// Margins a scan grows at once, so that the grown doses of a long sweep are not all kept in memory
+#define MARGIN_GROW_BLOCK_SIZE 8
+
+// Coverages of the P90, P95, P99 margins
+#define MARGIN_NUMBER_OF_COVERAGE_LEVELS 3
+static const double MARGIN_COVERAGE_LEVELS[MARGIN_NUMBER_OF_COVERAGE_LEVELS] = {0.90, 0.95, 0.99};
+
+//----------------------------------------------------------------------------
+vtkStandardNewMacro(vtkSlicerMarginCalculatorModuleLogic);
+vtkCxxSetObjectMacro(vtkSlicerMarginCalculatorModuleLogic, InputDoseVolumeNode, vtkMRMLScalarVolumeNode);
+vtkCxxSetObjectMacro(vtkSlicerMarginCalculatorModuleLogic, ReferenceDoseVolumeNode, vtkMRMLScalarVolumeNode);
+vtkCxxSetObjectMacro(vtkSlicerMarginCalculatorModuleLogic, InputContourNode, vtkMRMLScalarVolumeNode);
+
+//----------------------------------------------------------------------------
+vtkSlicerMarginCalculatorModuleLogic::vtkSlicerMarginCalculatorModuleLogic()
+{
+  this->InputDoseVolumeNode = NULL;
+  this->ReferenceDoseVolumeNode = NULL;
+  this->InputContourNode = NULL;
+
+  this->NumberOfSimulations = 100;
+  this->NumberOfFractions = 30;
+  this->SystematicErrorRange = 0.0;
+  this->RandomErrorRange = 0.0;
+  this->DoseGrowRange = 0.0;
+  this->ROIRadius[0] = 1.0;
+  this->ROIRadius[1] = 1.0;
+  this->ROIRadius[2] = 1.0;
+  this->DoseGrowOperation = SLICERRT_EXPAND_BY_DILATION;
+  this->DilationMethod = SLICERRT_DILATION_RESAMPLED;
+  this->DosePrecision = MARGINCALCULATOR_DOSE_PRECISION_DOUBLE;
+  this->NumberOfThreads = 0;
+  this->MarginSearch = false;
+  this->MarginSearchNoiseTolerance = 0.0;
+  this->CommonRandomNumbers = true;
+  this->RandomSeed = 1;
+  this->NumberOfEvaluatedPoints = 0;
+
+  this->DoseMorphologyLogic = vtkSlicerDoseMorphologyModuleLogic::New();
+  this->MotionSimulatorLogic = vtkSlicerMotionSimulatorModuleLogic::New();
+  this->DosePopulationHistogramLogic = vtkSlicerDosePopulationHistogramModuleLogic::New();
+  this->DosePopulationHistogramNode = vtkMRMLDosePopulationHistogramNode::New();
+  this->DosePopulationHistogramNode->SetUseDoseOptionToD98();
+
+  this->MarginTable = vtkDoubleArray::New();
+  this->MarginTable->SetNumberOfComponents(5);
+}
+
+//----------------------------------------------------------------------------
+vtkSlicerMarginCalculatorModuleLogic::~vtkSlicerMarginCalculatorModuleLogic()
+{
+  this->SetInputDoseVolumeNode(NULL);
+  this->SetReferenceDoseVolumeNode(NULL);
+  this->SetInputContourNode(NULL);
+
+  this->DosePopulationHistogramLogic->SetAndObserveDosePopulationHistogramNode(NULL);
+  this->DoseMorphologyLogic->Delete();
+  this->MotionSimulatorLogic->Delete();
+  this->DosePopulationHistogramLogic->Delete();
+  this->DosePopulationHistogramNode->Delete();
+  this->MarginTable->Delete();
+}
+
+//----------------------------------------------------------------------------
+void vtkSlicerMarginCalculatorModuleLogic::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "NumberOfSimulations: " << this->NumberOfSimulations << "\n";
+  os << indent << "NumberOfFractions: " << this->NumberOfFractions << "\n";
+  os << indent << "SystematicErrorRange: " << this->SystematicErrorRange << "\n";
+  os << indent << "RandomErrorRange: " << this->RandomErrorRange << "\n";
+  os << indent << "DoseGrowRange: " << this->DoseGrowRange << "\n";
+  os << indent << "ROIRadius: " << this->ROIRadius[0] << " " << this->ROIRadius[1] << " " << this->ROIRadius[2] << "\n";
+  os << indent << "DoseGrowOperation: " << this->DoseGrowOperation << "\n";
+  os << indent << "DilationMethod: " << this->DilationMethod << "\n";
+  os << indent << "DosePrecision: " << this->DosePrecision << "\n";
+  os << indent << "NumberOfThreads: " << this->NumberOfThreads << "\n";
+  os << indent << "MarginSearch: " << (this->MarginSearch ? "true" : "false") << "\n";
+  os << indent << "MarginSearchNoiseTolerance: " << this->MarginSearchNoiseTolerance << "\n";
+  os << indent << "CommonRandomNumbers: " << (this->CommonRandomNumbers ? "true" : "false") << "\n";
+  os << indent << "RandomSeed: " << this->RandomSeed << "\n";
+  os << indent << "NumberOfEvaluatedPoints: " << this->NumberOfEvaluatedPoints << "\n";
+  os << indent << "MarginTable: " << this->MarginTable->GetNumberOfTuples() << " rows\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkSlicerMarginCalculatorModuleLogic::SetDoseGrowOperationToDilation()
+{
+  this->SetDoseGrowOperation(SLICERRT_EXPAND_BY_DILATION);
+}
+
+//----------------------------------------------------------------------------
+void vtkSlicerMarginCalculatorModuleLogic::SetDoseGrowOperationToScaling()
+{
+  this->SetDoseGrowOperation(SLICERRT_EXPAND_BY_SCALING);
+}
+
+//----------------------------------------------------------------------------
+void vtkSlicerMarginCalculatorModuleLogic::GetSweepValues(std::vector<double> &systematicErrors, std::vector<double> &randomErrors,
+                                                          std::vector<double> &margins)
+{
+  // Tenths of a millimeter, truncated as the module does
+  systematicErrors.clear();
+  for (int i = 0; i < (int)(this->SystematicErrorRange*10); i += 5)
+  {
+    systematicErrors.push_back(std::max(i/10.0, MARGIN_MIN_ERROR_SD));
+  }
+  randomErrors.clear();
+  for (int j = 0; j < (int)(this->RandomErrorRange*10); j += 5)
+  {
+    randomErrors.push_back(std::max(j/10.0, MARGIN_MIN_ERROR_SD));
+  }
+  margins.clear();
+  for (int k = 0; k < (int)(this->DoseGrowRange*10); k += 2)
+  {
+    margins.push_back(k/10.0);
+  }
+}
+
+//---------------------------------------------------------------------------
+/// Sweep points simulated at once, shared by the sweep threads
+struct vtkSlicerMarginCalculatorSweepData
+{
+  vtkSlicerMotionSimulatorModuleLogic* MotionSimulatorLogic;
+  vtkDoubleArray* StandardErrors;
+
+  /// Per error pair. Every pair has its own copy of the prepared grown dose, pairs without one are skipped.
+  std::vector<vtkSlicerMotionSimulatorModuleLogic::TrialsOfImageInput> GrownDoseInputs;
+  std::vector<vtkMRMLMotionSimulatorNode*> SimulationParameters;
+  std::vector<vtkDoubleArray*> Trials;
+  std::vector<vtkDosePopulationHistogramAccumulator*> Accumulators;
+  std::vector<vtkDoubleArray*> Histograms;
+  std::vector<double> Coverages;
+  std::vector<int> Results;
+};
+
+//---------------------------------------------------------------------------
+static VTK_THREAD_RETURN_TYPE vtkSlicerMarginCalculatorSweepThread(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* threadInfo = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  vtkSlicerMarginCalculatorSweepData* data = static_cast<vtkSlicerMarginCalculatorSweepData*>(threadInfo->UserData);
+
+  for (size_t pairIndex = threadInfo->ThreadID; pairIndex < data->SimulationParameters.size(); pairIndex += threadInfo->NumberOfThreads)
+  {
+    if (!data->GrownDoseInputs[pairIndex].DoseImageData)
+    {
+      data->Results[pairIndex] = 0;
+      continue;
+    }
+
+    // The trials are binned as they are simulated
+    vtkDosePopulationHistogramAccumulator* accumulator = data->Accumulators[pairIndex];
+    accumulator->RemoveAllTrials();
+    if (data->MotionSimulatorLogic->SimulateTrialsOfPreparedImage(data->GrownDoseInputs[pairIndex],
+      data->SimulationParameters[pairIndex], data->Trials[pairIndex], data->StandardErrors, accumulator) != 0)
+    {
+      data->Results[pairIndex] = -1;
+      continue;
+    }
+    accumulator->GetHistogram(data->Histograms[pairIndex]);
+    data->Coverages[pairIndex] = data->Histograms[pairIndex]->GetComponent(MARGIN_COVERAGE_HISTOGRAM_INDEX, 1) / 100.0;
+    data->Results[pairIndex] = 0;
+  }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMarginCalculatorModuleLogic::RunSweep()
+{
+  if ( !this->GetMRMLScene() || !this->InputDoseVolumeNode || !this->InputDoseVolumeNode->GetImageData()
+    || !this->ReferenceDoseVolumeNode || !this->ReferenceDoseVolumeNode->GetImageData()
+    || !this->InputContourNode || !this->InputContourNode->GetImageData() )
+  {
+    vtkErrorMacro("RunSweep: Inputs are not initialized!");
+    return -1;
+  }
+  if (this->NumberOfSimulations <= 0)
+  {
+    vtkErrorMacro("RunSweep: Invalid number of simulations " << this->NumberOfSimulations << "!");
+    return -1;
+  }
+  if ( this->DoseGrowOperation == SLICERRT_EXPAND_BY_SCALING
+    && (this->ROIRadius[0] <= 0.0 || this->ROIRadius[1] <= 0.0 || this->ROIRadius[2] <= 0.0) )
+  {
+    vtkErrorMacro("RunSweep: The structure radii must be positive for scaling!");
+    return -1;
+  }
+
+  this->GetSweepValues(this->SweepSystematicErrors, this->SweepRandomErrors, this->SweepMargins);
+  int numberOfPairs = (int)(this->SweepSystematicErrors.size() * this->SweepRandomErrors.size());
+  int numberOfMargins = (int)this->SweepMargins.size();
+  this->SweepCoverages.assign(numberOfPairs * numberOfMargins, vtkMath::Nan());
+  this->NumberOfEvaluatedPoints = 0;
+
+  // The trial doses are normalized by the nominal D98 of the input dose, as the module computes the histograms
+  if (this->DosePopulationHistogramLogic->GetMRMLScene() != this->GetMRMLScene())
+  {
+    this->DosePopulationHistogramLogic->SetMRMLScene(this->GetMRMLScene());
+  }
+  this->DosePopulationHistogramLogic->SetAndObserveDosePopulationHistogramNode(this->DosePopulationHistogramNode);
+  vtkSmartPointer<vtkDosePopulationHistogramAccumulator> binning = vtkSmartPointer<vtkDosePopulationHistogramAccumulator>::New();
+  if (this->DosePopulationHistogramLogic->InitializeDPHAccumulator(this->InputDoseVolumeNode, this->InputContourNode, binning) != 0)
+  {
+    vtkErrorMacro("RunSweep: Failed to get the nominal statistics of the plan!");
+    return -1;
+  }
+
+  // Everything that only depends on the error pair is set up once for all margins
+  vtkSlicerMarginCalculatorSweepData data;
+  data.MotionSimulatorLogic = this->MotionSimulatorLogic;
+
+  // The same draws for all the sweep points, so that the coverages differ by the errors and margins only
+  vtkSmartPointer<vtkDoubleArray> standardErrors = vtkSmartPointer<vtkDoubleArray>::New();
+  data.StandardErrors = NULL;
+  if (this->CommonRandomNumbers)
+  {
+    vtkSlicerMotionSimulatorModuleLogic::GenerateStandardErrors(this->NumberOfSimulations, this->NumberOfFractions, this->RandomSeed, standardErrors);
+    data.StandardErrors = standardErrors;
+  }
+  std::vector< vtkSmartPointer<vtkMRMLMotionSimulatorNode> > simulationParameters;
+  std::vector< vtkSmartPointer<vtkDoubleArray> > trials;
+  std::vector< vtkSmartPointer<vtkDosePopulationHistogramAccumulator> > accumulators;
+  std::vector< vtkSmartPointer<vtkDoubleArray> > histograms;
+  for (unsigned int systematicErrorIndex = 0; systematicErrorIndex < this->SweepSystematicErrors.size(); systematicErrorIndex++)
+  {
+    for (unsigned int randomErrorIndex = 0; randomErrorIndex < this->SweepRandomErrors.size(); randomErrorIndex++)
+    {
+      double systematicError = this->SweepSystematicErrors[systematicErrorIndex];
+      double randomError = this->SweepRandomErrors[randomErrorIndex];
+      vtkSmartPointer<vtkMRMLMotionSimulatorNode> parameters = vtkSmartPointer<vtkMRMLMotionSimulatorNode>::New();
+      parameters->SetNumberOfSimulation(this->NumberOfSimulations);
+      parameters->SetNumberOfFraction(this->NumberOfFractions);
+      parameters->SetXSysSD(systematicError);
+      parameters->SetYSysSD(systematicError);
+      parameters->SetZSysSD(systematicError);
+      parameters->SetXRdmSD(randomError);
+      parameters->SetYRdmSD(randomError);
+      parameters->SetZRdmSD(randomError);
+      simulationParameters.push_back(parameters);
+      trials.push_back(vtkSmartPointer<vtkDoubleArray>::New());
+      vtkSmartPointer<vtkDosePopulationHistogramAccumulator> accumulator = vtkSmartPointer<vtkDosePopulationHistogramAccumulator>::New();
+      accumulator->CopyBinningParameters(binning);
+      accumulators.push_back(accumulator);
+      histograms.push_back(vtkSmartPointer<vtkDoubleArray>::New());
+
+      data.SimulationParameters.push_back(parameters);
+      data.Trials.push_back(trials.back());
+      data.Accumulators.push_back(accumulator);
+      data.Histograms.push_back(histograms.back());
+    }
+  }
+  data.GrownDoseInputs.resize(numberOfPairs);
+  data.Coverages.resize(numberOfPairs, 0.0);
+  data.Results.resize(numberOfPairs, 0);
+
+  vtkSmartPointer<vtkMultiThreader> threader = vtkSmartPointer<vtkMultiThreader>::New();
+  if (this->NumberOfThreads > 0)
+  {
+    threader->SetNumberOfThreads(this->NumberOfThreads);
+  }
+  if (numberOfPairs > 0 && threader->GetNumberOfThreads() > numberOfPairs)
+  {
+    threader->SetNumberOfThreads(numberOfPairs);
+  }
+  threader->SetSingleMethod(vtkSlicerMarginCalculatorSweepThread, &data);
+
+  if (numberOfPairs == 0 || numberOfMargins == 0)
+  {
+    this->UpdateMarginTable();
+    return 0;
+  }
+
+  if (!this->MarginSearch)
+  {
+    // Each margin is grown and prepared once and simulated for all the error pairs.
+    // The margins are grown a block at a time, each from the dose of the previous margin.
+    std::vector<vtkSlicerMotionSimulatorModuleLogic::TrialsOfImageInput> grownDoseInputs;
+    for (int marginIndex = 0; marginIndex < numberOfMargins; marginIndex++)
+    {
+      int blockMarginIndex = marginIndex % MARGIN_GROW_BLOCK_SIZE;
+      if (blockMarginIndex == 0)
+      {
+        std::vector<double> blockMargins(this->SweepMargins.begin() + marginIndex,
+          this->SweepMargins.begin() + std::min(marginIndex + MARGIN_GROW_BLOCK_SIZE, numberOfMargins));
+        if (this->GrowDoses(blockMargins, grownDoseInputs) != 0)
+        {
+          return -1;
+        }
+      }
+      for (int pairIndex = 0; pairIndex < numberOfPairs; pairIndex++)
+      {
+        vtkSlicerMotionSimulatorModuleLogic::CopyTrialsOfImageInput(grownDoseInputs[blockMarginIndex], data.GrownDoseInputs[pairIndex]);
+      }
+      threader->SingleMethodExecute();
+
+      for (int pairIndex = 0; pairIndex < numberOfPairs; pairIndex++)
+      {
+        if (data.Results[pairIndex] != 0)
+        {
+          vtkErrorMacro("RunSweep: Failed to simulate the margin " << this->SweepMargins[marginIndex] << " mm!");
+          return -1;
+        }
+        this->SweepCoverages[pairIndex * numberOfMargins + marginIndex] = data.Coverages[pairIndex];
+      }
+      this->NumberOfEvaluatedPoints += numberOfPairs;
+
+      double progress = (double)(marginIndex + 1) / numberOfMargins;
+      this->InvokeEvent(vtkCommand::ProgressEvent, &progress);
+    }
+  }
+  else
+  {
+    // Every pair searches its own margins. In each round the pairs ask for one margin each,
+    // the requested margins are grown once and the pairs are simulated together.
+    std::vector<int> previousBracketWidths(numberOfPairs * MARGIN_NUMBER_OF_COVERAGE_LEVELS, 0);
+    std::vector<int> requestedMarginIndices(numberOfPairs, -1);
+    std::vector<vtkSlicerMotionSimulatorModuleLogic::TrialsOfImageInput> grownDoseInputs;
+    while (true)
+    {
+      // Margins requested by the pairs, in increasing order so that dilations grow from each other
+      int numberOfSearchingPairs = 0;
+      std::map<int, int> grownDoseIndices;
+      for (int pairIndex = 0; pairIndex < numberOfPairs; pairIndex++)
+      {
+        requestedMarginIndices[pairIndex] = this->GetNextSearchMarginIndex(pairIndex, previousBracketWidths);
+        data.GrownDoseInputs[pairIndex] = vtkSlicerMotionSimulatorModuleLogic::TrialsOfImageInput();
+        if (requestedMarginIndices[pairIndex] < 0)
+        {
+          continue;
+        }
+        numberOfSearchingPairs++;
+        grownDoseIndices[requestedMarginIndices[pairIndex]] = 0;
+      }
+      if (numberOfSearchingPairs == 0)
+      {
+        break;
+      }
+
+      std::vector<double> requestedMargins;
+      for (std::map<int, int>::iterator grownDoseIt = grownDoseIndices.begin(); grownDoseIt != grownDoseIndices.end(); ++grownDoseIt)
+      {
+        grownDoseIt->second = (int)requestedMargins.size();
+        requestedMargins.push_back(this->SweepMargins[grownDoseIt->first]);
+      }
+      if (this->GrowDoses(requestedMargins, grownDoseInputs) != 0)
+      {
+        return -1;
+      }
+      for (int pairIndex = 0; pairIndex < numberOfPairs; pairIndex++)
+      {
+        if (requestedMarginIndices[pairIndex] >= 0)
+        {
+          vtkSlicerMotionSimulatorModuleLogic::CopyTrialsOfImageInput(grownDoseInputs[grownDoseIndices[requestedMarginIndices[pairIndex]]],
+            data.GrownDoseInputs[pairIndex]);
+        }
+      }
+
+      threader->SingleMethodExecute();
+
+      for (int pairIndex = 0; pairIndex < numberOfPairs; pairIndex++)
+      {
+        if (requestedMarginIndices[pairIndex] < 0)
+        {
+          continue;
+        }
+        if (data.Results[pairIndex] != 0)
+        {
+          vtkErrorMacro("RunSweep: Failed to simulate the margin " << this->SweepMargins[requestedMarginIndices[pairIndex]] << " mm!");
+          return -1;
+        }
+        this->SweepCoverages[pairIndex * numberOfMargins + requestedMarginIndices[pairIndex]] = data.Coverages[pairIndex];
+      }
+      this->NumberOfEvaluatedPoints += numberOfSearchingPairs;
+
+      double progress = (double)(numberOfPairs - numberOfSearchingPairs) / numberOfPairs;
+      this->InvokeEvent(vtkCommand::ProgressEvent, &progress);
+    }
+  }
+
+  this->UpdateMarginTable();
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMarginCalculatorModuleLogic::GrowDoses(const std::vector<double> &margins,
+                                                    std::vector<vtkSlicerMotionSimulatorModuleLogic::TrialsOfImageInput> &grownDoseInputs)
+{
+  grownDoseInputs.clear();
+  grownDoseInputs.resize(margins.size());
+  if (margins.empty())
+  {
+    return 0;
+  }
+
+  vtkSmartPointer<vtkMatrix4x4> inputIJKToRASMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  this->InputDoseVolumeNode->GetIJKToRASMatrix(inputIJKToRASMatrix);
+  int referenceDimensions[3] = {0, 0, 0};
+  this->ReferenceDoseVolumeNode->GetImageData()->GetDimensions(referenceDimensions);
+  double referenceSpacing[3] = {1.0, 1.0, 1.0};
+  this->ReferenceDoseVolumeNode->GetSpacing(referenceSpacing);
+
+  vtkImageData* inputDoseImageData = this->InputDoseVolumeNode->GetImageData();
+  int inputDimensions[3] = {0, 0, 0};
+  inputDoseImageData->GetDimensions(inputDimensions);
+  double doseUnitValue = MarginCalculatorCommon::GetDoseUnitValue(this->InputDoseVolumeNode);
+  bool scalingOnInputGrid = ( this->DoseGrowOperation == SLICERRT_EXPAND_BY_SCALING && inputDimensions[0] == referenceDimensions[0]
+    && inputDimensions[1] == referenceDimensions[1] && inputDimensions[2] == referenceDimensions[2] );
+
+  // Dilation margins, or scaling factors that grow the structure radii by the margins
+  vtkSmartPointer<vtkDoubleArray> sizes = vtkSmartPointer<vtkDoubleArray>::New();
+  sizes->SetNumberOfComponents(3);
+  sizes->SetNumberOfTuples(margins.size());
+  for (size_t marginIndex = 0; marginIndex < margins.size(); marginIndex++)
+  {
+    double size[3] = {margins[marginIndex], margins[marginIndex], margins[marginIndex]};
+    if (this->DoseGrowOperation == SLICERRT_EXPAND_BY_SCALING)
+    {
+      for (int axis = 0; axis < 3; axis++)
+      {
+        size[axis] = (margins[marginIndex] + this->ROIRadius[axis]) / this->ROIRadius[axis];
+      }
+    }
+    sizes->SetTuple(marginIndex, size);
+  }
+
+  vtkSmartPointer<vtkCollection> grownDoseImageDatas = vtkSmartPointer<vtkCollection>::New();
+  if (this->DoseGrowOperation == SLICERRT_EXPAND_BY_DILATION)
+  {
+    // Each margin is dilated from the dose of the previous one by the increment
+    if (this->DoseMorphologyLogic->DilateDoseSequence(inputDoseImageData, inputIJKToRASMatrix, referenceDimensions, referenceSpacing,
+      this->DilationMethod, sizes, this->DosePrecision, doseUnitValue, grownDoseImageDatas) != 0)
+    {
+      vtkErrorMacro("GrowDoses: Failed to dilate the dose by the margins!");
+      return -1;
+    }
+  }
+  else if (!scalingOnInputGrid)
+  {
+    // The scalings share the center of mass and the converted input, and run in parallel
+    vtkSmartPointer<vtkDoubleArray> parameters = vtkSmartPointer<vtkDoubleArray>::New();
+    parameters->SetNumberOfComponents(4);
+    for (size_t marginIndex = 0; marginIndex < margins.size(); marginIndex++)
+    {
+      double* size = sizes->GetTuple3(marginIndex);
+      parameters->InsertNextTuple4(this->DoseGrowOperation, size[0], size[1], size[2]);
+    }
+    if (this->DoseMorphologyLogic->MorphDoseBatch(inputDoseImageData, inputIJKToRASMatrix, referenceDimensions, referenceSpacing,
+      parameters, this->DilationMethod, this->DosePrecision, doseUnitValue, grownDoseImageDatas) != 0)
+    {
+      vtkErrorMacro("GrowDoses: Failed to scale the dose by the margins!");
+      return -1;
+    }
+  }
+
+  for (size_t marginIndex = 0; marginIndex < margins.size(); marginIndex++)
+  {
+    vtkSmartPointer<vtkImageData> grownDoseImageData;
+    vtkSmartPointer<vtkMatrix4x4> grownDoseResliceMatrix;
+    if (scalingOnInputGrid)
+    {
+      // The scaled dose would be the input resampled on its own grid, the trials resample the input directly
+      double* size = sizes->GetTuple3(marginIndex);
+      grownDoseResliceMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+      if (this->DoseMorphologyLogic->GetScalingResliceMatrixOfImage(inputDoseImageData, inputIJKToRASMatrix, size[0], size[1], size[2],
+        grownDoseResliceMatrix) != 0)
+      {
+        vtkErrorMacro("GrowDoses: Failed to scale the dose by " << margins[marginIndex] << " mm!");
+        return -1;
+      }
+      grownDoseImageData = vtkSmartPointer<vtkImageData>::New();
+      grownDoseImageData->ShallowCopy(inputDoseImageData);
+    }
+    else
+    {
+      grownDoseImageData = vtkImageData::SafeDownCast(grownDoseImageDatas->GetItemAsObject(marginIndex));
+    }
+
+    this->MotionSimulatorLogic->SetDoseResliceMatrix(grownDoseResliceMatrix);
+    int result = this->MotionSimulatorLogic->PrepareTrialsOfImage(grownDoseImageData, doseUnitValue, this->InputContourNode->GetImageData(),
+      this->DosePrecision, grownDoseInputs[marginIndex]);
+    this->MotionSimulatorLogic->SetDoseResliceMatrix(NULL);
+    if (result != 0)
+    {
+      vtkErrorMacro("GrowDoses: Failed to prepare the simulation of the dose grown by " << margins[marginIndex] << " mm!");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMarginCalculatorModuleLogic::GetNextSearchMarginIndex(int pairIndex, std::vector<int> &previousBracketWidths)
+{
+  int numberOfMargins = (int)this->SweepMargins.size();
+  const double* coverages = &this->SweepCoverages[pairIndex * numberOfMargins];
+
+  // The ends of the range bracket all the levels
+  if (vtkMath::IsNan(coverages[0]))
+  {
+    return 0;
+  }
+  if (vtkMath::IsNan(coverages[numberOfMargins - 1]))
+  {
+    return numberOfMargins - 1;
+  }
+
+  for (int levelIndex = 0; levelIndex < MARGIN_NUMBER_OF_COVERAGE_LEVELS; levelIndex++)
+  {
+    double level = MARGIN_COVERAGE_LEVELS[levelIndex];
+
+    // Bracket of the crossing: the first evaluated margin reaching the level and the evaluated margin before it
+    int upperIndex = -1;
+    int lowerIndex = -1;
+    for (int marginIndex = 0; marginIndex < numberOfMargins; marginIndex++)
+    {
+      if (vtkMath::IsNan(coverages[marginIndex]))
+      {
+        continue;
+      }
+      if (coverages[marginIndex] >= level)
+      {
+        upperIndex = marginIndex;
+        break;
+      }
+      lowerIndex = marginIndex;
+    }
+    if (upperIndex <= 0 || upperIndex - lowerIndex <= 1)
+    {
+      // Not reached, reached without a margin, or found on the grid
+      continue;
+    }
+
+    // Coverages closer than the noise of the simulated population can not be told apart any more
+    double lowerCoverage = coverages[lowerIndex];
+    double upperCoverage = coverages[upperIndex];
+    double standardError = sqrt(level * (1.0 - level) / this->NumberOfSimulations);
+    if (upperCoverage - lowerCoverage <= this->MarginSearchNoiseTolerance * standardError)
+    {
+      continue;
+    }
+
+    // Secant step while it keeps halving the bracket, bisection otherwise
+    int bracketWidth = upperIndex - lowerIndex;
+    int& previousBracketWidth = previousBracketWidths[pairIndex * MARGIN_NUMBER_OF_COVERAGE_LEVELS + levelIndex];
+    int nextIndex = lowerIndex + bracketWidth / 2;
+    if (previousBracketWidth == 0 || 2 * bracketWidth <= previousBracketWidth)
+    {
+      double fraction = (level - lowerCoverage) / (upperCoverage - lowerCoverage);
+      nextIndex = lowerIndex + (int)floor(fraction * bracketWidth + 0.5);
+      nextIndex = std::max(lowerIndex + 1, std::min(upperIndex - 1, nextIndex));
+    }
+    previousBracketWidth = bracketWidth;
+    return nextIndex;
+  }
+
+  return -1;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMarginCalculatorModuleLogic::UpdateMarginTable()
+{
+  int numberOfMargins = (int)this->SweepMargins.size();
+
+  this->MarginTable->Initialize();
+  this->MarginTable->SetNumberOfComponents(5);
+  this->MarginTable->SetNumberOfTuples(this->SweepSystematicErrors.size() * this->SweepRandomErrors.size());
+  vtkIdType pairIndex = 0;
+  for (unsigned int systematicErrorIndex = 0; systematicErrorIndex < this->SweepSystematicErrors.size(); systematicErrorIndex++)
+  {
+    for (unsigned int randomErrorIndex = 0; randomErrorIndex < this->SweepRandomErrors.size(); randomErrorIndex++, pairIndex++)
+    {
+      double row[5] = { this->SweepSystematicErrors[systematicErrorIndex], this->SweepRandomErrors[randomErrorIndex],
+        vtkMath::Nan(), vtkMath::Nan(), vtkMath::Nan() };
+
+      // A margin is taken where the coverage crosses the level upwards; the last crossing wins, as in the module.
+      // Margins skipped by the search are left out.
+      double previousCoverage = 0.0;
+      for (int marginIndex = 0; marginIndex < numberOfMargins; marginIndex++)
+      {
+        double coverage = this->SweepCoverages[pairIndex * numberOfMargins + marginIndex];
+        if (vtkMath::IsNan(coverage))
+        {
+          continue;
+        }
+        for (int levelIndex = 0; levelIndex < MARGIN_NUMBER_OF_COVERAGE_LEVELS; levelIndex++)
+        {
+          if (previousCoverage < MARGIN_COVERAGE_LEVELS[levelIndex] && coverage >= MARGIN_COVERAGE_LEVELS[levelIndex])
+          {
+            row[2 + levelIndex] = this->SweepMargins[marginIndex];
+          }
+        }
+        previousCoverage = coverage;
+      }
+
+      this->MarginTable->SetTuple(pairIndex, row);
+    }
+  }
+  this->MarginTable->Modified();
+}
+
+//---------------------------------------------------------------------------
+double vtkSlicerMarginCalculatorModuleLogic::GetCoverage(int systematicErrorIndex, int randomErrorIndex, int marginIndex)
+{
+  if ( systematicErrorIndex < 0 || systematicErrorIndex >= (int)this->SweepSystematicErrors.size()
+    || randomErrorIndex < 0 || randomErrorIndex >= (int)this->SweepRandomErrors.size()
+    || marginIndex < 0 || marginIndex >= (int)this->SweepMargins.size() )
+  {
+    return -1.0;
+  }
+  int pairIndex = systematicErrorIndex * (int)this->SweepRandomErrors.size() + randomErrorIndex;
+  return this->SweepCoverages[pairIndex * this->SweepMargins.size() + marginIndex];
+}
+
+//---------------------------------------------------------------------------
+// Write a value as Python prints a float, N/A if it is not a number
+static void vtkSlicerMarginCalculatorWriteValue(std::ostream &stream, double value)
+{
+  if (vtkMath::IsNan(value))
+  {
+    stream << "N/A";
+    return;
+  }
+  std::ostringstream valueStream;
+  valueStream.precision(12);
+  valueStream << value;
+  std::string valueString = valueStream.str();
+  if (valueString.find_first_of(".e") == std::string::npos)
+  {
+    valueString += ".0";
+  }
+  stream << valueString;
+}
+
+//---------------------------------------------------------------------------
+std::string vtkSlicerMarginCalculatorModuleLogic::GetMarginAsCSV()
+{
+  std::ostringstream csv;
+  csv << "Systematic error, Random Error, P90, P95, P99\n";
+  for (vtkIdType rowIndex = 0; rowIndex < this->MarginTable->GetNumberOfTuples(); rowIndex++)
+  {
+    for (int column = 0; column < 5; column++)
+    {
+      vtkSlicerMarginCalculatorWriteValue(csv, this->MarginTable->GetComponent(rowIndex, column));
+      csv << ",";
+    }
+    csv << "\n";
+  }
+  return csv.str();
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMarginCalculatorModuleLogic::SaveMarginCalculation(const char* fileName)
+{
+  if (!fileName)
+  {
+    vtkErrorMacro("SaveMarginCalculation: Invalid file name!");
+    return -1;
+  }
+  std::ofstream file(fileName);
+  if (!file.is_open())
+  {
+    vtkErrorMacro("SaveMarginCalculation: Unable to open " << fileName << " for writing!");
+    return -1;
+  }
+  file << this->GetMarginAsCSV();
+  return file.good() ? 0 : -1;
+}
@@ -0,0 +1,235 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program,
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// .NAME vtkSlicerMarginCalculatorModuleLogic - margin sweep of the margin calculator
+// .SECTION Description
+// Grows the dose of a plan by a series of margins and simulates every margin for a grid of
+// systematic and random setup errors, to find the margins reaching a population coverage.
+// The sweep runs in memory: no nodes are added to the scene.
+
+#ifndef __vtkSlicerMarginCalculatorModuleLogic_h
+#define __vtkSlicerMarginCalculatorModuleLogic_h
+
+// Slicer includes
+#include "vtkSlicerModuleLogic.h"
+
+// SlicerRT includes
+#include "vtkSlicerMotionSimulatorModuleLogic.h"
+
+// STD includes
+#include <string>
+#include <vector>
+
+#include "vtkSlicerMarginCalculatorModuleLogicExport.h"
+
+class vtkDoubleArray;
+class vtkImageData;
+class vtkMRMLScalarVolumeNode;
+class vtkMRMLDosePopulationHistogramNode;
+class vtkSlicerDoseMorphologyModuleLogic;
+class vtkSlicerDosePopulationHistogramModuleLogic;
+
+/// \ingroup Slicer_QtModules_MarginCalculator
+class VTK_SLICER_MARGINCALCULATOR_MODULE_LOGIC_EXPORT vtkSlicerMarginCalculatorModuleLogic :
+  public vtkSlicerModuleLogic
+{
+public:
+
+  static vtkSlicerMarginCalculatorModuleLogic *New();
+  vtkTypeMacro(vtkSlicerMarginCalculatorModuleLogic, vtkSlicerModuleLogic);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  /// Get/Set the dose of the plan that is grown
+  virtual void SetInputDoseVolumeNode(vtkMRMLScalarVolumeNode* node);
+  vtkGetObjectMacro(InputDoseVolumeNode, vtkMRMLScalarVolumeNode);
+
+  /// Get/Set the dose defining the grid of the grown doses
+  virtual void SetReferenceDoseVolumeNode(vtkMRMLScalarVolumeNode* node);
+  vtkGetObjectMacro(ReferenceDoseVolumeNode, vtkMRMLScalarVolumeNode);
+
+  /// Get/Set the structure labelmap, on the grid of the reference dose
+  virtual void SetInputContourNode(vtkMRMLScalarVolumeNode* node);
+  vtkGetObjectMacro(InputContourNode, vtkMRMLScalarVolumeNode);
+
+  /// Get/Set the number of simulated trials per sweep point
+  vtkSetMacro(NumberOfSimulations, int);
+  vtkGetMacro(NumberOfSimulations, int);
+
+  /// Get/Set the number of fractions of a trial
+  vtkSetMacro(NumberOfFractions, int);
+  vtkGetMacro(NumberOfFractions, int);
+
+  /// Get/Set the limit (mm) of the systematic error standard deviations of the sweep.
+  /// The errors go from 0 in steps of 0.5 mm, below the limit.
+  vtkSetMacro(SystematicErrorRange, double);
+  vtkGetMacro(SystematicErrorRange, double);
+
+  /// Get/Set the limit (mm) of the random error standard deviations of the sweep, in steps of 0.5 mm
+  vtkSetMacro(RandomErrorRange, double);
+  vtkGetMacro(RandomErrorRange, double);
+
+  /// Get/Set the limit (mm) of the margins the dose is grown by, in steps of 0.2 mm
+  vtkSetMacro(DoseGrowRange, double);
+  vtkGetMacro(DoseGrowRange, double);
+
+  /// Get/Set the radii (mm) of the structure. Scaling grows the dose by (margin + radius) / radius.
+  vtkSetVector3Macro(ROIRadius, double);
+  vtkGetVector3Macro(ROIRadius, double);
+
+  /// Get/Set how the dose is grown: SLICERRT_EXPAND_BY_DILATION or SLICERRT_EXPAND_BY_SCALING
+  vtkSetMacro(DoseGrowOperation, int);
+  vtkGetMacro(DoseGrowOperation, int);
+  void SetDoseGrowOperationToDilation();
+  void SetDoseGrowOperationToScaling();
+
+  /// Get/Set how the dose is dilated (SLICERRT_DILATION_* in vtkMRMLDoseMorphologyNode.h)
+  vtkSetMacro(DilationMethod, int);
+  vtkGetMacro(DilationMethod, int);
+
+  /// Get/Set the dose representation of the grown doses and the trials (MARGINCALCULATOR_DOSE_PRECISION_* in MarginCalculatorCommon.h)
+  vtkSetMacro(DosePrecision, int);
+  vtkGetMacro(DosePrecision, int);
+
+  /// Get/Set the number of sweep points simulated at once (0: number of processors)
+  vtkSetMacro(NumberOfThreads, int);
+  vtkGetMacro(NumberOfThreads, int);
+
+  /// Get/Set whether the margins of an error pair are searched instead of simulating all of them.
+  /// The coverage grows with the margin, so each level is bracketed by the ends of the margin range
+  /// and narrowed by secant steps, falling back to bisection when a step does not halve the bracket.
+  /// The margins found are on the same 0.2 mm grid as the full sweep. Off by default.
+  vtkSetMacro(MarginSearch, bool);
+  vtkGetMacro(MarginSearch, bool);
+  vtkBooleanMacro(MarginSearch, bool);
+
+  /// Get/Set when the search of a level stops before reaching the grid step: when the coverages at the
+  /// ends of its bracket differ by at most this many standard errors of a coverage simulated with
+  /// NumberOfSimulations trials. The upper end is taken as the margin. 0 (the default) always searches down to
+  /// the grid step, so the margins are those of the full sweep as long as the coverages grow with the margin.
+  vtkSetMacro(MarginSearchNoiseTolerance, double);
+  vtkGetMacro(MarginSearchNoiseTolerance, double);
+
+  /// Get/Set whether all sweep points simulate the same standard normal setup error draws, scaled by
+  /// the error standard deviations of each pair (common random numbers). The coverage differences between
+  /// margins and error pairs then reflect the margins and errors only, not the sampling noise, so the
+  /// coverage curves are smooth and the level crossings stable. On by default.
+  vtkSetMacro(CommonRandomNumbers, bool);
+  vtkGetMacro(CommonRandomNumbers, bool);
+  vtkBooleanMacro(CommonRandomNumbers, bool);
+
+  /// Get/Set the seed of the common random numbers
+  vtkSetMacro(RandomSeed, int);
+  vtkGetMacro(RandomSeed, int);
+
+  /// Get the number of sweep points (error pair and margin) simulated by the last sweep
+  vtkGetMacro(NumberOfEvaluatedPoints, int);
+
+  /// Run the sweep. Every margin is grown once and simulated for all error pairs in parallel.
+  /// With MarginSearch the pairs are searched together in rounds, each round growing the requested margins once.
+  /// The coverage of a sweep point is the population of the trials with a D98 of at least 96% of the
+  /// nominal D98, as element 97 of the dose population histogram. Invokes vtkCommand::ProgressEvent
+  /// after each margin with the completed fraction of the sweep as call data.
+  /// \return 0 on success, -1 on error
+  int RunSweep();
+
+  /// Get the margin table of the last sweep. One tuple per systematic and random error pair (the random error
+  /// changing fastest) with the components systematic error, random error, P90, P95, P99 margin (mm).
+  /// The margin is where the coverage rises to the level (the last such margin if it rises more than once),
+  /// as the MarginCalculator module finds it, NaN if it is not reached.
+  vtkGetObjectMacro(MarginTable, vtkDoubleArray);
+
+  /// Get the coverage (0..1) of a sweep point of the last sweep, NaN if the search skipped it,
+  /// -1 if the indices are out of range
+  double GetCoverage(int systematicErrorIndex, int randomErrorIndex, int marginIndex);
+
+  /// Get the margin table as comma separated values, as MarginCalculatorLogic.marginAsCSV writes it
+  std::string GetMarginAsCSV();
+
+  /// Write the margin table as comma separated values
+  /// \return 0 on success, -1 on error
+  int SaveMarginCalculation(const char* fileName);
+
+protected:
+  vtkSlicerMarginCalculatorModuleLogic();
+  virtual ~vtkSlicerMarginCalculatorModuleLogic();
+
+  /// Errors and margins of the sweep, as the MarginCalculator module steps them
+  void GetSweepValues(std::vector<double> &systematicErrors, std::vector<double> &randomErrors, std::vector<double> &margins);
+
+  /// Grow the input dose by each margin (mm) onto the reference grid and prepare it for the simulation.
+  /// Dilations grow each margin from the dose of the previous one (see vtkSlicerDoseMorphologyModuleLogic::DilateDoseSequence),
+  /// so the margins should increase. Scaling onto the grid of the input dose is not resampled: the input dose is
+  /// simulated through the scaling reslice matrix instead (see vtkSlicerMotionSimulatorModuleLogic::SetDoseResliceMatrix).
+  int GrowDoses(const std::vector<double> &margins, std::vector<vtkSlicerMotionSimulatorModuleLogic::TrialsOfImageInput> &grownDoseInputs);
+
+  /// Get the next margin index the search of an error pair simulates, -1 if all its levels are found.
+  /// The bracket widths of the previous steps (per pair and level) select between secant and bisection.
+  int GetNextSearchMarginIndex(int pairIndex, std::vector<int> &previousBracketWidths);
+
+  /// Find the margin tuples of the table from the coverages of the sweep
+  void UpdateMarginTable();
+
+protected:
+  vtkMRMLScalarVolumeNode* InputDoseVolumeNode;
+  vtkMRMLScalarVolumeNode* ReferenceDoseVolumeNode;
+  vtkMRMLScalarVolumeNode* InputContourNode;
+
+  int NumberOfSimulations;
+  int NumberOfFractions;
+  double SystematicErrorRange;
+  double RandomErrorRange;
+  double DoseGrowRange;
+  double ROIRadius[3];
+  int DoseGrowOperation;
+  int DilationMethod;
+  int DosePrecision;
+  int NumberOfThreads;
+  bool MarginSearch;
+  double MarginSearchNoiseTolerance;
+  bool CommonRandomNumbers;
+  int RandomSeed;
+  int NumberOfEvaluatedPoints;
+
+  /// Logics doing the steps of a sweep point. The morphology logic keeps the scaled doses cached between sweeps.
+  vtkSlicerDoseMorphologyModuleLogic* DoseMorphologyLogic;
+  vtkSlicerMotionSimulatorModuleLogic* MotionSimulatorLogic;
+  vtkSlicerDosePopulationHistogramModuleLogic* DosePopulationHistogramLogic;
+
+  /// Histogram settings of the sweep (D98 normalization), not added to the scene
+  vtkMRMLDosePopulationHistogramNode* DosePopulationHistogramNode;
+
+  /// Errors, margins and coverages (NaN if not simulated) of the last sweep. Coverages are indexed by
+  /// (systematic error index * number of random errors + random error index) * number of margins + margin index
+  std::vector<double> SweepSystematicErrors;
+  std::vector<double> SweepRandomErrors;
+  std::vector<double> SweepMargins;
+  std::vector<double> SweepCoverages;
+
+  /// Result of the last sweep
+  vtkDoubleArray* MarginTable;
+
+private:
+  vtkSlicerMarginCalculatorModuleLogic(const vtkSlicerMarginCalculatorModuleLogic&); // Not implemented
+  void operator=(const vtkSlicerMarginCalculatorModuleLogic&);               // Not implemented
+};
+
+#endif
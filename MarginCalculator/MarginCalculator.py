@@ -424,65 +424,44 @@ class MarginCalculatorLogic:
     return self.__marginResult
 
   def run(self, inputDoseVolumeNode, referenceDoseVolumeNode, inputContourNode, numberOfSimulations, numberOfFractions, systematicErrorRange, randomErrorRange, doseGrowRange, ROIRadiusX, ROIRadiusY, ROIRadiusZ, doseGrowOption):
-    radiusX = ROIRadiusX
-    radiusY = ROIRadiusY
-    radiusZ = ROIRadiusZ
-    systematicErrorRange = int(systematicErrorRange*10)
-    randomErrorRange = int(randomErrorRange*10)
-    doseGrowRange = int(doseGrowRange*10)
+    # The whole sweep runs in the native margin calculator logic, without adding nodes to the scene
+    from vtkSlicerMarginCalculatorModuleLogic import vtkSlicerMarginCalculatorModuleLogic
+    marginCalculatorLogic = vtkSlicerMarginCalculatorModuleLogic()
+    marginCalculatorLogic.SetMRMLScene(slicer.mrmlScene)
+    marginCalculatorLogic.SetInputDoseVolumeNode(inputDoseVolumeNode)
+    marginCalculatorLogic.SetReferenceDoseVolumeNode(referenceDoseVolumeNode)
+    marginCalculatorLogic.SetInputContourNode(inputContourNode)
+    marginCalculatorLogic.SetNumberOfSimulations(numberOfSimulations)
+    marginCalculatorLogic.SetNumberOfFractions(numberOfFractions)
+    marginCalculatorLogic.SetSystematicErrorRange(systematicErrorRange)
+    marginCalculatorLogic.SetRandomErrorRange(randomErrorRange)
+    marginCalculatorLogic.SetDoseGrowRange(doseGrowRange)
+    marginCalculatorLogic.SetROIRadius(ROIRadiusX, ROIRadiusY, ROIRadiusZ)
+    if doseGrowOption == "Dilation":
+      marginCalculatorLogic.SetDoseGrowOperationToDilation()
+    elif doseGrowOption == "Scaling":
+      marginCalculatorLogic.SetDoseGrowOperationToScaling()
+    # Dilation method and dose precision of the Dose Morphology settings in the scene, or their defaults
+    morphologySettings = slicer.mrmlScene.GetNthNodeByClass(0, 'vtkMRMLDoseMorphologyNode')
+    if morphologySettings is None:
+      morphologySettings = slicer.vtkMRMLDoseMorphologyNode()
+    marginCalculatorLogic.SetDilationMethod(morphologySettings.GetDilationMethod())
+    marginCalculatorLogic.SetDosePrecision(morphologySettings.GetDosePrecision())
+    # Only the margins around the P90, P95 and P99 crossings are simulated
+    marginCalculatorLogic.MarginSearchOn()
+
     self.__marginResult = []
-    for i in range(0,systematicErrorRange,5): # systemaic error
-      systemError = i/10.0
-      for j in range(0,randomErrorRange,5): # random error
-        randomError = j/10.0
-        D95old = 0.0
-        D95 = 0.0
-        P90 = 0.0
-        P95 = 0.0
-        P99 = 0.0
-        P90found = 0
-        P95found = 0
-        P99found = 0
-        for k in range(0,doseGrowRange,2): # dose growing
-          if doseGrowOption == "Dilation":
-            doseGrowSizeX = k/10.0
-            doseGrowSizeY = k/10.0
-            doseGrowSizeZ = k/10.0
-          elif doseGrowOption == "Scaling":
-            doseGrowSizeX = (k/10.0 + radiusX)/radiusX
-            doseGrowSizeY = (k/10.0 + radiusY)/radiusY
-            doseGrowSizeZ = (k/10.0 + radiusZ)/radiusZ
-          # print systemError, randomError, doseGrowSizeX, doseGrowSizeY, doseGrowSizeZ
-          # the following code is to fix the random number generator crush using std::tr1 lib for not allowing 0 sigma.
-          if abs(systemError) < 0.0001:
-            systemError = 0.0001
-          if abs(randomError) < 0.0001:
-            randomError = 0.0001
-          D95 = self.computeDPH(inputDoseVolumeNode, referenceDoseVolumeNode, inputContourNode, numberOfSimulations, numberOfFractions, systemError, randomError, doseGrowSizeX, doseGrowSizeY, doseGrowSizeZ, doseGrowOption)
-          #print "D95", D95
-          if D95old < 0.90 and D95 >= 0.90 :
-            #print "inside p90", k
-            P90 = k/10.0
-            P90found = 1
-          if D95old < 0.95 and D95 >= 0.95 :
-            #print "inside p95", k
-            P95 = k/10.0
-            P95found = 1
-          if D95old < 0.99 and D95 >= 0.99 :
-            #print "inside p99", k
-            P99 = k/10.0
-            P99found = 1
-          D95old = D95
-        if P90found == 0:
-          P90 = 'N/A'
-        if P95found == 0:
-          P95 = 'N/A'
-        if P99found == 0:
-          P99 = 'N/A'
-        #print "sys, rad, P90, P95, P99:", systemError, randomError, P90, P95, P99
-        self.__marginResult.append([systemError, randomError, P90, P95, P99])
-        
-  
+    if marginCalculatorLogic.RunSweep() != 0:
+      return
+    marginTable = marginCalculatorLogic.GetMarginTable()
+    for i in range(marginTable.GetNumberOfTuples()):
+      row = [marginTable.GetComponent(i, k) for k in range(5)]
+      # margins that are not reached are NaN
+      for k in range(2, 5):
+        if row[k] != row[k]:
+          row[k] = 'N/A'
+      self.__marginResult.append(row)
+
   def marginAsCSV(self):
     """
     print comma separated value file with header keys in quotes
@@ -503,113 +482,6 @@ class MarginCalculatorLogic:
     fp.write(self.marginAsCSV())
     fp.close()
   
-  def computeDPH(self, inputDoseVolumeNode, referenceDoseVolumeNode, inputContourNode, numberOfSimulations, numberOfFractions, systemError, randomError, doseGrowSizeX, doseGrowSizeY, doseGrowSizeZ, doseGrowOption):
-    # Step 1: morph dose
-    outputDoseVolumeNode = slicer.vtkMRMLScalarVolumeNode()
-    slicer.mrmlScene.AddNode(outputDoseVolumeNode)
-    
-    from vtkSlicerDoseMorphologyModuleLogic import vtkMRMLDoseMorphologyNode
-    doseMorphologyNode = vtkMRMLDoseMorphologyNode()
-    slicer.mrmlScene.AddNode(doseMorphologyNode)
-    
-    doseMorphologyNode.SetAndObserveInputDoseVolumeNode(inputDoseVolumeNode)
-    doseMorphologyNode.SetAndObserveReferenceDoseVolumeNode(referenceDoseVolumeNode)
-    doseMorphologyNode.SetAndObserveOutputDoseVolumeNode(outputDoseVolumeNode)
-    if doseGrowOption == "Dilation":
-      doseMorphologyNode.SetOperationToExpandByDilation()
-    elif doseGrowOption == "Scaling":
-      doseMorphologyNode.SetOperationToExpandByScaling()
-    doseMorphologyNode.SetXSize(doseGrowSizeX)
-    doseMorphologyNode.SetYSize(doseGrowSizeY)
-    doseMorphologyNode.SetZSize(doseGrowSizeZ)
-    
-    doseMorphologyLogic = slicer.modules.dosemorphology.logic()
-    doseMorphologyLogic.SetAndObserveDoseMorphologyNode(doseMorphologyNode)
-    doseMorphologyLogic.MorphDose()
-    
-    # print "finished step1"
-    
-    # Step 2: simulate patient motion
-    # #first convert ribbon model to labelmap
-    # inputContourNode.SetAndObserveRasterizationReferenceVolumeNodeId(referenceDoseVolumeNode.GetID())
-    # inputContourNode.SetRasterizationOversamplingFactor(1.0)
-    # tempLabelmapNode = inputContourNode.GetIndexedLabelmapVolumeNode()
-    
-    from vtkSlicerMotionSimulatorDoubleArrayModuleMRML import vtkMRMLMotionSimulatorDoubleArrayNode
-    motionSimulatorDoubleArrayNode = vtkMRMLMotionSimulatorDoubleArrayNode()
-    slicer.mrmlScene.AddNode(motionSimulatorDoubleArrayNode)
-    
-    from vtkSlicerMotionSimulatorModuleLogic import vtkMRMLMotionSimulatorNode
-    motionSimulatorNode = vtkMRMLMotionSimulatorNode()
-    slicer.mrmlScene.AddNode(motionSimulatorNode)
-    
-    motionSimulatorNode.SetAndObserveInputDoseVolumeNode(outputDoseVolumeNode)
-    motionSimulatorNode.SetAndObserveInputContourNode(inputContourNode)
-    motionSimulatorNode.SetAndObserveOutputDoubleArrayNode(motionSimulatorDoubleArrayNode)
-    motionSimulatorNode.SetNumberOfSimulation(numberOfSimulations)
-    motionSimulatorNode.SetNumberOfFraction(numberOfFractions)
-    motionSimulatorNode.SetXSysSD(systemError)
-    motionSimulatorNode.SetYSysSD(systemError)
-    motionSimulatorNode.SetZSysSD(systemError)
-    motionSimulatorNode.SetXRdmSD(randomError)
-    motionSimulatorNode.SetYRdmSD(randomError)
-    motionSimulatorNode.SetZRdmSD(randomError)
-    
-    motionSimualtorLogic = slicer.modules.motionsimulator.logic()
-    motionSimualtorLogic.SetAndObserveMotionSimulatorNode(motionSimulatorNode)
-    motionSimualtorLogic.RunSimulation()
-    
-    # print "finished step2"
-    
-    # Step 3: dose population histogram
-
-    from vtkSlicerDosePopulationHistogramModuleLogic import vtkMRMLDosePopulationHistogramNode
-    dosePopulationHistogramNode = vtkMRMLDosePopulationHistogramNode()
-    slicer.mrmlScene.AddNode(dosePopulationHistogramNode)
-    
-    outputDoubleArrayNode = slicer.vtkMRMLDoubleArrayNode()
-    slicer.mrmlScene.AddNode(outputDoubleArrayNode)
-    
-    dosePopulationHistogramNode.SetAndObserveDoubleArrayNode(motionSimulatorDoubleArrayNode)
-    dosePopulationHistogramNode.SetAndObserveDoseVolumeNode(inputDoseVolumeNode)
-    dosePopulationHistogramNode.SetAndObserveContourNode(inputContourNode)
-    dosePopulationHistogramNode.SetAndObserveOutputDoubleArrayNode(outputDoubleArrayNode)
-    dosePopulationHistogramNode.SetUseDoseOptionToD98()
-    
-    dosePopulationHistogramLogic = slicer.modules.dosepopulationhistogram.logic()
-    dosePopulationHistogramLogic.SetAndObserveDosePopulationHistogramNode(dosePopulationHistogramNode)
-    dosePopulationHistogramLogic.ComputeDPH()
- 
-    # print "finished step3"
-    
-    arrayNode = outputDoubleArrayNode
-    doubleArray = arrayNode.GetArray()
-    numberOfTuples = doubleArray.GetNumberOfTuples()
-    value = doubleArray.GetComponent(97, 1)
-    
-    # remove all the nodes
-    slicer.mrmlScene.RemoveNode(outputDoseVolumeNode)
-    del outputDoseVolumeNode
-    slicer.mrmlScene.RemoveNode(doseMorphologyNode)
-    del doseMorphologyNode
-    slicer.mrmlScene.RemoveNode(motionSimulatorDoubleArrayNode)
-    del motionSimulatorDoubleArrayNode
-    slicer.mrmlScene.RemoveNode(motionSimulatorNode)
-    del motionSimulatorNode
-    slicer.mrmlScene.RemoveNode(dosePopulationHistogramNode)
-    del dosePopulationHistogramNode
-    slicer.mrmlScene.RemoveNode(outputDoubleArrayNode)
-    del outputDoubleArrayNode
-    
-    return value/100.0
-    """
-    for i in range(0, numberOfTuples):
-      x = doubleArray.GetComponent(i, 0)
-      y = doubleArray.GetComponent(i, 1)
-      value = doubleArray.GetComponent(i, 2)
-      print "x,y,v", x, y, value
-    """
-    
 #
 #
 #
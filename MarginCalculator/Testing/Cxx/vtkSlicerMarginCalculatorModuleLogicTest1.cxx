@@ -0,0 +1,292 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program,
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// MarginCalculator includes
+#include "vtkSlicerMarginCalculatorModuleLogic.h"
+
+// MRML includes
+#include <vtkMRMLScalarVolumeNode.h>
+#include <vtkMRMLScene.h>
+
+// VTK includes
+#include <vtkDoubleArray.h>
+#include <vtkImageData.h>
+#include <vtkMath.h>
+#include <vtkNew.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Sweep of the test: 3 systematic errors, 2 random errors and 5 margins
+#define TEST_SYSTEMATIC_ERROR_RANGE 1.5
+#define TEST_RANDOM_ERROR_RANGE 1.0
+#define TEST_DOSE_GROW_RANGE 1.0
+#define TEST_NUMBER_OF_SYSTEMATIC_ERRORS 3
+#define TEST_NUMBER_OF_RANDOM_ERRORS 2
+#define TEST_NUMBER_OF_MARGINS 5
+
+// Margins of the search test, a range wide enough to search: 15 margins
+#define TEST_SEARCH_DOSE_GROW_RANGE 3.0
+
+// Radius (mm) of the spherical structure, the dose covers it with a plateau that falls off outside
+#define TEST_STRUCTURE_RADIUS 4.0
+
+//-----------------------------------------------------------------------------
+// Add a volume of a spherical dose falling off outside the structure, and the labelmap of the structure
+void CreateSyntheticPlan(vtkMRMLScene* scene, vtkMRMLScalarVolumeNode* doseVolumeNode, vtkMRMLScalarVolumeNode* contourNode)
+{
+  const int dimension = 20;
+  const double center = (dimension - 1) / 2.0;
+  vtkNew<vtkImageData> doseImageData;
+  doseImageData->SetDimensions(dimension, dimension, dimension);
+  vtkNew<vtkImageData> contourImageData;
+  contourImageData->SetDimensions(dimension, dimension, dimension);
+#if (VTK_MAJOR_VERSION <= 5)
+  doseImageData->SetScalarTypeToDouble();
+  doseImageData->AllocateScalars();
+  contourImageData->SetScalarTypeToUnsignedChar();
+  contourImageData->AllocateScalars();
+#else
+  doseImageData->AllocateScalars(VTK_DOUBLE, 1);
+  contourImageData->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+#endif
+  for (int k = 0; k < dimension; k++)
+  {
+    for (int j = 0; j < dimension; j++)
+    {
+      for (int i = 0; i < dimension; i++)
+      {
+        double radius = sqrt((i-center)*(i-center) + (j-center)*(j-center) + (k-center)*(k-center));
+        double dose = 60.0 * std::max(0.0, std::min(1.0, (TEST_STRUCTURE_RADIUS + 4.0 - radius) / 4.0));
+        doseImageData->SetScalarComponentFromDouble(i, j, k, 0, dose);
+        contourImageData->SetScalarComponentFromDouble(i, j, k, 0, radius <= TEST_STRUCTURE_RADIUS ? 1.0 : 0.0);
+      }
+    }
+  }
+
+  doseVolumeNode->SetName("Dose");
+  doseVolumeNode->SetAndObserveImageData(doseImageData.GetPointer());
+  scene->AddNode(doseVolumeNode);
+  contourNode->SetName("Structure");
+  contourNode->SetAndObserveImageData(contourImageData.GetPointer());
+  scene->AddNode(contourNode);
+}
+
+//-----------------------------------------------------------------------------
+// Values are equal, NaN (a level that is not reached) equals NaN
+bool IsSameValue(double value1, double value2)
+{
+  if (vtkMath::IsNan(value1) || vtkMath::IsNan(value2))
+  {
+    return (vtkMath::IsNan(value1) && vtkMath::IsNan(value2));
+  }
+  return (value1 == value2);
+}
+
+//-----------------------------------------------------------------------------
+// Run the sweep and keep its margin table and coverages
+bool RunSweep(vtkSlicerMarginCalculatorModuleLogic* logic, int numberOfThreads, vtkDoubleArray* marginTable, std::vector<double> &coverages)
+{
+  logic->SetNumberOfThreads(numberOfThreads);
+  if (logic->RunSweep() != 0)
+  {
+    std::cerr << "Sweep on " << numberOfThreads << " threads failed" << std::endl;
+    return false;
+  }
+  if (logic->GetNumberOfEvaluatedPoints() != TEST_NUMBER_OF_SYSTEMATIC_ERRORS * TEST_NUMBER_OF_RANDOM_ERRORS * TEST_NUMBER_OF_MARGINS)
+  {
+    std::cerr << "Sweep on " << numberOfThreads << " threads evaluated " << logic->GetNumberOfEvaluatedPoints() << " points" << std::endl;
+    return false;
+  }
+  marginTable->DeepCopy(logic->GetMarginTable());
+
+  coverages.clear();
+  for (int systematicErrorIndex = 0; systematicErrorIndex < TEST_NUMBER_OF_SYSTEMATIC_ERRORS; systematicErrorIndex++)
+  {
+    for (int randomErrorIndex = 0; randomErrorIndex < TEST_NUMBER_OF_RANDOM_ERRORS; randomErrorIndex++)
+    {
+      for (int marginIndex = 0; marginIndex < TEST_NUMBER_OF_MARGINS; marginIndex++)
+      {
+        double coverage = logic->GetCoverage(systematicErrorIndex, randomErrorIndex, marginIndex);
+        if (vtkMath::IsNan(coverage) || coverage < 0.0 || coverage > 1.0)
+        {
+          std::cerr << "Sweep on " << numberOfThreads << " threads has the coverage " << coverage << " at point ("
+            << systematicErrorIndex << ", " << randomErrorIndex << ", " << marginIndex << ")" << std::endl;
+          return false;
+        }
+        coverages.push_back(coverage);
+      }
+    }
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// The sweep on several threads gives the same coverages and margins as on a single thread
+bool CheckThreadedSweep(const char* caseName, vtkSlicerMarginCalculatorModuleLogic* logic)
+{
+  vtkNew<vtkDoubleArray> singleThreadTable;
+  std::vector<double> singleThreadCoverages;
+  vtkNew<vtkDoubleArray> multiThreadTable;
+  std::vector<double> multiThreadCoverages;
+  if ( !RunSweep(logic, 1, singleThreadTable.GetPointer(), singleThreadCoverages)
+    || !RunSweep(logic, 3, multiThreadTable.GetPointer(), multiThreadCoverages) )
+  {
+    std::cerr << caseName << ": sweep failed" << std::endl;
+    return false;
+  }
+
+  for (unsigned int pointIndex = 0; pointIndex < singleThreadCoverages.size(); pointIndex++)
+  {
+    if (singleThreadCoverages[pointIndex] != multiThreadCoverages[pointIndex])
+    {
+      std::cerr << caseName << ": coverage of point " << pointIndex << " is " << multiThreadCoverages[pointIndex]
+        << " on 3 threads and " << singleThreadCoverages[pointIndex] << " on a single thread" << std::endl;
+      return false;
+    }
+  }
+
+  if ( singleThreadTable->GetNumberOfTuples() != TEST_NUMBER_OF_SYSTEMATIC_ERRORS * TEST_NUMBER_OF_RANDOM_ERRORS
+    || multiThreadTable->GetNumberOfTuples() != singleThreadTable->GetNumberOfTuples() )
+  {
+    std::cerr << caseName << ": margin table has " << multiThreadTable->GetNumberOfTuples() << " rows on 3 threads and "
+      << singleThreadTable->GetNumberOfTuples() << " on a single thread" << std::endl;
+    return false;
+  }
+  for (vtkIdType rowIndex = 0; rowIndex < singleThreadTable->GetNumberOfTuples(); rowIndex++)
+  {
+    for (int component = 0; component < singleThreadTable->GetNumberOfComponents(); component++)
+    {
+      if (!IsSameValue(singleThreadTable->GetComponent(rowIndex, component), multiThreadTable->GetComponent(rowIndex, component)))
+      {
+        std::cerr << caseName << ": margin table row " << rowIndex << " depends on the number of threads" << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// The margin search finds the margins of the full sweep with fewer points. The common random numbers make the
+// coverage of a pair grow with the dilation margin, so the crossings of the levels are the same in both.
+bool CheckMarginSearch(vtkSlicerMarginCalculatorModuleLogic* logic)
+{
+  logic->SetDoseGrowRange(TEST_SEARCH_DOSE_GROW_RANGE);
+  logic->SetDoseGrowOperationToDilation();
+
+  logic->MarginSearchOff();
+  if (logic->RunSweep() != 0)
+  {
+    std::cerr << "Full sweep failed" << std::endl;
+    return false;
+  }
+  int numberOfSweepPoints = logic->GetNumberOfEvaluatedPoints();
+  vtkNew<vtkDoubleArray> sweepTable;
+  sweepTable->DeepCopy(logic->GetMarginTable());
+
+  logic->MarginSearchOn();
+  if (logic->RunSweep() != 0)
+  {
+    std::cerr << "Margin search failed" << std::endl;
+    return false;
+  }
+  if (logic->GetNumberOfEvaluatedPoints() > numberOfSweepPoints)
+  {
+    std::cerr << "Margin search evaluated " << logic->GetNumberOfEvaluatedPoints() << " points, the full sweep "
+      << numberOfSweepPoints << std::endl;
+    return false;
+  }
+  vtkDoubleArray* searchTable = logic->GetMarginTable();
+  if (searchTable->GetNumberOfTuples() != sweepTable->GetNumberOfTuples())
+  {
+    std::cerr << "Margin search table has " << searchTable->GetNumberOfTuples() << " rows instead of " << sweepTable->GetNumberOfTuples() << std::endl;
+    return false;
+  }
+  for (vtkIdType rowIndex = 0; rowIndex < sweepTable->GetNumberOfTuples(); rowIndex++)
+  {
+    for (int component = 0; component < sweepTable->GetNumberOfComponents(); component++)
+    {
+      if (!IsSameValue(sweepTable->GetComponent(rowIndex, component), searchTable->GetComponent(rowIndex, component)))
+      {
+        std::cerr << "Margin search table row " << rowIndex << " component " << component << " is " << searchTable->GetComponent(rowIndex, component)
+          << " instead of " << sweepTable->GetComponent(rowIndex, component) << std::endl;
+        return false;
+      }
+    }
+  }
+
+  logic->MarginSearchOff();
+  logic->SetDoseGrowRange(TEST_DOSE_GROW_RANGE);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+int vtkSlicerMarginCalculatorModuleLogicTest1( int vtkNotUsed(argc), char * vtkNotUsed(argv)[] )
+{
+  vtkNew<vtkMRMLScene> scene;
+  vtkNew<vtkMRMLScalarVolumeNode> doseVolumeNode;
+  vtkNew<vtkMRMLScalarVolumeNode> contourNode;
+  CreateSyntheticPlan(scene.GetPointer(), doseVolumeNode.GetPointer(), contourNode.GetPointer());
+
+  vtkNew<vtkSlicerMarginCalculatorModuleLogic> logic;
+  logic->SetMRMLScene(scene.GetPointer());
+  logic->SetInputDoseVolumeNode(doseVolumeNode.GetPointer());
+  logic->SetReferenceDoseVolumeNode(doseVolumeNode.GetPointer());
+  logic->SetInputContourNode(contourNode.GetPointer());
+  logic->SetNumberOfSimulations(20);
+  logic->SetNumberOfFractions(3);
+  logic->SetSystematicErrorRange(TEST_SYSTEMATIC_ERROR_RANGE);
+  logic->SetRandomErrorRange(TEST_RANDOM_ERROR_RANGE);
+  logic->SetDoseGrowRange(TEST_DOSE_GROW_RANGE);
+  logic->SetROIRadius(TEST_STRUCTURE_RADIUS, TEST_STRUCTURE_RADIUS, TEST_STRUCTURE_RADIUS);
+  logic->CommonRandomNumbersOn();
+  logic->SetRandomSeed(1);
+  logic->MarginSearchOff();
+  if (logic->GetMarginSearchNoiseTolerance() != 0.0)
+  {
+    std::cerr << "Margin search stops above the grid step by default" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  logic->SetDoseGrowOperationToDilation();
+  if (!CheckThreadedSweep("Dilation", logic.GetPointer()))
+  {
+    return EXIT_FAILURE;
+  }
+
+  // Scaling on the grid of the input dose is simulated through the reslice matrix
+  logic->SetDoseGrowOperationToScaling();
+  if (!CheckThreadedSweep("Scaling", logic.GetPointer()))
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (!CheckMarginSearch(logic.GetPointer()))
+  {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -8,6 +8,15 @@
 #include <vtkMRMLDisplayNode.h>
 #include <vtkMRMLColorTableNode.h>
 
+// VTK includes
+#include <vtkImageCast.h>
+#include <vtkImageData.h>
+#include <vtkImageShiftScale.h>
+#include <vtkNew.h>
+
+// STD includes
+#include <sstream>
+
 //----------------------------------------------------------------------------
 // Constant strings
 //----------------------------------------------------------------------------
@@ -140,6 +149,18 @@ const std::string MarginCalculatorCommon::PLANARIMAGE_RT_IMAGE_VOLUME_REFERENCE_
 const std::string MarginCalculatorCommon::PLANARIMAGE_DISPLAYED_MODEL_REFERENCE_ROLE = "planarImageDisplayedModel" + MarginCalculatorCommon::SLICERRT_REFERENCE_ROLE_ATTRIBUTE_NAME_POSTFIX; // Reference
 const std::string MarginCalculatorCommon::PLANARIMAGE_TEXTURE_VOLUME_REFERENCE_ROLE = "planarImageTexture" + MarginCalculatorCommon::SLICERRT_REFERENCE_ROLE_ATTRIBUTE_NAME_POSTFIX; // Reference
 
+// MotionSimulator constants
+const std::string MarginCalculatorCommon::MOTIONSIMULATOR_ATTRIBUTE_PREFIX = "MotionSimulator.";
+const std::string MarginCalculatorCommon::MOTIONSIMULATOR_REFINED_TRIAL_FRACTION_ATTRIBUTE_NAME = MarginCalculatorCommon::MOTIONSIMULATOR_ATTRIBUTE_PREFIX + "RefinedTrialFraction";
+
+// DosePopulationHistogram constants
+const std::string MarginCalculatorCommon::DPH_ATTRIBUTE_PREFIX = "DosePopulationHistogram.";
+const std::string MarginCalculatorCommon::DPH_BOOTSTRAP_RESAMPLES_ATTRIBUTE_NAME = MarginCalculatorCommon::DPH_ATTRIBUTE_PREFIX + "BootstrapResamples";
+const std::string MarginCalculatorCommon::DPH_BOOTSTRAP_CONFIDENCE_LEVEL_ATTRIBUTE_NAME = MarginCalculatorCommon::DPH_ATTRIBUTE_PREFIX + "BootstrapConfidenceLevel";
+const std::string MarginCalculatorCommon::DPH_CHART_CURVE_NODE_ID_ATTRIBUTE_NAME = MarginCalculatorCommon::DPH_ATTRIBUTE_PREFIX + "ChartCurveNodeID";
+const std::string MarginCalculatorCommon::DPH_FULL_RESOLUTION_NODE_ID_ATTRIBUTE_NAME = MarginCalculatorCommon::DPH_ATTRIBUTE_PREFIX + "FullResolutionNodeID";
+const std::string MarginCalculatorCommon::DPH_CHART_CURVE_NODE_NAME_POSTFIX = "_Chart";
+
 //----------------------------------------------------------------------------
 // Utility functions
 //----------------------------------------------------------------------------
@@ -164,3 +185,87 @@ bool MarginCalculatorCommon::IsDoseVolumeNode(vtkMRMLNode* node)
   return false;
 }
 
+//---------------------------------------------------------------------------
+double MarginCalculatorCommon::GetDoseUnitValue(vtkMRMLNode* doseVolumeNode)
+{
+  if (!doseVolumeNode)
+  {
+    return 0.0;
+  }
+
+  const char* doseUnitValueChars = doseVolumeNode->GetAttribute(MarginCalculatorCommon::DICOMRTIMPORT_DOSE_UNIT_VALUE_ATTRIBUTE_NAME.c_str());
+  if (!doseUnitValueChars)
+  {
+    return 0.0;
+  }
+
+  std::stringstream ss;
+  ss << doseUnitValueChars;
+  double doseUnitValue = 0.0;
+  ss >> doseUnitValue;
+  return (ss.fail() ? 0.0 : doseUnitValue);
+}
+
+//---------------------------------------------------------------------------
+int MarginCalculatorCommon::ConvertDoseImageData(vtkImageData* doseImageData, int dosePrecision, double doseUnitValue,
+                                                 vtkImageData* convertedImageData, double &doseScale)
+{
+  if (!doseImageData || !convertedImageData)
+  {
+    return -1;
+  }
+
+  doseScale = 1.0;
+  switch (dosePrecision)
+  {
+    case MARGINCALCULATOR_DOSE_PRECISION_DOUBLE:
+    {
+      convertedImageData->ShallowCopy(doseImageData);
+      return 0;
+    }
+    case MARGINCALCULATOR_DOSE_PRECISION_FLOAT:
+    {
+      vtkNew<vtkImageCast> cast;
+#if (VTK_MAJOR_VERSION <= 5)
+      cast->SetInput(doseImageData);
+#else
+      cast->SetInputData(doseImageData);
+#endif
+      cast->SetOutputScalarTypeToFloat();
+      cast->Update();
+      convertedImageData->ShallowCopy(cast->GetOutput());
+      return 0;
+    }
+    case MARGINCALCULATOR_DOSE_PRECISION_UINT16:
+    {
+      if (doseUnitValue <= 0.0)
+      {
+        return -1;
+      }
+      double range[2] = {0.0, 0.0};
+      doseImageData->GetScalarRange(range);
+      if (range[0] < 0.0 || range[1] / doseUnitValue + 0.5 > VTK_UNSIGNED_SHORT_MAX)
+      {
+        return -1;
+      }
+
+      // Shifting by half a unit rounds to the nearest unit instead of truncating
+      vtkNew<vtkImageShiftScale> shiftScale;
+#if (VTK_MAJOR_VERSION <= 5)
+      shiftScale->SetInput(doseImageData);
+#else
+      shiftScale->SetInputData(doseImageData);
+#endif
+      shiftScale->SetShift(0.5 * doseUnitValue);
+      shiftScale->SetScale(1.0 / doseUnitValue);
+      shiftScale->SetOutputScalarTypeToUnsignedShort();
+      shiftScale->ClampOverflowOn();
+      shiftScale->Update();
+      convertedImageData->ShallowCopy(shiftScale->GetOutput());
+      doseScale = doseUnitValue;
+      return 0;
+    }
+    default:
+      return -1;
+  }
+}
@@ -9,6 +9,20 @@
 
 #define EPSILON 0.0001
 
+// Internal dose representation used by the motion simulation and dose morphology kernels.
+// DOUBLE keeps the scalar type of the input (legacy behaviour).
+// FLOAT resamples in single precision: the relative error of each voxel is within a few
+//   float roundings (about 1e-6 of the voxel dose), far below the 0.2 Gy histogram bins.
+// UINT16 stores the dose in multiples of the DoseUnitValue (dose grid scaling) attribute:
+//   the conversion rounds each voxel to within half a dose unit, and imported RT doses
+//   round-trip exactly. Doses above 65535 dose units cannot be represented.
+//   Resampling the converted dose adds its own error on top of this: cubic interpolation
+//   overshoots near steep gradients and the overshoot is clamped to the 0..65535 range,
+//   so a resampled voxel is not within half a dose unit of the double result.
+#define MARGINCALCULATOR_DOSE_PRECISION_DOUBLE 0
+#define MARGINCALCULATOR_DOSE_PRECISION_FLOAT  1
+#define MARGINCALCULATOR_DOSE_PRECISION_UINT16 2
+
 #define UNUSED_VARIABLE(a) ((void) a)
 
 /* Define case insensitive string compare for all supported platforms. */
@@ -23,6 +37,7 @@
 #endif
 
 class vtkMRMLNode;
+class vtkImageData;
 
 /// \ingroup MarginCalculatorCommon
 class VTK_MARGINCALCULATORCOMMON_EXPORT MarginCalculatorCommon
@@ -158,6 +173,18 @@ public:
   static const std::string PLANARIMAGE_DISPLAYED_MODEL_REFERENCE_ROLE;
   static const std::string PLANARIMAGE_TEXTURE_VOLUME_REFERENCE_ROLE;
 
+  // MotionSimulator constants
+  static const std::string MOTIONSIMULATOR_ATTRIBUTE_PREFIX;
+  static const std::string MOTIONSIMULATOR_REFINED_TRIAL_FRACTION_ATTRIBUTE_NAME;
+
+  // DosePopulationHistogram constants
+  static const std::string DPH_ATTRIBUTE_PREFIX;
+  static const std::string DPH_BOOTSTRAP_RESAMPLES_ATTRIBUTE_NAME;
+  static const std::string DPH_BOOTSTRAP_CONFIDENCE_LEVEL_ATTRIBUTE_NAME;
+  static const std::string DPH_CHART_CURVE_NODE_ID_ATTRIBUTE_NAME;
+  static const std::string DPH_FULL_RESOLUTION_NODE_ID_ATTRIBUTE_NAME;
+  static const std::string DPH_CHART_CURVE_NODE_NAME_POSTFIX;
+
   //----------------------------------------------------------------------------
   // Utility functions
   //----------------------------------------------------------------------------
@@ -166,6 +193,16 @@ public:
   /// Determine if a node is a dose volume node
   static bool IsDoseVolumeNode(vtkMRMLNode* node);
 
+  /// Get the dose unit value (dose grid scaling) of a dose volume node, 0 if it is not set
+  static double GetDoseUnitValue(vtkMRMLNode* doseVolumeNode);
+
+  /// Convert dose image data to the given MARGINCALCULATOR_DOSE_PRECISION_* representation.
+  /// The stored values multiplied by doseScale give the dose, for UINT16 within half a dose unit
+  /// of the input (the error of later resampling is not included). Returns -1 if the dose cannot be
+  /// represented (missing dose unit value, negative dose or overflow for UINT16)
+  static int ConvertDoseImageData(vtkImageData* doseImageData, int dosePrecision, double doseUnitValue,
+                                  vtkImageData* convertedImageData, double &doseScale);
+
 };
 
 
@@ -59,6 +59,11 @@ vtkMRMLMotionSimulatorNode::vtkMRMLMotionSimulatorNode()
   this->YRdmSD = 1;
   this->ZRdmSD = 1;
 
+  this->DownsamplingFactor = 1;
+  this->RefinementThreshold = 97.0;
+  this->RefinementTolerance = 3.0;
+  this->DosePrecision = MARGINCALCULATOR_DOSE_PRECISION_DOUBLE;
+
   this->HideFromEditors = false;
 }
 
@@ -90,6 +95,14 @@ void vtkMRMLMotionSimulatorNode::WriteXML(ostream& of, int nIndent)
   of << indent << " YRdmSD=\"" << (this->YRdmSD) << "\"";
 
   of << indent << " ZRdmSD=\"" << (this->ZRdmSD) << "\"";
+
+  of << indent << " DownsamplingFactor=\"" << (this->DownsamplingFactor) << "\"";
+
+  of << indent << " RefinementThreshold=\"" << (this->RefinementThreshold) << "\"";
+
+  of << indent << " RefinementTolerance=\"" << (this->RefinementTolerance) << "\"";
+
+  of << indent << " DosePrecision=\"" << (this->DosePrecision) << "\"";
 }
 
 //----------------------------------------------------------------------------
@@ -146,6 +159,38 @@ void vtkMRMLMotionSimulatorNode::ReadXMLAttributes(const char** atts)
       this->ZRdmSD = 
         (strcmp(attValue,"true") ? false : true);
       }
+    else if (!strcmp(attName, "DownsamplingFactor")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      int intAttValue;
+      ss >> intAttValue;
+      this->DownsamplingFactor = intAttValue;
+      }
+    else if (!strcmp(attName, "RefinementThreshold")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      double doubleAttValue;
+      ss >> doubleAttValue;
+      this->RefinementThreshold = doubleAttValue;
+      }
+    else if (!strcmp(attName, "RefinementTolerance")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      double doubleAttValue;
+      ss >> doubleAttValue;
+      this->RefinementTolerance = doubleAttValue;
+      }
+    else if (!strcmp(attName, "DosePrecision")) 
+      {
+      std::stringstream ss;
+      ss << attValue;
+      int intAttValue;
+      ss >> intAttValue;
+      this->DosePrecision = intAttValue;
+      }
     }
 }
 
@@ -170,6 +215,11 @@ void vtkMRMLMotionSimulatorNode::Copy(vtkMRMLNode *anode)
   this->YRdmSD = node->GetYRdmSD();
   this->ZRdmSD = node->GetZRdmSD();
 
+  this->DownsamplingFactor = node->GetDownsamplingFactor();
+  this->RefinementThreshold = node->GetRefinementThreshold();
+  this->RefinementTolerance = node->GetRefinementTolerance();
+  this->DosePrecision = node->GetDosePrecision();
+
   this->DisableModifiedEventOff();
   this->InvokePendingModifiedEvent();
 }
@@ -189,6 +239,11 @@ void vtkMRMLMotionSimulatorNode::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "XRdmSD:   " << (this->XRdmSD) << "\n";
   os << indent << "YRdmSD:   " << (this->YRdmSD) << "\n";
   os << indent << "ZRdmSD:   " << (this->ZRdmSD) << "\n";
+
+  os << indent << "DownsamplingFactor:   " << (this->DownsamplingFactor) << "\n";
+  os << indent << "RefinementThreshold:   " << (this->RefinementThreshold) << "\n";
+  os << indent << "RefinementTolerance:   " << (this->RefinementTolerance) << "\n";
+  os << indent << "DosePrecision:   " << (this->DosePrecision) << "\n";
 }
 
 //----------------------------------------------------------------------------
@@ -114,6 +114,22 @@ public:
   vtkGetMacro(NumberOfFraction, int);
   vtkSetMacro(NumberOfFraction, int);
 
+  /// Get/Set downsampling factor of the coarse simulation grid (1: full grid only, 2 or 4: coarse-to-fine)
+  vtkGetMacro(DownsamplingFactor, int);
+  vtkSetMacro(DownsamplingFactor, int);
+
+  /// Get/Set coverage threshold of interest, in percent of the nominal D98
+  vtkGetMacro(RefinementThreshold, double);
+  vtkSetMacro(RefinementThreshold, double);
+
+  /// Get/Set half width of the band around the threshold (in percent) in which coarse trials are refined
+  vtkGetMacro(RefinementTolerance, double);
+  vtkSetMacro(RefinementTolerance, double);
+
+  /// Get/Set internal dose representation of the trial resampling (MARGINCALCULATOR_DOSE_PRECISION_* in MarginCalculatorCommon.h)
+  vtkGetMacro(DosePrecision, int);
+  vtkSetMacro(DosePrecision, int);
+
 protected:
   vtkMRMLMotionSimulatorNode();
   ~vtkMRMLMotionSimulatorNode();
@@ -136,6 +152,18 @@ protected:
 
   ///
   int    NumberOfFraction;
+
+  /// Downsampling factor of the coarse grid, trials are computed on the full grid only if 1
+  int    DownsamplingFactor;
+
+  /// Coverage threshold (% of nominal D98) around which coarse trials are re-evaluated
+  double RefinementThreshold;
+
+  /// Half width (%) of the refinement band
+  double RefinementTolerance;
+
+  /// Internal dose representation used to resample the trials
+  int    DosePrecision;
 };
 
 #endif
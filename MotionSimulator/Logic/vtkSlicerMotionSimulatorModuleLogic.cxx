@@ -26,6 +26,9 @@
 // SlicerRT includes
 #include "MarginCalculatorCommon.h"
 
+// Slicer includes
+#include <vtkSlicerApplicationLogic.h>
+
 // MRML includes
 #include <vtkMRMLVolumeNode.h>
 #include <vtkMRMLScalarVolumeNode.h>
@@ -37,12 +40,15 @@
 #include <vtkMRMLColorTableNode.h>
 #include <vtkMRMLProceduralColorNode.h>
 #include <vtkMRMLMotionSimulatorDoubleArrayNode.h>
+#include <vtkMotionSimulatorTrialStore.h>
+#include <vtkDosePopulationHistogramAccumulator.h>
 //#include <vtkMRMLContourNode.h>
 #include <vtkMRMLMotionSimulatorNode.h>
 #include <vtkMRMLScene.h>
 
 // VTK includes
 #include <vtkNew.h>
+#include <vtkCommand.h>
 #include <vtkImageData.h>
 #include <vtkImageMarchingCubes.h>
 #include <vtkImageChangeInformation.h>
@@ -64,30 +70,186 @@
 #include <vtkDoubleArray.h>
 #include <vtkObjectFactory.h>
 #include <vtkBoxMuellerRandomSequence.h>
+#include <vtkMinimalStandardRandomSequence.h>
+#include <vtkImageReslice.h>
+#include <vtkMatrix4x4.h>
+#include <vtkMutexLock.h>
+#include <vtkTimerLog.h>
+
+// VTKSYS includes
+#include <vtksys/SystemTools.hxx>
 
 // STD includes
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <sstream>
 #include <time.h>
 
 #define MOTION_MAX 5
 
+// Runs with more trials than this are streamed to a trial store file instead of kept in memory
+#define MOTION_MAX_IN_MEMORY_TRIALS 5000
+
 //----------------------------------------------------------------------------
 vtkStandardNewMacro(vtkSlicerMotionSimulatorModuleLogic);
 
+//---------------------------------------------------------------------------
+// Normal distributions of the setup errors of the trials. The sequences start from the same seed in
+// every simulation, so the shifts only depend on the error standard deviations.
+// Given standard errors (see GenerateStandardErrors) are scaled by the deviations instead.
+class vtkSlicerMotionSimulatorShiftGenerator
+{
+public:
+  vtkSlicerMotionSimulatorShiftGenerator(vtkMRMLMotionSimulatorNode* parameterNode, vtkDoubleArray* standardErrors = NULL)
+  {
+    this->StandardErrors = standardErrors;
+    this->TrialIndex = 0;
+    this->SystematicSD[0] = parameterNode->GetXSysSD();
+    this->SystematicSD[1] = parameterNode->GetYSysSD();
+    this->SystematicSD[2] = parameterNode->GetZSysSD();
+    this->RandomSD[0] = parameterNode->GetXRdmSD();
+    this->RandomSD[1] = parameterNode->GetYRdmSD();
+    this->RandomSD[2] = parameterNode->GetZRdmSD();
+    for (int axis = 0; axis < 3; axis++)
+    {
+      this->SystematicDistributions[axis] = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
+      this->RandomDistributions[axis] = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
+    }
+  }
+
+  /// Generate the shifts of the fractions of the next trial as consecutive x,y,z triplets
+  void NextTrial(std::vector<double> &fractionShifts)
+  {
+    int numberOfFractions = (int)fractionShifts.size() / 3;
+    if (this->StandardErrors)
+    {
+      // Systematic errors of the axes, then the random errors of the fractions. Read through the pointer,
+      // GetTuple is not safe for the threads sharing the draws.
+      const double* standardErrors = this->StandardErrors->GetPointer(this->TrialIndex++ * this->StandardErrors->GetNumberOfComponents());
+      for (int j = 0; j<numberOfFractions; j++)
+      {
+        for (int axis = 0; axis < 3; axis++)
+        {
+          double shift = this->SystematicSD[axis] * standardErrors[axis] + this->RandomSD[axis] * standardErrors[3+3*j+axis];
+          fractionShifts[3*j+axis] = shift < MOTION_MAX ? shift : MOTION_MAX;
+        }
+      }
+      return;
+    }
+
+    // Generate systematic error for all fractions, it stays the same over all fractions
+    double systematicShift[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+      systematicShift[axis] = this->SystematicDistributions[axis]->GetScaledValue(0.0, this->SystematicSD[axis]);
+      this->SystematicDistributions[axis]->Next();
+    }
+
+    for (int j = 0; j<numberOfFractions; j++)
+    { // Generate new random error for each new fraction
+      for (int axis = 0; axis < 3; axis++)
+      {
+        double shift = systematicShift[axis] + this->RandomDistributions[axis]->GetScaledValue(0.0, this->RandomSD[axis]);
+        this->RandomDistributions[axis]->Next();
+        fractionShifts[3*j+axis] = shift < MOTION_MAX ? shift : MOTION_MAX;
+      }
+    }
+  }
+
+private:
+  double SystematicSD[3];
+  double RandomSD[3];
+  vtkSmartPointer<vtkBoxMuellerRandomSequence> SystematicDistributions[3];
+  vtkSmartPointer<vtkBoxMuellerRandomSequence> RandomDistributions[3];
+  vtkDoubleArray* StandardErrors;
+  int TrialIndex;
+};
+
+//---------------------------------------------------------------------------
+/// Inputs and results of a simulation run. The inputs are copied from the scene before the trials start
+/// and the results are stored in the output node once they are complete, so the trials only use data
+/// owned by the run and can be computed on the worker thread of RunSimulationAsync().
+struct vtkSlicerMotionSimulatorRun
+{
+  vtkSlicerMotionSimulatorRun(vtkMRMLMotionSimulatorNode* parameterNode)
+    : ShiftGenerator(parameterNode)
+  {
+  }
+
+  /// Nodes the run reads or writes, a run whose node is removed from the scene is discarded
+  std::vector<std::string> NodeIDs;
+  std::string StructureName;
+
+  vtkSlicerMotionSimulatorShiftGenerator ShiftGenerator;
+  int NumberOfTrials;
+  int NumberOfFractions;
+
+  vtkSmartPointer<vtkImageData> TrialDoseVolume;
+  vtkSmartPointer<vtkImageStencilData> StructureStencil;
+  int DosePrecision;
+  double DoseScale;
+  double StartValue;
+  double StepSize;
+  int NumberOfSamples;
+  /// Copy of the dose reslice matrix of the logic, NULL if none
+  vtkSmartPointer<vtkMatrix4x4> DoseResliceMatrix;
+
+  /// Coarse grid of the first pass of the coarse-to-fine simulation
+  int DownsamplingFactor;
+  vtkSmartPointer<vtkImageData> DownsampledTrialDoseVolume;
+  vtkSmartPointer<vtkImageStencilData> DownsampledStencil;
+  double NominalD98Dose;
+  double RefinementThreshold;
+  double RefinementTolerance;
+
+  /// Results, in a trial store for large runs and in the array otherwise
+  vtkSmartPointer<vtkMotionSimulatorTrialStore> TrialStore;
+  vtkSmartPointer<vtkDoubleArray> Trials;
+  int NumberOfSimulatedTrials;
+  int NumberOfRefinedTrials;
+};
+
 //----------------------------------------------------------------------------
 vtkSlicerMotionSimulatorModuleLogic::vtkSlicerMotionSimulatorModuleLogic()
 {
   this->StartValue = 0.1;
   this->StepSize = 0.2;
   this->NumberOfSamples = 100;
+  this->RefinedTrialFraction = 1.0;
+  this->DoseResliceMatrix = NULL;
+  this->DPHAccumulator = NULL;
   this->MotionSimulatorNode = NULL;
+
+  this->SimulationThreader = vtkMultiThreader::New();
+  this->SimulationThreadID = -1;
+  this->SimulationRunning = false;
+  this->SimulationResult = 0;
+  this->SimulationRun = NULL;
+
+  this->ProgressLock = vtkMutexLock::New();
+  this->CancelRequested = false;
+  this->NumberOfCompletedTrials = 0;
+  this->NumberOfTrials = 0;
+  this->SimulationStartTime = 0.0;
+  this->SimulationElapsedTime = 0.0;
+  this->MinimumTrialD98 = 0.0;
+  this->SumTrialD98 = 0.0;
 }
 
 //----------------------------------------------------------------------------
 vtkSlicerMotionSimulatorModuleLogic::~vtkSlicerMotionSimulatorModuleLogic()
 {
+  // Do not leave the worker thread running on a deleted logic
+  this->StopSimulationAsync();
+  this->ReleaseSimulation();
+
   vtkSetAndObserveMRMLNodeMacro(this->MotionSimulatorNode, NULL);
+  this->SetDoseResliceMatrix(NULL);
+  this->SetDPHAccumulator(NULL);
+
+  this->SimulationThreader->Delete();
+  this->ProgressLock->Delete();
 }
 
 //----------------------------------------------------------------------------
@@ -102,6 +264,44 @@ void vtkSlicerMotionSimulatorModuleLogic::SetAndObserveMotionSimulatorNode(vtkMR
   vtkSetAndObserveMRMLNodeMacro(this->MotionSimulatorNode, node);
 }
 
+//----------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::SetDoseResliceMatrix(vtkMatrix4x4* matrix)
+{
+  if (this->DoseResliceMatrix == matrix)
+  {
+    return;
+  }
+  if (this->DoseResliceMatrix)
+  {
+    this->DoseResliceMatrix->UnRegister(this);
+  }
+  this->DoseResliceMatrix = matrix;
+  if (this->DoseResliceMatrix)
+  {
+    this->DoseResliceMatrix->Register(this);
+  }
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::SetDPHAccumulator(vtkDosePopulationHistogramAccumulator* accumulator)
+{
+  if (this->DPHAccumulator == accumulator)
+  {
+    return;
+  }
+  if (this->DPHAccumulator)
+  {
+    this->DPHAccumulator->UnRegister(this);
+  }
+  this->DPHAccumulator = accumulator;
+  if (this->DPHAccumulator)
+  {
+    this->DPHAccumulator->Register(this);
+  }
+  this->Modified();
+}
+
 //---------------------------------------------------------------------------
 void vtkSlicerMotionSimulatorModuleLogic::SetMRMLSceneInternal(vtkMRMLScene * newScene)
 {
@@ -163,6 +363,13 @@ void vtkSlicerMotionSimulatorModuleLogic::OnMRMLSceneNodeRemoved(vtkMRMLNode* no
     return;
   }
 
+  // A running simulation must not outlive the nodes it reads or writes
+  if (this->SimulationRun && node->GetID() && std::find(this->SimulationRun->NodeIDs.begin(),
+    this->SimulationRun->NodeIDs.end(), std::string(node->GetID())) != this->SimulationRun->NodeIDs.end())
+  {
+    this->StopSimulationAsync();
+  }
+
   // if the scene is still updating, jump out
   if (this->GetMRMLScene()->IsBatchProcessing())
   {
@@ -194,6 +401,7 @@ void vtkSlicerMotionSimulatorModuleLogic::OnMRMLSceneEndImport()
 //---------------------------------------------------------------------------
 void vtkSlicerMotionSimulatorModuleLogic::OnMRMLSceneEndClose()
 {
+  this->StopSimulationAsync();
   this->Modified();
 }
 
@@ -281,13 +489,627 @@ void vtkSlicerMotionSimulatorModuleLogic::GetStencilForContour(vtkMRMLScalarVolu
   structureStencil->DeepCopy(stencil->GetOutput());
 }
 
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::DownsampleDoseAndStencil( vtkImageData* doseVolume, 
+                                                                    vtkImageData* indexedLabelmap, 
+                                                                    int downsamplingFactor, 
+                                                                    vtkImageData* downsampledDoseVolume, 
+                                                                    vtkImageStencilData* downsampledStencil )
+{
+  double magnificationFactor = 1.0 / downsamplingFactor;
+
+  vtkNew<vtkImageResample> doseResampler;
+#if (VTK_MAJOR_VERSION <= 5)
+  doseResampler->SetInput(doseVolume);
+#else
+  doseResampler->SetInputData(doseVolume);
+#endif
+  doseResampler->SetAxisMagnificationFactor(0, magnificationFactor);
+  doseResampler->SetAxisMagnificationFactor(1, magnificationFactor);
+  doseResampler->SetAxisMagnificationFactor(2, magnificationFactor);
+  doseResampler->SetInterpolationModeToLinear();
+  doseResampler->Update();
+  downsampledDoseVolume->DeepCopy(doseResampler->GetOutput());
+
+  // Labelmap is interpolated the same way so that the 0.5 threshold gives the partial volume boundary
+  vtkNew<vtkImageResample> labelmapResampler;
+#if (VTK_MAJOR_VERSION <= 5)
+  labelmapResampler->SetInput(indexedLabelmap);
+#else
+  labelmapResampler->SetInputData(indexedLabelmap);
+#endif
+  labelmapResampler->SetAxisMagnificationFactor(0, magnificationFactor);
+  labelmapResampler->SetAxisMagnificationFactor(1, magnificationFactor);
+  labelmapResampler->SetAxisMagnificationFactor(2, magnificationFactor);
+  labelmapResampler->SetInterpolationModeToLinear();
+  labelmapResampler->Update();
+
+  vtkNew<vtkImageToImageStencil> stencil;
+#if (VTK_MAJOR_VERSION <= 5)
+  stencil->SetInput(labelmapResampler->GetOutput());
+#else
+  stencil->SetInputConnection(labelmapResampler->GetOutputPort());
+#endif
+  stencil->ThresholdByUpper(0.5);
+  stencil->Update();
+  downsampledStencil->DeepCopy(stencil->GetOutput());
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::ComputeStructureStatistics( vtkImageData* doseVolume, 
+                                                                     vtkImageStencilData* structureStencil, 
+                                                                     double startValue, double stepSize, int numSamples, 
+                                                                     double &minDose, double &d98Dose )
+{
+  vtkSmartPointer<vtkImageAccumulate> structureStat = vtkSmartPointer<vtkImageAccumulate>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+  structureStat->SetInput(doseVolume);
+  structureStat->SetStencil(structureStencil);
+#else
+  structureStat->SetInputData(doseVolume);
+  structureStat->SetStencilData(structureStencil);
+#endif
+  structureStat->SetComponentExtent(0,numSamples-1,0,0,0,0);
+  structureStat->SetComponentOrigin(startValue,0,0);
+  structureStat->SetComponentSpacing(stepSize,1,1);
+  structureStat->Update();
+
+  if (structureStat->GetVoxelCount() < 1)
+  {
+    return -1;
+  }
+
+  vtkImageData* statArray = structureStat->GetOutput();
+  unsigned long totalVoxels = structureStat->GetVoxelCount();
+  double D98 = 0.0;
+  double vlast = 0.0;
+  double dlast = 0.0;
+  unsigned long voxelBelowDose = 0;
+  for (int sampleIndex=0; sampleIndex<numSamples; ++sampleIndex)
+  {
+    unsigned long voxelsInBin = statArray->GetScalarComponentAsDouble(sampleIndex,0,0,0);
+    if ( (1.0-(double)voxelBelowDose/(double)totalVoxels)*100.0 < 98 && vlast >= 98)
+    {
+      D98 = (startValue + sampleIndex * stepSize + dlast)/2;
+    }
+    vlast = (1.0-(double)voxelBelowDose/(double)totalVoxels)*100.0;
+    voxelBelowDose += voxelsInBin;
+    dlast = startValue + sampleIndex * stepSize;
+  }
+
+  minDose = structureStat->GetMin()[0];
+  d98Dose = D98;
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// Reslice transform of a fraction: the shift, then the voxel transform of the dose if any
+static void vtkSlicerMotionSimulatorFractionTransform(const double* fractionShift, vtkMatrix4x4* doseResliceMatrix, vtkTransform* transform)
+{
+  transform->Identity();
+  transform->PostMultiply();
+  transform->Translate(fractionShift[0], fractionShift[1], fractionShift[2]);
+  if (doseResliceMatrix)
+  {
+    transform->Concatenate(doseResliceMatrix);
+  }
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::ComputeTrialStatistics( vtkImageData* doseVolume, 
+                                                                 vtkImageStencilData* structureStencil, 
+                                                                 const std::vector<double> &fractionShifts, 
+                                                                 vtkMatrix4x4* doseResliceMatrix, 
+                                                                 int dosePrecision, double doseScale, 
+                                                                 double startValue, double stepSize, int numSamples, 
+                                                                 double &minDose, double &d98Dose )
+{
+  int numberOfFractions = (int)fractionShifts.size() / 3;
+
+  vtkSmartPointer<vtkTransform> transform = vtkSmartPointer<vtkTransform>::New();
+  vtkSlicerMotionSimulatorFractionTransform(&fractionShifts[0], doseResliceMatrix, transform);
+
+  vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+  reslice->SetInput(doseVolume);
+#else
+  reslice->SetInputData(doseVolume);
+#endif
+  reslice->SetInformationInput(doseVolume);
+  reslice->SetResliceTransform(transform);
+  reslice->SetInterpolationModeToLinear();
+  if (dosePrecision == MARGINCALCULATOR_DOSE_PRECISION_UINT16)
+  {
+    // Fixed point dose is converted back to dose in float so that the fractions can be summed
+    reslice->SetOutputScalarType(VTK_FLOAT);
+    reslice->SetScalarScale(doseScale);
+  }
+  reslice->UpdateWholeExtent();
+
+  vtkSmartPointer<vtkImageData> baseImageData = reslice->GetOutput();
+
+  if (numberOfFractions >= 2)
+  {
+    for (int j = 1; j<numberOfFractions; j++)
+    {
+      vtkSmartPointer<vtkTransform> transform = vtkSmartPointer<vtkTransform>::New();
+      vtkSlicerMotionSimulatorFractionTransform(&fractionShifts[3*j], doseResliceMatrix, transform);
+
+      vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+      reslice->SetInput(doseVolume);
+#else
+      reslice->SetInputData(doseVolume);
+#endif
+      reslice->SetInformationInput(doseVolume);
+      reslice->SetResliceTransform(transform);
+      if (dosePrecision == MARGINCALCULATOR_DOSE_PRECISION_UINT16)
+      {
+        reslice->SetOutputScalarType(VTK_FLOAT);
+        reslice->SetScalarScale(doseScale);
+      }
+      reslice->UpdateWholeExtent();
+
+      vtkSmartPointer<vtkImageMathematics> adder = vtkSmartPointer<vtkImageMathematics>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+      adder->SetInput1(baseImageData);
+      adder->SetInput2(reslice->GetOutput());
+#else
+      adder->SetInput1Data(baseImageData);
+      adder->SetInput2Data(reslice->GetOutput());
+#endif
+      adder->SetOperationToAdd();
+      adder->Update();
+
+      baseImageData = adder->GetOutput();
+    }
+
+    vtkSmartPointer<vtkImageMathematics> MultiplyFilter1 = vtkSmartPointer<vtkImageMathematics>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+    MultiplyFilter1->SetInput(baseImageData);
+#else
+    MultiplyFilter1->SetInputData(baseImageData);
+#endif
+    MultiplyFilter1->SetConstantK(1./numberOfFractions);
+    MultiplyFilter1->SetOperationToMultiplyByK();
+    MultiplyFilter1->Update();
+    baseImageData = MultiplyFilter1->GetOutput();
+  }
+
+  return this->ComputeStructureStatistics(baseImageData, structureStencil, startValue, stepSize, numSamples, minDose, d98Dose);
+}
+
+//---------------------------------------------------------------------------
+std::string vtkSlicerMotionSimulatorModuleLogic::GetTrialStoreFileName(vtkMRMLMotionSimulatorDoubleArrayNode* outputArrayNode)
+{
+  // Temporary directory of the application, else the one of the system
+  std::string directory;
+  if (this->GetApplicationLogic() && this->GetApplicationLogic()->GetTemporaryPath())
+  {
+    directory = this->GetApplicationLogic()->GetTemporaryPath();
+  }
+  const char* temporaryDirectoryVariables[3] = { "TMPDIR", "TEMP", "TMP" };
+  for (int variableIndex = 0; variableIndex < 3 && (directory.empty() || !vtksys::SystemTools::FileIsDirectory(directory.c_str())); variableIndex++)
+  {
+    const char* variableValue = vtksys::SystemTools::GetEnv(temporaryDirectoryVariables[variableIndex]);
+    directory = (variableValue ? variableValue : "");
+  }
+  if (directory.empty() || !vtksys::SystemTools::FileIsDirectory(directory.c_str()))
+  {
+    directory = "/tmp";
+  }
+
+  // The file of the previous run is deleted with its store, a new run gets a new file
+  std::string fileName = directory + "/" + outputArrayNode->GetID() + "_Trials.bin";
+  for (int fileIndex = 1; vtksys::SystemTools::FileExists(fileName.c_str()); fileIndex++)
+  {
+    std::stringstream fileNameStream;
+    fileNameStream << directory << "/" << outputArrayNode->GetID() << "_Trials_" << fileIndex << ".bin";
+    fileName = fileNameStream.str();
+  }
+  return fileName;
+}
+
 //---------------------------------------------------------------------------
 int vtkSlicerMotionSimulatorModuleLogic::RunSimulation()
 {
-  vtkMRMLScalarVolumeNode* doseVolumeNode = this->MotionSimulatorNode->GetInputDoseVolumeNode();
+  if (this->SimulationThreadID >= 0)
+  {
+    vtkErrorMacro("RunSimulation: a simulation is already running!");
+    return -1;
+  }
+
+  this->ProgressLock->Lock();
+  this->CancelRequested = false;
+  this->ProgressLock->Unlock();
+
+  if (this->PrepareSimulation() != 0)
+  {
+    return -1;
+  }
+  int result = this->SimulateTrials();
+  if (result == 0)
+  {
+    this->StoreSimulationResults();
+  }
+  this->ReleaseSimulation();
+  return result;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::RunSimulationAsync()
+{
+  if (this->SimulationThreadID >= 0)
+  {
+    vtkErrorMacro("RunSimulationAsync: a simulation is already running!");
+    return -1;
+  }
+
+  this->ProgressLock->Lock();
+  this->CancelRequested = false;
+  this->ProgressLock->Unlock();
+
+  // The scene is only read here and in FinishSimulationAsync(), on the calling thread
+  if (this->PrepareSimulation() != 0)
+  {
+    return -1;
+  }
+
+  this->ProgressLock->Lock();
+  this->SimulationRunning = true;
+  this->ProgressLock->Unlock();
+
+  this->SimulationResult = 0;
+  this->SimulationThreadID = this->SimulationThreader->SpawnThread(vtkSlicerMotionSimulatorModuleLogic::SimulationThreadFunction, this);
+  if (this->SimulationThreadID < 0)
+  {
+    vtkErrorMacro("RunSimulationAsync: unable to start the simulation thread!");
+    this->ProgressLock->Lock();
+    this->SimulationRunning = false;
+    this->ProgressLock->Unlock();
+    this->ReleaseSimulation();
+    return -1;
+  }
+
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE vtkSlicerMotionSimulatorModuleLogic::SimulationThreadFunction(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* threadInfo = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  vtkSlicerMotionSimulatorModuleLogic* self = static_cast<vtkSlicerMotionSimulatorModuleLogic*>(threadInfo->UserData);
+
+  int result = self->SimulateTrials();
+
+  self->ProgressLock->Lock();
+  self->SimulationResult = result;
+  self->SimulationRunning = false;
+  self->ProgressLock->Unlock();
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::FinishSimulationAsync()
+{
+  if (this->SimulationThreadID < 0)
+  {
+    return this->SimulationResult;
+  }
+
+  // Joins the worker thread
+  this->SimulationThreader->TerminateThread(this->SimulationThreadID);
+  this->SimulationThreadID = -1;
+
+  this->ProgressLock->Lock();
+  int result = this->SimulationResult;
+  this->ProgressLock->Unlock();
+
+  if (result == 0)
+  {
+    this->StoreSimulationResults();
+  }
+  this->ReleaseSimulation();
+  return result;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::StopSimulationAsync()
+{
+  if (this->SimulationThreadID < 0)
+  {
+    return;
+  }
+
+  this->RequestCancel();
+  this->SimulationThreader->TerminateThread(this->SimulationThreadID);
+  this->SimulationThreadID = -1;
+
+  // The nodes of the run may be gone, the completed trials are not stored
+  this->ReleaseSimulation();
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerMotionSimulatorModuleLogic::IsSimulationRunning()
+{
+  this->ProgressLock->Lock();
+  bool running = this->SimulationRunning;
+  this->ProgressLock->Unlock();
+  return running;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::RequestCancel()
+{
+  this->ProgressLock->Lock();
+  this->CancelRequested = true;
+  this->ProgressLock->Unlock();
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerMotionSimulatorModuleLogic::IsCancelRequested()
+{
+  this->ProgressLock->Lock();
+  bool cancelRequested = this->CancelRequested;
+  this->ProgressLock->Unlock();
+  return cancelRequested;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::GetSimulationProgress( int &numberOfCompletedTrials, int &numberOfTrials, 
+                                                                 double &estimatedTimeRemaining, 
+                                                                 double &minimumD98, double &meanD98 )
+{
+  this->ProgressLock->Lock();
+  numberOfCompletedTrials = this->NumberOfCompletedTrials;
+  numberOfTrials = this->NumberOfTrials;
+  minimumD98 = this->MinimumTrialD98;
+  meanD98 = (this->NumberOfCompletedTrials > 0 ? this->SumTrialD98 / this->NumberOfCompletedTrials : 0.0);
+
+  // Assume the remaining trials take as long as the completed ones on average
+  estimatedTimeRemaining = 0.0;
+  if (this->NumberOfCompletedTrials > 0)
+  {
+    estimatedTimeRemaining = this->SimulationElapsedTime / this->NumberOfCompletedTrials * (this->NumberOfTrials - this->NumberOfCompletedTrials);
+  }
+  this->ProgressLock->Unlock();
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::InitializeSimulationProgress(int numberOfTrials)
+{
+  this->ProgressLock->Lock();
+  this->NumberOfCompletedTrials = 0;
+  this->NumberOfTrials = numberOfTrials;
+  this->SimulationStartTime = vtkTimerLog::GetUniversalTime();
+  this->SimulationElapsedTime = 0.0;
+  this->MinimumTrialD98 = 0.0;
+  this->SumTrialD98 = 0.0;
+  this->ProgressLock->Unlock();
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::UpdateSimulationProgress(double d98Dose)
+{
+  this->ProgressLock->Lock();
+  if (this->NumberOfCompletedTrials == 0 || d98Dose < this->MinimumTrialD98)
+  {
+    this->MinimumTrialD98 = d98Dose;
+  }
+  this->SumTrialD98 += d98Dose;
+  this->NumberOfCompletedTrials++;
+  this->SimulationElapsedTime = vtkTimerLog::GetUniversalTime() - this->SimulationStartTime;
+  double progress = (double)this->NumberOfCompletedTrials / this->NumberOfTrials;
+  bool running = this->SimulationRunning;
+  this->ProgressLock->Unlock();
+
+  // Observers may touch the GUI, they are only called from RunSimulation()
+  if (!running)
+  {
+    this->InvokeEvent(vtkCommand::ProgressEvent, &progress);
+  }
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::GenerateStandardErrors(int numberOfTrials, int numberOfFractions, int seed, vtkDoubleArray* standardErrors)
+{
+  if (!standardErrors)
+  {
+    return;
+  }
+  numberOfTrials = (numberOfTrials > 0 ? numberOfTrials : 0);
+  numberOfFractions = (numberOfFractions >= 2 ? numberOfFractions : 1);
+
+  vtkSmartPointer<vtkMinimalStandardRandomSequence> uniformSequence = vtkSmartPointer<vtkMinimalStandardRandomSequence>::New();
+  uniformSequence->SetSeed(seed);
+  vtkSmartPointer<vtkBoxMuellerRandomSequence> normalSequence = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
+  normalSequence->SetUniformSequence(uniformSequence);
+
+  int numberOfComponents = 3 + 3*numberOfFractions;
+  standardErrors->Initialize();
+  standardErrors->SetNumberOfComponents(numberOfComponents);
+  standardErrors->SetNumberOfTuples(numberOfTrials);
+  for (int trialIndex = 0; trialIndex < numberOfTrials; trialIndex++)
+  {
+    for (int component = 0; component < numberOfComponents; component++)
+    {
+      standardErrors->SetComponent(trialIndex, component, normalSequence->GetValue());
+      normalSequence->Next();
+    }
+  }
+  standardErrors->Modified();
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::SimulateTrialsOfImage(vtkImageData* doseImageData, double doseUnitValue, vtkImageData* contourImageData,
+                                                               vtkMRMLMotionSimulatorNode* parameterNode, vtkDoubleArray* outputTrials,
+                                                               vtkDoubleArray* standardErrors/*=NULL*/)
+{
+  if (!parameterNode)
+  {
+    vtkErrorMacro("SimulateTrialsOfImage: Invalid parameter node!");
+    return -1;
+  }
+
+  TrialsOfImageInput preparedInput;
+  if (this->PrepareTrialsOfImage(doseImageData, doseUnitValue, contourImageData, parameterNode->GetDosePrecision(), preparedInput) != 0)
+  {
+    return -1;
+  }
+  return this->SimulateTrialsOfPreparedImage(preparedInput, parameterNode, outputTrials, standardErrors);
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::PrepareTrialsOfImage(vtkImageData* doseImageData, double doseUnitValue, vtkImageData* contourImageData,
+                                                              int dosePrecision, TrialsOfImageInput &preparedInput)
+{
+  if (!doseImageData || !contourImageData)
+  {
+    vtkErrorMacro("PrepareTrialsOfImage: Invalid dose or contour!");
+    return -1;
+  }
+
+  int doseDimensions[3];
+  doseImageData->GetDimensions(doseDimensions);
+  int contourDimensions[3];
+  contourImageData->GetDimensions(contourDimensions);
+  if ( doseDimensions[0] != contourDimensions[0]
+    || doseDimensions[1] != contourDimensions[1]
+    || doseDimensions[2] != contourDimensions[2] )
+  {
+    vtkErrorMacro("PrepareTrialsOfImage: Dose volume has different dimensions than the indexed labelmap!");
+    return -1;
+  }
+
+  // Dose histogram sampling, as in RunSimulation
+  vtkSmartPointer<vtkImageAccumulate> doseStat = vtkSmartPointer<vtkImageAccumulate>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+  doseStat->SetInput(doseImageData);
+#else
+  doseStat->SetInputData(doseImageData);
+#endif
+  doseStat->Update();
+  double maxDose = doseStat->GetMax()[0];
+  double minDose = doseStat->GetMin()[0];
+  preparedInput.StartValue = (minDose < 0.0 ? this->StartValue : minDose);
+  preparedInput.StepSize = this->StepSize;
+  preparedInput.NumberOfSamples = (int)ceil( (maxDose-preparedInput.StartValue)/preparedInput.StepSize ) + 1;
+
+  vtkSmartPointer<vtkImageToImageStencil> stencil = vtkSmartPointer<vtkImageToImageStencil>::New();
+#if (VTK_MAJOR_VERSION <= 5)
+  stencil->SetInput(contourImageData);
+#else
+  stencil->SetInputData(contourImageData);
+#endif
+  stencil->ThresholdByUpper(0.5);
+  stencil->Update();
+  preparedInput.StructureStencil = vtkSmartPointer<vtkImageStencilData>::New();
+  preparedInput.StructureStencil->DeepCopy(stencil->GetOutput());
+
+  preparedInput.DosePrecision = dosePrecision;
+  preparedInput.DoseScale = 1.0;
+  preparedInput.DoseImageData = vtkSmartPointer<vtkImageData>::New();
+  if (MarginCalculatorCommon::ConvertDoseImageData(doseImageData, dosePrecision, doseUnitValue, preparedInput.DoseImageData, preparedInput.DoseScale) != 0)
+  {
+    vtkErrorMacro("PrepareTrialsOfImage: Dose volume cannot be represented with dose precision " << dosePrecision << " (dose unit value: " << doseUnitValue << ")!");
+    return -1;
+  }
+
+  preparedInput.DoseResliceMatrix = NULL;
+  if (this->DoseResliceMatrix)
+  {
+    preparedInput.DoseResliceMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    preparedInput.DoseResliceMatrix->DeepCopy(this->DoseResliceMatrix);
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::CopyTrialsOfImageInput(const TrialsOfImageInput &source, TrialsOfImageInput &target)
+{
+  target = source;
+  if (source.DoseImageData)
+  {
+    target.DoseImageData = vtkSmartPointer<vtkImageData>::New();
+    target.DoseImageData->ShallowCopy(source.DoseImageData);
+  }
+  if (source.StructureStencil)
+  {
+    target.StructureStencil = vtkSmartPointer<vtkImageStencilData>::New();
+    target.StructureStencil->DeepCopy(source.StructureStencil);
+  }
+  if (source.DoseResliceMatrix)
+  {
+    target.DoseResliceMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    target.DoseResliceMatrix->DeepCopy(source.DoseResliceMatrix);
+  }
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::SimulateTrialsOfPreparedImage(const TrialsOfImageInput &preparedInput, vtkMRMLMotionSimulatorNode* parameterNode,
+                                                                       vtkDoubleArray* outputTrials, vtkDoubleArray* standardErrors/*=NULL*/,
+                                                                       vtkDosePopulationHistogramAccumulator* accumulator/*=NULL*/)
+{
+  if (!preparedInput.DoseImageData || !preparedInput.StructureStencil || !parameterNode || !outputTrials)
+  {
+    vtkErrorMacro("SimulateTrialsOfPreparedImage: Invalid prepared input, parameter node or output array!");
+    return -1;
+  }
+  if (parameterNode->GetNumberOfSimulation() <= 0)
+  {
+    vtkErrorMacro("SimulateTrialsOfPreparedImage: Invalid number of simulation!");
+    return -1;
+  }
+
+  int numberOfTrials = parameterNode->GetNumberOfSimulation();
+  int numberOfFractions = parameterNode->GetNumberOfFraction() >= 2 ? parameterNode->GetNumberOfFraction() : 1;
+  if ( standardErrors && (standardErrors->GetNumberOfTuples() < numberOfTrials
+    || standardErrors->GetNumberOfComponents() != 3 + 3*numberOfFractions) )
+  {
+    vtkErrorMacro("SimulateTrialsOfPreparedImage: Standard errors do not cover " << numberOfTrials << " trials of " << numberOfFractions << " fractions!");
+    return -1;
+  }
+  outputTrials->SetNumberOfComponents(5);
+  outputTrials->SetNumberOfTuples(numberOfTrials);
+
+  vtkSlicerMotionSimulatorShiftGenerator shiftGenerator(parameterNode, standardErrors);
+  std::vector<double> fractionShifts(3*numberOfFractions, 0.0);
+  for (int trialIndex = 0; trialIndex < numberOfTrials; trialIndex++)
+  {
+    shiftGenerator.NextTrial(fractionShifts);
+
+    double minDoseROI = 0.0;
+    double D98 = 0.0;
+    if (this->ComputeTrialStatistics(preparedInput.DoseImageData, preparedInput.StructureStencil, fractionShifts, preparedInput.DoseResliceMatrix,
+      preparedInput.DosePrecision, preparedInput.DoseScale, preparedInput.StartValue, preparedInput.StepSize, preparedInput.NumberOfSamples, minDoseROI, D98) != 0)
+    {
+      vtkErrorMacro("SimulateTrialsOfPreparedImage: No voxels in the structure!");
+      outputTrials->SetNumberOfTuples(0);
+      return -1;
+    }
+
+    double trialResult[5] = { fractionShifts[0], fractionShifts[1], fractionShifts[2], minDoseROI, D98 };
+    outputTrials->SetTuple(trialIndex, trialResult);
+    if (accumulator)
+    {
+      accumulator->AddTrial(minDoseROI, D98);
+    }
+  }
+  outputTrials->Modified();
+
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::PrepareSimulation()
+{
+  this->ReleaseSimulation();
+
+  vtkMRMLScalarVolumeNode* doseVolumeNode = (this->MotionSimulatorNode ? this->MotionSimulatorNode->GetInputDoseVolumeNode() : NULL);
   //vtkMRMLContourNode* contourNode = this->MotionSimulatorNode->GetInputContourNode();
-  vtkMRMLScalarVolumeNode* contourNode = this->MotionSimulatorNode->GetInputContourNode();
-  vtkMRMLMotionSimulatorDoubleArrayNode* outputArrayNode = this->MotionSimulatorNode->GetOutputDoubleArrayNode();
+  vtkMRMLScalarVolumeNode* contourNode = (this->MotionSimulatorNode ? this->MotionSimulatorNode->GetInputContourNode() : NULL);
+  vtkMRMLMotionSimulatorDoubleArrayNode* outputArrayNode = (this->MotionSimulatorNode ? this->MotionSimulatorNode->GetOutputDoubleArrayNode() : NULL);
   // Make sure inputs are initialized
   if (!this->GetMRMLScene() || !this->MotionSimulatorNode || !doseVolumeNode || !contourNode || !outputArrayNode)
   {
@@ -295,13 +1117,41 @@ int vtkSlicerMotionSimulatorModuleLogic::RunSimulation()
     return -1;
   }
 
-  if (this->MotionSimulatorNode->GetNumberOfSimulation() <=0 || this->MotionSimulatorNode->GetNumberOfSimulation() > 5000)
+  if (this->MotionSimulatorNode->GetNumberOfSimulation() <=0)
   {
-    vtkErrorMacro("Unable to perform large number of simulation!");
+    vtkErrorMacro("Invalid number of simulation!");
+    return -1;
+  }
+
+  int downsamplingFactor = this->MotionSimulatorNode->GetDownsamplingFactor();
+  if (downsamplingFactor != 1 && downsamplingFactor != 2 && downsamplingFactor != 4)
+  {
+    vtkErrorMacro("Invalid downsampling factor " << downsamplingFactor << ", it must be 1, 2 or 4!");
     return -1;
   }
   //this->GetMRMLScene()->StartState(vtkMRMLScene::BatchProcessState); 
 
+  vtkSlicerMotionSimulatorRun* run = new vtkSlicerMotionSimulatorRun(this->MotionSimulatorNode);
+  this->SimulationRun = run;
+  run->NodeIDs.push_back(this->MotionSimulatorNode->GetID() ? this->MotionSimulatorNode->GetID() : "");
+  run->NodeIDs.push_back(doseVolumeNode->GetID() ? doseVolumeNode->GetID() : "");
+  run->NodeIDs.push_back(contourNode->GetID() ? contourNode->GetID() : "");
+  run->NodeIDs.push_back(outputArrayNode->GetID() ? outputArrayNode->GetID() : "");
+  run->NumberOfTrials = this->MotionSimulatorNode->GetNumberOfSimulation();
+  run->NumberOfFractions = this->MotionSimulatorNode->GetNumberOfFraction() >= 2 ? this->MotionSimulatorNode->GetNumberOfFraction() : 1;
+  run->DownsamplingFactor = downsamplingFactor;
+  run->NominalD98Dose = 0.0;
+  run->RefinementThreshold = this->MotionSimulatorNode->GetRefinementThreshold();
+  run->RefinementTolerance = this->MotionSimulatorNode->GetRefinementTolerance();
+  run->NumberOfSimulatedTrials = 0;
+  run->NumberOfRefinedTrials = 0;
+
+  this->InitializeSimulationProgress(run->NumberOfTrials);
+  if (this->DPHAccumulator)
+  {
+    this->DPHAccumulator->RemoveAllTrials();
+  }
+
   // Get maximum dose from dose volume
   vtkNew<vtkImageAccumulate> doseStat;
 #if (VTK_MAJOR_VERSION <= 5)
@@ -313,234 +1163,238 @@ int vtkSlicerMotionSimulatorModuleLogic::RunSimulation()
   double maxDose = doseStat->GetMax()[0];
   double minDose = doseStat->GetMin()[0];
 
-  double startValue, stepSize;
-  int numSamples;
   if (minDose < 0.0)
   {
-    startValue = this->StartValue;
+    run->StartValue = this->StartValue;
   }
   else
   {
-    startValue = minDose;
+    run->StartValue = minDose;
   }
 
-  stepSize = this->StepSize;
-  numSamples = (int)ceil( (maxDose-startValue)/stepSize ) + 1;
+  run->StepSize = this->StepSize;
+  run->NumberOfSamples = (int)ceil( (maxDose-run->StartValue)/run->StepSize ) + 1;
 
   // Get dose grid scaling and dose units
   //std::string structureName(contourNode->GetStructureName());
-  std::string structureName(contourNode->GetName());
-
-  vtkSmartPointer<vtkMRMLScalarVolumeNode> structureStenciledDoseVolumeNode
-    = vtkSmartPointer<vtkMRMLScalarVolumeNode>::New();
+  run->StructureName = (contourNode->GetName() ? contourNode->GetName() : "");
 
   // Compute statistics
   vtkSmartPointer<vtkImageData> resampledDoseVolume = vtkSmartPointer<vtkImageData>::New();
-  vtkSmartPointer<vtkImageStencilData> structureStencil = vtkSmartPointer<vtkImageStencilData>::New();
-  this->GetStencilForContour(doseVolumeNode, contourNode, resampledDoseVolume, structureStencil);
+  run->StructureStencil = vtkSmartPointer<vtkImageStencilData>::New();
+  this->GetStencilForContour(doseVolumeNode, contourNode, resampledDoseVolume, run->StructureStencil);
 
-  //// Get spacing and voxel volume
-  //contourNode->SetAndObserveRasterizationReferenceVolumeNodeId(doseVolumeNode->GetID());
-  //vtkMRMLScalarVolumeNode* indexedLabelmapNode = contourNode->GetIndexedLabelmapVolumeNode();
-  //if (!indexedLabelmapNode)
-  //{
-  //  vtkErrorMacro("Unable to get indexed labelmap representation from structure contour node '" << contourNode->GetName() << "'!");
-  //  return 0;
-  //}
-  //double* indexedLabelmapSpacing = indexedLabelmapNode->GetSpacing();
+  // Coarse grid used for the first pass of the coarse-to-fine simulation
+  vtkSmartPointer<vtkImageData> downsampledDoseVolume;
+  if (downsamplingFactor > 1)
+  {
+    downsampledDoseVolume = vtkSmartPointer<vtkImageData>::New();
+    run->DownsampledStencil = vtkSmartPointer<vtkImageStencilData>::New();
+    this->DownsampleDoseAndStencil(resampledDoseVolume, contourNode->GetImageData(), downsamplingFactor, downsampledDoseVolume, run->DownsampledStencil);
 
-    //indexedLabelmapVolumeNode->SetSpacing(
-    //  referenceSpacing[0]/this->RasterizationOversamplingFactor,
-    //  referenceSpacing[1]/this->RasterizationOversamplingFactor,
-    //  referenceSpacing[2]/this->RasterizationOversamplingFactor );
+    double nominalMinDose = 0.0;
+    int nominalResult = 0;
+    if (this->DoseResliceMatrix)
+    {
+      // The nominal dose is the input mapped by the matrix, sampled the same way as the trials
+      std::vector<double> nominalShift(3, 0.0);
+      nominalResult = this->ComputeTrialStatistics(resampledDoseVolume, run->StructureStencil, nominalShift, this->DoseResliceMatrix, MARGINCALCULATOR_DOSE_PRECISION_DOUBLE, 1.0,
+        run->StartValue, run->StepSize, run->NumberOfSamples, nominalMinDose, run->NominalD98Dose);
+    }
+    else
+    {
+      nominalResult = this->ComputeStructureStatistics(resampledDoseVolume, run->StructureStencil, run->StartValue, run->StepSize, run->NumberOfSamples,
+        nominalMinDose, run->NominalD98Dose);
+    }
+    if (nominalResult != 0)
+    {
+      vtkWarningMacro("No voxels in the structure. DVH computation aborted.");
+      this->ReleaseSimulation();
+      return -1;
+    }
+  }
 
-  // Create node and fill statistics
-  //std::string dvhArrayNodeName = structureName + SlicerRtCommon::DVH_ARRAY_NODE_NAME_POSTFIX;
-  //dvhArrayNodeName = this->GetMRMLScene()->GenerateUniqueName(dvhArrayNodeName);
-  //arrayNode->SetName(dvhArrayNodeName.c_str());
-  //arrayNode->HideFromEditorsOff();
+  // Trials are resampled from the dose in the requested internal representation,
+  // the nominal statistics above are always computed in the original precision
+  run->DosePrecision = this->MotionSimulatorNode->GetDosePrecision();
+  if (this->DoseResliceMatrix)
+  {
+    run->DoseResliceMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    run->DoseResliceMatrix->DeepCopy(this->DoseResliceMatrix);
+  }
+  double doseUnitValue = MarginCalculatorCommon::GetDoseUnitValue(doseVolumeNode);
+  run->DoseScale = 1.0;
+  run->TrialDoseVolume = vtkSmartPointer<vtkImageData>::New();
+  if (MarginCalculatorCommon::ConvertDoseImageData(resampledDoseVolume, run->DosePrecision, doseUnitValue, run->TrialDoseVolume, run->DoseScale) != 0)
+  {
+    vtkErrorMacro("Dose volume cannot be represented with dose precision " << run->DosePrecision << " (dose unit value: " << doseUnitValue << ")!");
+    this->ReleaseSimulation();
+    return -1;
+  }
+  if (downsamplingFactor > 1)
+  {
+    run->DownsampledTrialDoseVolume = vtkSmartPointer<vtkImageData>::New();
+    if (MarginCalculatorCommon::ConvertDoseImageData(downsampledDoseVolume, run->DosePrecision, doseUnitValue, run->DownsampledTrialDoseVolume, run->DoseScale) != 0)
+    {
+      vtkErrorMacro("Dose volume cannot be represented with dose precision " << run->DosePrecision << " (dose unit value: " << doseUnitValue << ")!");
+      this->ReleaseSimulation();
+      return -1;
+    }
+  }
 
-  //outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_TYPE_ATTRIBUTE_NAME.c_str(), SlicerRtCommon::DVH_TYPE_ATTRIBUTE_VALUE.c_str());
-  //outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_DOSE_VOLUME_NODE_ID_ATTRIBUTE_NAME.c_str(), doseVolumeNode->GetID());
-  outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_DVH_IDENTIFIER_ATTRIBUTE_NAME.c_str(), "1");
-  outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_STRUCTURE_NAME_ATTRIBUTE_NAME.c_str(), structureName.c_str());
-  //outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_STRUCTURE_CONTOUR_NODE_ID_ATTRIBUTE_NAME.c_str(), contourNode->GetID());
+  // Large runs are written to disk in chunks as the trials complete
+  if (run->NumberOfTrials > MOTION_MAX_IN_MEMORY_TRIALS)
+  {
+    run->TrialStore = vtkSmartPointer<vtkMotionSimulatorTrialStore>::New();
+    run->TrialStore->SetFileName(this->GetTrialStoreFileName(outputArrayNode).c_str());
+    run->TrialStore->RemoveFileOnDeleteOn();
+    if (run->TrialStore->OpenForWriting(5) != 0)
+    {
+      vtkErrorMacro("Unable to create trial store file " << run->TrialStore->GetFileName());
+      this->ReleaseSimulation();
+      return -1;
+    }
+  }
+  else
+  {
+    run->Trials = vtkSmartPointer<vtkDoubleArray>::New();
+    run->Trials->SetNumberOfComponents(5);
+    run->Trials->SetNumberOfTuples(run->NumberOfTrials);
+  }
+
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerMotionSimulatorModuleLogic::SimulateTrials()
+{
+  vtkSlicerMotionSimulatorRun* run = this->SimulationRun;
+  if (!run)
+  {
+    vtkErrorMacro("SimulateTrials: simulation is not prepared!");
+    return -1;
+  }
 
-  vtkDoubleArray* doubleArray = outputArrayNode->GetArray();
-  doubleArray->SetNumberOfTuples(this->MotionSimulatorNode->GetNumberOfSimulation());
-  doubleArray->SetNumberOfComponents(5);
-  int outputArrayIndex=0;
-
-  double xSysSD = this->MotionSimulatorNode->GetXSysSD();
-  double ySysSD = this->MotionSimulatorNode->GetYSysSD();
-  double zSysSD = this->MotionSimulatorNode->GetZSysSD();
-  double xRdmSD = this->MotionSimulatorNode->GetXRdmSD();
-  double yRdmSD = this->MotionSimulatorNode->GetYRdmSD();
-  double zRdmSD = this->MotionSimulatorNode->GetZRdmSD();
-
-  vtkSmartPointer<vtkBoxMuellerRandomSequence> Xdistribution = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
-  vtkSmartPointer<vtkBoxMuellerRandomSequence> Ydistribution = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
-  vtkSmartPointer<vtkBoxMuellerRandomSequence> Zdistribution = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
-  vtkSmartPointer<vtkBoxMuellerRandomSequence> Xdistribution2 = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
-  vtkSmartPointer<vtkBoxMuellerRandomSequence> Ydistribution2 = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
-  vtkSmartPointer<vtkBoxMuellerRandomSequence> Zdistribution2 = vtkSmartPointer<vtkBoxMuellerRandomSequence>::New();
-
-  for (int i = 0; i<this->MotionSimulatorNode->GetNumberOfSimulation(); i++)
+  std::vector<double> fractionShifts(3*run->NumberOfFractions, 0.0);
+  for (int i = 0; i<run->NumberOfTrials; i++)
   { 
-    vtkSmartPointer<vtkImageData> baseImageData = NULL;
-    
-    // Generate systematic error for all fractions, it stays the same over all fractions
-    double xSys = Xdistribution->GetScaledValue(0.0, xSysSD);
-    double ySys = Ydistribution->GetScaledValue(0.0, ySysSD);
-    double zSys = Zdistribution->GetScaledValue(0.0, zSysSD);
-    Xdistribution->Next();
-    Ydistribution->Next();
-    Zdistribution->Next();
-
-    double x = xSys + Xdistribution2->GetScaledValue(0.0, xRdmSD);
-    double y = ySys + Ydistribution2->GetScaledValue(0.0, yRdmSD);
-    double z = zSys + Zdistribution2->GetScaledValue(0.0, zRdmSD);
-    Xdistribution2->Next();
-    Ydistribution2->Next();
-    Zdistribution2->Next();
-
-    x = x < MOTION_MAX ? x : MOTION_MAX;
-    y = y < MOTION_MAX ? y : MOTION_MAX;
-    z = z < MOTION_MAX ? z : MOTION_MAX;
-
-    vtkSmartPointer<vtkTransform> transform = vtkSmartPointer<vtkTransform>::New();
-    transform->Identity();
-    transform->Translate(x, y, z);
-
-    vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
-#if (VTK_MAJOR_VERSION <= 5)
-    reslice->SetInput(resampledDoseVolume);
-#else
-    reslice->SetInputData(resampledDoseVolume);
-#endif
-    reslice->SetInformationInput(resampledDoseVolume);
-    reslice->SetResliceTransform(transform);
-    reslice->SetInterpolationModeToLinear();
-    reslice->UpdateWholeExtent();
-    
-    vtkSmartPointer<vtkImageData> translatedDoseVolume;
-    baseImageData = reslice->GetOutput();
-
-    if (this->MotionSimulatorNode->GetNumberOfFraction()>=2)
+    // Cancellation is cooperative, the trials completed so far are kept
+    if (this->IsCancelRequested())
     {
-      for (int j = 1; j<this->MotionSimulatorNode->GetNumberOfFraction(); j++)
-      { // Generate new random error for each new fraction
-        double x = xSys + Xdistribution2->GetScaledValue(0.0, xRdmSD);
-        double y = ySys + Ydistribution2->GetScaledValue(0.0, yRdmSD);
-        double z = zSys + Zdistribution2->GetScaledValue(0.0, zRdmSD);
-        Xdistribution2->Next();
-        Ydistribution2->Next();
-        Zdistribution2->Next();
-
-        x = x < MOTION_MAX ? x : MOTION_MAX;
-        y = y < MOTION_MAX ? y : MOTION_MAX;
-        z = z < MOTION_MAX ? z : MOTION_MAX;
-      
-        vtkSmartPointer<vtkTransform> transform = vtkSmartPointer<vtkTransform>::New();
-        transform->Identity();
-        transform->Translate(x, y, z);
-      
-        vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
-#if (VTK_MAJOR_VERSION <= 5)
-        reslice->SetInput(resampledDoseVolume);
-#else
-        reslice->SetInputData(resampledDoseVolume);
-#endif
-        reslice->SetInformationInput(resampledDoseVolume);
-        reslice->SetResliceTransform(transform);
-        reslice->UpdateWholeExtent();
-        
-        vtkSmartPointer<vtkImageData> translatedDoseVolume;
-        //translatedDoseVolume = reslice->GetOutput();
-      
-        vtkSmartPointer<vtkImageMathematics> adder = vtkSmartPointer<vtkImageMathematics>::New();
-#if (VTK_MAJOR_VERSION <= 5)
-        adder->SetInput1(baseImageData);
-        adder->SetInput2(reslice->GetOutput());
-#else
-        adder->SetInput1Data(baseImageData);
-        adder->SetInput2Data(reslice->GetOutput());
-#endif
-        adder->SetOperationToAdd();
-        adder->Update();
-         
-        baseImageData = adder->GetOutput();
+      break;
+    }
+
+    run->ShiftGenerator.NextTrial(fractionShifts);
+
+    double minDoseROI = 0.0;
+    double D98 = 0.0;
+    bool refine = true;
+    if (run->DownsamplingFactor > 1)
+    {
+      if (this->ComputeTrialStatistics(run->DownsampledTrialDoseVolume, run->DownsampledStencil, fractionShifts, run->DoseResliceMatrix, run->DosePrecision, run->DoseScale,
+        run->StartValue, run->StepSize, run->NumberOfSamples, minDoseROI, D98) == 0
+        && run->NominalD98Dose > EPSILON)
+      {
+        // Only the trials that may fall on either side of the threshold need the full resolution result
+        refine = ( fabs(D98*100.0/run->NominalD98Dose - run->RefinementThreshold) <= run->RefinementTolerance );
+      }
+      if (refine)
+      {
+        run->NumberOfRefinedTrials++;
       }
-    
-      vtkSmartPointer<vtkImageMathematics> MultiplyFilter1 = vtkSmartPointer<vtkImageMathematics>::New();
-#if (VTK_MAJOR_VERSION <= 5)
-      MultiplyFilter1->SetInput(baseImageData);
-#else
-      MultiplyFilter1->SetInputData(baseImageData);
-#endif
-      MultiplyFilter1->SetConstantK(1./this->MotionSimulatorNode->GetNumberOfFraction());
-      MultiplyFilter1->SetOperationToMultiplyByK();
-      MultiplyFilter1->Update();
-      baseImageData = MultiplyFilter1->GetOutput();
     }
-    
-    vtkSmartPointer<vtkImageAccumulate> structureStat = vtkSmartPointer<vtkImageAccumulate>::New();
-#if (VTK_MAJOR_VERSION <= 5)
-    structureStat->SetInput(baseImageData);
-    structureStat->SetStencil(structureStencil);
-#else
-    structureStat->SetInputData(baseImageData);
-    structureStat->SetStencilData(structureStencil);
-#endif
-    structureStat->SetComponentExtent(0,numSamples-1,0,0,0,0);
-    structureStat->SetComponentOrigin(startValue,0,0);
-    structureStat->SetComponentSpacing(stepSize,1,1);
-    structureStat->Update();
 
-    if (structureStat->GetVoxelCount() < 1)
+    if (refine && this->ComputeTrialStatistics(run->TrialDoseVolume, run->StructureStencil, fractionShifts, run->DoseResliceMatrix, run->DosePrecision, run->DoseScale,
+      run->StartValue, run->StepSize, run->NumberOfSamples, minDoseROI, D98) != 0)
     {
       vtkWarningMacro("No voxels in the structure. DVH computation aborted.");
-      return 0;
+      return -1;
     }
 
-    vtkSmartPointer<vtkDoubleArray> dvhArray = vtkSmartPointer<vtkDoubleArray>::New();
-    dvhArray->SetNumberOfComponents(2);
-    dvhArray->SetNumberOfTuples(numSamples);
-
-    vtkImageData* statArray = structureStat->GetOutput();
-    unsigned long totalVoxels = structureStat->GetVoxelCount();
-    //for (int sampleIndex=0; sampleIndex<numSamples; ++sampleIndex)
-    //{
-    //  unsigned long voxelsInBin = statArray->GetScalarComponentAsDouble(sampleIndex,0,0,0);
-    //  doubleArray->SetComponent( outputArrayIndex, 0, startValue + sampleIndex * stepSize );
-    //  doubleArray->SetComponent( outputArrayIndex, 1, (1.0-(double)voxelBelowDose/(double)totalVoxels)*100.0 );
-    //  ++outputArrayIndex;
-    //  voxelBelowDose += voxelsInBin;
-    //}
-    double D98 = 0.0;
-    double vlast = 0.0;
-    double dlast = 0.0;
-    unsigned long voxelBelowDose = 0;
-    for (int sampleIndex=0; sampleIndex<numSamples; ++sampleIndex)
+    double trialResult[5] = { fractionShifts[0], fractionShifts[1], fractionShifts[2], minDoseROI, D98 };
+    if (run->TrialStore)
     {
-      unsigned long voxelsInBin = statArray->GetScalarComponentAsDouble(sampleIndex,0,0,0);
-      if ( (1.0-(double)voxelBelowDose/(double)totalVoxels)*100.0 < 98 && vlast >= 98)
+      if (run->TrialStore->AppendTuple(trialResult) != 0)
       {
-        D98 = (startValue + sampleIndex * stepSize + dlast)/2;
+        vtkErrorMacro("Failed to write trial results to " << run->TrialStore->GetFileName());
+        return -1;
       }
-      vlast = (1.0-(double)voxelBelowDose/(double)totalVoxels)*100.0;
-      voxelBelowDose += voxelsInBin;
-      dlast = startValue + sampleIndex * stepSize;
     }
+    else
+    {
+      run->Trials->SetTuple(run->NumberOfSimulatedTrials, trialResult);
+    }
+    run->NumberOfSimulatedTrials++;
+    if (this->DPHAccumulator)
+    {
+      this->DPHAccumulator->AddTrial(minDoseROI, D98);
+    }
+    this->UpdateSimulationProgress(D98);
+  }
+
+  if (run->TrialStore && run->TrialStore->Close() != 0)
+  {
+    return -1;
+  }
 
-    double minDoseROI = structureStat->GetMin()[0];
-    doubleArray->SetComponent(outputArrayIndex, 0, x);
-    doubleArray->SetComponent(outputArrayIndex, 1, y);
-    doubleArray->SetComponent(outputArrayIndex, 2, z);
-    doubleArray->SetComponent(outputArrayIndex, 3, minDoseROI);
-    doubleArray->SetComponent(outputArrayIndex, 4, D98);
-    outputArrayIndex++;
+  // A cancelled run only contains the completed trials
+  if (run->Trials && run->NumberOfSimulatedTrials < run->Trials->GetNumberOfTuples())
+  {
+    run->Trials->SetNumberOfTuples(run->NumberOfSimulatedTrials);
   }
 
   return 0;
 }
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::StoreSimulationResults()
+{
+  vtkSlicerMotionSimulatorRun* run = this->SimulationRun;
+  vtkMRMLMotionSimulatorDoubleArrayNode* outputArrayNode = (this->MotionSimulatorNode ? this->MotionSimulatorNode->GetOutputDoubleArrayNode() : NULL);
+  if (!run || !outputArrayNode)
+  {
+    return;
+  }
+
+  int wasModifying = outputArrayNode->StartModify();
+
+  // Create node and fill statistics
+  //std::string dvhArrayNodeName = structureName + SlicerRtCommon::DVH_ARRAY_NODE_NAME_POSTFIX;
+  //dvhArrayNodeName = this->GetMRMLScene()->GenerateUniqueName(dvhArrayNodeName);
+  //arrayNode->SetName(dvhArrayNodeName.c_str());
+  //arrayNode->HideFromEditorsOff();
+
+  //outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_TYPE_ATTRIBUTE_NAME.c_str(), SlicerRtCommon::DVH_TYPE_ATTRIBUTE_VALUE.c_str());
+  //outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_DOSE_VOLUME_NODE_ID_ATTRIBUTE_NAME.c_str(), doseVolumeNode->GetID());
+  outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_DVH_IDENTIFIER_ATTRIBUTE_NAME.c_str(), "1");
+  outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_STRUCTURE_NAME_ATTRIBUTE_NAME.c_str(), run->StructureName.c_str());
+  //outputArrayNode->SetAttribute(MarginCalculatorCommon::DVH_STRUCTURE_CONTOUR_NODE_ID_ATTRIBUTE_NAME.c_str(), contourNode->GetID());
+
+  if (run->TrialStore)
+  {
+    outputArrayNode->SetTrialStore(run->TrialStore);
+  }
+  else
+  {
+    outputArrayNode->SetTrialStore(NULL);
+    // Copied so that results cached for the array are invalidated by its modification time
+    outputArrayNode->GetArray()->DeepCopy(run->Trials);
+  }
+
+  // Report how much of the run had to be computed on the full resolution grid
+  this->RefinedTrialFraction = (run->DownsamplingFactor > 1 && run->NumberOfSimulatedTrials > 0 ? (double)run->NumberOfRefinedTrials / run->NumberOfSimulatedTrials : 1.0);
+  std::ostringstream refinedTrialFractionStream;
+  refinedTrialFractionStream << this->RefinedTrialFraction;
+  outputArrayNode->SetAttribute(MarginCalculatorCommon::MOTIONSIMULATOR_REFINED_TRIAL_FRACTION_ATTRIBUTE_NAME.c_str(), refinedTrialFractionStream.str().c_str());
+
+  outputArrayNode->Modified();
+  outputArrayNode->EndModify(wasModifying);
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerMotionSimulatorModuleLogic::ReleaseSimulation()
+{
+  // A trial store that was not stored in the output node deletes its file
+  delete this->SimulationRun;
+  this->SimulationRun = NULL;
+}
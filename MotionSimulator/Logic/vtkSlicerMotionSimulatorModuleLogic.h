@@ -34,8 +34,14 @@
 
 // MRML includes
 
+// VTK includes
+#include <vtkMultiThreader.h>
+#include <vtkSmartPointer.h>
+
 // STD includes
 #include <cstdlib>
+#include <string>
+#include <vector>
 
 #include "vtkSlicerMotionSimulatorModuleLogicExport.h"
 
@@ -43,8 +49,14 @@ class vtkMRMLScalarVolumeNode;
 //class vtkMRMLContourNode;
 class vtkMRMLDoubleArrayListNode;
 class vtkMRMLMotionSimulatorNode;
+class vtkMRMLMotionSimulatorDoubleArrayNode;
+class vtkDoubleArray;
 class vtkImageData;
 class vtkImageStencilData;
+class vtkMatrix4x4;
+class vtkMutexLock;
+class vtkDosePopulationHistogramAccumulator;
+struct vtkSlicerMotionSimulatorRun;
 
 /// \ingroup Slicer_QtModules_ExtensionTemplate
 class VTK_SLICER_MOTIONSIMULATOR_MODULE_LOGIC_EXPORT vtkSlicerMotionSimulatorModuleLogic :
@@ -65,9 +77,113 @@ public:
   ///
   vtkGetObjectMacro(MotionSimulatorNode, vtkMRMLMotionSimulatorNode);
 
-  ///
+  /// Run the simulation on the calling thread.
+  /// Invokes vtkCommand::ProgressEvent after each trial with the completed fraction of the
+  /// trials as call data; the trial counts and the time estimate are available through
+  /// GetSimulationProgress(). Returns with the completed trials if a cancel was requested.
   int  RunSimulation();
 
+  /// Start the simulation on a worker thread. Returns -1 if a simulation is already running
+  /// or the inputs are invalid. The inputs are copied before the thread starts and the worker
+  /// does not touch the scene; ProgressEvent is not invoked, poll IsSimulationRunning() and
+  /// GetSimulationProgress() instead. The simulation is cancelled and discarded if the scene
+  /// is closed or one of its nodes is removed.
+  int  RunSimulationAsync();
+
+  /// Wait for the worker thread, store the trials in the output array node and
+  /// return the result of the simulation. Must be called from the thread that started it
+  int  FinishSimulationAsync();
+
+  /// Return true while the worker thread started by RunSimulationAsync() has not completed
+  bool IsSimulationRunning();
+
+  /// Ask the running simulation to stop after the current trial
+  void RequestCancel();
+
+  /// Return true if a cancel was requested for the current simulation
+  bool IsCancelRequested();
+
+  /// Get the progress of the current (or last) simulation.
+  /// The estimated time is in seconds, and the D98 statistics cover the completed trials only
+  void GetSimulationProgress( int &numberOfCompletedTrials, int &numberOfTrials, 
+                              double &estimatedTimeRemaining, 
+                              double &minimumD98, double &meanD98 );
+
+  /// Get the fraction of trials of the last run that were computed on the full resolution grid
+  /// (1.0 unless a downsampling factor is set in the parameter node)
+  vtkGetMacro(RefinedTrialFraction, double);
+
+  /// Set a voxel transform of the input dose to apply before the shift of each fraction.
+  /// The dose of a fraction at a voxel is then sampled from the input dose at the voxel shifted
+  /// and mapped by the matrix, so an affine morphology of the dose (e.g. the scaling returned by
+  /// vtkSlicerDoseMorphologyModuleLogic::GetScalingResliceMatrix) is simulated from the original dose
+  /// in a single resampling. The dose grid is kept, so it must match the contour as without the matrix.
+  /// NULL (the default) simulates the input dose as is.
+  void SetDoseResliceMatrix(vtkMatrix4x4* matrix);
+  vtkGetObjectMacro(DoseResliceMatrix, vtkMatrix4x4);
+
+  /// Set an accumulator the metrics of each completed trial are added to, so the dose population
+  /// histogram is available while the simulation runs. The trials of the accumulator are removed when
+  /// a simulation starts, its binning (see vtkSlicerDosePopulationHistogramModuleLogic::InitializeDPHAccumulator)
+  /// is kept. NULL (the default) does not accumulate.
+  void SetDPHAccumulator(vtkDosePopulationHistogramAccumulator* accumulator);
+  vtkGetObjectMacro(DPHAccumulator, vtkDosePopulationHistogramAccumulator);
+
+  /// Simulate the trials of a dose image without a scene, as RunSimulation does on the full resolution
+  /// grid. The dose and the contour labelmap images must have the same dimensions, the dose is in the
+  /// image data representation of the MorphDose output (see vtkSlicerDoseMorphologyModuleLogic::MorphDoseImage).
+  /// The number of trials and fractions, the errors and the dose precision are read from the parameter
+  /// node, which does not need to be in a scene; the downsampling factor is ignored. One tuple per trial
+  /// is written to the output array, with the components of the RunSimulation output. The progress is
+  /// not updated. The images go through pipelines, so use PrepareTrialsOfImage and SimulateTrialsOfPreparedImage
+  /// to simulate the same images on several threads.
+  /// If standard errors are given (see GenerateStandardErrors), the shifts of the trials are these draws
+  /// scaled by the error standard deviations of the parameter node, instead of new draws.
+  /// \return 0 on success, -1 on error
+  int SimulateTrialsOfImage(vtkImageData* doseImageData, double doseUnitValue, vtkImageData* contourImageData,
+                            vtkMRMLMotionSimulatorNode* parameterNode, vtkDoubleArray* outputTrials,
+                            vtkDoubleArray* standardErrors=NULL);
+
+  /// Dose and structure of SimulateTrialsOfImage, converted to the dose precision with the histogram
+  /// sampling and the dose reslice matrix of the time of the preparation
+  struct TrialsOfImageInput
+  {
+    TrialsOfImageInput() : DosePrecision(0), DoseScale(1.0), StartValue(0.0), StepSize(0.0), NumberOfSamples(0) { }
+
+    vtkSmartPointer<vtkImageData> DoseImageData;
+    vtkSmartPointer<vtkImageStencilData> StructureStencil;
+    /// NULL if no dose reslice matrix was set
+    vtkSmartPointer<vtkMatrix4x4> DoseResliceMatrix;
+    int DosePrecision;
+    double DoseScale;
+    double StartValue;
+    double StepSize;
+    int NumberOfSamples;
+  };
+
+  /// Prepare the simulation of a dose image as SimulateTrialsOfImage does, once for all the error
+  /// standard deviations it is simulated with. Runs on the calling thread.
+  /// \return 0 on success, -1 on error
+  int PrepareTrialsOfImage(vtkImageData* doseImageData, double doseUnitValue, vtkImageData* contourImageData,
+                           int dosePrecision, TrialsOfImageInput &preparedInput);
+
+  /// Copy a prepared input into objects of its own. The dose scalars are shared, they are only read.
+  static void CopyTrialsOfImageInput(const TrialsOfImageInput &source, TrialsOfImageInput &target);
+
+  /// Simulate the trials of a prepared input as SimulateTrialsOfImage does, the dose precision of the parameter
+  /// node is ignored. Only the input and the arguments are used, so threads may simulate at once if each of
+  /// them has its own copy of the input (see CopyTrialsOfImageInput). The metrics of each trial are added to
+  /// the given accumulator, not to the one set by SetDPHAccumulator.
+  /// \return 0 on success, -1 on error
+  int SimulateTrialsOfPreparedImage(const TrialsOfImageInput &preparedInput, vtkMRMLMotionSimulatorNode* parameterNode,
+                                    vtkDoubleArray* outputTrials, vtkDoubleArray* standardErrors=NULL,
+                                    vtkDosePopulationHistogramAccumulator* accumulator=NULL);
+
+  /// Draw standard normal setup errors of a series of trials, to simulate several error standard deviations
+  /// or doses with the same draws (common random numbers). One tuple per trial: the systematic errors of the
+  /// x, y, z axes, then the x, y, z random errors of each fraction. The same seed gives the same draws.
+  static void GenerateStandardErrors(int numberOfTrials, int numberOfFractions, int seed, vtkDoubleArray* standardErrors);
+
 protected:
   vtkSlicerMotionSimulatorModuleLogic();
   virtual ~vtkSlicerMotionSimulatorModuleLogic();
@@ -99,9 +215,91 @@ protected:
                              vtkImageData* resampledDoseVolume, 
                              vtkImageStencilData* structureStencil );
 
+  /// Resample the dose volume and the structure labelmap to a grid coarser by the given factor
+  void DownsampleDoseAndStencil( vtkImageData* doseVolume, 
+                                 vtkImageData* indexedLabelmap, 
+                                 int downsamplingFactor, 
+                                 vtkImageData* downsampledDoseVolume, 
+                                 vtkImageStencilData* downsampledStencil );
+
+  /// Compute minimum dose and D98 of the dose in the stencil. Returns -1 if the stencil is empty
+  int ComputeStructureStatistics( vtkImageData* doseVolume, 
+                                  vtkImageStencilData* structureStencil, 
+                                  double startValue, double stepSize, int numSamples, 
+                                  double &minDose, double &d98Dose );
+
+  /// Accumulate the dose of a trial over all fractions, then compute its structure statistics.
+  /// Fraction shifts are stored as consecutive x,y,z triplets, each followed by the dose reslice matrix if given.
+  /// The dose volume is in the given MARGINCALCULATOR_DOSE_PRECISION_* representation, its values multiplied
+  /// by doseScale give the dose. Returns -1 if the stencil is empty
+  int ComputeTrialStatistics( vtkImageData* doseVolume, 
+                              vtkImageStencilData* structureStencil, 
+                              const std::vector<double> &fractionShifts, 
+                              vtkMatrix4x4* doseResliceMatrix, 
+                              int dosePrecision, double doseScale, 
+                              double startValue, double stepSize, int numSamples, 
+                              double &minDose, double &d98Dose );
+
+  /// Get the file used to stream the trials of a large run into the output node.
+  /// It is created in the temporary directory of the application (TMPDIR/TEMP/TMP without one)
+  std::string GetTrialStoreFileName(vtkMRMLMotionSimulatorDoubleArrayNode* outputArrayNode);
+
   double StartValue;
   double StepSize;
   int    NumberOfSamples;
+
+  /// Fraction of trials refined on the full grid in the last run
+  double RefinedTrialFraction;
+
+  /// Voxel transform of the input dose composed with the fraction shifts, NULL if not used
+  vtkMatrix4x4* DoseResliceMatrix;
+
+  /// Dose population histogram the trial metrics are added to, NULL if not used
+  vtkDosePopulationHistogramAccumulator* DPHAccumulator;
+
+  /// Copy the inputs of a simulation from the scene, on the calling thread
+  int PrepareSimulation();
+
+  /// Run the trials of the prepared simulation, shared by RunSimulation() and RunSimulationAsync().
+  /// Only uses the data of the run, the results are kept in it until StoreSimulationResults()
+  int SimulateTrials();
+
+  /// Store the trials of the run in the output array node, on the thread owning the scene
+  void StoreSimulationResults();
+
+  /// Delete the prepared run and its unstored results
+  void ReleaseSimulation();
+
+  /// Cancel the running asynchronous simulation, wait for it and discard its results
+  void StopSimulationAsync();
+
+  /// Worker thread entry point of RunSimulationAsync()
+  static VTK_THREAD_RETURN_TYPE SimulationThreadFunction(void* arg);
+
+  /// Reset the progress counters at the start of a run
+  void InitializeSimulationProgress(int numberOfTrials);
+
+  /// Record a completed trial and invoke ProgressEvent when not running on the worker thread
+  void UpdateSimulationProgress(double d98Dose);
+
+  /// Thread used by RunSimulationAsync()
+  vtkMultiThreader* SimulationThreader;
+  int SimulationThreadID;
+  bool SimulationRunning;
+  int SimulationResult;
+
+  /// Inputs and results of the prepared simulation, NULL if none
+  vtkSlicerMotionSimulatorRun* SimulationRun;
+
+  /// Guards the progress and cancel state shared with the worker thread
+  vtkMutexLock* ProgressLock;
+  bool CancelRequested;
+  int NumberOfCompletedTrials;
+  int NumberOfTrials;
+  double SimulationStartTime;
+  double SimulationElapsedTime;
+  double MinimumTrialD98;
+  double SumTrialD98;
 private:
 
   vtkSlicerMotionSimulatorModuleLogic(const vtkSlicerMotionSimulatorModuleLogic&); // Not implemented
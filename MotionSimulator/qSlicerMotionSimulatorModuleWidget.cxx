@@ -21,11 +21,15 @@
 
 // Qt includes
 #include <QDebug>
+#include <QTimer>
 
 //
 #include <MarginCalculatorCommon.h>
 
 // SlicerQt includes
+#include <qSlicerCoreApplication.h>
+#include <qSlicerModuleManager.h>
+#include <qSlicerAbstractCoreModule.h>
 #include "qSlicerMotionSimulatorModuleWidget.h"
 #include "ui_qSlicerMotionSimulatorModule.h"
 
@@ -33,6 +37,9 @@
 #include "vtkSlicerMotionSimulatorModuleLogic.h"
 #include "vtkMRMLMotionSimulatorNode.h"
 
+// Dose population histogram includes
+#include <vtkSlicerDosePopulationHistogramModuleLogic.h>
+
 // MRML includes
 #include <vtkMRMLScalarVolumeNode.h>
 //#include <vtkMRMLContourNode.h>
@@ -60,6 +67,8 @@ public:
   ~qSlicerMotionSimulatorModuleWidgetPrivate();
   vtkSlicerMotionSimulatorModuleLogic* logic() const;
 
+  /// Polls the logic while a simulation runs in the background
+  QTimer* SimulationTimer;
 };
 
 //-----------------------------------------------------------------------------
@@ -69,6 +78,7 @@ public:
 qSlicerMotionSimulatorModuleWidgetPrivate::qSlicerMotionSimulatorModuleWidgetPrivate(qSlicerMotionSimulatorModuleWidget& object)
   : q_ptr(&object)
 {
+  this->SimulationTimer = NULL;
 }
 
 //-----------------------------------------------------------------------------
@@ -242,6 +252,11 @@ void qSlicerMotionSimulatorModuleWidget::setup()
   this->connect( d->lineEdit_NumberOfFractions, SIGNAL(textChanged(QString)), this, SLOT(lineEditNumberOfFractionsChanged(QString)));
 
   this->connect( d->pushButton_RunSimulation, SIGNAL(clicked()), this, SLOT(runSimulationClicked()) );
+  this->connect( d->pushButton_CancelSimulation, SIGNAL(clicked()), this, SLOT(cancelSimulationClicked()) );
+
+  d->SimulationTimer = new QTimer(this);
+  d->SimulationTimer->setInterval(200);
+  this->connect( d->SimulationTimer, SIGNAL(timeout()), this, SLOT(onSimulationTimerTimeout()) );
 
   this->updateButtonsState();
 }
@@ -460,7 +475,14 @@ void qSlicerMotionSimulatorModuleWidget::updateButtonsState()
     return;
   }
 
-  d->pushButton_RunSimulation->setEnabled(true);
+  // Inputs must not change while the simulation runs in the background
+  bool simulationRunning = (d->SimulationTimer && d->SimulationTimer->isActive());
+  d->pushButton_RunSimulation->setEnabled(!simulationRunning);
+  d->pushButton_CancelSimulation->setEnabled(simulationRunning);
+  d->MRMLNodeComboBox_ParameterSet->setEnabled(!simulationRunning);
+  d->CTKCollapsibleButton_Input->setEnabled(!simulationRunning);
+  d->CollapsibleButton_MotionParameters->setEnabled(!simulationRunning);
+  d->CollapsibleButton_Output->setEnabled(!simulationRunning);
 }
 
 //-----------------------------------------------------------------------------
@@ -468,11 +490,93 @@ void qSlicerMotionSimulatorModuleWidget::runSimulationClicked()
 {
   Q_D(qSlicerMotionSimulatorModuleWidget);
 
-  QApplication::setOverrideCursor(QCursor(Qt::BusyCursor));
+  // Bin the trials for the dose population histogram while they are simulated, if it is computed from this output
+  vtkSlicerDosePopulationHistogramModuleLogic* dphLogic = NULL;
+  qSlicerAbstractCoreModule* dphModule = qSlicerCoreApplication::application()->moduleManager()->module("DosePopulationHistogram");
+  if (dphModule)
+  {
+    dphLogic = vtkSlicerDosePopulationHistogramModuleLogic::SafeDownCast(dphModule->logic());
+  }
+  vtkMRMLMotionSimulatorNode* paramNode = d->logic()->GetMotionSimulatorNode();
+  d->logic()->SetDPHAccumulator( (dphLogic && paramNode) ? dphLogic->StartDPHAccumulation(paramNode->GetOutputDoubleArrayNode()) : NULL );
+
+  // perform the simulation off the GUI thread
+  d->progressBar_Simulation->setValue(0);
+  if (d->logic()->RunSimulationAsync() != 0)
+  {
+    d->label_SimulationStatus->setText(tr("Unable to start the simulation"));
+    return;
+  }
+
+  d->label_SimulationStatus->setText(tr("Simulation started"));
+  d->SimulationTimer->start();
+  this->updateButtonsState();
+}
+
+//-----------------------------------------------------------------------------
+void qSlicerMotionSimulatorModuleWidget::cancelSimulationClicked()
+{
+  Q_D(qSlicerMotionSimulatorModuleWidget);
+
+  d->logic()->RequestCancel();
+  d->pushButton_CancelSimulation->setEnabled(false);
+  d->label_SimulationStatus->setText(tr("Cancelling after the current trial..."));
+}
+
+//-----------------------------------------------------------------------------
+void qSlicerMotionSimulatorModuleWidget::onSimulationTimerTimeout()
+{
+  Q_D(qSlicerMotionSimulatorModuleWidget);
+
+  bool simulationRunning = d->logic()->IsSimulationRunning();
+
+  int numberOfCompletedTrials = 0;
+  int numberOfTrials = 0;
+  double estimatedTimeRemaining = 0.0;
+  double minimumD98 = 0.0;
+  double meanD98 = 0.0;
+  d->logic()->GetSimulationProgress(numberOfCompletedTrials, numberOfTrials, estimatedTimeRemaining, minimumD98, meanD98);
+
+  d->progressBar_Simulation->setMaximum(numberOfTrials > 0 ? numberOfTrials : 1);
+  d->progressBar_Simulation->setValue(numberOfCompletedTrials);
+
+  // Partial results of the completed trials
+  QString status = tr("%1 of %2 trials").arg(numberOfCompletedTrials).arg(numberOfTrials);
+  if (numberOfCompletedTrials > 0)
+  {
+    status += tr(", D98 min %1 / mean %2").arg(minimumD98, 0, 'f', 2).arg(meanD98, 0, 'f', 2);
+  }
+
+  if (simulationRunning)
+  {
+    if (d->pushButton_CancelSimulation->isEnabled() && numberOfCompletedTrials > 0)
+    {
+      status += tr(", about %1 s remaining").arg(estimatedTimeRemaining, 0, 'f', 0);
+    }
+    else if (!d->pushButton_CancelSimulation->isEnabled())
+    {
+      status += tr(", cancelling...");
+    }
+    d->label_SimulationStatus->setText(status);
+    return;
+  }
 
-  // perform the simulation
-  d->logic()->RunSimulation();
+  // The worker is done, publish the output on the GUI thread
+  d->SimulationTimer->stop();
+  if (d->logic()->FinishSimulationAsync() != 0)
+  {
+    status = tr("Simulation failed after ") + status;
+  }
+  else if (d->logic()->IsCancelRequested() && numberOfCompletedTrials < numberOfTrials)
+  {
+    status = tr("Simulation cancelled after ") + status;
+  }
+  else
+  {
+    status = tr("Simulation completed: ") + status;
+  }
+  d->label_SimulationStatus->setText(status);
 
-  QApplication::restoreOverrideCursor();
+  this->updateButtonsState();
 }
 
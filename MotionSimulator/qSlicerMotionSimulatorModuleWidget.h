@@ -86,6 +86,11 @@ protected slots:
 
   void runSimulationClicked();
 
+  void cancelSimulationClicked();
+
+  /// Poll the progress of the simulation running in the background
+  void onSimulationTimerTimeout();
+
 protected:
   QScopedPointer<qSlicerMotionSimulatorModuleWidgetPrivate> d_ptr;
   
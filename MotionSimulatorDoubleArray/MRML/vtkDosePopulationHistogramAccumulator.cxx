@@ -0,0 +1,491 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program, 
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// MotionSimulatorDoubleArray includes
+#include "vtkDosePopulationHistogramAccumulator.h"
+
+// VTK includes
+#include <vtkDoubleArray.h>
+#include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
+#include <vtkObjectFactory.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+
+// Number of bins the histogram starts with
+static const int DPH_ACCUMULATOR_MINIMUM_NUMBER_OF_BINS = 100;
+
+//----------------------------------------------------------------------------
+/// Resampling work shared by the bootstrap threads
+struct vtkDosePopulationHistogramBootstrapData
+{
+  /// Level of each trial
+  const int* TrialLevels;
+  vtkIdType NumberOfTrials;
+  int NumberOfLevels;
+  int NumberOfResamples;
+  int Seed;
+  /// Population at each level of each resample, NumberOfResamples rows of NumberOfLevels values
+  double* Populations;
+};
+
+//----------------------------------------------------------------------------
+/// SplitMix64 step, used as a fast random stream that can be started at any resample
+static vtkTypeUInt64 vtkDosePopulationHistogramNextRandom(vtkTypeUInt64 &state)
+{
+  state += vtkTypeUInt64(0x9E3779B97F4A7C15ULL);
+  vtkTypeUInt64 value = state;
+  value = (value ^ (value >> 30)) * vtkTypeUInt64(0xBF58476D1CE4E5B9ULL);
+  value = (value ^ (value >> 27)) * vtkTypeUInt64(0x94D049BB133111EBULL);
+  return value ^ (value >> 31);
+}
+
+//----------------------------------------------------------------------------
+static VTK_THREAD_RETURN_TYPE vtkDosePopulationHistogramBootstrapThread(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* threadInfo = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  vtkDosePopulationHistogramBootstrapData* data = static_cast<vtkDosePopulationHistogramBootstrapData*>(threadInfo->UserData);
+
+  int firstResample = (int)((vtkIdType)data->NumberOfResamples * threadInfo->ThreadID / threadInfo->NumberOfThreads);
+  int lastResample = (int)((vtkIdType)data->NumberOfResamples * (threadInfo->ThreadID+1) / threadInfo->NumberOfThreads);
+
+  std::vector<vtkIdType> resampleLevels(data->NumberOfLevels);
+  for (int resampleIndex = firstResample; resampleIndex < lastResample; resampleIndex++)
+  {
+    // Each resample has its own stream, so the result does not depend on the number of threads
+    vtkTypeUInt64 state = ((vtkTypeUInt64)(unsigned int)data->Seed << 32) ^ (vtkTypeUInt64)resampleIndex;
+    state = vtkDosePopulationHistogramNextRandom(state);
+
+    std::fill(resampleLevels.begin(), resampleLevels.end(), 0);
+    for (vtkIdType drawIndex = 0; drawIndex < data->NumberOfTrials; drawIndex++)
+    {
+      vtkIdType trialIndex = (vtkIdType)((vtkDosePopulationHistogramNextRandom(state) >> 11) * (1.0/9007199254740992.0) * data->NumberOfTrials);
+      if (trialIndex >= data->NumberOfTrials)
+      {
+        trialIndex = data->NumberOfTrials - 1;
+      }
+      resampleLevels[data->TrialLevels[trialIndex]]++;
+    }
+
+    double* population = data->Populations + (vtkIdType)resampleIndex * data->NumberOfLevels;
+    vtkIdType numberBelowLevel = 0;
+    for (int levelIndex = 0; levelIndex < data->NumberOfLevels; ++levelIndex)
+    {
+      population[levelIndex] = (1.0-(double)numberBelowLevel/(double)data->NumberOfTrials)*100.0;
+      numberBelowLevel += resampleLevels[levelIndex];
+    }
+  }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+/// Set a row of a histogram array, the bands are only set if the array has them
+static void vtkDosePopulationHistogramSetTuple(vtkDoubleArray* histogram, vtkIdType tupleIndex, double dose, double population,
+                                               double lowerPopulation, double upperPopulation)
+{
+  histogram->SetComponent( tupleIndex, 0, dose );
+  histogram->SetComponent( tupleIndex, 1, population );
+  histogram->SetComponent( tupleIndex, 2, 0 );
+  if (histogram->GetNumberOfComponents() == 5)
+  {
+    histogram->SetComponent( tupleIndex, 3, lowerPopulation );
+    histogram->SetComponent( tupleIndex, 4, upperPopulation );
+  }
+}
+
+//----------------------------------------------------------------------------
+vtkStandardNewMacro(vtkDosePopulationHistogramAccumulator);
+
+//----------------------------------------------------------------------------
+vtkDosePopulationHistogramAccumulator::vtkDosePopulationHistogramAccumulator()
+{
+  this->UseDoseOption = 1;
+  this->DoseNormalizationFactor = 1.0;
+  this->StartValue = 0.1;
+  this->StepSize = 1.0;
+  this->BootstrapSeed = 1;
+  this->NumberOfThreads = 0;
+  this->Bins.resize(DPH_ACCUMULATOR_MINIMUM_NUMBER_OF_BINS, 0);
+  this->NumberOfTrials = 0;
+  this->NumberOfSortedTrialDoses = 0;
+  this->Lock = vtkMutexLock::New();
+}
+
+//----------------------------------------------------------------------------
+vtkDosePopulationHistogramAccumulator::~vtkDosePopulationHistogramAccumulator()
+{
+  this->Lock->Delete();
+}
+
+//----------------------------------------------------------------------------
+void vtkDosePopulationHistogramAccumulator::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "UseDoseOption:   " << this->UseDoseOption << "\n";
+  os << indent << "DoseNormalizationFactor:   " << this->DoseNormalizationFactor << "\n";
+  os << indent << "StartValue:   " << this->StartValue << "\n";
+  os << indent << "StepSize:   " << this->StepSize << "\n";
+  os << indent << "BootstrapSeed:   " << this->BootstrapSeed << "\n";
+  os << indent << "NumberOfThreads:   " << this->NumberOfThreads << "\n";
+  os << indent << "NumberOfBins:   " << this->Bins.size() << "\n";
+  os << indent << "NumberOfTrials:   " << this->NumberOfTrials << "\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkDosePopulationHistogramAccumulator::CopyBinningParameters(vtkDosePopulationHistogramAccumulator* source)
+{
+  if (!source)
+  {
+    vtkErrorMacro("CopyBinningParameters: Invalid source accumulator!");
+    return;
+  }
+  this->SetUseDoseOption(source->GetUseDoseOption());
+  this->SetDoseNormalizationFactor(source->GetDoseNormalizationFactor());
+  this->SetStartValue(source->GetStartValue());
+  this->SetStepSize(source->GetStepSize());
+}
+
+//----------------------------------------------------------------------------
+bool vtkDosePopulationHistogramAccumulator::IsBinningEqual(vtkDosePopulationHistogramAccumulator* other)
+{
+  return ( other != NULL
+    && this->UseDoseOption == other->GetUseDoseOption()
+    && this->DoseNormalizationFactor == other->GetDoseNormalizationFactor()
+    && this->StartValue == other->GetStartValue()
+    && this->StepSize == other->GetStepSize() );
+}
+
+//----------------------------------------------------------------------------
+void vtkDosePopulationHistogramAccumulator::RemoveAllTrials()
+{
+  this->Lock->Lock();
+  this->Bins.assign(DPH_ACCUMULATOR_MINIMUM_NUMBER_OF_BINS, 0);
+  this->NumberOfTrials = 0;
+  this->TrialDoses.clear();
+  this->NumberOfSortedTrialDoses = 0;
+  this->Lock->Unlock();
+}
+
+//----------------------------------------------------------------------------
+void vtkDosePopulationHistogramAccumulator::AddTrial(double minDose, double d98Dose)
+{
+  this->Lock->Lock();
+  this->NumberOfTrials++;
+  if (this->UseDoseOption == 0 || this->UseDoseOption == 1)
+  {
+    double dose = (this->UseDoseOption == 0 ? minDose : d98Dose) * this->DoseNormalizationFactor;
+    this->TrialDoses.push_back(dose);
+
+    int binIndex = (int)(dose/this->StepSize);
+    if (binIndex < 0)
+    {
+      binIndex = 0;
+    }
+    if (binIndex+1 > (int)this->Bins.size())
+    {
+      this->Bins.resize(binIndex+1, 0);
+    }
+    this->Bins[binIndex]++;
+  }
+  this->Lock->Unlock();
+}
+
+//----------------------------------------------------------------------------
+vtkIdType vtkDosePopulationHistogramAccumulator::GetNumberOfTrials()
+{
+  this->Lock->Lock();
+  vtkIdType numberOfTrials = this->NumberOfTrials;
+  this->Lock->Unlock();
+  return numberOfTrials;
+}
+
+//----------------------------------------------------------------------------
+void vtkDosePopulationHistogramAccumulator::SortTrialDoses()
+{
+  if (this->NumberOfSortedTrialDoses == this->TrialDoses.size())
+  {
+    return;
+  }
+  std::vector<double>::iterator firstUnsorted = this->TrialDoses.begin() + this->NumberOfSortedTrialDoses;
+  std::sort(firstUnsorted, this->TrialDoses.end());
+  std::inplace_merge(this->TrialDoses.begin(), firstUnsorted, this->TrialDoses.end());
+  this->NumberOfSortedTrialDoses = this->TrialDoses.size();
+}
+
+//----------------------------------------------------------------------------
+double vtkDosePopulationHistogramAccumulator::GetPopulationAtDose(double dose)
+{
+  this->Lock->Lock();
+  this->SortTrialDoses();
+  double population = 0.0;
+  if (this->NumberOfTrials > 0)
+  {
+    vtkIdType numberBelowDose = std::lower_bound(this->TrialDoses.begin(), this->TrialDoses.end(), dose) - this->TrialDoses.begin();
+    population = (1.0-(double)numberBelowDose/(double)this->NumberOfTrials)*100.0;
+  }
+  this->Lock->Unlock();
+  return population;
+}
+
+//----------------------------------------------------------------------------
+int vtkDosePopulationHistogramAccumulator::ComputeBootstrapBands(const std::vector<int> &trialLevels, int numberOfLevels, int numberOfResamples,
+                                                                 double confidenceLevel, std::vector<double> &lowerBand, std::vector<double> &upperBand)
+{
+  if (numberOfResamples <= 0 || confidenceLevel <= 0.0 || confidenceLevel >= 100.0)
+  {
+    vtkErrorMacro("ComputeBootstrapBands: Invalid number of resamples " << numberOfResamples << " or confidence level " << confidenceLevel << "!");
+    return -1;
+  }
+
+  lowerBand.assign(numberOfLevels, 0.0);
+  upperBand.assign(numberOfLevels, 0.0);
+  if (trialLevels.empty() || numberOfLevels <= 0)
+  {
+    return 0;
+  }
+
+  std::vector<double> populations((size_t)numberOfResamples * numberOfLevels);
+  vtkDosePopulationHistogramBootstrapData data;
+  data.TrialLevels = &trialLevels[0];
+  data.NumberOfTrials = (vtkIdType)trialLevels.size();
+  data.NumberOfLevels = numberOfLevels;
+  data.NumberOfResamples = numberOfResamples;
+  data.Seed = this->BootstrapSeed;
+  data.Populations = &populations[0];
+
+  vtkMultiThreader* threader = vtkMultiThreader::New();
+  if (this->NumberOfThreads > 0)
+  {
+    threader->SetNumberOfThreads(this->NumberOfThreads);
+  }
+  if (threader->GetNumberOfThreads() > numberOfResamples)
+  {
+    threader->SetNumberOfThreads(numberOfResamples);
+  }
+  threader->SetSingleMethod(vtkDosePopulationHistogramBootstrapThread, &data);
+  threader->SingleMethodExecute();
+  threader->Delete();
+
+  // Pointwise percentiles of the resampled curves
+  double tailFraction = (1.0 - confidenceLevel/100.0) / 2.0;
+  int lowerRank = (int)floor(tailFraction * (numberOfResamples-1) + 0.5);
+  int upperRank = numberOfResamples - 1 - lowerRank;
+  std::vector<double> levelPopulations(numberOfResamples);
+  for (int levelIndex=0; levelIndex<numberOfLevels; ++levelIndex)
+  {
+    for (int resampleIndex=0; resampleIndex<numberOfResamples; ++resampleIndex)
+    {
+      levelPopulations[resampleIndex] = populations[(size_t)resampleIndex * numberOfLevels + levelIndex];
+    }
+    std::nth_element(levelPopulations.begin(), levelPopulations.begin() + lowerRank, levelPopulations.end());
+    lowerBand[levelIndex] = levelPopulations[lowerRank];
+    std::nth_element(levelPopulations.begin(), levelPopulations.begin() + upperRank, levelPopulations.end());
+    upperBand[levelIndex] = levelPopulations[upperRank];
+  }
+
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+void vtkDosePopulationHistogramAccumulator::GetHistogram(vtkDoubleArray* histogram)
+{
+  this->GetHistogramWithBootstrapBands(histogram, 0, 0.0);
+}
+
+//----------------------------------------------------------------------------
+int vtkDosePopulationHistogramAccumulator::GetHistogramWithBootstrapBands(vtkDoubleArray* histogram, int numberOfResamples, double confidenceLevel)
+{
+  if (!histogram)
+  {
+    vtkErrorMacro("GetHistogramWithBootstrapBands: Invalid output array!");
+    return -1;
+  }
+
+  // Trials may still be added while the bands are computed, work on a copy of the bins
+  this->Lock->Lock();
+  std::vector<vtkIdType> bins(this->Bins);
+  vtkIdType numberOfTrials = this->NumberOfTrials;
+  this->Lock->Unlock();
+  int numberOfBins = (int)bins.size();
+
+  // The trials sorted once by a counting pass over the bins: the level of a trial is its bin
+  std::vector<double> lowerBand;
+  std::vector<double> upperBand;
+  if (numberOfResamples > 0)
+  {
+    std::vector<int> trialBins;
+    trialBins.reserve(numberOfTrials);
+    for (int binIndex=0; binIndex<numberOfBins; ++binIndex)
+    {
+      trialBins.insert(trialBins.end(), (size_t)bins[binIndex], binIndex);
+    }
+    if (this->ComputeBootstrapBands(trialBins, numberOfBins, numberOfResamples, confidenceLevel, lowerBand, upperBand) != 0)
+    {
+      return -1;
+    }
+  }
+
+  histogram->SetNumberOfComponents(numberOfResamples > 0 ? 5 : 3);
+  histogram->SetNumberOfTuples(numberOfBins + 1);
+
+  // Add first fixed point at (0.0, 100%)
+  vtkDosePopulationHistogramSetTuple(histogram, 0, 0.0, 100.0, 100.0, 100.0);
+
+  vtkIdType numberBelowDose = 0;
+  for (int sampleIndex=0; sampleIndex<numberOfBins; ++sampleIndex)
+  {
+    double population = (1.0-(double)numberBelowDose/(double)numberOfTrials)*100.0;
+    vtkDosePopulationHistogramSetTuple( histogram, sampleIndex+1, this->StartValue + sampleIndex * this->StepSize, population,
+      (numberOfTrials > 0 && numberOfResamples > 0 ? lowerBand[sampleIndex] : population),
+      (numberOfTrials > 0 && numberOfResamples > 0 ? upperBand[sampleIndex] : population) );
+    numberBelowDose += bins[sampleIndex];
+  }
+
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkDosePopulationHistogramAccumulator::GetExactHistogram(vtkDoubleArray* histogram, int numberOfResamples, double confidenceLevel)
+{
+  if (!histogram)
+  {
+    vtkErrorMacro("GetExactHistogram: Invalid output array!");
+    return -1;
+  }
+
+  this->Lock->Lock();
+  this->SortTrialDoses();
+  std::vector<double> trialDoses(this->TrialDoses);
+  this->Lock->Unlock();
+  vtkIdType numberOfTrials = (vtkIdType)trialDoses.size();
+
+  // Level of a trial: 1 + index of its dose among the distinct doses. The population at the
+  // k-th distinct dose is then that of level k+1, the population just above it that of level k+2.
+  std::vector<int> trialLevels(numberOfTrials);
+  int numberOfDistinctDoses = 0;
+  for (vtkIdType trialIndex=0; trialIndex<numberOfTrials; ++trialIndex)
+  {
+    if (trialIndex == 0 || trialDoses[trialIndex] != trialDoses[trialIndex-1])
+    {
+      numberOfDistinctDoses++;
+    }
+    trialLevels[trialIndex] = numberOfDistinctDoses;
+  }
+
+  std::vector<double> lowerBand;
+  std::vector<double> upperBand;
+  if (numberOfResamples > 0 && this->ComputeBootstrapBands(trialLevels, numberOfDistinctDoses + 2, numberOfResamples, confidenceLevel, lowerBand, upperBand) != 0)
+  {
+    return -1;
+  }
+
+  histogram->SetNumberOfComponents(numberOfResamples > 0 ? 5 : 3);
+  histogram->SetNumberOfTuples(2 * numberOfDistinctDoses + 1);
+  vtkDosePopulationHistogramSetTuple(histogram, 0, 0.0, 100.0, 100.0, 100.0);
+
+  // Each distinct dose is a step: population receiving at least the dose, then more than the dose
+  vtkIdType firstTrialIndex = 0;
+  for (int doseIndex=0; doseIndex<numberOfDistinctDoses; ++doseIndex)
+  {
+    double dose = trialDoses[firstTrialIndex];
+    vtkIdType endTrialIndex = firstTrialIndex;
+    while (endTrialIndex < numberOfTrials && trialDoses[endTrialIndex] == dose)
+    {
+      endTrialIndex++;
+    }
+    double populationAtDose = (1.0-(double)firstTrialIndex/(double)numberOfTrials)*100.0;
+    double populationAboveDose = (1.0-(double)endTrialIndex/(double)numberOfTrials)*100.0;
+    vtkDosePopulationHistogramSetTuple( histogram, 2*doseIndex+1, dose, populationAtDose,
+      (numberOfResamples > 0 ? lowerBand[doseIndex+1] : populationAtDose), (numberOfResamples > 0 ? upperBand[doseIndex+1] : populationAtDose) );
+    vtkDosePopulationHistogramSetTuple( histogram, 2*doseIndex+2, dose, populationAboveDose,
+      (numberOfResamples > 0 ? lowerBand[doseIndex+2] : populationAboveDose), (numberOfResamples > 0 ? upperBand[doseIndex+2] : populationAboveDose) );
+    firstTrialIndex = endTrialIndex;
+  }
+
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkDosePopulationHistogramAccumulator::GetHistogramAtDoses(vtkDoubleArray* doses, vtkDoubleArray* histogram, int numberOfResamples, double confidenceLevel)
+{
+  if (!doses || !histogram)
+  {
+    vtkErrorMacro("GetHistogramAtDoses: Invalid dose or output array!");
+    return -1;
+  }
+
+  this->Lock->Lock();
+  this->SortTrialDoses();
+  std::vector<double> trialDoses(this->TrialDoses);
+  this->Lock->Unlock();
+  vtkIdType numberOfTrials = (vtkIdType)trialDoses.size();
+
+  // Axis doses in increasing order, with their row in the output
+  int numberOfDoses = doses->GetNumberOfTuples();
+  std::vector< std::pair<double, int> > sortedDoses(numberOfDoses);
+  for (int doseIndex=0; doseIndex<numberOfDoses; ++doseIndex)
+  {
+    sortedDoses[doseIndex] = std::make_pair(doses->GetComponent(doseIndex, 0), doseIndex);
+  }
+  std::sort(sortedDoses.begin(), sortedDoses.end());
+
+  // Level of a trial: number of axis doses it reaches, so the population at the k-th
+  // sorted axis dose is that of level k+1. Both lists are sorted, a single merge pass assigns them.
+  std::vector<int> trialLevels(numberOfTrials);
+  int numberOfReachedDoses = 0;
+  for (vtkIdType trialIndex=0; trialIndex<numberOfTrials; ++trialIndex)
+  {
+    while (numberOfReachedDoses < numberOfDoses && sortedDoses[numberOfReachedDoses].first <= trialDoses[trialIndex])
+    {
+      numberOfReachedDoses++;
+    }
+    trialLevels[trialIndex] = numberOfReachedDoses;
+  }
+
+  std::vector<double> lowerBand;
+  std::vector<double> upperBand;
+  if (numberOfResamples > 0 && this->ComputeBootstrapBands(trialLevels, numberOfDoses + 1, numberOfResamples, confidenceLevel, lowerBand, upperBand) != 0)
+  {
+    return -1;
+  }
+
+  histogram->SetNumberOfComponents(numberOfResamples > 0 ? 5 : 3);
+  histogram->SetNumberOfTuples(numberOfDoses);
+  for (int sortedDoseIndex=0; sortedDoseIndex<numberOfDoses; ++sortedDoseIndex)
+  {
+    double dose = sortedDoses[sortedDoseIndex].first;
+    double population = 0.0;
+    if (numberOfTrials > 0)
+    {
+      vtkIdType numberBelowDose = std::lower_bound(trialDoses.begin(), trialDoses.end(), dose) - trialDoses.begin();
+      population = (1.0-(double)numberBelowDose/(double)numberOfTrials)*100.0;
+    }
+    vtkDosePopulationHistogramSetTuple( histogram, sortedDoses[sortedDoseIndex].second, dose, population,
+      (numberOfResamples > 0 ? lowerBand[sortedDoseIndex+1] : population), (numberOfResamples > 0 ? upperBand[sortedDoseIndex+1] : population) );
+  }
+
+  return 0;
+}
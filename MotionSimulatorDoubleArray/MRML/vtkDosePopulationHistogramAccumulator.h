@@ -0,0 +1,157 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program, 
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// .NAME vtkDosePopulationHistogramAccumulator - incremental dose population histogram of simulation trials
+// .SECTION Description
+// Trial metrics are added one by one and binned the same way as
+// vtkSlicerDosePopulationHistogramModuleLogic::ComputeDPH, so the population histogram
+// can be read at any time while trials are added, without intermediate MRML nodes.
+// The normalized trial doses are also kept sorted, so the exact population curve can be
+// queried at any dose without binning.
+// Adding trials and reading the histogram may happen on different threads.
+
+#ifndef __vtkDosePopulationHistogramAccumulator_h
+#define __vtkDosePopulationHistogramAccumulator_h
+
+// VTK includes
+#include <vtkObject.h>
+
+// STD includes
+#include <vector>
+
+#include "vtkSlicerMotionSimulatorDoubleArrayModuleMRMLExport.h"
+
+class vtkDoubleArray;
+class vtkMutexLock;
+
+class VTK_SLICER_MOTIONSIMULATORDOUBLEARRAY_MODULE_MRML_EXPORT vtkDosePopulationHistogramAccumulator : public vtkObject
+{
+public:
+  static vtkDosePopulationHistogramAccumulator *New();
+  vtkTypeMacro(vtkDosePopulationHistogramAccumulator, vtkObject);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  /// Get/Set which trial metric is binned: 0 for the minimum dose, 1 for D98 (same values as ART_DPH_USEDMIN and ART_DPH_USED98)
+  vtkSetMacro(UseDoseOption, int);
+  vtkGetMacro(UseDoseOption, int);
+
+  /// Get/Set the factor the trial metric is multiplied with before binning (100 / nominal dose for percent of nominal)
+  vtkSetMacro(DoseNormalizationFactor, double);
+  vtkGetMacro(DoseNormalizationFactor, double);
+
+  /// Get/Set the dose of the first bin in the histogram
+  vtkSetMacro(StartValue, double);
+  vtkGetMacro(StartValue, double);
+
+  /// Get/Set the bin width in normalized dose
+  vtkSetMacro(StepSize, double);
+  vtkGetMacro(StepSize, double);
+
+  /// Copy the metric, normalization and binning parameters of another accumulator
+  void CopyBinningParameters(vtkDosePopulationHistogramAccumulator* source);
+
+  /// Return true if the metric, normalization and binning parameters equal those of another accumulator
+  bool IsBinningEqual(vtkDosePopulationHistogramAccumulator* other);
+
+  /// Remove all trials, the binning parameters are kept
+  void RemoveAllTrials();
+
+  /// Add the metrics of a completed trial
+  void AddTrial(double minDose, double d98Dose);
+
+  /// Get the number of trials added since the last RemoveAllTrials
+  vtkIdType GetNumberOfTrials();
+
+  /// Write the population histogram of the trials added so far: dose, percentage of trials
+  /// receiving at least that dose and a zero third component, starting with the point (0, 100%)
+  void GetHistogram(vtkDoubleArray* histogram);
+
+  /// Write the population histogram as GetHistogram, with the lower and upper pointwise percentile
+  /// band of numberOfResamples bootstrap resamples of the trials as fourth and fifth component.
+  /// The confidence level is in percent (e.g. 95 for the 2.5 and 97.5 percentiles).
+  /// The resamples are computed in parallel and do not depend on the number of threads.
+  /// \return 0 on success, -1 if the parameters are invalid
+  int GetHistogramWithBootstrapBands(vtkDoubleArray* histogram, int numberOfResamples, double confidenceLevel);
+
+  /// Get the percentage of trials whose normalized dose is at least the given dose.
+  /// The trial doses are sorted on the first query after trials were added (new trials are merged
+  /// into the sorted ones), further queries cost O(log N)
+  double GetPopulationAtDose(double dose);
+
+  /// Write the exact (step) population curve of the trials: for each distinct normalized trial dose
+  /// the percentage of trials receiving at least and more than that dose, starting with the point (0, 100%).
+  /// Components are as in GetHistogramWithBootstrapBands, bands are added if numberOfResamples is positive.
+  /// \return 0 on success, -1 if the parameters are invalid
+  int GetExactHistogram(vtkDoubleArray* histogram, int numberOfResamples, double confidenceLevel);
+
+  /// Write the population curve at the given normalized doses (in any order, one row per dose).
+  /// Components are as in GetHistogramWithBootstrapBands, bands are added if numberOfResamples is positive.
+  /// \return 0 on success, -1 if the parameters are invalid
+  int GetHistogramAtDoses(vtkDoubleArray* doses, vtkDoubleArray* histogram, int numberOfResamples, double confidenceLevel);
+
+  /// Get/Set the seed of the bootstrap resampling
+  vtkSetMacro(BootstrapSeed, int);
+  vtkGetMacro(BootstrapSeed, int);
+
+  /// Get/Set the number of threads computing the bootstrap resamples, 0 (default) uses the vtkMultiThreader default
+  vtkSetMacro(NumberOfThreads, int);
+  vtkGetMacro(NumberOfThreads, int);
+
+protected:
+  vtkDosePopulationHistogramAccumulator();
+  ~vtkDosePopulationHistogramAccumulator();
+
+  /// Merge the trial doses added since the last call into the sorted ones. The lock must be held.
+  void SortTrialDoses();
+
+  /// Compute the pointwise percentile bands of bootstrap resamples of the trials. Each trial is
+  /// given by a level, the population at level s being the percentage of trials with level >= s.
+  /// The bands are returned for levels 0 to numberOfLevels-1.
+  /// \return 0 on success, -1 if the parameters are invalid
+  int ComputeBootstrapBands(const std::vector<int> &trialLevels, int numberOfLevels, int numberOfResamples,
+                            double confidenceLevel, std::vector<double> &lowerBand, std::vector<double> &upperBand);
+
+protected:
+  int UseDoseOption;
+  double DoseNormalizationFactor;
+  double StartValue;
+  double StepSize;
+  int BootstrapSeed;
+  int NumberOfThreads;
+
+  /// Number of trials in each bin, grows when a trial falls beyond the last bin
+  std::vector<vtkIdType> Bins;
+  vtkIdType NumberOfTrials;
+
+  /// Normalized dose of each trial, the first NumberOfSortedTrialDoses are sorted
+  std::vector<double> TrialDoses;
+  size_t NumberOfSortedTrialDoses;
+
+  /// Guards the bins, the trial doses and the number of trials
+  vtkMutexLock* Lock;
+
+private:
+  vtkDosePopulationHistogramAccumulator(const vtkDosePopulationHistogramAccumulator&); // Not implemented
+  void operator=(const vtkDosePopulationHistogramAccumulator&);               // Not implemented
+};
+
+#endif
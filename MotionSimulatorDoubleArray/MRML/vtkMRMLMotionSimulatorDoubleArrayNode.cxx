@@ -15,12 +15,14 @@ Version:   $Revision: 1.2 $
 // MRML includes
 #include "vtkMRMLMotionSimulatorDoubleArrayNode.h"
 #include "vtkMRMLMotionSimulatorDoubleArrayStorageNode.h"
+#include "vtkMotionSimulatorTrialStore.h"
 
 // VTK includes
 #include <vtkDoubleArray.h>
 #include <vtkObjectFactory.h>
 
 // STD includes
+#include <algorithm>
 #include <sstream>
 
 //------------------------------------------------------------------------------
@@ -35,6 +37,8 @@ vtkMRMLMotionSimulatorDoubleArrayNode::vtkMRMLMotionSimulatorDoubleArrayNode()
   this->Array = vtkDoubleArray::New();
   this->Array->SetNumberOfComponents(5);
 
+  this->TrialStore = NULL;
+
   this->Unit.resize(3);
 
   this->HideFromEditorsOff();
@@ -48,6 +52,124 @@ vtkMRMLMotionSimulatorDoubleArrayNode::~vtkMRMLMotionSimulatorDoubleArrayNode()
     this->Array->Delete();
     this->Array = NULL;
     }
+  if (this->TrialStore)
+    {
+    this->TrialStore->UnRegister(this);
+    this->TrialStore = NULL;
+    }
+}
+
+//----------------------------------------------------------------------------
+vtkDoubleArray* vtkMRMLMotionSimulatorDoubleArrayNode::GetArray()
+{
+  return this->Array;
+}
+
+//----------------------------------------------------------------------------
+void vtkMRMLMotionSimulatorDoubleArrayNode::SetTrialStore(vtkMotionSimulatorTrialStore* trialStore)
+{
+  if (this->TrialStore == trialStore)
+    {
+    return;
+    }
+  if (this->TrialStore)
+    {
+    this->TrialStore->UnRegister(this);
+    }
+  this->TrialStore = trialStore;
+  if (this->TrialStore)
+    {
+    this->TrialStore->Register(this);
+    }
+
+  // Values of the new store are only read on demand, rows of the previous values are dropped
+  if (this->TrialStore)
+    {
+    this->Array->SetNumberOfTuples(0);
+    }
+  this->TrialStoreLoadTime = vtkTimeStamp();
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+int vtkMRMLMotionSimulatorDoubleArrayNode::LoadArrayFromTrialStore()
+{
+  if (!this->TrialStore)
+    {
+    return 0;
+    }
+  vtkIdType numberOfTuples = this->TrialStore->GetNumberOfTuples();
+  if (this->TrialStoreLoadTime.GetMTime() > this->TrialStore->GetMTime()
+    && this->Array->GetNumberOfTuples() == numberOfTuples)
+    {
+    return 0;
+    }
+
+  if (this->TrialStore->ReadTuples(0, numberOfTuples, this->Array) != 0)
+    {
+    vtkErrorMacro("LoadArrayFromTrialStore: failed to load values from trial store");
+    return -1;
+    }
+  this->TrialStoreLoadTime.Modified();
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkMRMLMotionSimulatorDoubleArrayNode::GetRowValues(int index, double* values)
+{
+  if (index < 0)
+    {
+    return 0;
+    }
+  if (!this->TrialStore)
+    {
+    if (index >= this->Array->GetNumberOfTuples())
+      {
+      return 0;
+      }
+    this->Array->GetTypedTuple(index, values);
+    return this->Array->GetNumberOfComponents();
+    }
+
+  if (index >= this->TrialStore->GetNumberOfTuples())
+    {
+    return 0;
+    }
+  vtkDoubleArray* row = vtkDoubleArray::New();
+  int numberOfComponents = 0;
+  if (this->TrialStore->ReadTuples(index, 1, row) == 0)
+    {
+    row->GetTypedTuple(0, values);
+    numberOfComponents = row->GetNumberOfComponents();
+    }
+  row->Delete();
+  return numberOfComponents;
+}
+
+//----------------------------------------------------------------------------
+int vtkMRMLMotionSimulatorDoubleArrayNode::GetTuples(vtkIdType startTuple, vtkIdType numberOfTuples, vtkDoubleArray* tuples)
+{
+  if (!tuples)
+    {
+    return -1;
+    }
+  if (this->TrialStore)
+    {
+    return this->TrialStore->ReadTuples(startTuple, numberOfTuples, tuples);
+    }
+
+  if (startTuple < 0 || numberOfTuples < 0 || startTuple + numberOfTuples > this->Array->GetNumberOfTuples())
+    {
+    vtkErrorMacro("GetTuples: invalid range " << startTuple << "+" << numberOfTuples << " (array has " << this->Array->GetNumberOfTuples() << " rows)");
+    return -1;
+    }
+  tuples->SetNumberOfComponents(this->Array->GetNumberOfComponents());
+  tuples->SetNumberOfTuples(numberOfTuples);
+  for (vtkIdType i = 0; i < numberOfTuples; i++)
+    {
+    tuples->SetTuple(i, startTuple + i, this->Array);
+    }
+  return 0;
 }
 
 
@@ -58,6 +180,17 @@ void vtkMRMLMotionSimulatorDoubleArrayNode::WriteXML(ostream& of, int nIndent)
   // Start by having the superclass write its information
   Superclass::WriteXML(of, nIndent);
 
+  // Large trial sets stay in their file, only the reference goes to the scene.
+  // Temporary files are deleted with the node, their values are saved by the storage node.
+  if (this->TrialStore && this->TrialStore->GetFileName())
+    {
+    if (!this->TrialStore->GetRemoveFileOnDelete())
+      {
+      of << " trialStoreFileName=\"" << this->TrialStore->GetFileName() << "\"";
+      }
+    return;
+    }
+
   std::stringstream ssX;
   std::stringstream ssY;
   std::stringstream ssZ;
@@ -69,7 +202,7 @@ void vtkMRMLMotionSimulatorDoubleArrayNode::WriteXML(ostream& of, int nIndent)
     {
     // Put values to the string streams except the last values.
     int n = this->Array->GetNumberOfTuples() - 1;
-    double xy[4];
+    double xy[5];
     for (int i = 0; i < n; i ++)
       {
       this->Array->GetTypedTuple(i, xy);
@@ -194,6 +327,13 @@ void vtkMRMLMotionSimulatorDoubleArrayNode::ReadXMLAttributes(const char** atts)
         valueValue2.push_back(v);
         }
       }
+    else if (!strcmp(attName, "trialStoreFileName"))
+      {
+      vtkMotionSimulatorTrialStore* trialStore = vtkMotionSimulatorTrialStore::New();
+      trialStore->SetFileName(attValue);
+      this->SetTrialStore(trialStore);
+      trialStore->Delete();
+      }
     }
 
   if (valueValue.size() > 0)  // if Y error values have loaded
@@ -281,6 +421,8 @@ void vtkMRMLMotionSimulatorDoubleArrayNode::ProcessMRMLEvents( vtkObject *caller
 void vtkMRMLMotionSimulatorDoubleArrayNode::PrintSelf(ostream& os, vtkIndent indent)
 {
   vtkMRMLNode::PrintSelf(os,indent);
+
+  os << indent << "TrialStore: " << (this->TrialStore && this->TrialStore->GetFileName() ? this->TrialStore->GetFileName() : "(none)") << "\n";
 }
 
 
@@ -296,6 +438,10 @@ void vtkMRMLMotionSimulatorDoubleArrayNode::SetSize(unsigned int n)
 //----------------------------------------------------------------------------
 unsigned int vtkMRMLMotionSimulatorDoubleArrayNode::GetSize()
 {
+  if (this->TrialStore)
+    {
+    return this->TrialStore->GetNumberOfTuples();
+    }
   return this->Array->GetNumberOfTuples();
 }
 
@@ -316,10 +462,8 @@ double vtkMRMLMotionSimulatorDoubleArrayNode::GetYAxisValue(double vtkNotUsed(x)
 int vtkMRMLMotionSimulatorDoubleArrayNode::GetXYZValue(int index, double* x, double* y, double* z)
 {
   double xy[5];
-
-  if (this->Array->GetNumberOfComponents() >= 3 && index < this->Array->GetNumberOfTuples())
+  if (this->GetRowValues(index, xy) >= 3)
     {
-    this->Array->GetTypedTuple(index, xy);
     *x = xy[0];
     *y = xy[1];
     *z = xy[2];
@@ -336,10 +480,8 @@ int vtkMRMLMotionSimulatorDoubleArrayNode::GetXYZValue(int index, double* x, dou
 int vtkMRMLMotionSimulatorDoubleArrayNode::GetXYZValue(int index, double* x, double* y, double* z, double* value, double* value2)
 {
   double xy[5];
-
-  if (this->Array->GetNumberOfComponents() >= 5 && index < this->Array->GetNumberOfTuples())
+  if (this->GetRowValues(index, xy) >= 5)
     {
-    this->Array->GetTypedTuple(index, xy);
     *x    = xy[0];
     *y    = xy[1];
     *z    = xy[2];
@@ -457,165 +599,95 @@ void vtkMRMLMotionSimulatorDoubleArrayNode::GetRange(double* rangeX, double* ran
     return;
     }
 
-  int nTuples = this->Array->GetNumberOfTuples();
-  int nComp   = this->Array->GetNumberOfComponents();
-
-  double xy[3];
-  double c;
-
-  // Consider error value in the range calculation,
-  // if fIncludeError=1 and number of components is larger than 3
-
-  if (fIncludeError && nComp > 2)
+  if (!this->TrialStore)
     {
-    c = 1.0;
-    }
-  else
-    {
-    xy[2] = 0.0;
-    c     = 0.0;
+    ExtendRange(this->Array, fIncludeError, true, rangeX, rangeY);
+    return;
     }
 
-  if (nTuples > 0)
+  // Rows of a trial store are scanned in chunks instead of loading them all
+  vtkIdType numberOfTuples = this->TrialStore->GetNumberOfTuples();
+  vtkIdType chunkSize = this->TrialStore->GetChunkSize();
+  vtkDoubleArray* chunk = vtkDoubleArray::New();
+  for (vtkIdType startTuple = 0; startTuple < numberOfTuples; startTuple += chunkSize)
     {
-    // Get the first values as an initial value
-    this->Array->GetTypedTuple(0, xy);
-    rangeX[0] = xy[0];
-    rangeX[1] = xy[0];
-    rangeY[0] = xy[1] - c * xy[2];
-    rangeY[1] = xy[1] + c * xy[2];
-    
-    // Search the array
-    for (int i = 1; i < nTuples; i ++)
+    vtkIdType numberOfChunkTuples = std::min(chunkSize, numberOfTuples - startTuple);
+    if (this->TrialStore->ReadTuples(startTuple, numberOfChunkTuples, chunk) != 0)
       {
-      this->Array->GetTypedTuple(i, xy);
-
-      // X value
-      if (xy[0] < rangeX[0])
-        {
-        rangeX[0] = xy[0];
-        }
-      else if (xy[0] > rangeX[1])
-        {
-        rangeX[1] = xy[0];
-        }
-
-      // Y and error
-      double low  = xy[1] - c * xy[2];
-      double high = xy[1] + c * xy[2];
-
-      if (low < rangeY[0])
-        {
-        rangeY[0] = low;
-        }
-      if (high > rangeY[1])
-        {
-        rangeY[1] = high;
-        }
+      vtkErrorMacro("GetRange: failed to read values from trial store");
+      break;
       }
-
+    ExtendRange(chunk, fIncludeError, startTuple == 0, rangeX, rangeY);
     }
-
+  chunk->Delete();
 }
 
-
 //----------------------------------------------------------------------------
-void vtkMRMLMotionSimulatorDoubleArrayNode::GetXRange(double* range)
+void vtkMRMLMotionSimulatorDoubleArrayNode::ExtendRange(vtkDoubleArray* values, int fIncludeError, bool initialize, double* rangeX, double* rangeY)
 {
-  range[0] = 0.0;
-  range[1] = 0.0;
-
-  if (!this->Array)
+  int nTuples = values->GetNumberOfTuples();
+  int nComp   = values->GetNumberOfComponents();
+  if (nTuples <= 0 || nComp < 2)
     {
     return;
     }
 
-  int nTuples = this->Array->GetNumberOfTuples();
-  double xy[3];
+  // Consider error value in the range calculation,
+  // if fIncludeError=1 and number of components is larger than 2
+  double c = (fIncludeError && nComp > 2 ? 1.0 : 0.0);
 
-  if (this->Array->GetNumberOfComponents() >= 2 && nTuples > 0)
+  for (int i = 0; i < nTuples; i ++)
     {
+    double x = values->GetComponent(i, 0);
+    double y = values->GetComponent(i, 1);
+    double error = (nComp > 2 ? values->GetComponent(i, 2) : 0.0);
+    double low  = y - c * error;
+    double high = y + c * error;
 
     // Get the first values as an initial value
-    this->Array->GetTypedTuple(0, xy);
-    range[0] = xy[0];
-    range[1] = xy[0];
+    if (initialize && i == 0)
+      {
+      rangeX[0] = x;
+      rangeX[1] = x;
+      rangeY[0] = low;
+      rangeY[1] = high;
+      continue;
+      }
 
-    // Search the array
-    for (int i = 1; i < nTuples; i ++)
+    // X value
+    if (x < rangeX[0])
       {
-      this->Array->GetTypedTuple(i, xy);
-      if (xy[0] < range[0])
-        {
-        range[0] = xy[0];
-        }
-      else if (xy[0] > range[1])
-        {
-        range[1] = xy[0];
-        }
+      rangeX[0] = x;
+      }
+    else if (x > rangeX[1])
+      {
+      rangeX[1] = x;
       }
 
+    // Y and error
+    if (low < rangeY[0])
+      {
+      rangeY[0] = low;
+      }
+    if (high > rangeY[1])
+      {
+      rangeY[1] = high;
+      }
     }
 }
 
+//----------------------------------------------------------------------------
+void vtkMRMLMotionSimulatorDoubleArrayNode::GetXRange(double* range)
+{
+  double rangeY[2];
+  this->GetRange(range, rangeY, 0);
+}
 
 //----------------------------------------------------------------------------
 void vtkMRMLMotionSimulatorDoubleArrayNode::GetYRange(double* range, int fIncludeError)
 {
-  range[0] = 0.0;
-  range[1] = 0.0;
-
-  if (!this->Array)
-    {
-    return;
-    }
-
-  int nTuples = this->Array->GetNumberOfTuples();
-  int nComp   = this->Array->GetNumberOfComponents();
-
-  double xy[3];
-  double c;
-
-  // Consider error value in the range calculation,
-  // if fIncludeError=1 and number of components is larger than 3
-
-  if (fIncludeError && nComp > 2)
-    {
-    c = 1.0;
-    }
-  else
-    {
-    xy[2] = 0.0;
-    c     = 0.0;
-    }
-
-  if (nTuples > 0)
-    {
-
-    // Get the first values as an initial value
-    this->Array->GetTypedTuple(0, xy);
-    range[0] = xy[1] - c * xy[2];
-    range[1] = xy[1] + c * xy[2];
-    
-    // Search the array
-    for (int i = 1; i < nTuples; i ++)
-      {
-      this->Array->GetTypedTuple(i, xy);
-      double low  = xy[1] - c * xy[2];
-      double high = xy[1] + c * xy[2];
-
-      if (low < range[0])
-        {
-        range[0] = low;
-        }
-      if (high > range[1])
-        {
-        range[1] = high;
-        }
-      }
-
-    }
-
+  double rangeX[2];
+  this->GetRange(rangeX, range, fIncludeError);
 }
 
 void vtkMRMLMotionSimulatorDoubleArrayNode::SetLabels(const LabelsVectorType &labels)
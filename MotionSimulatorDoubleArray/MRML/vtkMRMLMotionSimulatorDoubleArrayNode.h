@@ -19,8 +19,10 @@
 #include <vector>
 
 #include "vtkMRMLStorableNode.h"
+#include <vtkTimeStamp.h>
 class vtkDoubleArray;
 class vtkMRMLStorageNode;
+class vtkMotionSimulatorTrialStore;
 
 #include "vtkSlicerMotionSimulatorDoubleArrayModuleMRMLExport.h"
 
@@ -72,7 +74,30 @@ public:
   /// Get and Set Macros
   //----------------------------------------------------------------
   virtual void SetArray(vtkDoubleArray*);
-  vtkGetObjectMacro ( Array, vtkDoubleArray );
+
+  /// 
+  /// Get the in-memory value array. Rows of a trial store are not read by this method,
+  /// the array is empty until LoadArrayFromTrialStore is called. Use GetTuples
+  /// to process the rows of large stores in chunks.
+  virtual vtkDoubleArray* GetArray();
+
+  /// 
+  /// Read all rows of the trial store into the in-memory array, if the store changed
+  /// since the last load. Returns 0 without a store, -1 if the store cannot be read
+  int LoadArrayFromTrialStore();
+
+  /// 
+  /// Copy a range of rows into the given array (resized to hold them),
+  /// without loading the other rows of a trial store. Returns -1 if the range is invalid
+  int GetTuples(vtkIdType startTuple, vtkIdType numberOfTuples, vtkDoubleArray* tuples);
+
+  /// 
+  /// Set file backed store holding the values (NULL to keep values in memory only).
+  /// The array is not loaded until it is accessed. The file of a temporary store
+  /// (see vtkMotionSimulatorTrialStore::RemoveFileOnDelete) is deleted with the last node
+  /// referring to it and is not referenced from the scene, the storage node saves the values.
+  virtual void SetTrialStore(vtkMotionSimulatorTrialStore*);
+  vtkGetObjectMacro ( TrialStore, vtkMotionSimulatorTrialStore );
 
   //----------------------------------------------------------------
   /// Access methods
@@ -166,7 +191,20 @@ public:
   /// Data
   //----------------------------------------------------------------
 
+  /// 
+  /// Copy the values of one row (of the trial store if set) into 'values' (at least 5 long).
+  /// Returns the number of components, 0 if the index is out of range
+  int GetRowValues(int index, double* values);
+
+  /// 
+  /// Extend the X and Y ranges by the rows of 'values'. The ranges are
+  /// initialized from the first row if 'initialize' is set
+  static void ExtendRange(vtkDoubleArray* values, int fIncludeError, bool initialize, double* rangeX, double* rangeY);
+
   vtkDoubleArray* Array;
+
+  vtkMotionSimulatorTrialStore* TrialStore;
+  vtkTimeStamp TrialStoreLoadTime;
   
   std::vector< std::string > Unit;
   std::vector< std::string > Labels;
@@ -16,11 +16,17 @@ Version:   $Revision: 1.6 $
 #include "vtkMRMLMotionSimulatorDoubleArrayStorageNode.h"
 #include "vtkMRMLMotionSimulatorDoubleArrayNode.h"
 #include "vtkMRMLScene.h"
+#include "vtkMotionSimulatorTrialStore.h"
 
 // VTK includes
+#include <vtkDoubleArray.h>
+#include <vtkNew.h>
 #include <vtkObjectFactory.h>
 #include <vtkStringArray.h>
 
+// STD includes
+#include <algorithm>
+
 //------------------------------------------------------------------------------
 vtkMRMLNodeNewMacro(vtkMRMLMotionSimulatorDoubleArrayStorageNode);
 
@@ -278,6 +284,32 @@ int vtkMRMLMotionSimulatorDoubleArrayStorageNode::WriteDataInternal(vtkMRMLNode
 
 
 
+    // Values of a file backed node are copied chunk by chunk, without loading the whole array
+    vtkMotionSimulatorTrialStore* trialStore = doubleArrayNode->GetTrialStore();
+    if (trialStore && trialStore->GetNumberOfComponents() >= 5)
+    {
+        vtkNew<vtkDoubleArray> chunk;
+        vtkIdType numberOfTuples = trialStore->GetNumberOfTuples();
+        for (vtkIdType start = 0; start < numberOfTuples; start += trialStore->GetChunkSize())
+        {
+            vtkIdType count = std::min<vtkIdType>(trialStore->GetChunkSize(), numberOfTuples - start);
+            if (trialStore->ReadTuples(start, count, chunk.GetPointer()) != 0)
+            {
+                vtkErrorMacro("WriteData: unable to read values from trial store");
+                of.close();
+                return 0;
+            }
+            for (vtkIdType i = 0; i < count; i++)
+            {
+                double* xy = chunk->GetTuple(i);
+                of << xy[0] << "," << xy[1] << "," << xy[2] << "," << xy[3] << "," << xy[4];
+                of << endl;
+            }
+        }
+        of.close();
+        return 1;
+    }
+
     for (unsigned int i = 0; i < doubleArrayNode->GetSize(); i++)
     {
         double x,y,z,value,value2;
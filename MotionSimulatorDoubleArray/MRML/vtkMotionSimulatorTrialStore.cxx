@@ -0,0 +1,324 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program, 
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// MotionSimulatorDoubleArray includes
+#include "vtkMotionSimulatorTrialStore.h"
+
+// VTK includes
+#include <vtkDoubleArray.h>
+#include <vtkMutexLock.h>
+#include <vtkObjectFactory.h>
+#include <vtksys/SystemTools.hxx>
+
+// STD includes
+#include <algorithm>
+#include <cstring>
+
+// File layout: magic string, number of components (int32), padding (int32), then rows of doubles
+static const char TRIAL_STORE_MAGIC[8] = { 'M', 'S', 'T', 'R', 'I', 'A', 'L', '1' };
+static const std::streamoff TRIAL_STORE_HEADER_SIZE = 16;
+
+//----------------------------------------------------------------------------
+vtkStandardNewMacro(vtkMotionSimulatorTrialStore);
+
+//----------------------------------------------------------------------------
+vtkMotionSimulatorTrialStore::vtkMotionSimulatorTrialStore()
+{
+  this->FileName = NULL;
+  this->ChunkSize = 4096;
+  this->RemoveFileOnDelete = false;
+  this->NumberOfComponents = 0;
+  this->NumberOfTuplesInFile = 0;
+  this->OutputStream = NULL;
+  this->Lock = vtkMutexLock::New();
+}
+
+//----------------------------------------------------------------------------
+vtkMotionSimulatorTrialStore::~vtkMotionSimulatorTrialStore()
+{
+  if (this->RemoveFileOnDelete)
+  {
+    this->RemoveFile();
+  }
+  this->Close();
+  this->SetFileName(NULL);
+  this->Lock->Delete();
+}
+
+//----------------------------------------------------------------------------
+void vtkMotionSimulatorTrialStore::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "FileName:   " << (this->FileName ? this->FileName : "(none)") << "\n";
+  os << indent << "ChunkSize:   " << this->ChunkSize << "\n";
+  os << indent << "RemoveFileOnDelete:   " << (this->RemoveFileOnDelete ? "true" : "false") << "\n";
+  os << indent << "NumberOfComponents:   " << this->NumberOfComponents << "\n";
+  os << indent << "NumberOfTuplesInFile:   " << this->NumberOfTuplesInFile << "\n";
+}
+
+//----------------------------------------------------------------------------
+int vtkMotionSimulatorTrialStore::GetNumberOfComponents()
+{
+  if (this->NumberOfComponents == 0)
+  {
+    this->ReadFileInformation();
+  }
+  return this->NumberOfComponents;
+}
+
+//----------------------------------------------------------------------------
+vtkIdType vtkMotionSimulatorTrialStore::GetNumberOfTuples()
+{
+  if (this->NumberOfComponents == 0)
+  {
+    this->ReadFileInformation();
+  }
+  if (this->NumberOfComponents == 0)
+  {
+    return 0;
+  }
+  this->Lock->Lock();
+  vtkIdType numberOfTuples = this->NumberOfTuplesInFile + (vtkIdType)(this->Chunk.size() / this->NumberOfComponents);
+  this->Lock->Unlock();
+  return numberOfTuples;
+}
+
+//----------------------------------------------------------------------------
+int vtkMotionSimulatorTrialStore::OpenForWriting(int numberOfComponents)
+{
+  this->Close();
+
+  if (!this->FileName || numberOfComponents < 1)
+  {
+    vtkErrorMacro("OpenForWriting: file name or number of components is not set!");
+    return -1;
+  }
+
+  this->OutputStream = new std::ofstream(this->FileName, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!this->OutputStream->is_open())
+  {
+    vtkErrorMacro("OpenForWriting: unable to open file " << this->FileName << " for writing");
+    delete this->OutputStream;
+    this->OutputStream = NULL;
+    return -1;
+  }
+
+  int header[2] = { numberOfComponents, 0 };
+  this->OutputStream->write(TRIAL_STORE_MAGIC, sizeof(TRIAL_STORE_MAGIC));
+  this->OutputStream->write(reinterpret_cast<const char*>(header), sizeof(header));
+
+  this->Lock->Lock();
+  this->NumberOfComponents = numberOfComponents;
+  this->NumberOfTuplesInFile = 0;
+  this->Chunk.clear();
+  this->Chunk.reserve(this->ChunkSize * numberOfComponents);
+  this->Lock->Unlock();
+
+  this->Modified();
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkMotionSimulatorTrialStore::AppendTuple(const double* tuple)
+{
+  if (!this->OutputStream)
+  {
+    vtkErrorMacro("AppendTuple: store is not open for writing!");
+    return -1;
+  }
+
+  this->Lock->Lock();
+  this->Chunk.insert(this->Chunk.end(), tuple, tuple + this->NumberOfComponents);
+  bool chunkFull = ((int)this->Chunk.size() >= this->ChunkSize * this->NumberOfComponents);
+  this->Lock->Unlock();
+  if (chunkFull)
+  {
+    return this->Flush();
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkMotionSimulatorTrialStore::Flush()
+{
+  if (!this->OutputStream || this->Chunk.empty())
+  {
+    return 0;
+  }
+
+  // Only the writer changes the chunk, so it is written to the file without holding the lock.
+  // Readers see the rows in the file once they are counted.
+  this->OutputStream->write(reinterpret_cast<const char*>(&this->Chunk[0]), this->Chunk.size() * sizeof(double));
+  this->OutputStream->flush();
+  if (!this->OutputStream->good())
+  {
+    vtkErrorMacro("Flush: failed to write trial results to " << this->FileName);
+    return -1;
+  }
+
+  this->Lock->Lock();
+  this->NumberOfTuplesInFile += (vtkIdType)(this->Chunk.size() / this->NumberOfComponents);
+  this->Chunk.clear();
+  this->Lock->Unlock();
+
+  this->Modified();
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkMotionSimulatorTrialStore::Close()
+{
+  if (!this->OutputStream)
+  {
+    return 0;
+  }
+
+  int result = this->Flush();
+  this->OutputStream->close();
+  delete this->OutputStream;
+  this->OutputStream = NULL;
+  return result;
+}
+
+//----------------------------------------------------------------------------
+bool vtkMotionSimulatorTrialStore::IsOpenForWriting()
+{
+  return this->OutputStream != NULL;
+}
+
+//----------------------------------------------------------------------------
+int vtkMotionSimulatorTrialStore::ReadFileInformation()
+{
+  if (!this->FileName || this->OutputStream)
+  {
+    return -1;
+  }
+
+  std::ifstream inputStream(this->FileName, std::ios::in | std::ios::binary);
+  if (!inputStream.is_open())
+  {
+    return -1;
+  }
+
+  char magic[sizeof(TRIAL_STORE_MAGIC)];
+  int header[2] = { 0, 0 };
+  inputStream.read(magic, sizeof(magic));
+  inputStream.read(reinterpret_cast<char*>(header), sizeof(header));
+  if (!inputStream.good() || memcmp(magic, TRIAL_STORE_MAGIC, sizeof(magic)) != 0 || header[0] < 1)
+  {
+    vtkErrorMacro("ReadFileInformation: " << this->FileName << " is not a trial store file");
+    return -1;
+  }
+
+  inputStream.seekg(0, std::ios::end);
+  std::streamoff dataSize = (std::streamoff)inputStream.tellg() - TRIAL_STORE_HEADER_SIZE;
+
+  this->NumberOfComponents = header[0];
+  this->NumberOfTuplesInFile = (vtkIdType)(dataSize / (std::streamoff)(sizeof(double) * this->NumberOfComponents));
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkMotionSimulatorTrialStore::ReadTuples(vtkIdType startTuple, vtkIdType numberOfTuples, vtkDoubleArray* tuples)
+{
+  if (!tuples)
+  {
+    return -1;
+  }
+
+  if (this->NumberOfComponents == 0)
+  {
+    this->ReadFileInformation();
+  }
+
+  // Rows already in the file are read from it, the rest is copied from the chunk.
+  // The file is only appended to, so the rows counted here stay valid after unlocking.
+  this->Lock->Lock();
+  vtkIdType numberOfTuplesInFile = this->NumberOfTuplesInFile;
+  vtkIdType totalNumberOfTuples = numberOfTuplesInFile
+    + (this->NumberOfComponents > 0 ? (vtkIdType)(this->Chunk.size() / this->NumberOfComponents) : 0);
+  if (startTuple < 0 || numberOfTuples < 0 || startTuple + numberOfTuples > totalNumberOfTuples)
+  {
+    this->Lock->Unlock();
+    vtkErrorMacro("ReadTuples: invalid range " << startTuple << "+" << numberOfTuples << " (store has " << totalNumberOfTuples << " rows)");
+    return -1;
+  }
+
+  tuples->SetNumberOfComponents(this->NumberOfComponents);
+  tuples->SetNumberOfTuples(numberOfTuples);
+  vtkIdType chunkStartTuple = std::max(startTuple, numberOfTuplesInFile);
+  if (chunkStartTuple < startTuple + numberOfTuples)
+  {
+    std::copy(this->Chunk.begin() + (chunkStartTuple - numberOfTuplesInFile) * this->NumberOfComponents,
+      this->Chunk.begin() + (startTuple + numberOfTuples - numberOfTuplesInFile) * this->NumberOfComponents,
+      tuples->GetPointer((chunkStartTuple - startTuple) * this->NumberOfComponents));
+  }
+  this->Lock->Unlock();
+
+  vtkIdType numberOfTuplesFromFile = std::min(startTuple + numberOfTuples, numberOfTuplesInFile) - startTuple;
+  if (numberOfTuplesFromFile <= 0)
+  {
+    return 0;
+  }
+
+  std::ifstream inputStream(this->FileName, std::ios::in | std::ios::binary);
+  if (!inputStream.is_open())
+  {
+    vtkErrorMacro("ReadTuples: unable to open file " << this->FileName);
+    return -1;
+  }
+
+  std::streamoff rowSize = (std::streamoff)(sizeof(double) * this->NumberOfComponents);
+  inputStream.seekg(TRIAL_STORE_HEADER_SIZE + startTuple * rowSize, std::ios::beg);
+  inputStream.read(reinterpret_cast<char*>(tuples->GetPointer(0)), numberOfTuplesFromFile * rowSize);
+  if (!inputStream.good())
+  {
+    vtkErrorMacro("ReadTuples: failed to read trial results from " << this->FileName);
+    return -1;
+  }
+
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkMotionSimulatorTrialStore::RemoveFile()
+{
+  this->Close();
+  if (!this->FileName || !vtksys::SystemTools::FileExists(this->FileName))
+  {
+    return 0;
+  }
+
+  if (!vtksys::SystemTools::RemoveFile(this->FileName))
+  {
+    vtkErrorMacro("RemoveFile: unable to delete " << this->FileName);
+    return -1;
+  }
+
+  this->Lock->Lock();
+  this->NumberOfTuplesInFile = 0;
+  this->Chunk.clear();
+  this->Lock->Unlock();
+  this->Modified();
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  This file was originally developed by Kevin Wang, Radiation Medicine Program, 
+  University Health Network and was supported by Cancer Care Ontario (CCO)'s ACRU program 
+  with funds provided by the Ontario Ministry of Health and Long-Term Care
+  and Ontario Consortium for Adaptive Interventions in Radiation Oncology (OCAIRO).
+
+==============================================================================*/
+
+// .NAME vtkMotionSimulatorTrialStore - file backed store of motion simulation trial results
+// .SECTION Description
+// Trial rows are appended to an in-memory chunk that is written to a binary file
+// whenever it is full, so the number of trials is not limited by the available memory.
+// Rows can be read back in arbitrary ranges while the store is still being written,
+// reading does not write to the file so it may happen on another thread than the appending.
+
+#ifndef __vtkMotionSimulatorTrialStore_h
+#define __vtkMotionSimulatorTrialStore_h
+
+// VTK includes
+#include <vtkObject.h>
+
+// STD includes
+#include <fstream>
+#include <vector>
+
+#include "vtkSlicerMotionSimulatorDoubleArrayModuleMRMLExport.h"
+
+class vtkDoubleArray;
+class vtkMutexLock;
+
+class VTK_SLICER_MOTIONSIMULATORDOUBLEARRAY_MODULE_MRML_EXPORT vtkMotionSimulatorTrialStore : public vtkObject
+{
+public:
+  static vtkMotionSimulatorTrialStore *New();
+  vtkTypeMacro(vtkMotionSimulatorTrialStore, vtkObject);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  /// Get/Set the file that holds the trial rows
+  vtkSetStringMacro(FileName);
+  vtkGetStringMacro(FileName);
+
+  /// Get/Set the number of rows kept in memory before they are written to the file
+  vtkSetMacro(ChunkSize, int);
+  vtkGetMacro(ChunkSize, int);
+
+  /// Get/Set if the file is deleted together with the store (for temporary stores)
+  vtkSetMacro(RemoveFileOnDelete, bool);
+  vtkGetMacro(RemoveFileOnDelete, bool);
+  vtkBooleanMacro(RemoveFileOnDelete, bool);
+
+  /// Get the number of values in a row
+  int GetNumberOfComponents();
+
+  /// Get the number of rows in the store, including the ones not yet written to the file
+  vtkIdType GetNumberOfTuples();
+
+  /// Create (or truncate) the file and prepare the store for appending rows.
+  /// Returns -1 if the file cannot be created
+  int OpenForWriting(int numberOfComponents);
+
+  /// Append a row of GetNumberOfComponents() values
+  int AppendTuple(const double* tuple);
+
+  /// Write the rows kept in memory to the file
+  int Flush();
+
+  /// Flush and close the file, the store remains readable
+  int Close();
+
+  /// Return true while rows can be appended
+  bool IsOpenForWriting();
+
+  /// Read a range of rows into the given array (resized to hold them).
+  /// Rows not yet written to the file are copied from memory.
+  /// Returns -1 if the range is invalid or the file cannot be read
+  int ReadTuples(vtkIdType startTuple, vtkIdType numberOfTuples, vtkDoubleArray* tuples);
+
+  /// Close the store and delete its file
+  int RemoveFile();
+
+protected:
+  vtkMotionSimulatorTrialStore();
+  ~vtkMotionSimulatorTrialStore();
+
+  /// Read number of components and rows from the file header and size
+  int ReadFileInformation();
+
+protected:
+  char* FileName;
+  int ChunkSize;
+  bool RemoveFileOnDelete;
+
+  int NumberOfComponents;
+
+  /// Number of rows already written to the file
+  vtkIdType NumberOfTuplesInFile;
+
+  /// Rows appended since the last flush
+  std::vector<double> Chunk;
+
+  std::ofstream* OutputStream;
+
+  /// Guards the chunk and the number of rows in the file between the writer and the readers
+  vtkMutexLock* Lock;
+
+private:
+  vtkMotionSimulatorTrialStore(const vtkMotionSimulatorTrialStore&); // Not implemented
+  void operator=(const vtkMotionSimulatorTrialStore&);               // Not implemented
+};
+
+#endif